@@ -0,0 +1,121 @@
+/**
+ * @file alloc.c
+ * @brief Allocation count benchmark.
+ *
+ * This benchmark creates `n` tags, shells and visited directories through
+ * the same constructors the daemon uses, and reports how many heap
+ * allocations the slab pools and the string arena made for them. Before the
+ * pools, every tag took three allocations, every shell two (itself and its
+ * action stack), and every directory one. It then frees everything and
+ * creates it again, to show that freed records are recycled rather than
+ * allocated anew.
+ *
+ * Each tag's path is also visited, and every shell pushes it, so the intern
+ * table is expected to hold one copy of each path with three references.
+ *
+ * Usage: alloc [n]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frecency.h"
+#include "hashmap.h"
+#include "intern.h"
+#include "pool.h"
+#include "shell.h"
+#include "tag.h"
+
+#define DEFAULT_N 10000
+
+/* Depth of each shell's action stack */
+#define BENCH_ACTION_DEPTH 16
+
+static void fill(struct hashmap *tags, struct hashmap *shells,
+                 struct frecency *f, int n)
+{
+    char tag[64], path[96];
+    struct shell *s;
+    struct tag *t;
+    int i, len;
+
+    for (i = 0; i < n; i++) {
+        len = snprintf(tag, sizeof(tag), "tag-%d", i);
+        snprintf(path, sizeof(path), "/home/user/projects/project-%d", i);
+        t = tag_create(tag, len, path);
+        hashmap_insert(tags, t->tag, t);
+
+        s = shell_create(i, BENCH_ACTION_DEPTH);
+        hashmap_insert(shells, &s->pid, s);
+        action_push(&s->actions, intern(path));
+
+        frecency_visit(f, path, time(NULL));
+    }
+}
+
+static void report(const char *phase, int n,
+                   const struct alloc_stats *before)
+{
+    struct intern_stats paths;
+    struct alloc_stats now;
+    uint64_t records, heap;
+
+    alloc_stats_get(&now);
+    intern_stats_get(&paths);
+    records = now.pool_allocs - before->pool_allocs;
+    heap = now.heap_allocs - before->heap_allocs;
+
+    printf("%-10s %10d %10llu %12llu %14.2f %14d\n", phase, n,
+           (unsigned long long)records, (unsigned long long)heap,
+           (double)heap / n, 6 * n);
+    printf("%-10s %10s %u paths interned, %llu references\n", "", "",
+           paths.n_strings, (unsigned long long)paths.n_refs);
+}
+
+int main(int argc, char **argv)
+{
+    struct hashmap tags = {0}, shells = {0};
+    struct alloc_stats before;
+    struct frecency f;
+    int n;
+
+    n = (argc > 1) ? atoi(argv[1]) : DEFAULT_N;
+    if (n < 1) {
+        n = 1;
+    }
+
+    tags.hash_func = hash_string;
+    tags.compare_func = compare_tag_tag;
+    tags.cleanup_func = cleanup_tag;
+    shells.hash_func = hash_int;
+    shells.compare_func = compare_shell_pid;
+    shells.cleanup_func = cleanup_shell;
+    frecency_init(&f);
+
+    printf("%-10s %10s %10s %12s %14s %14s\n", "phase", "n", "records",
+           "heap allocs", "allocs per n", "before pools");
+
+    alloc_stats_get(&before);
+    fill(&tags, &shells, &f, n);
+    report("first", n, &before);
+
+    hashmap_delete_all(&tags);
+    hashmap_delete_all(&shells);
+    frecency_deinit(&f);
+
+    alloc_stats_get(&before);
+    fill(&tags, &shells, &f, n);
+    report("recycled", n, &before);
+
+    hashmap_delete_all(&tags);
+    hashmap_delete_all(&shells);
+    frecency_deinit(&f);
+    intern_deinit();
+    pool_destroy_all();
+
+    return 0;
+}
@@ -0,0 +1,470 @@
+/**
+ * @file containers.c
+ * @brief Container and tag file microbenchmark harness.
+ *
+ * This benchmark measures the storage behind tags and shells at 10, 1k, 10k
+ * and 100k elements. For each storage and element kind it times looking up
+ * an element, inserting one, which for the list walks to its tail, and
+ * deleting one, then reports the time and the allocations per operation. It
+ * also times reading the tag file at startup, which stats every tag's path,
+ * and compacting the journal into the tag file through the writer thread,
+ * which syncs it to disk.
+ *
+ * Storage is plugged in through `struct storage`, so a candidate container
+ * is compared side by side with the others by adding it to `storages`.
+ *
+ * Heap allocations are counted by wrapping `malloc()`, `calloc()` and
+ * `realloc()` for the whole program, as the hash map and radix tree allocate
+ * from the heap directly. Records are the objects handed out by the slab
+ * pools, see pool.h.
+ *
+ * Usage: containers [max elements]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hashmap.h"
+#include "list.h"
+#include "log.h"
+#include "pool.h"
+#include "radix.h"
+#include "shell.h"
+#include "tag.h"
+#include "writer.h"
+
+/* Minimum time measured for each operation */
+#define MIN_TIME_NS 20000000.0
+
+/* Elements inserted or deleted between two clock reads */
+#define BATCH_MAX 16
+
+static const int sizes[] = {10, 1000, 10000, 100000};
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long heap_allocs;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+/**
+ * @brief Structure describing a kind of element.
+ */
+struct kind {
+    const char *name;
+    void *(*create)(int i);   /**<< Creates element `i` */
+    void *(*make_key)(int i); /**<< Copies the key of element `i` */
+    void *(*key)(void *data); /**<< Returns an element's own key */
+    uint32_t (*hash)(void *key);
+    int (*compare)(void *data, void *key);
+    int (*cleanup)(void *data);
+};
+
+/**
+ * @brief Structure holding an instance of any storage.
+ */
+struct container {
+    const struct kind *kind;
+    struct list list;
+    struct hashmap map;
+};
+
+/**
+ * @brief Structure describing a storage under test.
+ *
+ * `fill` builds the container before measuring, and may be any fast way of
+ * inserting. `insert`, `get` and `delete` are measured.
+ */
+struct storage {
+    const char *name;
+    void (*init)(struct container *c);
+    void (*deinit)(struct container *c);
+    int (*fill)(struct container *c, void *data);
+    int (*insert)(struct container *c, void *data);
+    void *(*get)(struct container *c, void *key);
+    int (*delete)(struct container *c, void *key);
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *tag_new(int i)
+{
+    char tag[32];
+    int len;
+
+    len = snprintf(tag, sizeof(tag), "tag-%d", i);
+    return tag_create(tag, len, "/home/user/projects/project");
+}
+
+static void *tag_make_key(int i)
+{
+    char tag[32];
+
+    snprintf(tag, sizeof(tag), "tag-%d", i);
+    return strdup(tag);
+}
+
+static void *tag_key(void *data)
+{
+    return ((struct tag *)data)->tag;
+}
+
+static void *shell_new(int i)
+{
+    return shell_create(i + 1, 1);
+}
+
+static void *shell_make_key(int i)
+{
+    int *pid = malloc(sizeof(*pid));
+
+    *pid = i + 1;
+    return pid;
+}
+
+static void *shell_key(void *data)
+{
+    return &((struct shell *)data)->pid;
+}
+
+static const struct kind kinds[] = {
+    {"tag", tag_new, tag_make_key, tag_key, hash_string, compare_tag_tag,
+     cleanup_tag},
+    {"shell", shell_new, shell_make_key, shell_key, hash_int,
+     compare_shell_pid, cleanup_shell},
+};
+
+static void list_init(struct container *c)
+{
+    memset(&c->list, 0, sizeof(c->list));
+    c->list.compare_func = c->kind->compare;
+    c->list.cleanup_func = c->kind->cleanup;
+}
+
+static void list_deinit(struct container *c)
+{
+    list_delete_all(&c->list);
+}
+
+static int list_fill(struct container *c, void *data)
+{
+    struct node *node;
+
+    if (list_node_create(&node)) {
+        return 1;
+    }
+    node->data = data;
+    return list_prepend_node(&c->list, node);
+}
+
+static int list_insert(struct container *c, void *data)
+{
+    struct node *node;
+
+    if (list_node_create(&node)) {
+        return 1;
+    }
+    node->data = data;
+    return list_append_node(&c->list, node);
+}
+
+static void *list_get(struct container *c, void *key)
+{
+    struct node *node = list_get_node(&c->list, key);
+
+    return node != NULL ? node->data : NULL;
+}
+
+static int list_delete(struct container *c, void *key)
+{
+    return list_delete_node(&c->list, key);
+}
+
+static void map_init(struct container *c)
+{
+    memset(&c->map, 0, sizeof(c->map));
+    c->map.hash_func = c->kind->hash;
+    c->map.compare_func = c->kind->compare;
+    c->map.cleanup_func = c->kind->cleanup;
+}
+
+static void map_deinit(struct container *c)
+{
+    hashmap_delete_all(&c->map);
+}
+
+static int map_insert(struct container *c, void *data)
+{
+    return hashmap_insert(&c->map, c->kind->key(data), data);
+}
+
+static void *map_get(struct container *c, void *key)
+{
+    return hashmap_get(&c->map, key);
+}
+
+static int map_delete(struct container *c, void *key)
+{
+    return hashmap_delete(&c->map, key);
+}
+
+static const struct storage storages[] = {
+    {"list", list_init, list_deinit, list_fill, list_insert, list_get,
+     list_delete},
+    {"hashmap", map_init, map_deinit, map_insert, map_insert, map_get,
+     map_delete},
+};
+
+/**
+ * @brief Structure holding the cost of an operation.
+ */
+struct result {
+    long ops;
+    double ns;
+    unsigned long heap;
+    uint64_t records;
+};
+
+static void result_start(struct result *r, double *start)
+{
+    struct alloc_stats stats;
+
+    alloc_stats_get(&stats);
+    r->heap -= heap_allocs;
+    r->records -= stats.pool_allocs;
+    *start = now_ns();
+}
+
+static void result_stop(struct result *r, double start, long ops)
+{
+    struct alloc_stats stats;
+
+    r->ns += now_ns() - start;
+    r->ops += ops;
+    alloc_stats_get(&stats);
+    r->heap += heap_allocs;
+    r->records += stats.pool_allocs;
+}
+
+static void report(const char *storage, const char *kind, const char *op,
+                   int n, const struct result *r)
+{
+    printf("%-8s %-6s %-8s %8d %10ld %12.1f %10.3f %10.3f\n", storage, kind,
+           op, n, r->ops, r->ns / r->ops, (double)r->heap / r->ops,
+           (double)r->records / r->ops);
+}
+
+static void bench_storage(const struct storage *s, const struct kind *k,
+                          int n)
+{
+    struct container c = {.kind = k};
+    struct result get = {0}, insert = {0}, delete = {0};
+    void **keys;
+    int batch = n < BATCH_MAX ? n : BATCH_MAX;
+    int picked[BATCH_MAX];
+    volatile void *sink;
+    double start;
+    long i;
+    int j;
+
+    /* Keys of the elements, and of those inserted on top */
+    keys = malloc((n + batch) * sizeof(*keys));
+    for (j = 0; j < n + batch; j++) {
+        keys[j] = k->make_key(j);
+    }
+
+    s->init(&c);
+    for (j = 0; j < n; j++) {
+        s->fill(&c, k->create(j));
+    }
+
+    result_start(&get, &start);
+    for (i = 0; now_ns() - start < MIN_TIME_NS; i += 64) {
+        for (j = 0; j < 64; j++) {
+            sink = s->get(&c, keys[random() % n]);
+        }
+    }
+    result_stop(&get, start, i);
+    (void)sink;
+
+    /* Insert a batch past the end, then remove it without measuring */
+    while (insert.ns < MIN_TIME_NS) {
+        void *data[BATCH_MAX];
+
+        for (j = 0; j < batch; j++) {
+            data[j] = k->create(n + j);
+        }
+        result_start(&insert, &start);
+        for (j = 0; j < batch; j++) {
+            s->insert(&c, data[j]);
+        }
+        result_stop(&insert, start, batch);
+        for (j = 0; j < batch; j++) {
+            s->delete(&c, keys[n + j]);
+        }
+    }
+
+    /* Delete a batch of distinct elements, then put them back */
+    while (delete.ns < MIN_TIME_NS) {
+        for (j = 0; j < batch; j++) {
+            picked[j] = (random() % (n / batch)) * batch + j;
+        }
+        result_start(&delete, &start);
+        for (j = 0; j < batch; j++) {
+            s->delete(&c, keys[picked[j]]);
+        }
+        result_stop(&delete, start, batch);
+        for (j = 0; j < batch; j++) {
+            s->fill(&c, k->create(picked[j]));
+        }
+    }
+
+    report(s->name, k->name, "get", n, &get);
+    report(s->name, k->name, "insert", n, &insert);
+    report(s->name, k->name, "delete", n, &delete);
+
+    s->deinit(&c);
+    for (j = 0; j < n + batch; j++) {
+        free(keys[j]);
+    }
+    free(keys);
+}
+
+/**
+ * @brief Times writing and reading a tag file of `n` tags.
+ *
+ * Every tag names its own directory under `dir`, created as needed, so that
+ * reading the file keeps every tag.
+ */
+static void bench_tag_file(const char *dir, int n, int *n_dirs)
+{
+    struct hashmap tags = {0}, loaded = {0};
+    struct radix_tree tree = {0};
+    struct tag_journal journal;
+    struct result write = {0}, read = {0};
+    char path[PATH_MAX], tagfile[PATH_MAX];
+    char tag[32];
+    double start;
+    int len, i;
+
+    for (; *n_dirs < n; (*n_dirs)++) {
+        snprintf(path, sizeof(path), "%s/%d", dir, *n_dirs);
+        mkdir(path, 0700);
+    }
+
+    tags.hash_func = loaded.hash_func = hash_string;
+    tags.compare_func = loaded.compare_func = compare_tag_tag;
+    tags.cleanup_func = loaded.cleanup_func = cleanup_tag;
+    for (i = 0; i < n; i++) {
+        len = snprintf(tag, sizeof(tag), "tag-%d", i);
+        snprintf(path, sizeof(path), "%s/%d", dir, i);
+        struct tag *t = tag_create(tag, len, path);
+        hashmap_insert(&tags, t->tag, t);
+    }
+
+    snprintf(tagfile, sizeof(tagfile), "%s/tags", dir);
+    tag_journal_open(&journal, &tags, tagfile);
+
+    while (write.ns < MIN_TIME_NS || write.ops < 3L * n) {
+        result_start(&write, &start);
+        tag_journal_compact(&journal);
+        writer_drain();
+        result_stop(&write, start, n);
+    }
+
+    while (read.ns < MIN_TIME_NS || read.ops < 3L * n) {
+        result_start(&read, &start);
+        read_tag_file(&loaded, &tree, tagfile);
+        result_stop(&read, start, n);
+        radix_delete_all(&tree);
+        hashmap_delete_all(&loaded);
+    }
+
+    report("tag file", "tag", "write", n, &write);
+    report("tag file", "tag", "read", n, &read);
+
+    tag_journal_close(&journal);
+    hashmap_delete_all(&tags);
+}
+
+static void remove_dir(const char *dir, int n_dirs)
+{
+    char path[PATH_MAX];
+    int i;
+
+    for (i = 0; i < n_dirs; i++) {
+        snprintf(path, sizeof(path), "%s/%d", dir, i);
+        rmdir(path);
+    }
+    snprintf(path, sizeof(path), "%s/tags", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/tags.journal", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/nav-bench-XXXXXX";
+    int max = (argc > 1) ? atoi(argv[1]) : 100000;
+    int n_dirs = 0;
+    int i, s, k;
+
+    /* Loading a tag file logs every tag, which would be timed too */
+    set_log_level(LOG_LVL_NONE);
+
+    if (mkdtemp(dir) == NULL || writer_init()) {
+        perror("setup");
+        return 1;
+    }
+
+    printf("%-8s %-6s %-8s %8s %10s %12s %10s %10s\n", "storage", "kind",
+           "op", "n", "ops", "ns/op", "heap/op", "records/op");
+
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        if (sizes[i] > max) {
+            break;
+        }
+        for (s = 0; s < (int)(sizeof(storages) / sizeof(storages[0])); s++) {
+            for (k = 0; k < (int)(sizeof(kinds) / sizeof(kinds[0])); k++) {
+                bench_storage(&storages[s], &kinds[k], sizes[i]);
+            }
+        }
+        bench_tag_file(dir, sizes[i], &n_dirs);
+    }
+
+    writer_deinit();
+    remove_dir(dir, n_dirs);
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file fuzzy.c
+ * @brief Fuzzy matcher microbenchmark.
+ *
+ * This benchmark measures the cost of fuzzy matching a pattern against a
+ * large synthetic corpus of paths, as `search` does against the tags and
+ * visited directories. Each pattern is matched by the scorer alone, and then
+ * through each prefilter the CPU supports. The time per candidate and the
+ * number of candidates surviving the prefilter are reported.
+ *
+ * Usage: fuzzy [paths]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fuzzy.h"
+
+#define DEFAULT_PATHS 100000
+
+/* Repeat each measurement until at least this many candidates are matched */
+#define MIN_WORK 2000000L
+
+static const char *const words[] = {
+    "src",     "include", "build",   "docs",    "tests",  "lib",
+    "home",    "user",    "projects", "work",   "config", "cache",
+    "daemon",  "client",  "shared",  "vendor",  "assets", "scripts",
+    "release", "debug",   "old",     "backup",  "kernel", "drivers",
+    "net",     "fs",      "mm",      "arch",    "tools",  "bench",
+};
+
+static const char *const patterns[] = {"src", "prjdmn", "usrcfg", "xyzzy",
+                                       "Kernel", "hmwrkbldtst"};
+
+static const char *const impl_names[] = {
+    [FUZZY_IMPL_SCALAR] = "scalar",
+    [FUZZY_IMPL_SSE2] = "sse2",
+    [FUZZY_IMPL_AVX2] = "avx2",
+};
+
+struct path {
+    char *str;
+    size_t len;
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static struct path *make_paths(int n)
+{
+    struct path *paths;
+    char buf[256];
+    int i, depth, d, len;
+
+    paths = malloc(n * sizeof(*paths));
+    for (i = 0; i < n; i++) {
+        len = snprintf(buf, sizeof(buf), "/home/user");
+        depth = 2 + random() % 6;
+        for (d = 0; d < depth; d++) {
+            len += snprintf(buf + len, sizeof(buf) - len, "/%s",
+                            words[random() % (sizeof(words) /
+                                              sizeof(words[0]))]);
+        }
+        len += snprintf(buf + len, sizeof(buf) - len, "-%d", i);
+        paths[i].str = strdup(buf);
+        paths[i].len = len;
+    }
+
+    return paths;
+}
+
+/**
+ * @brief Matches every path, returning the time per path in nanoseconds.
+ *
+ * @param prefilter Whether to run the prefilter before the scorer.
+ * @param survivors Set to the number of paths passing the prefilter.
+ * @param matches Set to the number of matching paths.
+ */
+static double bench_match(const struct fuzzy_pattern *p, struct path *paths,
+                          int n, bool prefilter, int *survivors, int *matches)
+{
+    volatile int sink = 0;
+    double start;
+    long rounds, r;
+    int i, score;
+
+    rounds = MIN_WORK / n > 0 ? MIN_WORK / n : 1;
+
+    start = now_ns();
+    for (r = 0; r < rounds; r++) {
+        *survivors = 0;
+        *matches = 0;
+        for (i = 0; i < n; i++) {
+            if (prefilter && !p->prefilter(p, paths[i].str, paths[i].len)) {
+                continue;
+            }
+            (*survivors)++;
+            if (fuzzy_score(p, paths[i].str, paths[i].len, &score)) {
+                (*matches)++;
+                sink += score;
+            }
+        }
+    }
+    (void)sink;
+
+    return (now_ns() - start) / (rounds * n);
+}
+
+int main(int argc, char **argv)
+{
+    struct fuzzy_pattern p;
+    struct path *paths;
+    int survivors, matches;
+    int n, i, impl;
+    double ns;
+
+    n = (argc > 1) ? atoi(argv[1]) : DEFAULT_PATHS;
+    if (n < 1) {
+        n = 1;
+    }
+
+    paths = make_paths(n);
+
+    printf("%d paths\n", n);
+    printf("%-12s %-8s %12s %10s %10s\n", "pattern", "filter", "per path",
+           "survivors", "matches");
+
+    for (i = 0; i < (int)(sizeof(patterns) / sizeof(patterns[0])); i++) {
+        fuzzy_compile(&p, patterns[i]);
+
+        ns = bench_match(&p, paths, n, false, &survivors, &matches);
+        printf("%-12s %-8s %9.1f ns %10d %10d\n", patterns[i], "none", ns,
+               survivors, matches);
+
+        for (impl = FUZZY_IMPL_SCALAR; impl <= FUZZY_IMPL_AVX2; impl++) {
+            if (fuzzy_set_impl(&p, impl)) {
+                continue;
+            }
+            ns = bench_match(&p, paths, n, true, &survivors, &matches);
+            printf("%-12s %-8s %9.1f ns %10d %10d\n", patterns[i],
+                   impl_names[impl], ns, survivors, matches);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        free(paths[i].str);
+    }
+    free(paths);
+
+    return 0;
+}
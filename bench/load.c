@@ -0,0 +1,643 @@
+/**
+ * @file load.c
+ * @brief Multi-shell load generator.
+ *
+ * This benchmark drives a running daemon the way many shells would. Each
+ * simulated shell has its own datagram socket and PID, and has at most one
+ * request in flight, drawn from a weighted mix of commands. Requests are
+ * paced to a target total rate, or sent as soon as the previous reply arrives
+ * if no rate is given. Throughput and latency percentiles are reported for
+ * each command and overall.
+ *
+ * Requests are due on a fixed schedule, and latencies are measured from when
+ * a request was due rather than when it was sent. A daemon falling behind the
+ * target rate therefore shows up in the percentiles, instead of silently
+ * lowering the rate. Listings are fetched page by page, and count as one
+ * request.
+ *
+ * The shells use PIDs above the kernel's PID limit, registered explicitly, so
+ * they never collide with real shells, and are unregistered at the end. The
+ * daemon is found like the client finds it, through `NAV_CACHE_DIR`. It logs
+ * every request, so for meaningful numbers run it as `daemon 2>/dev/null`.
+ *
+ * Usage: load [-s shells] [-d seconds] [-r rate] [-m mix] [-t tags]
+ *             [-j threads]
+ *
+ * The mix lists commands with their weights, e.g. "get=3,push=1", out of
+ * register, get, push, pop, list and show. A `pop` on an empty stack is
+ * answered with "BAD", so some are expected.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+#include "utils.h"
+
+#define DEFAULT_SHELLS   16
+#define DEFAULT_SECONDS  5
+#define DEFAULT_TAGS     100
+#define DEFAULT_THREADS  2
+#define DEFAULT_MIX      "register=1,get=40,push=25,pop=20,list=7,show=7"
+
+/* First PID of the simulated shells, the kernel's largest PID limit */
+#define PID_BASE 4194304
+
+/* Time after which a request is given up on */
+#define REQUEST_TIMEOUT_NS 1000000000ULL
+
+/* Maximum size of a request frame, the fields are short */
+#define FRAME_MAX 512
+
+/* Maximum size of a reply frame, see the daemon's server.h */
+#define REPLY_MAX (sizeof(struct proto_header) + 8192)
+
+/**
+ * @brief Enum representing the commands in the mix.
+ */
+enum load_op {
+    LOAD_REGISTER,
+    LOAD_GET,
+    LOAD_PUSH,
+    LOAD_POP,
+    LOAD_LIST,
+    LOAD_SHOW,
+    LOAD_NUM
+};
+
+static const char *const op_names[LOAD_NUM] = {
+    [LOAD_REGISTER] = "register", [LOAD_GET] = "get",
+    [LOAD_PUSH] = "push",         [LOAD_POP] = "pop",
+    [LOAD_LIST] = "list",         [LOAD_SHOW] = "show",
+};
+
+/* Directories pushed and tagged, those that exist are used */
+static const char *const dir_candidates[] = {"/", "/tmp", "/usr", "/var",
+                                             "/etc", "/home"};
+
+static const char *dirs[sizeof(dir_candidates) / sizeof(dir_candidates[0])];
+static int n_dirs;
+
+static int weights[LOAD_NUM];
+static int total_weight;
+static int n_tags = DEFAULT_TAGS;
+
+static struct sockaddr_un nav_addr;
+static socklen_t nav_addr_len;
+
+/**
+ * @brief Structure holding the state of a simulated shell.
+ */
+struct shell {
+    int fd;
+    int pid;
+    bool busy;       /**<< Whether a request is in flight */
+    bool blocked;    /**<< Whether the daemon's queue was full */
+    int op;          /**<< The request in flight */
+    int opcode;      /**<< Its opcode, to ignore replies that timed out */
+    uint64_t due;    /**<< When the current or next request is due */
+    uint64_t sent;   /**<< When the current request was first sent */
+    char frame[FRAME_MAX];
+    int frame_len;
+};
+
+/**
+ * @brief Structure holding the latencies recorded for a command.
+ */
+struct samples {
+    uint64_t *ns;
+    size_t n;
+    size_t cap;
+};
+
+/**
+ * @brief Structure holding the state of a thread driving shells.
+ */
+struct worker {
+    pthread_t thread;
+    struct shell *shells;
+    int n_shells;
+    struct pollfd *pfds;
+    unsigned int seed;
+    uint64_t interval; /**<< Time between a shell's requests, 0 for none */
+    uint64_t end;
+    struct samples samples[LOAD_NUM];
+    uint64_t bad;
+    uint64_t timeouts;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void samples_add(struct samples *s, uint64_t ns)
+{
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->ns = realloc(s->ns, s->cap * sizeof(*s->ns));
+        if (s->ns == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    s->ns[s->n++] = ns;
+}
+
+static int parse_mix(const char *mix)
+{
+    char *copy, *item, *eq, *saveptr = NULL;
+    int op;
+
+    copy = strdup(mix);
+    for (item = strtok_r(copy, ",", &saveptr); item != NULL;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        eq = strchr(item, '=');
+        if (eq != NULL) {
+            *eq = '\0';
+        }
+        for (op = 0; op < LOAD_NUM; op++) {
+            if (strcmp(item, op_names[op]) == 0) {
+                break;
+            }
+        }
+        if (op == LOAD_NUM) {
+            fprintf(stderr, "Unknown command in mix: %s\n", item);
+            free(copy);
+            return 1;
+        }
+        weights[op] = eq != NULL ? atoi(eq + 1) : 1;
+        total_weight += weights[op];
+    }
+    free(copy);
+
+    return total_weight > 0 ? 0 : 1;
+}
+
+/**
+ * @brief Finds the daemon's socket, like the client does.
+ */
+static int find_daemon(void)
+{
+    char path[sizeof(nav_addr.sun_path)];
+    const char *cache_dir = getenv("NAV_CACHE_DIR");
+    char *uname;
+
+    if (cache_dir != NULL) {
+        snprintf(path, sizeof(path), "%s/nav.sock", cache_dir);
+    } else {
+        uname = get_username();
+        if (uname == NULL) {
+            return 1;
+        }
+        snprintf(path, sizeof(path), "/home/%s/.cache/nav/nav.sock", uname);
+    }
+
+    nav_addr_len = set_socket_address(&nav_addr, path,
+                                      use_abstract_sockets());
+    return nav_addr_len == 0;
+}
+
+/**
+ * @brief Opens a shell's socket, autobound to a unique abstract address.
+ */
+static int open_socket(void)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(sa_family_t)) == -1 ||
+        connect(fd, (struct sockaddr *)&nav_addr, nav_addr_len) == -1) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void encode(struct shell *s, const char *cmd, int argc, char **argv)
+{
+    s->opcode = proto_lookup_opcode(cmd);
+    s->frame_len = proto_encode_request(s->frame, sizeof(s->frame),
+                                        s->opcode, s->pid, argc, argv);
+}
+
+/**
+ * @brief Sends a request and waits for its whole reply, outside the
+ * measurements.
+ *
+ * @return 0 if the reply is not "BAD", non-zero otherwise.
+ */
+static int request_sync(struct shell *s, const char *cmd, int argc,
+                        char **argv)
+{
+    struct proto_header header;
+    struct pollfd pfd = {.fd = s->fd, .events = POLLIN};
+    char reply[REPLY_MAX];
+    ssize_t n;
+
+    encode(s, cmd, argc, argv);
+    for (;;) {
+        if (send(s->fd, s->frame, s->frame_len, 0) == -1) {
+            if (errno == EAGAIN) {
+                usleep(1000);
+                continue;
+            }
+            return 1;
+        }
+
+        if (poll(&pfd, 1, 1000) != 1) {
+            return 1;
+        }
+        n = recv(s->fd, reply, sizeof(reply), 0);
+        if (n < (ssize_t)sizeof(header)) {
+            return 1;
+        }
+        memcpy(&header, reply, sizeof(header));
+        if (!(header.flags & PROTO_FLAG_MORE)) {
+            break;
+        }
+        memcpy(s->frame + offsetof(struct proto_header, cursor),
+               &header.cursor, sizeof(header.cursor));
+    }
+
+    return n == sizeof(header) + 4 &&
+           memcmp(reply + sizeof(header), "BAD\n", 4) == 0;
+}
+
+static int pick_op(struct worker *w)
+{
+    int r = rand_r(&w->seed) % total_weight;
+    int op;
+
+    for (op = 0; r >= weights[op]; op++) {
+        r -= weights[op];
+    }
+
+    return op;
+}
+
+/**
+ * @brief Sends a shell's next request, or the rest of one blocked earlier.
+ */
+static void send_request(struct worker *w, struct shell *s, uint64_t now)
+{
+    char tag[32];
+    char *argv[1];
+
+    if (!s->busy) {
+        s->op = pick_op(w);
+        switch (s->op) {
+        case LOAD_GET:
+            snprintf(tag, sizeof(tag), "load-%d",
+                     rand_r(&w->seed) % n_tags);
+            argv[0] = tag;
+            encode(s, "get", 1, argv);
+            break;
+        case LOAD_PUSH:
+            argv[0] = (char *)dirs[rand_r(&w->seed) % n_dirs];
+            encode(s, "push", 1, argv);
+            break;
+        default:
+            encode(s, op_names[s->op], 0, NULL);
+            break;
+        }
+        s->busy = true;
+        s->sent = now;
+    }
+
+    s->blocked = false;
+    if (send(s->fd, s->frame, s->frame_len, 0) == -1) {
+        /* Wait for room in the daemon's queue, which is part of the latency */
+        s->blocked = errno == EAGAIN;
+        if (!s->blocked) {
+            perror("send");
+        }
+    }
+}
+
+static void finish_request(struct worker *w, struct shell *s, uint64_t now)
+{
+    s->busy = false;
+    if (w->interval == 0) {
+        s->due = now;
+    } else {
+        s->due += w->interval;
+    }
+}
+
+static void receive_reply(struct worker *w, struct shell *s, uint64_t now)
+{
+    struct proto_header header;
+    char reply[REPLY_MAX];
+    ssize_t n;
+
+    while ((n = recv(s->fd, reply, sizeof(reply), 0)) >= 0) {
+        if (!s->busy || n < (ssize_t)sizeof(header)) {
+            continue;
+        }
+        memcpy(&header, reply, sizeof(header));
+        if (header.opcode != s->opcode) {
+            continue;
+        }
+
+        /* Fetch the next page of a listing */
+        if (header.flags & PROTO_FLAG_MORE) {
+            memcpy(s->frame + offsetof(struct proto_header, cursor),
+                   &header.cursor, sizeof(header.cursor));
+            send_request(w, s, now);
+            continue;
+        }
+
+        if (n == sizeof(header) + 4 &&
+            memcmp(reply + sizeof(header), "BAD\n", 4) == 0) {
+            w->bad++;
+        }
+        samples_add(&w->samples[s->op], now - s->due);
+        finish_request(w, s, now);
+    }
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker *w = arg;
+    struct shell *s;
+    struct timespec timeout;
+    uint64_t now, wake;
+    int i;
+
+    for (;;) {
+        now = now_ns();
+        if (now >= w->end) {
+            break;
+        }
+
+        wake = w->end;
+        for (i = 0; i < w->n_shells; i++) {
+            s = &w->shells[i];
+            if (s->busy && now - s->sent > REQUEST_TIMEOUT_NS) {
+                w->timeouts++;
+                finish_request(w, s, now);
+            }
+            if ((!s->busy && s->due <= now) || s->blocked) {
+                send_request(w, s, now);
+            }
+
+            w->pfds[i].events = s->blocked ? POLLOUT : POLLIN;
+            if (!s->busy && s->due < wake) {
+                wake = s->due;
+            } else if (s->busy && s->sent + REQUEST_TIMEOUT_NS < wake) {
+                wake = s->sent + REQUEST_TIMEOUT_NS;
+            }
+        }
+
+        if (wake <= now) {
+            continue;
+        }
+        wake -= now;
+        timeout.tv_sec = wake / 1000000000;
+        timeout.tv_nsec = wake % 1000000000;
+        if (ppoll(w->pfds, w->n_shells, &timeout, NULL) <= 0) {
+            continue;
+        }
+
+        now = now_ns();
+        for (i = 0; i < w->n_shells; i++) {
+            if (w->pfds[i].revents & POLLIN) {
+                receive_reply(w, &w->shells[i], now);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const struct samples *s, double p)
+{
+    size_t i;
+
+    if (s->n == 0) {
+        return 0;
+    }
+
+    i = (size_t)(p / 100 * s->n);
+    if (i >= s->n) {
+        i = s->n - 1;
+    }
+
+    return s->ns[i] / 1000.0;
+}
+
+static void report(const char *name, struct samples *s, double seconds)
+{
+    qsort(s->ns, s->n, sizeof(*s->ns), compare_u64);
+    printf("%-10s %10zu %10.1f %9.1f us %9.1f us %9.1f us %9.1f us\n", name,
+           s->n, s->n / seconds, percentile_us(s, 50), percentile_us(s, 99),
+           percentile_us(s, 99.9), s->n ? s->ns[s->n - 1] / 1000.0 : 0);
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-s shells] [-d seconds] [-r rate] [-m mix] "
+            "[-t tags] [-j threads]\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct samples all = {0};
+    struct worker *workers;
+    struct shell *shells;
+    const char *mix = DEFAULT_MIX;
+    char tag[32];
+    char *args[2];
+    uint64_t start, interval = 0;
+    uint64_t bad = 0, timeouts = 0;
+    double seconds = DEFAULT_SECONDS, rate = 0;
+    int n_shells = DEFAULT_SHELLS, n_threads = DEFAULT_THREADS;
+    int opt, i, j, k, op;
+
+    while ((opt = getopt(argc, argv, "s:d:r:m:t:j:")) != -1) {
+        switch (opt) {
+        case 's':
+            n_shells = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 't':
+            n_tags = atoi(optarg);
+            break;
+        case 'j':
+            n_threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (n_shells < 1 || n_tags < 1 || n_threads < 1 || seconds <= 0 ||
+        parse_mix(mix)) {
+        usage(argv[0]);
+    }
+    if (n_threads > n_shells) {
+        n_threads = n_shells;
+    }
+
+    for (i = 0; i < (int)(sizeof(dir_candidates) / sizeof(*dir_candidates));
+         i++) {
+        if (access(dir_candidates[i], F_OK) == 0) {
+            dirs[n_dirs++] = dir_candidates[i];
+        }
+    }
+
+    if (find_daemon()) {
+        fprintf(stderr, "Cannot find the daemon's socket\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Register the shells, and tag directories for `get` and `list` */
+    shells = calloc(n_shells, sizeof(*shells));
+    for (i = 0; i < n_shells; i++) {
+        shells[i].pid = PID_BASE + i;
+        shells[i].fd = open_socket();
+        if (shells[i].fd == -1 ||
+            request_sync(&shells[i], "register", 0, NULL)) {
+            fprintf(stderr, "Cannot register shell %d, is the daemon up?\n",
+                    shells[i].pid);
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < n_tags; i++) {
+        snprintf(tag, sizeof(tag), "load-%d", i);
+        args[0] = tag;
+        args[1] = (char *)dirs[i % n_dirs];
+        if (request_sync(&shells[0], "add", 2, args)) {
+            fprintf(stderr, "Cannot add tag %s\n", tag);
+        }
+    }
+
+    if (rate > 0) {
+        interval = (uint64_t)(1e9 * n_shells / rate);
+    }
+
+    /* Spread the shells' first requests over one interval */
+    start = now_ns();
+    for (i = 0; i < n_shells; i++) {
+        shells[i].due = start + (interval * i) / n_shells;
+    }
+
+    workers = calloc(n_threads, sizeof(*workers));
+    for (i = 0, j = 0; i < n_threads; i++) {
+        workers[i].shells = &shells[j];
+        workers[i].n_shells = n_shells / n_threads + (i < n_shells % n_threads);
+        workers[i].pfds = calloc(workers[i].n_shells, sizeof(struct pollfd));
+        for (k = 0; k < workers[i].n_shells; k++) {
+            workers[i].pfds[k].fd = workers[i].shells[k].fd;
+        }
+        workers[i].seed = i + 1;
+        workers[i].interval = interval;
+        workers[i].end = start + (uint64_t)(seconds * 1e9);
+        j += workers[i].n_shells;
+
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        bad += workers[i].bad;
+        timeouts += workers[i].timeouts;
+    }
+
+    printf("%d shells, %d threads, %.1f s, ", n_shells, n_threads, seconds);
+    if (rate > 0) {
+        printf("target %.0f requests/s\n", rate);
+    } else {
+        printf("no target rate\n");
+    }
+    printf("%-10s %10s %10s %12s %12s %12s %12s\n", "command", "requests",
+           "req/s", "p50", "p99", "p99.9", "max");
+
+    for (op = 0; op < LOAD_NUM; op++) {
+        struct samples merged = {0};
+
+        for (i = 0; i < n_threads; i++) {
+            for (j = 0; j < (int)workers[i].samples[op].n; j++) {
+                samples_add(&merged, workers[i].samples[op].ns[j]);
+                samples_add(&all, workers[i].samples[op].ns[j]);
+            }
+            free(workers[i].samples[op].ns);
+        }
+        if (merged.n > 0) {
+            report(op_names[op], &merged, seconds);
+        }
+        free(merged.ns);
+    }
+    report("all", &all, seconds);
+    printf("%llu replied BAD, %llu timed out\n", (unsigned long long)bad,
+           (unsigned long long)timeouts);
+
+    /* Leave the daemon as it was found, once late replies are discarded */
+    usleep(100000);
+    for (i = 0; i < n_shells; i++) {
+        while (recv(shells[i].fd, tag, sizeof(tag), 0) >= 0) {
+        }
+    }
+    for (i = 0; i < n_tags; i++) {
+        snprintf(tag, sizeof(tag), "load-%d", i);
+        args[0] = tag;
+        request_sync(&shells[0], "delete", 1, args);
+    }
+    for (i = 0; i < n_shells; i++) {
+        request_sync(&shells[i], "unregister", 0, NULL);
+        close(shells[i].fd);
+    }
+
+    for (i = 0; i < n_threads; i++) {
+        free(workers[i].pfds);
+    }
+    free(workers);
+    free(shells);
+    free(all.ns);
+
+    return EXIT_SUCCESS;
+}
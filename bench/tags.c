@@ -0,0 +1,169 @@
+/**
+ * @file tags.c
+ * @brief Tag lookup microbenchmark.
+ *
+ * This benchmark measures the cost of looking up a tag by name in the tag
+ * map, and compares it against the linear list lookup the map replaced. Each
+ * container is filled with `n` tags, and then queried for tags that exist
+ * (hits) and tags that do not (misses).
+ *
+ * Usage: tags [ops]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashmap.h"
+#include "list.h"
+#include "tag.h"
+
+#define DEFAULT_OPS 1000000L
+
+/* Cap list lookups, as the linear scan makes large sizes very slow */
+#define LIST_MAX_WORK 200000000L
+
+static const int sizes[] = {10, 1000, 10000, 100000};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static struct tag *make_tag(int i)
+{
+    char tag[64], path[64];
+    int tag_len;
+
+    tag_len = snprintf(tag, sizeof(tag), "tag-%d", i);
+    snprintf(path, sizeof(path), "/home/user/projects/project-%d", i);
+
+    return tag_create(tag, tag_len, path);
+}
+
+static char **make_keys(int n, long ops, int miss)
+{
+    char **keys;
+    char buf[64];
+    long i;
+    int n_keys;
+
+    /* Use a bounded set of keys so string formatting is not measured */
+    n_keys = (ops < 4096) ? ops : 4096;
+    keys = malloc(n_keys * sizeof(char *));
+    for (i = 0; i < n_keys; i++) {
+        snprintf(buf, sizeof(buf), miss ? "missing-%d" : "tag-%d",
+                 (int)(random() % n));
+        keys[i] = strdup(buf);
+    }
+
+    return keys;
+}
+
+static void free_keys(char **keys, long ops)
+{
+    int n_keys = (ops < 4096) ? ops : 4096;
+    int i;
+
+    for (i = 0; i < n_keys; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+}
+
+static double bench_map(struct hashmap *m, char **keys, long ops)
+{
+    volatile void *sink;
+    double start;
+    long i;
+
+    start = now_ns();
+    for (i = 0; i < ops; i++) {
+        sink = hashmap_get(m, keys[i & 4095]);
+    }
+    (void)sink;
+
+    return (now_ns() - start) / ops;
+}
+
+static double bench_list(struct list *l, char **keys, long ops)
+{
+    volatile void *sink;
+    double start;
+    long i;
+
+    start = now_ns();
+    for (i = 0; i < ops; i++) {
+        sink = list_get_node(l, keys[i & 4095]);
+    }
+    (void)sink;
+
+    return (now_ns() - start) / ops;
+}
+
+int main(int argc, char **argv)
+{
+    struct hashmap map = {0};
+    struct list list = {0};
+    struct node *node;
+    struct tag *t;
+    char **hits, **misses;
+    long ops, list_ops;
+    int s, i, n;
+
+    ops = (argc > 1) ? atol(argv[1]) : DEFAULT_OPS;
+    if (ops < 4096) {
+        ops = 4096;
+    }
+
+    map.hash_func = hash_string;
+    map.compare_func = compare_tag_tag;
+    map.cleanup_func = cleanup_tag;
+    list.compare_func = compare_tag_tag;
+    list.cleanup_func = cleanup_tag;
+
+    printf("%-8s %10s %12s %12s %12s %12s\n", "tags", "ops", "map hit",
+           "map miss", "list hit", "list miss");
+
+    for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        n = sizes[s];
+
+        for (i = 0; i < n; i++) {
+            t = make_tag(i);
+            hashmap_insert(&map, t->tag, t);
+
+            t = make_tag(i);
+            list_node_create(&node);
+            node->data = t;
+            list_prepend_node(&list, node);
+        }
+
+        list_ops = LIST_MAX_WORK / n;
+        if (list_ops > ops) {
+            list_ops = ops;
+        } else if (list_ops < 4096) {
+            list_ops = 4096;
+        }
+
+        hits = make_keys(n, ops, 0);
+        misses = make_keys(n, ops, 1);
+
+        printf("%-8d %10ld %9.1f ns %9.1f ns %9.1f ns %9.1f ns\n", n, ops,
+               bench_map(&map, hits, ops), bench_map(&map, misses, ops),
+               bench_list(&list, hits, list_ops),
+               bench_list(&list, misses, list_ops));
+
+        free_keys(hits, ops);
+        free_keys(misses, ops);
+        hashmap_delete_all(&map);
+        list_delete_all(&list);
+    }
+
+    return 0;
+}
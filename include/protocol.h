@@ -0,0 +1,164 @@
+/**
+ * @file protocol.h
+ * @brief Binary wire protocol shared by the client and the daemon.
+ *
+ * This header defines the framing of requests and replies exchanged over the
+ * nav sockets. A frame is a fixed size `struct proto_header` followed by
+ * `length` bytes of payload. Request payloads are a sequence of fields, each
+ * a 16-bit length followed by that many bytes and a terminating NUL byte that
+ * is not counted in the length. Because every field is NUL-terminated on the
+ * wire, the daemon hands out string views into the receive buffer instead of
+ * copying arguments. Reply payloads are the raw reply bytes.
+ *
+ * Listings (`show`, `list`, `actions`, `complete` and `stats`) are paginated
+ * so that a reply never has to hold all of them. A reply with
+ * `PROTO_FLAG_MORE` set is one page, and the next page is fetched by repeating
+ * the request with the reply's cursor.
+ * Cursors are opaque to the client and 0 requests the first page.
+ *
+ * Both ends always run on the same host, so all integers are in host byte
+ * order.
+ *
+ * The original text protocol, `"<pid> <cmd> <args>"`, is still accepted. Its
+ * requests always start with a digit, while binary frames start with
+ * `PROTO_MAGIC`, so the two can be told apart from the first byte.
+ */
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* First byte of every binary frame, never the first byte of a text request */
+#define PROTO_MAGIC 0x00
+
+/* Version of the framing described in this header */
+#define PROTO_VERSION 2
+
+/* Reply flag, set when a listing continues from the reply's cursor */
+#define PROTO_FLAG_MORE 0x01
+
+/* Maximum number of fields in a request */
+#define PROTO_MAX_FIELDS 8
+
+/**
+ * @brief Enum representing the request opcodes.
+ */
+enum proto_opcode {
+    PROTO_OP_REGISTER = 0,
+    PROTO_OP_UNREGISTER,
+    PROTO_OP_ADD,
+    PROTO_OP_DELETE,
+    PROTO_OP_SHOW,
+    PROTO_OP_GET,
+    PROTO_OP_PUSH,
+    PROTO_OP_POP,
+    PROTO_OP_ACTIONS,
+    PROTO_OP_LIST,
+    PROTO_OP_RESET,
+    PROTO_OP_JUMP,
+    PROTO_OP_COMPLETE,
+    PROTO_OP_VISIT,
+    PROTO_OP_SEARCH,
+    PROTO_OP_FLUSH,
+    PROTO_OP_STATS,
+    PROTO_OP_NUM
+};
+
+/**
+ * @brief Structure representing the header of every binary frame.
+ */
+struct proto_header {
+    uint8_t magic;   /**<< Always `PROTO_MAGIC` */
+    uint8_t version; /**<< Always `PROTO_VERSION` */
+    uint8_t opcode;  /**<< The request opcode, echoed in the reply */
+    uint8_t flags;   /**<< 0 in requests, `PROTO_FLAG_*` in replies */
+    int32_t pid;     /**<< PID of the shell the request is made for */
+    uint32_t length; /**<< Length of the payload following the header */
+    uint32_t cursor; /**<< Where a listing starts, or continues in replies */
+};
+
+/**
+ * @brief Structure representing a view of a string inside a frame.
+ *
+ * `ptr[len]` is always a NUL byte, so `ptr` can be used as a C string.
+ */
+struct proto_str {
+    const char *ptr;
+    uint16_t len;
+};
+
+/**
+ * @brief Structure representing a parsed request.
+ *
+ * The fields point into the buffer the request was parsed from, which must
+ * outlive the request.
+ */
+struct proto_request {
+    struct proto_header header;
+    int n_fields;
+    struct proto_str fields[PROTO_MAX_FIELDS];
+};
+
+/**
+ * @brief Looks up the opcode for a command name.
+ *
+ * @param name The command name, e.g. "get".
+ * @return The opcode, or -1 if the command is unknown.
+ */
+int proto_lookup_opcode(const char *name);
+
+/**
+ * @brief Looks up the command name for an opcode.
+ *
+ * @param opcode The opcode, below `PROTO_OP_NUM`.
+ * @return The command name.
+ */
+const char *proto_opcode_name(int opcode);
+
+/**
+ * @brief Encodes a request frame.
+ *
+ * The header's cursor is set to 0, and can be changed in place to fetch later
+ * pages of a listing.
+ *
+ * @param buf Buffer for the frame.
+ * @param size Size of `buf`.
+ * @param opcode The request opcode.
+ * @param pid The PID of the shell the request is made for.
+ * @param argc Number of fields.
+ * @param argv The fields, as C strings.
+ * @return Length of the frame, or -1 if it does not fit in `buf`.
+ */
+int proto_encode_request(char *buf, size_t size, int opcode, int32_t pid,
+                         int argc, char **argv);
+
+/**
+ * @brief Parses a binary request frame.
+ *
+ * The header and every field are checked against `len`, and every field must
+ * be NUL-terminated. Nothing is copied.
+ *
+ * @param buf The received frame.
+ * @param len Length of the frame in bytes.
+ * @param req Pointer to the request to fill in.
+ * @return 0 on success, non-zero if the frame is malformed.
+ */
+int proto_parse_request(const char *buf, size_t len,
+                        struct proto_request *req);
+
+/**
+ * @brief Parses a text protocol request.
+ *
+ * The request is split on spaces in place, so `buf` is modified and must be
+ * NUL-terminated. The path of `add`, `push`, `jump` and `visit` is the rest
+ * of the line, so it may contain spaces.
+ *
+ * @param buf The received request.
+ * @param req Pointer to the request to fill in.
+ * @return 0 on success, non-zero if the request is malformed.
+ */
+int proto_parse_text_request(char *buf, struct proto_request *req);
+
+#endif /* PROTOCOL_H_ */
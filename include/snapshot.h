@@ -0,0 +1,146 @@
+/**
+ * @file snapshot.h
+ * @brief Shared memory snapshot of the tag map.
+ *
+ * This header defines a read-only snapshot of the tag map that the daemon
+ * publishes in a file under the cache directory. Clients map the file and
+ * answer `get` and `list` from it, without a round trip to the daemon.
+ *
+ * The file starts with a `struct snapshot_header`, followed by an index of
+ * `n_tags` 32-bit entry offsets sorted by tag, followed by the entries in the
+ * daemon's map order. Each entry is a 16-bit tag length, the tag and a NUL,
+ * then a 16-bit path length, the path and a NUL. Offsets are relative to the
+ * first entry.
+ *
+ * The snapshot is guarded by a sequence lock. The daemon makes `seq` odd while
+ * it rewrites the snapshot and even again when it is done, and readers retry
+ * if `seq` was odd or changed while they read. Readers never write to the
+ * mapping, and treat its contents as untrusted.
+ *
+ * A snapshot is only valid while the daemon that wrote it is running. The
+ * daemon sets `pid` to 0 when it exits, or when the tags do not fit, and
+ * readers also check that `pid` is still alive to catch a daemon that crashed.
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SNAPSHOT_FILE "tags.snap"
+
+/* "snav" in the first bytes of the file */
+#define SNAPSHOT_MAGIC 0x76616e73
+
+/* Version of the layout described in this header */
+#define SNAPSHOT_VERSION 1
+
+/* Size of the snapshot file, which bounds the tags it can hold */
+#define SNAPSHOT_SIZE (1 << 20)
+
+/* Number of times a reader retries while the daemon is writing */
+#define SNAPSHOT_READ_RETRIES 16
+
+/**
+ * @brief Structure representing the header of a snapshot file.
+ */
+struct snapshot_header {
+    uint32_t magic;    /**<< Always `SNAPSHOT_MAGIC` */
+    uint32_t version;  /**<< Always `SNAPSHOT_VERSION` */
+    uint32_t seq;      /**<< Sequence lock, odd while being written */
+    int32_t pid;       /**<< PID of the daemon, 0 if the snapshot is unusable */
+    uint32_t n_tags;   /**<< Number of entries */
+    uint32_t data_len; /**<< Length of the entries following the index */
+};
+
+/**
+ * @brief Structure representing a mapped snapshot file.
+ */
+struct snapshot {
+    void *map;   /**<< The mapping, or `NULL` if not mapped */
+    size_t size; /**<< Size of the mapping in bytes */
+};
+
+/**
+ * @brief Structure representing a tag to publish in a snapshot.
+ */
+struct snapshot_entry {
+    const char *tag;
+    const char *path;
+};
+
+/**
+ * @brief Creates the snapshot file and maps it for writing.
+ *
+ * Any existing file at `path` is unlinked first, so readers still mapping it
+ * are not affected. The new snapshot holds no tags until it is published.
+ *
+ * @param s Pointer to the snapshot to initialise.
+ * @param path Path of the snapshot file.
+ * @return 0 on success, non-zero on failure.
+ */
+int snapshot_create(struct snapshot *s, const char *path);
+
+/**
+ * @brief Replaces the contents of a snapshot created with `snapshot_create()`.
+ *
+ * If the entries do not fit, the snapshot is marked unusable so that readers
+ * fall back to asking the daemon.
+ *
+ * @param s Pointer to the snapshot.
+ * @param entries The tags to publish, in the order `list` returns them.
+ * @param n_entries Number of entries.
+ * @return 0 on success, non-zero if the snapshot was marked unusable.
+ */
+int snapshot_publish(struct snapshot *s, const struct snapshot_entry *entries,
+                     uint32_t n_entries);
+
+/**
+ * @brief Marks a snapshot unusable, unmaps it and removes its file.
+ *
+ * @param s Pointer to the snapshot.
+ * @param path Path of the snapshot file.
+ */
+void snapshot_destroy(struct snapshot *s, const char *path);
+
+/**
+ * @brief Maps an existing snapshot file for reading.
+ *
+ * @param s Pointer to the snapshot to initialise.
+ * @param path Path of the snapshot file.
+ * @return 0 on success, non-zero on failure.
+ */
+int snapshot_open(struct snapshot *s, const char *path);
+
+/**
+ * @brief Looks up the path for a tag.
+ *
+ * @param s Pointer to the snapshot.
+ * @param tag The tag to look up.
+ * @param dest Buffer for the NUL-terminated path.
+ * @param dest_size Size of `dest`.
+ * @return 0 if the tag was found, 1 if it does not exist, -1 if the snapshot
+ *         cannot be used and the daemon must be asked instead.
+ */
+int snapshot_get(const struct snapshot *s, const char *tag, char *dest,
+                 size_t dest_size);
+
+/**
+ * @brief Lists all tags, separated by spaces.
+ *
+ * @param s Pointer to the snapshot.
+ * @param dest Set to the NUL-terminated list, which the caller must free.
+ * @return Length of the list, or -1 if the snapshot cannot be used and the
+ *         daemon must be asked instead.
+ */
+int snapshot_list(const struct snapshot *s, char **dest);
+
+/**
+ * @brief Unmaps a snapshot opened with `snapshot_open()`.
+ *
+ * @param s Pointer to the snapshot.
+ */
+void snapshot_close(struct snapshot *s);
+
+#endif /* SNAPSHOT_H_ */
@@ -10,6 +10,11 @@
 #define UTILS_H_
 
 #include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Set to a non-empty value other than "0" to use abstract socket addresses */
+#define ABSTRACT_SOCKET_ENV_VAR "NAV_ABSTRACT_SOCKET"
 
 /**
  * @brief Retrieves the username of the current user.
@@ -37,17 +42,31 @@ char *get_username(void);
 int get_trailing_whitespace(char *s);
 
 /**
- * @brief Validate a path to ensure it exists.
+ * @brief Checks whether abstract socket addresses are enabled.
+ *
+ * Abstract addresses are enabled by setting `NAV_ABSTRACT_SOCKET` in the
+ * environment to a non-empty value other than "0".
+ *
+ * @return `true` if abstract socket addresses should be used.
+ */
+bool use_abstract_sockets(void);
+
+/**
+ * @brief Fills in a Unix socket address for `path`.
  *
- * This function checks if a specified file or directory path exists
- * by performing a `fstatat` system call on the provided path.
- * Logs an error if the path is invalid or does not exist.
+ * With `abstract` set, the address is `path` in the Linux abstract namespace,
+ * i.e. prefixed with a NUL byte. Such an address has no file behind it, so
+ * binding to it needs no filesystem access and nothing has to be unlinked
+ * afterwards. The returned length must be passed to `bind()` and `connect()`
+ * as is, since every byte of an abstract name is significant.
  *
- * @param path Pointer to the string containing the path to validate.
- * @return `true` if the path exists; `false` if it does not or
- *         if there is an error accessing the path.
+ * @param addr Pointer to the address to fill in.
+ * @param path The socket path, or name in the abstract namespace.
+ * @param abstract Whether to use the abstract namespace.
+ * @return Length of the address, or 0 if `path` is too long.
  */
-bool valid_path(char *path);
+socklen_t set_socket_address(struct sockaddr_un *addr, const char *path,
+                             bool abstract);
 
 #endif /* UTILS_H_ */
 
@@ -1,6 +1,17 @@
 #!/bin/bash
 
 NAV_CLIENT="${NAV_CLIENT:-./build/client}"
+NAV_BUILTIN="${NAV_BUILTIN:-./build/nav.so}"
+
+# Prefer the loadable builtin, which keeps a socket open for the life of the
+# shell instead of running the client for every request
+if [ -f "$NAV_BUILTIN" ] && enable -f "$NAV_BUILTIN" nav 2> /dev/null; then
+    _NAV_HAVE_BUILTIN=1
+elif [ -n "$NAV_SERVE" ]; then
+    # Otherwise, if asked, run one client for the life of the shell that
+    # streams every request over a single connection
+    coproc _NAV_COPROC { exec "$NAV_CLIENT" --serve $$ 2> /dev/null; }
+fi
 
 function _nav_error {
     echo "Error: $1"
@@ -17,31 +28,46 @@ function _nav_usage {
     echo "  show|s            Show all tag-path associations."
     echo "  back|b            Undo the previous action."
     echo "  actions|a         List all recorded actions."
+    echo "  search|f [pat]    Fuzzy search tagged and visited directories."
     echo "  reset|ar          Delete all recorded actions."
     return 1
 }
 
-function _register_client {
-    local connected
-    connected=$($NAV_CLIENT $$ register 2>/dev/null)
+# Send a request to the daemon and store the reply in _nav_reply. Shells are
+# registered by the daemon on their first request, so no explicit registration
+# is needed.
+function _nav_request {
+    if [ -n "$_NAV_HAVE_BUILTIN" ]; then
+        builtin nav -v _nav_reply "$@"
+    elif [ -n "$_NAV_COPROC_PID" ]; then
+        # Arguments are tab separated, each reply is terminated by a NUL byte
+        local IFS=$'\t'
+        printf '%s\n' "$*" >&"${_NAV_COPROC[1]}" &&
+            IFS= read -r -d '' -t 1 -u "${_NAV_COPROC[0]}" _nav_reply &&
+            _nav_reply="${_nav_reply%$'\n'}"
+    else
+        _nav_reply=$($NAV_CLIENT $$ "$@" 2> /dev/null)
+    fi
 
-    if [ -z "$connected" ]; then
-        _nav_error "Unable to reach daemon. Is it running?"
+    if [ $? -ne 0 ]; then
+        _nav_error "Unable to reach daemon. Is it running?" >&2
         return 1
     fi
 }
 
 function _unregister_client {
-    $NAV_CLIENT $$ unregister 2> /dev/null > /dev/null
+    _nav_request unregister 2> /dev/null
+
+    # Unloading the builtin closes its socket and removes the socket file
+    if [ -n "$_NAV_HAVE_BUILTIN" ]; then
+        enable -d nav
+    fi
 }
 
 # Unregister the client when shell exits
 trap _unregister_client EXIT
 
 function nav {
-    # Attempt to register
-    _register_client || return 1
-
     case "$1" in
         add)
             # Command: nav add [tag] [path]
@@ -50,7 +76,8 @@ function nav {
             if [ -z "$tag" ] || [ -z "$path" ]; then
                 _nav_usage
             else
-                output=$($NAV_CLIENT $$ add "$tag" "$path" 2> /dev/null)
+                _nav_request add "$tag" "$path"
+                output="$_nav_reply"
                 if [ "$output" == "OK" ]; then
                     echo "Added tag '$tag' with path '$path'"
                 else
@@ -64,7 +91,8 @@ function nav {
             if [ -z "$tag" ]; then
                 _nav_usage
             else
-                output=$($NAV_CLIENT $$ delete "$tag" 2> /dev/null)
+                _nav_request delete "$tag"
+                output="$_nav_reply"
                 if [ "$output" == "OK" ]; then
                     echo "Deleted tag '$tag'"
                 else
@@ -74,14 +102,16 @@ function nav {
             ;;
         show|s)
             # Command: nav show
-            output=$($NAV_CLIENT $$ show 2> /dev/null)
+            _nav_request show
+            output="$_nav_reply"
             if [ "$output" != "BAD" ]; then
                 echo "$output"
             fi
             ;;
         actions|a)
             # Command: nav actions 
-            output=$($NAV_CLIENT $$ actions 2> /dev/null)
+            _nav_request actions
+            output="$_nav_reply"
             if [ "$output" != "BAD" ] && [ -n "$output" ]; then
                 echo "$output"
             else
@@ -90,15 +120,31 @@ function nav {
             ;;
         back|b)
             # Command: nav back
-            dir=$($NAV_CLIENT $$ pop 2> /dev/null)
+            _nav_request pop
+            dir="$_nav_reply"
             if [ -n "$dir" ] && [ "$dir" != "BAD" ]; then
                 cd "$dir" || _nav_error "Failed to navigate to $dir"
             else
                 echo "No previous actions found"
             fi
             ;;
+        search|f)
+            # Command: nav search [pattern]
+            if [ -z "$2" ]; then
+                _nav_usage
+            else
+                _nav_request search "$2"
+                output="$_nav_reply"
+                if [ "$output" != "BAD" ] && [ -n "$output" ]; then
+                    echo "$output"
+                else
+                    echo "No directory matches '$2'"
+                fi
+            fi
+            ;;
         reset|ar)
-            output=$($NAV_CLIENT $$ reset 2> /dev/null)
+            _nav_request reset
+            output="$_nav_reply"
             if [ "$output" == "OK" ]; then
                 echo "Action stack cleared"
             fi
@@ -111,19 +157,16 @@ function nav {
                 return 1;
             fi
 
-            dir=$($NAV_CLIENT $$ get "$tag" 2> /dev/null)
+            # Push the current directory to the action stack and retrieve
+            # the tag's path in a single request
+            _nav_request jump "$tag" "$PWD"
+            dir="$_nav_reply"
 
             if [ "$dir" == "BAD" ] || [ -z "$dir" ]; then
-                echo "Tag '$tag' not found."
+                echo "Tag '$tag' not found and no visited directory matches."
             else
-                # Push current directory to the action stack
-                output=$($NAV_CLIENT $$ push "$(pwd)" 2> /dev/null)
-                if [ "$output" == "OK" ]; then
-                    # Change directory to the retrieved path
-                    cd "$dir" || _nav_error "Failed to navigate to $dir"
-                else
-                    _nav_error "Failed to push current directory to action stack"
-                fi
+                # Change directory to the retrieved path
+                cd "$dir" || _nav_error "Failed to navigate to $dir"
             fi
             ;;
     esac
@@ -131,7 +174,7 @@ function nav {
 
 # Autocomplete function for the 'nav' command
 function _nav_autocomplete {
-    local cur prev options
+    local cur prev options tag_options
 
     # Current word being completed
     cur="${COMP_WORDS[COMP_CWORD]}"
@@ -139,18 +182,20 @@ function _nav_autocomplete {
     prev="${COMP_WORDS[COMP_CWORD-1]}"
 
     # Define commands
-    cmd_options="show back add delete actions"
+    cmd_options="show back add delete actions search"
 
-    # Get tags
-    _register_client || return 1
-    tag_options=$($NAV_CLIENT $$ list 2> /dev/null)
+    # Get the tags starting with the current word, one per line
+    tag_options=()
+    if _nav_request complete "$cur" 2> /dev/null && [ -n "$_nav_reply" ]; then
+        mapfile -t tag_options <<< "$_nav_reply"
+    fi
 
     case "$prev" in
-        nav)           
-            COMPREPLY=( $(compgen -W "$cmd_options $tag_options" -- "$cur") )
+        nav)
+            COMPREPLY=( $(compgen -W "$cmd_options" -- "$cur") "${tag_options[@]}" )
             ;;
         delete)
-            COMPREPLY=( $(compgen -W "$tag_options" -- "$cur") )
+            COMPREPLY=( "${tag_options[@]}" )
             ;;
         *)
             COMPREPLY=()
@@ -160,3 +205,26 @@ function _nav_autocomplete {
 
 # Register the autocomplete function for 'nav'
 complete -F _nav_autocomplete nav
+
+# Report the working directory to the daemon whenever it changes, so that
+# 'nav [term]' can fall back to the most frecently visited matching directory.
+# The exit status is kept for the prompt commands and PS1 that run after.
+function _nav_visit {
+    local status=$?
+
+    if [ "$PWD" != "$_NAV_LAST_PWD" ]; then
+        _NAV_LAST_PWD="$PWD"
+        if [ -n "$_NAV_HAVE_BUILTIN" ] || [ -n "$_NAV_COPROC_PID" ]; then
+            _nav_request visit "$PWD" 2> /dev/null
+        else
+            # Don't hold up the prompt for a fork of the client
+            ("$NAV_CLIENT" $$ visit "$PWD" > /dev/null 2>&1 &)
+        fi
+    fi
+
+    return $status
+}
+
+if [[ ";$PROMPT_COMMAND;" != *";_nav_visit;"* ]]; then
+    PROMPT_COMMAND="_nav_visit${PROMPT_COMMAND:+;$PROMPT_COMMAND}"
+fi
@@ -21,12 +21,11 @@ function _nav_usage {
     return 1
 }
 
-function _register_client {
-    local connected
-    connected=$($NAV_CLIENT $$ register 2>/dev/null)
-
-    if [ -z "$connected" ]; then
-        _nav_error "Unable to reach daemon. Is it running?"
+# Send a request to the daemon. Shells are registered by the daemon on their
+# first request, so no explicit registration is needed.
+function _nav_request {
+    if ! $NAV_CLIENT $$ "$@" 2> /dev/null; then
+        _nav_error "Unable to reach daemon. Is it running?" >&2
         return 1
     fi
 }
@@ -41,9 +40,6 @@ if [[ ! "${zshexit_functions[(r)_unregister_client]}" ]]; then
 fi
 
 function nav {
-    # Attempt to register
-    _register_client || return 1
-
     case "$1" in
         add)
             # Command: nav add [tag] [path]
@@ -52,7 +48,7 @@ function nav {
             if [ -z "$tag" ] || [ -z "$path" ]; then
                 _nav_usage
             else
-                output=$($NAV_CLIENT $$ add "$tag" "$path" 2> /dev/null)
+                output=$(_nav_request add "$tag" "$path")
                 if [ "$output" = "OK" ]; then
                     echo "Added tag '$tag' with path '$path'"
                 else
@@ -66,7 +62,7 @@ function nav {
             if [ -z "$tag" ]; then
                 _nav_usage
             else
-                output=$($NAV_CLIENT $$ delete "$tag" 2> /dev/null)
+                output=$(_nav_request delete "$tag")
                 if [ "$output" = "OK" ]; then
                     echo "Deleted tag '$tag'"
                 else
@@ -76,14 +72,14 @@ function nav {
             ;;
         show|s)
             # Command: nav show
-            output=$($NAV_CLIENT $$ show 2> /dev/null)
+            output=$(_nav_request show)
             if [ "$output" != "BAD" ]; then
                 echo "$output"
             fi
             ;;
         actions|a)
             # Command: nav actions
-            output=$($NAV_CLIENT $$ actions 2> /dev/null)
+            output=$(_nav_request actions)
             if [ "$output" != "BAD" ] && [ -n "$output" ]; then
                 echo "$output"
             else
@@ -92,7 +88,7 @@ function nav {
             ;;
         back|b)
             # Command: nav back
-            dir=$($NAV_CLIENT $$ pop 2> /dev/null)
+            dir=$(_nav_request pop)
             if [ -n "$dir" ] && [ "$dir" != "BAD" ]; then
                 cd "$dir" || _nav_error "Failed to navigate to $dir"
             else
@@ -100,7 +96,7 @@ function nav {
             fi
             ;;
         reset|ar)
-            output=$($NAV_CLIENT $$ reset 2> /dev/null)
+            output=$(_nav_request reset)
             if [ "$output" = "OK" ]; then
                 echo "Action stack cleared"
             fi
@@ -113,19 +109,15 @@ function nav {
                 return 1;
             fi
 
-            dir=$($NAV_CLIENT $$ get "$tag" 2> /dev/null)
+            # Push the current directory to the action stack and retrieve
+            # the tag's path in a single request
+            dir=$(_nav_request jump "$tag" "$(pwd)")
 
             if [ "$dir" = "BAD" ] || [ -z "$dir" ]; then
                 echo "Tag '$tag' not found."
             else
-                # Push current directory to the action stack
-                output=$($NAV_CLIENT $$ push "$(pwd)" 2> /dev/null)
-                if [ "$output" = "OK" ]; then
-                    # Change directory to the retrieved path
-                    cd "$dir" || _nav_error "Failed to navigate to $dir"
-                else
-                    _nav_error "Failed to push current directory to action stack"
-                fi
+                # Change directory to the retrieved path
+                cd "$dir" || _nav_error "Failed to navigate to $dir"
             fi
             ;;
     esac
@@ -139,7 +131,7 @@ function _nav_completion {
     # Define commands
     cmd_options=(show back add delete actions reset)
 
-    # Get tags (without registering, just try to get the list)
+    # Get tags
     tag_options=(${(f)"$($NAV_CLIENT $$ list 2> /dev/null)"})
 
     case "$words[2]" in
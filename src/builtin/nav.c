@@ -0,0 +1,180 @@
+/**
+ * @file nav.c
+ * @brief Bash loadable builtin for talking to the nav daemon.
+ *
+ * This builtin does what the command line client does, without the cost of a
+ * fork and exec per request. The client socket is opened on first use and
+ * kept open for the life of the shell, so each request is a single send and
+ * receive. Load it with:
+ *
+ *   enable -f /path/to/nav.so nav
+ *
+ * The shell's PID is added to every request, so `nav get tag` is equivalent
+ * to `client $$ get tag`. With `-v var` the reply is stored in `var` rather
+ * than printed, which avoids a command substitution subshell.
+ */
+
+#include <config.h>
+
+#if defined(HAVE_UNISTD_H)
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "loadables.h"
+
+#include "client.h"
+#include "log.h"
+
+/* Declared by bash, the PID that `$$` expands to */
+extern pid_t dollar_dollar_pid;
+
+static struct client client = {.sfd = -1};
+
+static int open_client(void)
+{
+    char cache_dir[CACHE_DIR_MAX_LEN];
+    char name[16];
+
+    if (client_get_cache_dir(cache_dir, sizeof(cache_dir))) {
+        return 1;
+    }
+
+    snprintf(name, sizeof(name), "%d", (int)dollar_dollar_pid);
+    return client_open(&client, cache_dir, name);
+}
+
+/**
+ * @brief Sends a request, reconnecting once if it could not be sent.
+ *
+ * A request that timed out is not sent again, as the daemon may have run it,
+ * and running e.g. `pop` twice would drop an extra action.
+ */
+static int request(int argc, char **argv, char **reply)
+{
+    char pid[16];
+    int err;
+
+    snprintf(pid, sizeof(pid), "%d", (int)dollar_dollar_pid);
+
+    if (client.sfd == -1 && open_client()) {
+        return -1;
+    }
+
+    err = client_request(&client, pid, argc, argv, reply);
+    if (err == CLIENT_UNSENT) {
+        /* The daemon may have restarted since the socket was connected */
+        client_close(&client);
+        if (open_client()) {
+            return -1;
+        }
+        err = client_request(&client, pid, argc, argv, reply);
+    }
+
+    return err < 0 ? -1 : 0;
+}
+
+int nav_builtin(WORD_LIST *list)
+{
+    char *reply;
+    char *var = NULL;
+    char **argv;
+    size_t len;
+    int argc;
+    int opt;
+    int err;
+
+    reset_internal_getopt();
+    while ((opt = internal_getopt(list, "v:")) != -1) {
+        switch (opt) {
+        case 'v':
+            var = list_optarg;
+            break;
+        CASE_HELPOPT;
+        default:
+            builtin_usage();
+            return EX_USAGE;
+        }
+    }
+    list = loptend;
+
+    if (list == NULL) {
+        builtin_usage();
+        return EX_USAGE;
+    }
+
+    if (var != NULL && !legal_identifier(var)) {
+        sh_invalidid(var);
+        return EXECUTION_FAILURE;
+    }
+
+    argv = strvec_from_word_list(list, 0, 0, &argc);
+    err = request(argc, argv, &reply);
+    free(argv);
+
+    if (err) {
+        if (var != NULL) {
+            bind_variable(var, "", 0);
+        }
+        return EXECUTION_FAILURE;
+    }
+
+    if (var == NULL) {
+        printf("%s", reply);
+        fflush(stdout);
+        free(reply);
+        return EXECUTION_SUCCESS;
+    }
+
+    /* Strip trailing newlines, as a command substitution would */
+    len = strlen(reply);
+    while (len > 0 && reply[len - 1] == '\n') {
+        reply[--len] = '\0';
+    }
+
+    err = bind_variable(var, reply, 0) == NULL;
+    free(reply);
+
+    return err ? EXECUTION_FAILURE : EXECUTION_SUCCESS;
+}
+
+int nav_builtin_load(char *name)
+{
+    /* Keep the shell's terminal free of client log output */
+    set_log_level(LOG_LVL_NONE);
+
+    return 1;
+}
+
+void nav_builtin_unload(char *name)
+{
+    client_close(&client);
+}
+
+char *nav_doc[] = {
+    "Send a request to the nav daemon.",
+    "",
+    "Sends COMMAND and its ARGUMENTs to the nav daemon on behalf of this",
+    "shell and prints the reply. The connection to the daemon is kept open",
+    "between requests.",
+    "",
+    "Options:",
+    "  -v var\tassign the reply to shell variable VAR rather than",
+    "\t\tprinting it, with trailing newlines removed",
+    "",
+    "Exit Status:",
+    "Returns success unless an invalid option is given or the daemon",
+    "cannot be reached.",
+    (char *)NULL,
+};
+
+struct builtin nav_struct = {
+    "nav",
+    nav_builtin,
+    BUILTIN_ENABLED,
+    nav_doc,
+    "nav [-v var] command [argument ...]",
+    0,
+};
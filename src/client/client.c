@@ -0,0 +1,419 @@
+/**
+ * @file client.c
+ * @brief Implementation of the daemon client interface.
+ *
+ * This file implements the socket handling shared by the command line client
+ * and the bash loadable builtin.
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "client.h"
+#include "protocol.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "log.h"
+
+int client_get_cache_dir(char *dest, size_t dest_size)
+{
+    char *uname;
+    char *temp_env;
+    int err;
+
+    if (dest_size > CACHE_DIR_MAX_LEN) {
+        dest_size = CACHE_DIR_MAX_LEN;
+    }
+
+    temp_env = getenv(CACHE_DIR_ENV_VAR);
+    if (temp_env) {
+        /* Check for truncation */
+        if (strlen(temp_env) >= dest_size) {
+            LOG_ERR("Path too long for cache dir: '%s'", temp_env);
+            return 1;
+        }
+        strncpy(dest, temp_env, dest_size);
+        dest[dest_size - 1] = '\0';
+    } else {
+        uname = get_username();
+        if (uname == NULL) {
+            LOG_ERR("Invalid user.");
+            return 1;
+        }
+        err = snprintf(dest, dest_size, DEFAULT_CACHE_DIR, uname);
+        if (err >= (int)dest_size || err < 0) {
+            LOG_ERR("Failed to format default path for cache dir");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int set_timeout(int sfd, long usec)
+{
+    struct timeval timeval;
+    int err;
+
+    timeval.tv_sec = usec / 1000000;
+    timeval.tv_usec = usec % 1000000;
+    err = setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &timeval, sizeof(timeval));
+    if (err == -1) {
+        LOG_ERR("setsockopt: %s", strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Connects the client socket to the daemon socket `file`.
+ *
+ * With abstract sockets enabled, the daemon's abstract address is tried first,
+ * falling back to its pathname socket if that is not available.
+ *
+ * @return 0 on success, non-zero on failure.
+ */
+static int connect_daemon(struct client *c, const char *cache_dir,
+                          const char *file)
+{
+    char path[sizeof(c->nav_addr.sun_path)];
+    socklen_t len;
+    int err;
+
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, file);
+
+    if (use_abstract_sockets()) {
+        len = set_socket_address(&c->nav_addr, path, true);
+        if (len > 0 &&
+            connect(c->sfd, (struct sockaddr *)&c->nav_addr, len) == 0) {
+            return 0;
+        }
+    }
+
+    len = set_socket_address(&c->nav_addr, path, false);
+    if (len == 0) {
+        return 1;
+    }
+
+    err = connect(c->sfd, (struct sockaddr *)&c->nav_addr, len);
+    if (err == -1) {
+        LOG_ERR("connect: %s '%s'", strerror(errno), path);
+        return 1;
+    }
+
+    return 0;
+}
+
+int client_open(struct client *c, const char *cache_dir, const char *name)
+{
+    int err;
+
+    memset(c, 0, sizeof(*c));
+    strncpy(c->cache_dir, cache_dir, sizeof(c->cache_dir) - 1);
+
+    c->type = SOCK_DGRAM;
+    c->sfd = socket(AF_UNIX, c->type | SOCK_CLOEXEC, 0);
+    if (c->sfd == -1) {
+        LOG_ERR("socket: %s", strerror(errno));
+        return 1;
+    }
+
+    if (set_timeout(c->sfd, CLIENT_TIMEOUT_US)) {
+        goto close;
+    }
+
+    if (use_abstract_sockets()) {
+        /* Binding just the address family autobinds the socket to a unique
+         * abstract address, so there is no socket file to create or remove */
+        c->my_addr.sun_family = AF_UNIX;
+        err = bind(c->sfd, (struct sockaddr *)&c->my_addr,
+                   sizeof(sa_family_t));
+    } else {
+        c->my_addr.sun_family = AF_UNIX;
+        snprintf(c->my_addr.sun_path, sizeof(c->my_addr.sun_path),
+                 "%s/%s.sock", cache_dir, name);
+
+        /* Remove a socket file left behind by a client that was killed */
+        unlink(c->my_addr.sun_path);
+
+        err = bind(c->sfd, (struct sockaddr *)&c->my_addr,
+                   sizeof(c->my_addr));
+    }
+
+    if (err == -1) {
+        LOG_ERR("bind: %s", strerror(errno));
+        goto close;
+    }
+
+    if (connect_daemon(c, cache_dir, DEFAULT_SOCKET_FILE)) {
+        if (strlen(c->my_addr.sun_path) > 0) {
+            unlink(c->my_addr.sun_path);
+        }
+        goto close;
+    }
+
+    return 0;
+
+close:
+    close(c->sfd);
+    c->sfd = -1;
+    return 1;
+}
+
+int client_open_stream(struct client *c, const char *cache_dir)
+{
+    memset(c, 0, sizeof(*c));
+    strncpy(c->cache_dir, cache_dir, sizeof(c->cache_dir) - 1);
+
+    c->type = SOCK_SEQPACKET;
+    c->sfd = socket(AF_UNIX, c->type | SOCK_CLOEXEC, 0);
+    if (c->sfd == -1) {
+        LOG_ERR("socket: %s", strerror(errno));
+        return 1;
+    }
+
+    if (set_timeout(c->sfd, CLIENT_TIMEOUT_US) ||
+        connect_daemon(c, cache_dir, DEFAULT_STREAM_FILE)) {
+        close(c->sfd);
+        c->sfd = -1;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Sends a request frame and receives one page of the reply.
+ *
+ * The page's payload is stored at `reply`, which must have room for
+ * `CLIENT_PAGE_MAX` bytes, and its header in `header`.
+ *
+ * @return Length of the page, `CLIENT_UNSENT` if the frame could not be sent,
+ *         or -1 on failure or timeout.
+ */
+static int request_page(struct client *c, const char *frame, int frame_len,
+                        char *reply, struct proto_header *header)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    int n;
+
+    if (send(c->sfd, frame, frame_len, MSG_NOSIGNAL) == -1) {
+        LOG_ERR("send: %s", strerror(errno));
+        return CLIENT_UNSENT;
+    }
+
+    /* Receive the header and payload into place, without a copy */
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(*header);
+    iov[1].iov_base = reply;
+    iov[1].iov_len = CLIENT_PAGE_MAX;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    n = recvmsg(c->sfd, &msg, 0);
+    if (n == -1) {
+        LOG_ERR("recv: %s", strerror(errno));
+        return -1;
+    }
+
+    /* An empty read on a stream connection means the daemon hung up */
+    if (n == 0 && c->type == SOCK_SEQPACKET) {
+        LOG_ERR("Connection closed by daemon");
+        return -1;
+    }
+
+    if (n < (int)sizeof(*header) || header->magic != PROTO_MAGIC ||
+        header->version != PROTO_VERSION ||
+        header->length != n - sizeof(*header)) {
+        LOG_ERR("Malformed reply");
+        return -1;
+    }
+
+    return n - sizeof(*header);
+}
+
+/**
+ * @brief Answers a `get` or `list` request from the tag snapshot.
+ *
+ * The snapshot is mapped on first use. If it turns out to be unusable, e.g.
+ * because the daemon restarted and published a new one, it is unmapped so
+ * the next request maps the current file.
+ *
+ * @return Length of the reply, or -1 if the daemon must be asked instead.
+ */
+static int read_snapshot(struct client *c, int opcode, int argc, char **argv,
+                         char **reply)
+{
+    char path[PATH_MAX];
+    size_t len;
+    int err;
+
+    if (!((opcode == PROTO_OP_GET && argc == 2) ||
+          (opcode == PROTO_OP_LIST && argc == 1))) {
+        return -1;
+    }
+
+    if (c->snapshot.map == NULL) {
+        snprintf(path, sizeof(path), "%s/" SNAPSHOT_FILE, c->cache_dir);
+        if (snapshot_open(&c->snapshot, path)) {
+            return -1;
+        }
+    }
+
+    if (opcode == PROTO_OP_LIST) {
+        err = snapshot_list(&c->snapshot, reply);
+        if (err == -1) {
+            snapshot_close(&c->snapshot);
+        }
+        return err;
+    }
+
+    err = snapshot_get(&c->snapshot, argv[1], path, sizeof(path));
+    if (err == -1) {
+        snapshot_close(&c->snapshot);
+    }
+    if (err) {
+        return -1;
+    }
+
+    /* Same as the daemon's reply */
+    len = strlen(path);
+    *reply = malloc(len + 2);
+    if (*reply == NULL) {
+        return -1;
+    }
+    memcpy(*reply, path, len);
+    memcpy(*reply + len, "\n", 2);
+
+    return len + 1;
+}
+
+int client_request(struct client *c, const char *pid, int argc, char **argv,
+                   char **reply)
+{
+    char buf[CLIENT_REQUEST_MAX];
+    struct proto_header header;
+    char *end;
+    char *tmp;
+    size_t reply_len;
+    bool complete = false;
+    int err = -1;
+    long pid_num;
+    int opcode;
+    int pages;
+    int len;
+    int n;
+
+    *reply = NULL;
+
+    if (argc < 1) {
+        LOG_ERR("No command");
+        return -1;
+    }
+
+    opcode = proto_lookup_opcode(argv[0]);
+    if (opcode == -1) {
+        LOG_ERR("Unknown command '%s'", argv[0]);
+        return -1;
+    }
+
+    len = read_snapshot(c, opcode, argc, argv, reply);
+    if (len != -1) {
+        return len;
+    }
+
+    pid_num = strtol(pid, &end, 10);
+    if (end == pid || *end != '\0') {
+        LOG_ERR("Invalid pid '%s'", pid);
+        return -1;
+    }
+
+    /* Discard late replies to earlier requests that timed out */
+    while (recv(c->sfd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+
+    len = proto_encode_request(buf, sizeof(buf), opcode, pid_num, argc - 1,
+                               argv + 1);
+    if (len == -1) {
+        LOG_ERR("Request too long");
+        return -1;
+    }
+
+    if (opcode == PROTO_OP_FLUSH) {
+        set_timeout(c->sfd, CLIENT_FLUSH_TIMEOUT_US);
+    }
+
+    reply_len = 0;
+    for (pages = 0; pages < CLIENT_PAGES_MAX; pages++) {
+        tmp = realloc(*reply, reply_len + CLIENT_PAGE_MAX + 1);
+        if (tmp == NULL) {
+            LOG_ERR("realloc: %s", strerror(errno));
+            break;
+        }
+        *reply = tmp;
+
+        n = request_page(c, buf, len, *reply + reply_len, &header);
+        if (n < 0) {
+            /* Later pages only repeat a listing, which runs nothing */
+            if (n == CLIENT_UNSENT && pages == 0) {
+                err = CLIENT_UNSENT;
+            }
+            break;
+        }
+        reply_len += n;
+
+        if (!(header.flags & PROTO_FLAG_MORE)) {
+            (*reply)[reply_len] = '\0';
+            complete = true;
+            break;
+        }
+
+        /* Ask for the next page, the rest of the frame stays the same */
+        memcpy(buf + offsetof(struct proto_header, cursor), &header.cursor,
+               sizeof(header.cursor));
+    }
+
+    if (opcode == PROTO_OP_FLUSH) {
+        set_timeout(c->sfd, CLIENT_TIMEOUT_US);
+    }
+
+    if (complete) {
+        return reply_len;
+    }
+
+    if (pages == CLIENT_PAGES_MAX) {
+        LOG_ERR("Too many pages in reply");
+    }
+
+    free(*reply);
+    *reply = NULL;
+    return err;
+}
+
+void client_close(struct client *c)
+{
+    if (c->sfd != -1) {
+        close(c->sfd);
+        c->sfd = -1;
+    }
+
+    snapshot_close(&c->snapshot);
+
+    if (strlen(c->my_addr.sun_path) > 0) {
+        unlink(c->my_addr.sun_path);
+    }
+}
@@ -0,0 +1,136 @@
+/**
+ * @file client.h
+ * @brief Client interface for talking to the nav daemon.
+ *
+ * This header defines the interface shared by the command line client and
+ * the bash loadable builtin. A client either owns a datagram socket bound
+ * under the cache directory and connected to the daemon's socket, or a stream
+ * connection to the daemon which needs no socket file of its own. Either can
+ * be used for any number of requests before it is closed.
+ *
+ * `get` and `list` are answered from the daemon's tag snapshot when it is
+ * usable, see snapshot.h, and only sent to the daemon otherwise.
+ */
+
+#ifndef CLIENT_H_
+#define CLIENT_H_
+
+#include <stddef.h>
+#include <sys/un.h>
+
+#include "snapshot.h"
+
+#define CACHE_DIR_ENV_VAR   "NAV_CACHE_DIR"
+#define DEFAULT_CACHE_DIR   "/home/%s/.cache/nav"
+#define DEFAULT_SOCKET_FILE "nav.sock"
+#define DEFAULT_STREAM_FILE "stream.sock"
+
+/* Maximum length of the cache directory, see the daemon's state.h */
+#define CACHE_DIR_MAX_LEN 95
+
+/* Maximum size of a request sent to the daemon, see the daemon's server.h */
+#define CLIENT_REQUEST_MAX 8192
+
+/* Maximum size of one page of a reply, see the daemon's server.h */
+#define CLIENT_PAGE_MAX 8192
+
+/* Maximum number of pages fetched for one reply */
+#define CLIENT_PAGES_MAX 4096
+
+/* Time waited for a reply, in microseconds. A flush waits on the disk. */
+#define CLIENT_TIMEOUT_US       50000
+#define CLIENT_FLUSH_TIMEOUT_US 5000000
+
+/* Returned by `client_request()` when the request was not sent, so it can be
+ * sent again on a new connection without running twice */
+#define CLIENT_UNSENT -2
+
+/**
+ * @brief Structure representing a connection to the daemon.
+ */
+struct client {
+    int sfd;
+    int type;                    /**<< `SOCK_DGRAM` or `SOCK_SEQPACKET` */
+    struct sockaddr_un my_addr;  /**<< Address this client is bound to */
+    struct sockaddr_un nav_addr; /**<< Address of the daemon */
+    char cache_dir[CACHE_DIR_MAX_LEN];
+    struct snapshot snapshot; /**<< The daemon's tag snapshot, mapped lazily */
+};
+
+/**
+ * @brief Resolves the cache directory.
+ *
+ * The cache directory is taken from the `NAV_CACHE_DIR` environment variable
+ * if set, otherwise the default under the user's home directory is used.
+ *
+ * @param dest Buffer for the cache directory.
+ * @param dest_size Size of `dest`, at most `CACHE_DIR_MAX_LEN` is used.
+ * @return 0 on success, non-zero on failure.
+ */
+int client_get_cache_dir(char *dest, size_t dest_size);
+
+/**
+ * @brief Opens a connection to the daemon.
+ *
+ * The client socket is bound to `<cache_dir>/<name>.sock`, replacing any stale
+ * socket file left behind at that path, and connected to the daemon socket.
+ * With abstract sockets enabled, the client socket is instead autobound to a
+ * unique abstract address and the daemon's abstract address is tried before
+ * its socket file. Receives time out after 50ms.
+ *
+ * @param c Pointer to the client to initialise.
+ * @param cache_dir The cache directory holding the daemon socket.
+ * @param name The name of the client socket file, without extension.
+ * @return 0 on success, non-zero on failure.
+ */
+int client_open(struct client *c, const char *cache_dir, const char *name);
+
+/**
+ * @brief Opens a stream connection to the daemon.
+ *
+ * The client connects a `SOCK_SEQPACKET` socket to the daemon's stream socket,
+ * trying its abstract address first if abstract sockets are enabled. No socket
+ * file is created for the client. Receives time out after 50ms.
+ *
+ * @param c Pointer to the client to initialise.
+ * @param cache_dir The cache directory holding the daemon socket.
+ * @return 0 on success, non-zero on failure.
+ */
+int client_open_stream(struct client *c, const char *cache_dir);
+
+/**
+ * @brief Sends a request to the daemon and waits for the reply.
+ *
+ * The request is sent as a binary frame, see protocol.h. `argv[0]` names the
+ * command and the remaining arguments are sent as separate fields, so they
+ * may contain spaces. Any replies left over from earlier, timed out requests
+ * are discarded before the request is sent. `get` and `list` are answered
+ * from the tag snapshot instead when possible, and a `get` for a tag missing
+ * from it still goes to the daemon.
+ *
+ * Paginated replies are reassembled by repeating the request with the cursor
+ * of each page until the daemon sets no `PROTO_FLAG_MORE`. A listing changed
+ * between pages may miss or repeat entries.
+ *
+ * @param c Pointer to the client.
+ * @param pid The PID of the shell the request is made for.
+ * @param argc Number of request arguments.
+ * @param argv Request arguments, starting with the command.
+ * @param reply Set to the NUL-terminated reply, which the caller must free.
+ *              Set to NULL on failure.
+ * @return Length of the reply on success, `CLIENT_UNSENT` if the request
+ *         could not be sent, e.g. because the daemon restarted, and -1 on
+ *         any other failure. A request that timed out may still be run by
+ *         the daemon, so it must not be sent again.
+ */
+int client_request(struct client *c, const char *pid, int argc, char **argv,
+                   char **reply);
+
+/**
+ * @brief Closes the connection and removes the client socket file, if any.
+ *
+ * @param c Pointer to the client.
+ */
+void client_close(struct client *c);
+
+#endif /* CLIENT_H_ */
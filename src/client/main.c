@@ -1,32 +1,24 @@
-#include <asm-generic/socket.h>
-#include <bits/types/struct_timeval.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <sys/un.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <signal.h>
-#include <errno.h>
 
-#include "utils.h"
+#include "client.h"
 #include "log.h"
-
-#define CACHE_DIR_ENV_VAR   "NAV_CACHE_DIR"
-#define DEFAULT_CACHE_DIR   "/home/%s/.cache/nav"
-#define DEFAULT_SOCKET_FILE "nav.sock"
+#include "protocol.h"
 
 /* Global state variables */
-static int sfd;
-static struct sockaddr_un my_addr;
-static struct sockaddr_un nav_addr;
+static struct client client = {.sfd = -1};
 
-static char cache_dir[95] = {0};
+static char cache_dir[CACHE_DIR_MAX_LEN] = {0};
 
 static void sigint_handler(int signo, siginfo_t *info, void *context)
 {
-    if (strlen(my_addr.sun_path) > 0) {
-        unlink(my_addr.sun_path);
+    if (strlen(client.my_addr.sun_path) > 0) {
+        unlink(client.my_addr.sun_path);
     }
 
     _exit(EXIT_SUCCESS);
@@ -42,108 +34,152 @@ void register_handlers(void)
 
 static void process_command(int argc, char **argv)
 {
-    char buf[1024] = {0};
-    int offset = 0;
-    int err = 0;
-    char **ptr = argv;
-
-    while (*ptr != NULL) {
-        offset += sprintf(buf + offset, "%s ", *ptr);
-        ptr++;
-    }
+    char *reply;
+    int err;
 
-    send(sfd, buf, strlen(buf), 0);
+    err = client_request(&client, argv[0], argc - 1, argv + 1, &reply);
+    client_close(&client);
 
-    memset(buf, 0, sizeof(buf));
-    err = recv(sfd, buf, sizeof(buf), 0);
-    if (err == -1) {
-        LOG_ERR("recv: %s", strerror(errno));
-        close(sfd);
-        unlink(my_addr.sun_path);
+    if (err < 0) {
         exit(EXIT_FAILURE);
     }
 
-    printf("%s", buf);
+    printf("%s", reply);
+    free(reply);
+}
 
-    close(sfd);
-    unlink(my_addr.sun_path);
+/**
+ * @brief Splits a line into fields in place.
+ *
+ * Fields are separated by tabs, so that they may contain spaces. A line
+ * without tabs is split on spaces instead, for convenience when typing.
+ *
+ * @return The number of fields stored in `fields`.
+ */
+static int split_line(char *line, char **fields, int max_fields)
+{
+    const char *delim = strchr(line, '\t') ? "\t" : " ";
+    char *saveptr = NULL;
+    char *token;
+    int n = 0;
+
+    for (token = strtok_r(line, delim, &saveptr);
+         token != NULL && n < max_fields;
+         token = strtok_r(NULL, delim, &saveptr)) {
+        fields[n++] = token;
+    }
 
-    return;
+    return n;
 }
 
-void setup_socket(char *pid)
+/**
+ * @brief Serves requests read from stdin over a stream connection.
+ *
+ * Each line read from stdin is a command and its arguments, see
+ * `split_line()`, sent to the daemon on behalf of `pid`. Each reply is written
+ * to stdout followed by a NUL byte, so a shell can read it with `read -d ''`.
+ * Lines that are not a known command get an empty reply. The connection is
+ * reopened once if a request cannot be sent, e.g. because the daemon
+ * restarted; if that fails too, or a request gets no reply, the client exits
+ * so the shell can fall back to another transport. A request that got no
+ * reply may have run, so it is never sent again.
+ */
+static void serve(char *pid)
 {
+    char *reply;
+    char *fields[PROTO_MAX_FIELDS + 1];
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
     int err;
-    struct timeval timeval;
+    int n;
 
-    sfd = socket(AF_UNIX, SOCK_DGRAM, 0);
-    if (sfd == -1) {
-        LOG_ERR("socket: %s", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+    while ((len = getline(&line, &line_size, stdin)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
 
-    /* Set 0.05 second timeout on receive */
-    timeval.tv_sec = 0;
-    timeval.tv_usec = 50000;
-    err = setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &timeval, sizeof(timeval));
-    if (err == -1) {
-        LOG_ERR("setsockopt: %s", strerror(errno));
-        close(sfd);
-        exit(EXIT_FAILURE);
-    }
+        n = split_line(line, fields, PROTO_MAX_FIELDS + 1);
+        if (n == 0 || proto_lookup_opcode(fields[0]) == -1) {
+            fwrite("", 1, 1, stdout);
+            fflush(stdout);
+            continue;
+        }
 
-    my_addr.sun_family = AF_UNIX;
-    snprintf(my_addr.sun_path, 108, "%s/%s.sock", cache_dir, pid);
+        err = client_request(&client, pid, n, fields, &reply);
+        if (err == CLIENT_UNSENT) {
+            client_close(&client);
+            if (client_open_stream(&client, cache_dir)) {
+                break;
+            }
+            err = client_request(&client, pid, n, fields, &reply);
+        }
+        if (err < 0) {
+            break;
+        }
 
-    err = bind(sfd, (struct sockaddr *)&my_addr, sizeof(my_addr));
-    if (err == -1) {
-        LOG_ERR("bind: %s", strerror(errno));
-        close(sfd);
-        exit(EXIT_FAILURE);
+        fwrite(reply, 1, strlen(reply) + 1, stdout);
+        fflush(stdout);
+        free(reply);
     }
 
-    nav_addr.sun_family = AF_UNIX;
-    snprintf(nav_addr.sun_path, 108, "%s/nav.sock", cache_dir);
-
-    err = connect(sfd, (struct sockaddr *)&nav_addr, sizeof(nav_addr));
-    if (err == -1) {
-        LOG_ERR("connect: %s '%s'", strerror(errno), nav_addr.sun_path);
-        close(sfd);
-        unlink(my_addr.sun_path);
-        exit(EXIT_FAILURE);
-    }
+    free(line);
+    client_close(&client);
+    exit(len == -1 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 void print_usage(const char *program_name)
 {
-    printf("Usage: %s [options] <command> [arguments]\n", program_name);
+    printf("Usage: %s [options] <pid> <command> [arguments]\n", program_name);
+    printf("       %s --serve <pid>\n", program_name);
     printf("Options:\n"
            "  -v                Print version.\n"
+           "  -s, --serve       Read commands from stdin, one per line with\n"
+           "                    tab separated arguments, and write each reply\n"
+           "                    followed by a NUL byte. Requests share a\n"
+           "                    single connection.\n"
            "\n"
            "Note: A PID must prefix all commands shown below. Use $$ in bash.\n"
            "\n"
            "Commands:\n"
            "  get [tag]         Retrieve the path for the the specified tag.\n"
+           "  jump [tag] [cwd]  Push cwd to the action stack and retrieve the\n"
+           "                    path for the specified tag.\n"
            "  add [tag] [path]  Add a new tag-path association.\n"
            "  delete [tag]      Remove the specified tag.\n"
            "  show              Show all tag-path associations.\n"
            "  push              Save an action to the the action stack.\n"
            "  pop               Get the last action from the action stack.\n"
-           "  actions           List all recorded actions.\n");
+           "  actions           List all recorded actions.\n"
+           "  complete [prefix] [n]\n"
+           "                    List up to n tags starting with prefix.\n"
+           "  visit [path]      Record a visit to a directory.\n"
+           "  search [pattern] [n]\n"
+           "                    List up to n tagged or visited directories\n"
+           "                    fuzzy matching pattern, best first.\n"
+           "  flush             Wait until every change is saved to disk.\n"
+           "  stats [json]      Show the daemon's request counters and\n"
+           "                    latencies, as JSON if asked.\n");
 }
 
 int main(int argc, char **argv)
 {
+    static const struct option long_options[] = {
+        {"serve", no_argument, NULL, 's'},
+        {"version", no_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0},
+    };
+    bool serve_mode = false;
     int opt;
-    int err;
-    char *uname;
-    char *temp_env;
 
-    while ((opt = getopt(argc, argv, "vd:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "vs", long_options, NULL)) != -1) {
         switch (opt) {
         case 'v':
             printf("nav client version 0\n");
             exit(EXIT_SUCCESS);
+        case 's':
+            serve_mode = true;
+            break;
         default:
             print_usage(argv[0]);
             exit(EXIT_FAILURE);
@@ -155,31 +191,23 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    temp_env = getenv(CACHE_DIR_ENV_VAR);
-    if (temp_env) {
-        /* Check for truncation */
-        if (strlen(temp_env) >= sizeof(cache_dir)) {
-            LOG_ERR("Path too long for cache dir: '%s'", temp_env);
-            return -1;
-        }
-        strncpy(cache_dir, temp_env, sizeof(cache_dir));
-        cache_dir[sizeof(cache_dir) - 1] = '\0';
-    } else {
-        uname = get_username();
-        if (uname == NULL) {
-            LOG_ERR("Invalid user.");
-            exit(EXIT_FAILURE);
-        }
-        err = snprintf(cache_dir, sizeof(cache_dir), DEFAULT_CACHE_DIR, uname);
-        if (err >= sizeof(cache_dir) || err < 0) {
-            LOG_ERR("Failed to format default path for cache dir");
-            return -1;
-        }
+    if (client_get_cache_dir(cache_dir, sizeof(cache_dir))) {
+        exit(EXIT_FAILURE);
     }
     LOG_INF("Using cache directory '%s'", cache_dir);
 
     register_handlers();
-    setup_socket(argv[optind]);
+
+    if (serve_mode) {
+        if (client_open_stream(&client, cache_dir)) {
+            exit(EXIT_FAILURE);
+        }
+        serve(argv[optind]);
+    }
+
+    if (client_open(&client, cache_dir, argv[optind])) {
+        exit(EXIT_FAILURE);
+    }
 
     argc -= optind;
     argv += optind;
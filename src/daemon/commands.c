@@ -4,607 +4,1666 @@
  *
  * This file contains the implementation of the command dispatching mechanism.
  * It provides functions to register and unregister shells, as well as a
- * dispatch function that matches command strings to the appropriate handlers.
+ * dispatch function that looks up the handler for a request by its opcode.
+ * Handlers receive the request fields as string views into the receive
+ * buffer, and only copy them when they are stored.
  *
  */
 
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
-#include <sys/un.h>
-
-#include "list.h"
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/sock_diag.h>
+
+#include "frecency.h"
+#include "fuzzy.h"
+#include "event.h"
+#include "hashmap.h"
+#include "intern.h"
 #include "log.h"
+#include "metrics.h"
+#include "pathstat.h"
+#include "pool.h"
+#include "protocol.h"
+#include "server.h"
 #include "state.h"
 #include "shell.h"
 #include "tag.h"
 #include "utils.h"
+#include "writer.h"
+
+/* Maximum number of items in one page of a listing */
+#define PAGE_ITEMS_MAX 64
+
+/* Maximum number of buffers making up one item of a listing */
+#define PAGE_ITEM_PARTS 4
+
+/* Number of results of a search when no limit is given */
+#define SEARCH_LIMIT_DEFAULT 10
+
+/* Maximum number of results of a search */
+#define SEARCH_LIMIT_MAX PAGE_ITEMS_MAX
 
 /**
- * @brief Enum representing the available commands.
- *
- * This enum is used to index the command table and map command strings
- * to their corresponding functions.
- */
-enum commands {
-    CMD_REGISTER = 0,
-    CMD_UNREGISTER,
-    CMD_ADD,
-    CMD_DELETE,
-    CMD_SHOW,
-    CMD_GET,
-    CMD_PUSH,
-    CMD_POP,
-    CMD_ACTIONS,
-    CMD_LIST,
-    CMD_RESET,
-    CMD_NUM
+ * @brief Structure holding one page of a listing.
+ *
+ * The page is a list of buffers referencing the stored strings, which are
+ * gathered straight into the reply.
+ */
+struct page {
+    struct iovec iov[PAGE_ITEMS_MAX * PAGE_ITEM_PARTS];
+    int n_iov;
+    int n_items;
+    size_t len; /**<< Total length of the buffers in bytes */
 };
 
 /* Prototypes */
-static void cmd_register(int pid, char *args);
-static void cmd_unregister(int pid, char *args);
-static void cmd_add(int pid, char *args);
-static void cmd_delete(int pid, char *args);
-static void cmd_show(int pid, char *args);
-static void cmd_get(int pid, char *args);
-static void cmd_push(int pid, char *args);
-static void cmd_pop(int pid, char *args);
-static void cmd_actions(int pid, char *args);
-static void cmd_list(int pid, char *args);
-static void cmd_reset(int pid, char *args);
+static void cmd_register(int pid, const struct proto_request *req);
+static void cmd_unregister(int pid, const struct proto_request *req);
+static void cmd_add(int pid, const struct proto_request *req);
+static void cmd_delete(int pid, const struct proto_request *req);
+static void cmd_show(int pid, const struct proto_request *req);
+static void cmd_get(int pid, const struct proto_request *req);
+static void cmd_push(int pid, const struct proto_request *req);
+static void cmd_pop(int pid, const struct proto_request *req);
+static void cmd_actions(int pid, const struct proto_request *req);
+static void cmd_list(int pid, const struct proto_request *req);
+static void cmd_reset(int pid, const struct proto_request *req);
+static void cmd_jump(int pid, const struct proto_request *req);
+static void cmd_complete(int pid, const struct proto_request *req);
+static void cmd_visit(int pid, const struct proto_request *req);
+static void cmd_search(int pid, const struct proto_request *req);
+static void cmd_flush(int pid, const struct proto_request *req);
+static void cmd_stats(int pid, const struct proto_request *req);
 
 /**
  * @brief Structure representing a command entry.
  *
- * This structure holds the mapping between a command string and its
- * corresponding function. It is used in the dispatch table to determine which
- * function to call based on the command string.
+ * This structure holds the function handling an opcode, and the number of
+ * fields the function expects. It is used in the dispatch table, which is
+ * indexed by opcode.
  */
 struct command {
-    const char *cmd_name;
-    void (*cmd_func)(int pid, char *args);
+    void (*cmd_func)(int pid, const struct proto_request *req);
+    int min_fields; /**<< Number of fields the command requires */
 };
 
-const struct command cmd_table[] = {
-    {"register", cmd_register}, {"unregister", cmd_unregister},
-    {"add", cmd_add},           {"delete", cmd_delete},
-    {"show", cmd_show},         {"get", cmd_get},
-    {"push", cmd_push},         {"pop", cmd_pop},
-    {"actions", cmd_actions},   {"list", cmd_list},
-    {"reset", cmd_reset},
+static const struct command cmd_table[PROTO_OP_NUM] = {
+    [PROTO_OP_REGISTER] = {cmd_register, 0},
+    [PROTO_OP_UNREGISTER] = {cmd_unregister, 0},
+    [PROTO_OP_ADD] = {cmd_add, 2},
+    [PROTO_OP_DELETE] = {cmd_delete, 1},
+    [PROTO_OP_SHOW] = {cmd_show, 0},
+    [PROTO_OP_GET] = {cmd_get, 1},
+    [PROTO_OP_PUSH] = {cmd_push, 1},
+    [PROTO_OP_POP] = {cmd_pop, 0},
+    [PROTO_OP_ACTIONS] = {cmd_actions, 0},
+    [PROTO_OP_LIST] = {cmd_list, 0},
+    [PROTO_OP_RESET] = {cmd_reset, 0},
+    [PROTO_OP_JUMP] = {cmd_jump, 2},
+    [PROTO_OP_COMPLETE] = {cmd_complete, 0},
+    [PROTO_OP_VISIT] = {cmd_visit, 1},
+    [PROTO_OP_SEARCH] = {cmd_search, 1},
+    [PROTO_OP_FLUSH] = {cmd_flush, 0},
+    [PROTO_OP_STATS] = {cmd_stats, 0},
 };
 
-void dispatch_command(char *cmd_str, int pid, char *args)
+void dispatch_command(const struct proto_request *req)
 {
-    int cmd_len;
-    int i;
+    const struct command *cmd;
 
-    for (i = 0; i < CMD_NUM; i++) {
-        cmd_len = strlen(cmd_table[i].cmd_name);
+    if (req->header.opcode >= PROTO_OP_NUM) {
+        LOG_INF("Unknown opcode: %u", req->header.opcode);
+        return;
+    }
+    cmd = &cmd_table[req->header.opcode];
 
-        if (strncmp(cmd_str, cmd_table[i].cmd_name, cmd_len) == 0) {
-            cmd_table[i].cmd_func(pid, args);
-            return;
-        }
+    if (req->n_fields < cmd->min_fields) {
+        LOG_ERR("Too few fields for opcode %u", req->header.opcode);
+        server_reply("BAD\n", 4);
+        return;
     }
-    LOG_INF("Unknown command: %s", cmd_str);
+
+    cmd->cmd_func(req->header.pid, req);
 }
 
 /**
- * @brief Registers a shell with the provided PID.
+ * @brief Adds an item to a page of a listing if it fits.
  *
- * This function handles the registration of a shell with the given PID.
- * It checks if the shell is already registered, allocates necessary
- * resources, and stores the shell data in the global state.
+ * An item fits if the page has room for another item and the page's payload
+ * stays within `SERVER_REPLY_MAX`. The first item is always added, so every
+ * page makes progress. Only the buffer descriptions are copied, the buffers
+ * themselves must outlive the page.
  *
- * @param pid The PID of the shell to register.
- * @param args Additional arguments (currently unused).
+ * @param page Pointer to the page.
+ * @param parts Array of buffers making up the item.
+ * @param n_parts Number of buffers in `parts`, at most `PAGE_ITEM_PARTS`.
+ * @return `true` if the item was added.
  */
-static void cmd_register(int pid, char *args)
+static bool page_add(struct page *page, const struct iovec *parts,
+                     int n_parts)
 {
-    struct state *state;
-    struct shell *shell_data;
-    struct node *shell_node;
-
-    state = get_state();
-
-    LOG_INF("shell at PID=%d wants to register", pid);
-
-    shell_node = list_get_node(&state->shells, &pid);
-    if (shell_node) {
-        LOG_INF("shell %d already registered", pid);
-
-        shell_data = (struct shell *)shell_node->data;
-        sendto(state->sfd, "OK\n", 4, 0,
-               (struct sockaddr *)&shell_data->sock_addr,
-               sizeof(shell_data->sock_addr));
+    size_t len = 0;
+    int i;
 
-        return;
+    for (i = 0; i < n_parts; i++) {
+        len += parts[i].iov_len;
     }
 
-    if (list_node_create(&shell_node)) {
-        LOG_ERR("shell node create failed");
-        return;
+    if (page->n_items > 0 && (page->n_items == PAGE_ITEMS_MAX ||
+                              page->len + len > SERVER_REPLY_MAX)) {
+        return false;
     }
 
-    shell_data = (struct shell *)malloc(sizeof(struct shell));
-    if (shell_data == NULL) {
-        LOG_ERR("shell data malloc create failed");
-        return;
-    }
+    memcpy(&page->iov[page->n_iov], parts, n_parts * sizeof(*parts));
+    page->n_iov += n_parts;
+    page->len += len;
+    page->n_items++;
 
-    shell_data->pid = pid;
-    shell_data->sock_addr.sun_family = AF_UNIX;
-    snprintf(shell_data->sock_addr.sun_path,
-             sizeof(shell_data->sock_addr.sun_path), "%s/%d.sock",
-             state->cache_dir, pid);
+    return true;
+}
 
-    /* Initialise the action stack */
-    shell_data->actions.head = NULL;
-    shell_data->actions.n_items = 0;
-    shell_data->actions.compare_func = compare_action_path;
-    shell_data->actions.cleanup_func = cleanup_action;
+/**
+ * @brief Replies with a stored string followed by a newline.
+ *
+ * The reply is gathered straight from `str`, so no intermediate buffer is
+ * formatted.
+ *
+ * @param str The string to reply with.
+ */
+static void reply_line(const char *str)
+{
+    struct iovec iov[2] = {
+        {.iov_base = (void *)str, .iov_len = strlen(str)},
+        {.iov_base = "\n", .iov_len = 1},
+    };
 
-    shell_node->data = shell_data;
-    list_append_node(&state->shells, shell_node);
+    server_replyv(iov, 2);
+}
 
-    /* Send registration message */
-    sendto(state->sfd, "OK\n", 4, 0, (struct sockaddr *)&shell_data->sock_addr,
-           sizeof(shell_data->sock_addr));
+static void reply_ok(void *ctx)
+{
+    server_reply("OK\n", 3);
+}
 
-    LOG_INF("shell %d registered", pid);
+static void reply_bad(void *ctx)
+{
+    server_reply("BAD\n", 4);
 }
 
 /**
- * @brief Unregisters a shell with the provided PID.
- *
- * This function handles the unregistration of a shell with the given PID.
- * It checks if the shell exists in the global state, removes it from the
- * shell list, and deallocates associated resources.
+ * @brief Function finishing a request once its path has been checked.
  *
- * @param pid The PID of the shell to unregister.
- * @param args Additional arguments (currently unused).
+ * @param pid The PID of the shell.
+ * @param fields The fields the request was checked with.
+ * @param status The result of the check.
  */
-static void cmd_unregister(int pid, char *args)
-{
-    struct state *state;
-    struct node *shell_node;
-    struct shell *shell_data;
-    struct sockaddr_un shell_addr;
+typedef void (*checked_func)(int pid, const char *const *fields,
+                             enum path_status status);
 
-    LOG_INF("shell at PID=%d wants to unregister", pid);
+/**
+ * @brief Structure holding a request whose reply waits for a path check.
+ */
+struct path_check {
+    int pid;
+    checked_func finish;
+    enum path_status status;
+    int n_fields;
+    char *fields[3]; /**<< Copies of the fields, from the string arena */
+    struct server_deferred *reply;
+};
 
-    state = get_state();
+static void free_check(struct path_check *check)
+{
+    int i;
 
-    shell_node = list_get_node(&state->shells, &pid);
-    if (shell_node == NULL) {
-        LOG_ERR("shell %d does not exist", pid);
-        return;
+    for (i = 0; i < check->n_fields; i++) {
+        arena_strfree(check->fields[i]);
     }
-    shell_data = (struct shell *)shell_node->data;
-
-    memcpy(&shell_addr, &shell_data->sock_addr, sizeof(shell_addr));
+    arena_free(check, sizeof(*check));
+}
 
-    if (list_delete_node(&state->shells, &pid)) {
-        LOG_ERR("shell node delete failed");
-        return;
-    }
+static void finish_check(void *ctx)
+{
+    struct path_check *check = ctx;
 
-    LOG_INF("shell %d unregistered", pid);
-    sendto(state->sfd, "OK\n", 3, 0, (struct sockaddr *)&shell_addr,
-           sizeof(shell_addr));
+    check->finish(check->pid, (const char *const *)check->fields,
+                  check->status);
 }
 
-static void cmd_add(int pid, char *args)
+static void path_checked(enum path_status status, void *ctx)
 {
-    char *line = NULL, *token = NULL, *tag = NULL, *path = NULL;
-    char *saveptr = NULL;
-    int j;
-    struct state *state;
-    struct node *tag_node;
-    struct tag *tag_data;
-    struct node *shell_node;
-    struct shell *shell_data;
-
-    state = get_state();
+    struct path_check *check = ctx;
 
-    shell_node = list_get_node(&state->shells, &pid);
-    if (shell_node == NULL) {
-        LOG_ERR("shell %d does not exist", pid);
-        return;
-    }
-    shell_data = (struct shell *)shell_node->data;
+    check->status = status;
+    server_resume(check->reply, finish_check, check);
+    free_check(check);
+}
 
-    /* Extract args */
-    for (j = 1, line = args;; j++, line = NULL) {
-        token = strtok_r(line, " ", &saveptr);
-        if (token == NULL) {
-            break;
-        }
+/**
+ * @brief Checks that a path exists, then finishes the request.
+ *
+ * Paths are checked by the stat workers, see pathstat.h, so a hung mount
+ * never stalls the daemon. A path with a cached result is finished straight
+ * away. Otherwise the reply is deferred until the check completes, and the
+ * fields are copied out of the request buffer meanwhile.
+ *
+ * @param pid The PID of the shell.
+ * @param path The path to check.
+ * @param finish Function finishing the request.
+ * @param fields The fields `finish` needs, at most 3.
+ * @param n_fields Number of fields.
+ */
+static void check_path(int pid, const char *path, checked_func finish,
+                       const char *const *fields, int n_fields)
+{
+    struct path_check *check;
+    enum path_status status;
+    int i;
 
-        if (j == 1) {
-            tag = strndup(token, get_trailing_whitespace(token));
-        } else if (j == 2) {
-            path = strndup(token, get_trailing_whitespace(token));
-        } else {
-            LOG_ERR("Too many tokens");
-            goto freeargs;
-        }
+    if (pathstat_lookup(path, &status)) {
+        finish(pid, fields, status);
+        return;
     }
 
-    if (path == NULL) {
-        LOG_ERR("Too few tokens");
-        goto freeargs;
+    check = (struct path_check *)arena_alloc(sizeof(*check));
+    if (check == NULL) {
+        server_reply("BAD\n", 4);
+        return;
     }
+    memset(check, 0, sizeof(*check));
 
-    if (!valid_path(path)) {
-        goto freeargs;
+    check->reply = server_defer_reply();
+    if (check->reply == NULL) {
+        free_check(check);
+        server_reply("BAD\n", 4);
+        return;
     }
 
-    /* Check if it already exists */
-    tag_node = list_get_node(&state->tags, tag);
-    if (tag_node != NULL) {
-        LOG_INF("Tag '%s' already exists. Updating.", tag);
-        free(((struct tag *)tag_node->data)->path);
-        ((struct tag *)tag_node->data)->path = path;
-        goto end;
+    check->pid = pid;
+    check->finish = finish;
+    for (i = 0; i < n_fields; i++) {
+        check->fields[i] = arena_strndup(fields[i], strlen(fields[i]));
+        if (check->fields[i] == NULL) {
+            break;
+        }
+        check->n_fields++;
     }
 
-    /* Create the tag and add it to the list*/
-    if (list_node_create(&tag_node)) {
-        LOG_ERR("tag node create failed");
-        goto freeargs;
+    if (check->n_fields < n_fields ||
+        pathstat_submit(path, true, path_checked, check)) {
+        server_resume(check->reply, reply_bad, NULL);
+        free_check(check);
     }
+}
 
-    tag_data = (struct tag *)malloc(sizeof(struct tag));
-    if (tag_data == NULL) {
-        LOG_ERR("tag data malloc create failed");
-        goto freeargs;
-    }
+/**
+ * @brief Frees the state of a shell whose process exited.
+ *
+ * This function is an `event_func` callback for the shell's pidfd. Shells
+ * killed without unregistering, e.g. when their terminal crashed, would
+ * otherwise keep their state until the daemon exits.
+ *
+ * @param fd The shell's pidfd.
+ * @param events The epoll events reported for `fd`.
+ * @param ctx The PID of the shell.
+ */
+static void shell_exited(int fd, uint32_t events, void *ctx)
+{
+    struct state *state = get_state();
+    int pid = (int)(intptr_t)ctx;
 
-    tag_data->tag = tag;
-    tag_data->path = path;
-    tag_node->data = tag_data;
-    list_append_node(&state->tags, tag_node);
+    (void)fd;
+    (void)events;
 
-end:
-    LOG_INF("Tag %s --> %s added.", tag, path);
+    if (hashmap_delete(&state->shells, &pid) == 0) {
+        state->shells_reaped++;
+        LOG_INF("shell %d exited", pid);
+    }
+}
 
-    write_tag_file(&state->tags, state->tagfile_path);
+/**
+ * @brief Watches for the exit of a shell, so that its state is freed.
+ *
+ * A shell that cannot be watched, e.g. because it already exited or the
+ * kernel lacks `pidfd_open()`, is kept until it unregisters.
+ */
+static void watch_shell(struct shell *shell_data)
+{
+    int pidfd;
 
-    sendto(state->sfd, "OK\n", 3, 0, (struct sockaddr *)&shell_data->sock_addr,
-           sizeof(shell_data->sock_addr));
-    return;
+    pidfd = (int)syscall(SYS_pidfd_open, shell_data->pid, 0);
+    if (pidfd == -1) {
+        LOG_ERR("pidfd_open %d: %s", shell_data->pid, strerror(errno));
+        return;
+    }
 
-freeargs:
-    free(tag);
-    free(path);
+    if (event_add_fd(pidfd, EPOLLIN, shell_exited,
+                     (void *)(intptr_t)shell_data->pid)) {
+        close(pidfd);
+        return;
+    }
 
-    sendto(state->sfd, "BAD\n", 4, 0, (struct sockaddr *)&shell_data->sock_addr,
-           sizeof(shell_data->sock_addr));
-    return;
+    shell_data->pidfd = pidfd;
 }
 
-static void cmd_delete(int pid, char *args)
+/**
+ * @brief Creates and stores the state for a new shell.
+ *
+ * @param pid The PID of the shell.
+ * @return Pointer to the new shell, or `NULL` on failure.
+ */
+static struct shell *create_shell(int pid)
 {
-    char *line = NULL, *token = NULL, *tag = NULL;
-    char *saveptr = NULL;
     struct state *state;
-    struct node *tag_node;
-    struct node *shell_node;
     struct shell *shell_data;
 
     state = get_state();
 
-    shell_node = list_get_node(&state->shells, &pid);
-    if (shell_node == NULL) {
-        LOG_ERR("shell %d does not exist", pid);
-        return;
-    }
-    shell_data = (struct shell *)shell_node->data;
-
-    line = args;
-    token = strtok_r(line, " ", &saveptr);
-    if (token == NULL) {
-        LOG_ERR("Too few tokens");
-        return;
+    shell_data = shell_create(pid, state->action_depth);
+    if (shell_data == NULL) {
+        LOG_ERR("shell create failed");
+        return NULL;
     }
 
-    tag = strndup(token, get_trailing_whitespace(token));
-
-    /* Check if tag exists */
-    tag_node = list_get_node(&state->tags, tag);
-    if (tag_node == NULL) {
-        LOG_INF("Tag '%s' does not exist.", tag);
-        sendto(state->sfd, "BAD\n", 4, 0,
-               (struct sockaddr *)&shell_data->sock_addr,
-               sizeof(shell_data->sock_addr));
-    } else {
-        list_delete_node(&state->tags, tag);
-        LOG_INF("Tag '%s' deleted.", tag);
-        write_tag_file(&state->tags, state->tagfile_path);
-        sendto(state->sfd, "OK\n", 3, 0,
-               (struct sockaddr *)&shell_data->sock_addr,
-               sizeof(shell_data->sock_addr));
+    if (hashmap_insert(&state->shells, &pid, shell_data)) {
+        LOG_ERR("shell insert failed");
+        cleanup_shell(shell_data);
+        return NULL;
     }
+    watch_shell(shell_data);
 
-    free(tag);
-    return;
+    LOG_INF("shell %d registered", pid);
+    return shell_data;
 }
 
-static void cmd_show(int pid, char *args)
+/**
+ * @brief Looks up the shell with the provided PID, registering it if needed.
+ *
+ * Shells are registered implicitly on their first request. The kernel
+ * verified credentials of the request must show that it was sent by the shell
+ * itself or one of its descendants, e.g. a client run from the shell. This
+ * prevents a request from creating state on behalf of an arbitrary PID.
+ *
+ * @param pid The PID of the shell.
+ * @return Pointer to the shell, or `NULL` if it does not exist and could not
+ *         be registered.
+ */
+static struct shell *get_shell(int pid)
 {
     struct state *state;
-    struct node *tag_node;
-    struct node *shell_node;
     struct shell *shell_data;
-    struct tag *tag_data;
-    char buf[2048] = {0};
-    int offset = 0;
 
     state = get_state();
 
-    shell_node = list_get_node(&state->shells, &pid);
-    if (shell_node == NULL) {
-        LOG_ERR("shell %d does not exist", pid);
-        return;
+    shell_data = (struct shell *)hashmap_get(&state->shells, &pid);
+    if (shell_data != NULL) {
+        return shell_data;
     }
 
-    shell_data = (struct shell *)shell_node->data;
-
-    tag_node = state->tags.head;
-    while (tag_node != NULL) {
-        tag_data = (struct tag *)tag_node->data;
-
-        offset += snprintf(buf + offset, sizeof(buf) - offset, "%s --> %s\n",
-                           tag_data->tag, tag_data->path);
-        tag_node = tag_node->next;
+    if (!server_sender_owns_pid(pid)) {
+        LOG_ERR("shell %d does not exist", pid);
+        return NULL;
     }
 
-    sendto(state->sfd, buf, strlen(buf), 0,
-           (struct sockaddr *)&shell_data->sock_addr,
-           sizeof(shell_data->sock_addr));
+    return create_shell(pid);
 }
 
-static void cmd_list(int pid, char *args)
+/**
+ * @brief Registers a shell with the provided PID.
+ *
+ * This function handles the explicit registration of a shell with the given
+ * PID. It checks if the shell is already registered, allocates necessary
+ * resources, and stores the shell data in the global state.
+ *
+ * Shells are also registered implicitly on their first request, see
+ * `get_shell()`, so this command is only kept for compatibility.
+ *
+ * @param pid The PID of the shell to register.
+ * @param req The request (no fields are used).
+ */
+static void cmd_register(int pid, const struct proto_request *req)
 {
     struct state *state;
-    struct node *tag_node;
-    struct node *shell_node;
-    struct shell *shell_data;
-    struct tag *tag_data;
-    char buf[256] = {0};
-    int offset = 0;
 
     state = get_state();
 
-    shell_node = list_get_node(&state->shells, &pid);
-    if (shell_node == NULL) {
-        LOG_ERR("shell %d does not exist", pid);
-        return;
-    }
+    LOG_INF("shell at PID=%d wants to register", pid);
 
-    shell_data = (struct shell *)shell_node->data;
+    if (hashmap_get(&state->shells, &pid) != NULL) {
+        LOG_INF("shell %d already registered", pid);
+        server_reply("OK\n", 4);
 
-    tag_node = state->tags.head;
-    while (tag_node != NULL) {
-        tag_data = (struct tag *)tag_node->data;
-        offset += sprintf(buf + offset, "%s ", tag_data->tag);
-        tag_node = tag_node->next;
+        return;
     }
 
-    if (offset > 0) {
-        buf[offset - 1] = 0;
+    if (create_shell(pid) == NULL) {
+        return;
     }
 
-    sendto(state->sfd, buf, 256, 0, (struct sockaddr *)&shell_data->sock_addr,
-           sizeof(shell_data->sock_addr));
+    /* Send registration message */
+    server_reply("OK\n", 4);
 }
 
-static void cmd_get(int pid, char *args)
+/**
+ * @brief Unregisters a shell with the provided PID.
+ *
+ * This function handles the unregistration of a shell with the given PID.
+ * It checks if the shell exists in the global state, removes it from the
+ * shell map, and deallocates associated resources.
+ *
+ * @param pid The PID of the shell to unregister.
+ * @param req The request (no fields are used).
+ */
+static void cmd_unregister(int pid, const struct proto_request *req)
 {
-    char *line = NULL, *token = NULL, *tag = NULL;
-    char *saveptr = NULL;
     struct state *state;
-    struct node *tag_node;
-    struct node *shell_node;
-    struct shell *shell_data;
-    struct tag *tag_data;
-    char buf[100] = {0};
+
+    LOG_INF("shell at PID=%d wants to unregister", pid);
 
     state = get_state();
 
-    shell_node = list_get_node(&state->shells, &pid);
-    if (shell_node == NULL) {
+    if (hashmap_delete(&state->shells, &pid)) {
         LOG_ERR("shell %d does not exist", pid);
         return;
     }
-    shell_data = (struct shell *)shell_node->data;
-
-    line = args;
-    token = strtok_r(line, " ", &saveptr);
-    if (token == NULL) {
-        LOG_ERR("Too few tokens.");
-        return;
-    }
-
-    tag = strndup(token, get_trailing_whitespace(token));
-
-    /* Check if tag exists */
-    tag_node = list_get_node(&state->tags, tag);
-    if (tag_node == NULL) {
-        LOG_INF("Tag '%s' does not exist.", tag);
-        sendto(state->sfd, "BAD\n", 4, 0,
-               (struct sockaddr *)&shell_data->sock_addr,
-               sizeof(shell_data->sock_addr));
-    } else {
-        tag_data = (struct tag *)tag_node->data;
-        sprintf(buf, "%s\n", tag_data->path);
-        sendto(state->sfd, buf, strlen(buf), 0,
-               (struct sockaddr *)&shell_data->sock_addr,
-               sizeof(shell_data->sock_addr));
-    }
 
-    free(tag);
-    return;
+    LOG_INF("shell %d unregistered", pid);
+    server_reply("OK\n", 3);
 }
 
-static void cmd_push(int pid, char *args)
+/**
+ * @brief Adds a tag once its path has been checked, see `cmd_add()`.
+ *
+ * A path whose check timed out is accepted, as a hung mount usually comes
+ * back.
+ */
+static void finish_add(int pid, const char *const *fields,
+                       enum path_status status)
 {
-    char *action = NULL;
+    const char *tag, *path;
     struct state *state;
-    struct node *shell_node;
-    struct shell *shell_data;
-    struct node *action_node;
-    struct action *action_data;
+    struct tag *tag_data;
 
     state = get_state();
 
-    shell_node = list_get_node(&state->shells, &pid);
-    if (shell_node == NULL) {
-        LOG_ERR("shell %d does not exist", pid);
-        return;
-    }
-    shell_data = (struct shell *)shell_node->data;
-
-    if (args == NULL) {
-        return;
-    }
+    tag = fields[0];
+    path = fields[1];
 
-    action = strndup(args, get_trailing_whitespace(args));
-    if (!valid_path(action)) {
-        goto free;
+    if (status == PATH_MISSING) {
+        goto bad;
     }
 
-    /* Reject immediate duplicate actions */
-    if (shell_data->actions.head != NULL) {
-        action_data = (struct action *)shell_data->actions.head->data;
-        if (action_data != NULL && !strcmp(action_data->path, action)) {
-            free(action);
-            goto ok;
+    /* Check if it already exists */
+    tag_data = (struct tag *)hashmap_get(&state->tags, (void *)tag);
+    if (tag_data != NULL) {
+        LOG_INF("Tag '%s' already exists. Updating.", tag);
+        if (tag_set_path(tag_data, path)) {
+            goto bad;
         }
+        goto end;
     }
 
-    LOG_INF("Adding action %s", action);
+    /* Create the tag and add it to the map. The fields are only copied out of
+     * the request buffer now that they are to be stored. */
+    tag_data = tag_create(tag, strlen(tag), path);
+    if (tag_data == NULL) {
+        goto bad;
+    }
 
-    if (list_node_create(&action_node)) {
-        LOG_ERR("action node create failed");
-        goto free;
+    if (hashmap_insert(&state->tags, tag_data->tag, tag_data)) {
+        LOG_ERR("tag insert failed");
+        cleanup_tag(tag_data);
+        goto bad;
     }
 
-    action_data = (struct action *)malloc(sizeof(struct action));
-    if (action_data == NULL) {
-        LOG_ERR("shell data malloc create failed");
-        goto free;
+    if (radix_insert(&state->tag_tree, tag_data->tag, tag_data)) {
+        LOG_ERR("tag tree insert failed");
+        hashmap_delete(&state->tags, (void *)tag);
+        goto bad;
     }
 
-    action_data->path = action;
-    action_node->data = action_data;
-    list_prepend_node(&shell_data->actions, action_node);
+end:
+    LOG_INF("Tag %s --> %s added.", tag_data->tag, tag_data->path);
+
+    tag_journal_set(&state->journal, tag_data);
+    publish_tag_snapshot(&state->tags, &state->snapshot);
 
-ok:
-    sendto(state->sfd, "OK\n", 4, 0, (struct sockaddr *)&shell_data->sock_addr,
-           sizeof(shell_data->sock_addr));
+    server_reply("OK\n", 3);
     return;
 
-free:
-    sendto(state->sfd, "BAD\n", 4, 0, (struct sockaddr *)&shell_data->sock_addr,
-           sizeof(shell_data->sock_addr));
-    free(action);
+bad:
+    server_reply("BAD\n", 4);
     return;
 }
 
-static void cmd_pop(int pid, char *args)
+static void cmd_add(int pid, const struct proto_request *req)
 {
-    struct state *state;
-    struct node *shell_node;
-    struct shell *shell_data;
-    struct node *action_node;
-    struct action *action_data;
-    char buf[100] = {0};
+    const char *fields[2];
 
-    state = get_state();
+    if (get_shell(pid) == NULL) {
+        return;
+    }
 
-    shell_node = list_get_node(&state->shells, &pid);
-    if (shell_node == NULL) {
-        LOG_ERR("shell %d does not exist", pid);
+    if (req->n_fields > 2) {
+        LOG_ERR("Too many tokens");
+        server_reply("BAD\n", 4);
         return;
     }
-    shell_data = (struct shell *)shell_node->data;
 
-    action_node = shell_data->actions.head;
-    if (action_node == NULL) {
-        sendto(state->sfd, "BAD\n", 4, 0,
-               (struct sockaddr *)&shell_data->sock_addr,
-               sizeof(shell_data->sock_addr));
+    fields[0] = req->fields[0].ptr;
+    fields[1] = req->fields[1].ptr;
+    check_path(pid, fields[1], finish_add, fields, 2);
+}
+
+static void cmd_delete(int pid, const struct proto_request *req)
+{
+    const char *tag;
+    struct state *state;
+
+    state = get_state();
+
+    if (get_shell(pid) == NULL) {
         return;
     }
-    action_data = (struct action *)action_node->data;
 
-    sprintf(buf, "%s\n", action_data->path);
-    sendto(state->sfd, buf, strlen(buf), 0,
-           (struct sockaddr *)&shell_data->sock_addr,
-           sizeof(shell_data->sock_addr));
+    tag = req->fields[0].ptr;
 
-    list_delete_node(&shell_data->actions, action_data->path);
+    /* Delete the tag if it exists. The map frees it, so it goes from the
+     * tree first. */
+    radix_delete(&state->tag_tree, tag);
+    if (hashmap_delete(&state->tags, (void *)tag)) {
+        LOG_INF("Tag '%s' does not exist.", tag);
+        server_reply("BAD\n", 4);
+    } else {
+        LOG_INF("Tag '%s' deleted.", tag);
+        tag_journal_delete(&state->journal, tag);
+        publish_tag_snapshot(&state->tags, &state->snapshot);
+        server_reply("OK\n", 3);
+    }
 
     return;
 }
 
-static void cmd_actions(int pid, char *args)
+static void cmd_show(int pid, const struct proto_request *req)
 {
     struct state *state;
-    struct node *shell_node;
-    struct shell *shell_data;
-    struct node *action_node;
-    struct action *action_data;
-    char buf[1024] = {0};
-    int i;
-    int offset = 0;
+    struct tag *tag_data;
+    struct page page = {0};
+    uint32_t iter = req->header.cursor;
+    uint32_t next;
 
     state = get_state();
 
-    shell_node = list_get_node(&state->shells, &pid);
-    if (shell_node == NULL) {
-        LOG_ERR("shell %d does not exist", pid);
+    if (get_shell(pid) == NULL) {
         return;
     }
-    shell_data = (struct shell *)shell_node->data;
 
-    i = 1;
-    action_node = shell_data->actions.head;
-    while (action_node != NULL) {
-        action_data = (struct action *)action_node->data;
-        offset += sprintf(buf + offset, "    %d. %s\n", i, action_data->path);
-        action_node = action_node->next;
-        i++;
+    for (;;) {
+        next = iter;
+        tag_data = (struct tag *)hashmap_next(&state->tags, &iter);
+        if (tag_data == NULL) {
+            next = 0;
+            break;
+        }
+
+        struct iovec parts[] = {
+            {.iov_base = tag_data->tag, .iov_len = strlen(tag_data->tag)},
+            {.iov_base = " --> ", .iov_len = 5},
+            {.iov_base = (void *)tag_data->path,
+             .iov_len = intern_len(tag_data->path)},
+            {.iov_base = "\n", .iov_len = 1},
+        };
+        if (!page_add(&page, parts, 4)) {
+            break;
+        }
     }
 
-    sendto(state->sfd, buf, strlen(buf), 0,
-           (struct sockaddr *)&shell_data->sock_addr,
-           sizeof(shell_data->sock_addr));
+    server_reply_page(page.iov, page.n_iov, next);
 }
 
-static void cmd_reset(int pid, char *args)
+static void cmd_list(int pid, const struct proto_request *req)
 {
     struct state *state;
-    struct node *shell_node;
-    struct shell *shell_data;
+    struct tag *tag_data;
+    struct page page = {0};
+    uint32_t iter = req->header.cursor;
+    uint32_t next;
+    int first;
 
     state = get_state();
 
-    shell_node = list_get_node(&state->shells, &pid);
-    if (shell_node == NULL) {
-        LOG_ERR("shell %d does not exist", pid);
+    if (get_shell(pid) == NULL) {
         return;
     }
-    shell_data = (struct shell *)shell_node->data;
 
-    list_delete_all(&shell_data->actions);
+    for (;;) {
+        next = iter;
+        tag_data = (struct tag *)hashmap_next(&state->tags, &iter);
+        if (tag_data == NULL) {
+            next = 0;
+            break;
+        }
 
-    sendto(state->sfd, "OK\n", 4, 0, (struct sockaddr *)&shell_data->sock_addr,
-           sizeof(shell_data->sock_addr));
-    return;
+        /* Tags are separated by spaces, with none before the first tag */
+        first = req->header.cursor == 0 && page.n_items == 0;
+        struct iovec parts[] = {
+            {.iov_base = " ", .iov_len = 1},
+            {.iov_base = tag_data->tag, .iov_len = strlen(tag_data->tag)},
+        };
+        if (!page_add(&page, parts + first, 2 - first)) {
+            break;
+        }
+    }
+
+    server_reply_page(page.iov, page.n_iov, next);
+}
+
+/**
+ * @brief Function finishing a request once its tag has been resolved.
+ *
+ * @param pid The PID of the shell.
+ * @param fields The fields the tag was resolved with, the tag first.
+ * @param path The path the tag resolves to.
+ */
+typedef void (*resolved_func)(int pid, const char *const *fields,
+                              const char *path);
+
+/**
+ * @brief Structure holding a request whose reply waits for the visited
+ * directories matching its tag to be checked.
+ */
+struct resolve {
+    int pid;
+    resolved_func finish;
+    enum path_status status; /**<< Result of checking `paths[next]` */
+    bool checking;           /**<< Whether `paths[next]` is being checked */
+    int depth; /**<< Calls to `try_matches()` under way, which free nothing */
+    int n_fields;
+    char *fields[2]; /**<< Copies of the fields, from the string arena */
+    int n_paths;
+    int next;                               /**<< Match being tried */
+    const char *paths[FRECENCY_CANDIDATES]; /**<< Interned references */
+    struct server_deferred *reply;
+};
+
+static void free_resolve(struct resolve *r)
+{
+    int i;
+
+    for (i = 0; i < r->n_fields; i++) {
+        arena_strfree(r->fields[i]);
+    }
+    for (i = 0; i < r->n_paths; i++) {
+        intern_put(r->paths[i]);
+    }
+    arena_free(r, sizeof(*r));
+}
+
+static void match_checked(enum path_status status, void *ctx);
+
+/**
+ * @brief Finishes a request with the first remaining match that exists.
+ *
+ * A match the cache knows to be missing is skipped, but the user is only
+ * sent to a match that was checked afresh, as `pathstat_wait()` advises.
+ * The reply is deferred and `r->checking` is set until the check completes.
+ * Matches that no longer exist are forgotten, and the request gets "BAD"
+ * once none is left.
+ */
+static void try_matches(struct resolve *r)
+{
+    enum path_status status;
+    const char *path;
+
+    for (; r->next < r->n_paths; r->next++) {
+        path = r->paths[r->next];
+
+        if (pathstat_lookup(path, &status) && status == PATH_MISSING) {
+            frecency_forget(&get_state()->frecency, path);
+            continue;
+        }
+
+        r->reply = server_defer_reply();
+        if (r->reply == NULL) {
+            break;
+        }
+
+        /* The check may complete before pathstat_submit() returns */
+        r->checking = true;
+        r->depth++;
+        if (pathstat_submit(path, false, match_checked, r)) {
+            r->checking = false;
+            server_resume(r->reply, reply_bad, NULL);
+        }
+        r->depth--;
+        return;
+    }
+
+    LOG_INF("Tag '%s' does not exist.", r->fields[0]);
+    server_reply("BAD\n", 4);
+}
+
+static void finish_match(void *ctx)
+{
+    struct resolve *r = ctx;
+
+    /* A path whose check timed out is accepted */
+    if (r->status != PATH_MISSING) {
+        r->finish(r->pid, (const char *const *)r->fields, r->paths[r->next]);
+        return;
+    }
+
+    frecency_forget(&get_state()->frecency, r->paths[r->next]);
+    r->next++;
+    try_matches(r);
+}
+
+static void match_checked(enum path_status status, void *ctx)
+{
+    struct resolve *r = ctx;
+
+    r->status = status;
+    r->checking = false;
+    server_resume(r->reply, finish_match, r);
+    if (!r->checking && r->depth == 0) {
+        free_resolve(r);
+    }
+}
+
+/**
+ * @brief Resolves a tag to a path, then finishes the request.
+ *
+ * If no tag matches, the tag is taken as a query term for the highest ranked
+ * visited directory instead, see `frecency_best()`. The best matches are
+ * found in one scan and checked in turn like any other path, see
+ * `check_path()`, so a match on a hung mount never stalls the daemon.
+ *
+ * @param pid The PID of the shell.
+ * @param finish Function finishing the request.
+ * @param fields The fields `finish` needs, the tag first, at most 2.
+ * @param n_fields Number of fields.
+ */
+static void resolve_tag(int pid, resolved_func finish,
+                        const char *const *fields, int n_fields)
+{
+    struct state *state = get_state();
+    struct tag *tag_data;
+    struct resolve *r;
+    int i;
+
+    tag_data = (struct tag *)hashmap_get(&state->tags, (void *)fields[0]);
+    if (tag_data != NULL) {
+        finish(pid, fields, tag_data->path);
+        return;
+    }
+
+    r = (struct resolve *)arena_alloc(sizeof(*r));
+    if (r == NULL) {
+        server_reply("BAD\n", 4);
+        return;
+    }
+    memset(r, 0, sizeof(*r));
+
+    r->pid = pid;
+    r->finish = finish;
+    for (i = 0; i < n_fields; i++) {
+        r->fields[i] = arena_strndup(fields[i], strlen(fields[i]));
+        if (r->fields[i] == NULL) {
+            free_resolve(r);
+            server_reply("BAD\n", 4);
+            return;
+        }
+        r->n_fields++;
+    }
+
+    /* Forgetting a match frees its path, so hold a reference to each */
+    r->n_paths = frecency_best(&state->frecency, fields[0], time(NULL),
+                               r->paths, FRECENCY_CANDIDATES);
+    for (i = 0; i < r->n_paths; i++) {
+        intern_ref(r->paths[i]);
+    }
+
+    try_matches(r);
+    if (!r->checking) {
+        free_resolve(r);
+    }
+}
+
+static void finish_get(int pid, const char *const *fields, const char *path)
+{
+    reply_line(path);
+}
+
+static void cmd_get(int pid, const struct proto_request *req)
+{
+    const char *fields[1];
+
+    if (get_shell(pid) == NULL) {
+        return;
+    }
+
+    fields[0] = req->fields[0].ptr;
+    resolve_tag(pid, finish_get, fields, 1);
+}
+
+/**
+ * @brief Pushes a checked path onto a shell's action stack.
+ *
+ * The path is copied only once it is to be stored. Pushing the path already
+ * on top of the stack succeeds without adding a duplicate action. Either way,
+ * the push counts as a visit to the path.
+ *
+ * @param shell_data Pointer to the shell.
+ * @param action Pointer to the path.
+ * @param status The result of checking the path, see `check_path()`.
+ * @return 0 on success, non-zero on failure.
+ */
+static int push_action(struct shell *shell_data, const char *action,
+                       enum path_status status)
+{
+    const char *path;
+
+    if (status == PATH_MISSING) {
+        return 1;
+    }
+
+    frecency_visit(&get_state()->frecency, action, time(NULL));
+
+    path = intern(action);
+    if (path == NULL) {
+        LOG_ERR("intern failed");
+        return 1;
+    }
+
+    /* Reject immediate duplicate actions. Interned paths are equal exactly
+     * when their pointers are. */
+    if (action_peek(&shell_data->actions, 0, NULL) == path) {
+        intern_put(path);
+        return 0;
+    }
+
+    LOG_INF("Adding action %s", action);
+
+    action_push(&shell_data->actions, path);
+
+    return 0;
+}
+
+static void finish_push(int pid, const char *const *fields,
+                        enum path_status status)
+{
+    struct shell *shell_data;
+
+    /* The shell may have gone while the path was checked */
+    shell_data = get_shell(pid);
+    if (shell_data == NULL) {
+        return;
+    }
+
+    if (push_action(shell_data, fields[0], status)) {
+        server_reply("BAD\n", 4);
+        return;
+    }
+
+    server_reply("OK\n", 4);
+}
+
+static void cmd_push(int pid, const struct proto_request *req)
+{
+    const char *fields[1];
+
+    if (get_shell(pid) == NULL) {
+        return;
+    }
+
+    fields[0] = req->fields[0].ptr;
+    check_path(pid, fields[0], finish_push, fields, 1);
+}
+
+static void finish_jump(int pid, const char *const *fields,
+                        enum path_status status)
+{
+    struct shell *shell_data;
+
+    shell_data = get_shell(pid);
+    if (shell_data == NULL) {
+        return;
+    }
+
+    if (push_action(shell_data, fields[1], status)) {
+        server_reply("BAD\n", 4);
+        return;
+    }
+
+    reply_line(fields[2]);
+}
+
+static void jump_resolved(int pid, const char *const *fields,
+                          const char *path)
+{
+    /* The tag, the cwd, and the path the tag resolves to */
+    const char *jump[3] = {fields[0], fields[1], path};
+
+    check_path(pid, fields[1], finish_jump, jump, 3);
+}
+
+/**
+ * @brief Resolves a tag and records the navigation in one request.
+ *
+ * This function handles `jump <tag> <cwd>`. If the tag resolves, see
+ * `resolve_tag()`, `cwd` is pushed onto the shell's action stack and the path
+ * is returned. This replaces a `get` followed by a `push`. Nothing is pushed
+ * if the tag does not resolve.
+ *
+ * @param pid The PID of the shell.
+ * @param req The request, holding the tag and the shell's current working
+ *            directory.
+ */
+static void cmd_jump(int pid, const struct proto_request *req)
+{
+    const char *fields[2];
+
+    if (get_shell(pid) == NULL) {
+        return;
+    }
+
+    fields[0] = req->fields[0].ptr;
+    fields[1] = req->fields[1].ptr;
+    resolve_tag(pid, jump_resolved, fields, 2);
+}
+
+static void cmd_pop(int pid, const struct proto_request *req)
+{
+    struct shell *shell_data;
+    const char *path;
+
+    shell_data = get_shell(pid);
+    if (shell_data == NULL) {
+        return;
+    }
+
+    path = action_peek(&shell_data->actions, 0, NULL);
+    if (path == NULL) {
+        server_reply("BAD\n", 4);
+        return;
+    }
+
+    /* The reply is sent before the path's reference is released */
+    reply_line(path);
+
+    action_pop(&shell_data->actions);
+
+    return;
+}
+
+static void cmd_actions(int pid, const struct proto_request *req)
+{
+    struct shell *shell_data;
+    struct page page = {0};
+    char numbers[PAGE_ITEMS_MAX][16];
+    const char *path;
+    uint32_t path_len;
+    uint32_t i;
+    uint32_t next;
+    int len;
+
+    shell_data = get_shell(pid);
+    if (shell_data == NULL) {
+        return;
+    }
+
+    /* The cursor is the position of the first action on the page */
+    i = req->header.cursor;
+    for (next = 0; (path = action_peek(&shell_data->actions, i, &path_len));
+         i++) {
+        /* The page is full, and there is no buffer left for the number */
+        if (page.n_items == PAGE_ITEMS_MAX) {
+            next = i;
+            break;
+        }
+
+        len = snprintf(numbers[page.n_items], sizeof(numbers[0]), "    %u. ",
+                       i + 1);
+        struct iovec parts[] = {
+            {.iov_base = numbers[page.n_items], .iov_len = len},
+            {.iov_base = (void *)path, .iov_len = path_len},
+            {.iov_base = "\n", .iov_len = 1},
+        };
+        if (!page_add(&page, parts, 3)) {
+            next = i;
+            break;
+        }
+    }
+
+    server_reply_page(page.iov, page.n_iov, next);
+}
+
+static void cmd_reset(int pid, const struct proto_request *req)
+{
+    struct shell *shell_data;
+
+    shell_data = get_shell(pid);
+    if (shell_data == NULL) {
+        return;
+    }
+
+    action_clear(&shell_data->actions);
+
+    server_reply("OK\n", 4);
+    return;
+}
+
+/**
+ * @brief Structure holding the state of a `complete` request.
+ *
+ * Matches are counted from the first match overall, so the cursor of a page
+ * is the number of matches on the pages before it.
+ */
+struct completion {
+    struct page page;
+    uint32_t skip;      /**<< Matches already sent on earlier pages */
+    uint32_t limit;     /**<< Matches to send in total, 0 for no limit */
+    uint32_t n_matches; /**<< Matches seen so far */
+    uint32_t next;      /**<< Cursor of the next page, 0 if there is none */
+};
+
+static int complete_tag(const char *key, void *data, void *ctx)
+{
+    struct completion *c = (struct completion *)ctx;
+    struct tag *tag_data = (struct tag *)data;
+
+    if (c->limit != 0 && c->n_matches == c->limit) {
+        return 1;
+    }
+
+    if (c->n_matches < c->skip) {
+        c->n_matches++;
+        return 0;
+    }
+
+    struct iovec parts[] = {
+        {.iov_base = tag_data->tag, .iov_len = strlen(tag_data->tag)},
+        {.iov_base = "\n", .iov_len = 1},
+    };
+    if (!page_add(&c->page, parts, 2)) {
+        c->next = c->n_matches;
+        return 1;
+    }
+    c->n_matches++;
+
+    return 0;
+}
+
+/**
+ * @brief Replies with the tags starting with a prefix.
+ *
+ * Matching tags are found in the tag tree, and sent one per line in
+ * lexicographic order. Without a prefix every tag matches.
+ *
+ * @param pid The PID of the shell.
+ * @param req The request, holding the optional prefix and the optional maximum
+ *            number of tags to reply with.
+ */
+static void cmd_complete(int pid, const struct proto_request *req)
+{
+    struct completion c = {0};
+    struct state *state;
+    const char *prefix;
+    unsigned long limit;
+    char *end;
+
+    state = get_state();
+
+    if (get_shell(pid) == NULL) {
+        return;
+    }
+
+    if (req->n_fields > 2) {
+        LOG_ERR("Too many tokens");
+        server_reply("BAD\n", 4);
+        return;
+    }
+
+    prefix = req->n_fields > 0 ? req->fields[0].ptr : "";
+
+    if (req->n_fields > 1) {
+        errno = 0;
+        limit = strtoul(req->fields[1].ptr, &end, 10);
+        if (errno || end == req->fields[1].ptr || *end != '\0' ||
+            limit > UINT32_MAX) {
+            LOG_ERR("Invalid limit '%s'", req->fields[1].ptr);
+            server_reply("BAD\n", 4);
+            return;
+        }
+        c.limit = limit;
+    }
+
+    c.skip = req->header.cursor;
+    if (radix_walk_prefix(&state->tag_tree, prefix, complete_tag, &c)) {
+        LOG_ERR("Tag tree walk failed");
+        server_reply("BAD\n", 4);
+        return;
+    }
+
+    server_reply_page(c.page.iov, c.page.n_iov, c.next);
+}
+
+static void finish_visit(int pid, const char *const *fields,
+                         enum path_status status)
+{
+    if (status == PATH_MISSING ||
+        frecency_visit(&get_state()->frecency, fields[0], time(NULL))) {
+        server_reply("BAD\n", 4);
+        return;
+    }
+
+    server_reply("OK\n", 3);
+}
+
+/**
+ * @brief Records a visit to a directory without touching the action stack.
+ *
+ * @param pid The PID of the shell.
+ * @param req The request, holding the directory.
+ */
+static void cmd_visit(int pid, const struct proto_request *req)
+{
+    const char *fields[1];
+
+    if (get_shell(pid) == NULL) {
+        return;
+    }
+
+    fields[0] = req->fields[0].ptr;
+    check_path(pid, fields[0], finish_visit, fields, 1);
+}
+
+/**
+ * @brief Structure representing a directory found by a search.
+ */
+struct search_result {
+    const char *path;
+    size_t len; /**<< Length of `path` */
+    int score;
+};
+
+/**
+ * @brief Structure holding the best results of a search so far.
+ */
+struct search {
+    struct fuzzy_pattern pattern;
+    struct search_result results[SEARCH_LIMIT_MAX]; /**<< Best first */
+    int n_results;
+    int limit;
+};
+
+/**
+ * @brief Orders results by score, then shorter paths first.
+ */
+static bool result_before(const struct search_result *a,
+                          const struct search_result *b)
+{
+    if (a->score != b->score) {
+        return a->score > b->score;
+    } else if (a->len != b->len) {
+        return a->len < b->len;
+    }
+
+    return strcmp(a->path, b->path) < 0;
+}
+
+/**
+ * @brief Matches a candidate and keeps its directory if it ranks high enough.
+ *
+ * @param s Pointer to the search.
+ * @param name The candidate matched against the pattern.
+ * @param len Length of `name`.
+ * @param path The candidate's directory, which is kept once even if several
+ *             candidates lead to it.
+ */
+static void search_add(struct search *s, const char *name, size_t len,
+                       const char *path)
+{
+    struct search_result r;
+    int i;
+
+    if (!fuzzy_match(&s->pattern, name, len, &r.score)) {
+        return;
+    }
+    r.path = path;
+    r.len = path == name ? len : strlen(path);
+
+    for (i = 0; i < s->n_results; i++) {
+        if (strcmp(s->results[i].path, path) == 0) {
+            if (!result_before(&r, &s->results[i])) {
+                return;
+            }
+            memmove(&s->results[i], &s->results[i + 1],
+                    (s->n_results - i - 1) * sizeof(r));
+            s->n_results--;
+            break;
+        }
+    }
+
+    if (s->n_results == s->limit) {
+        if (!result_before(&r, &s->results[s->n_results - 1])) {
+            return;
+        }
+        s->n_results--;
+    }
+
+    for (i = s->n_results; i > 0 && result_before(&r, &s->results[i - 1]);
+         i--) {
+        s->results[i] = s->results[i - 1];
+    }
+    s->results[i] = r;
+    s->n_results++;
+}
+
+/**
+ * @brief Replies with the directories that fuzzy match a pattern.
+ *
+ * Tags are matched by name and visited directories by path. The matching
+ * directories are sent one per line, best match first.
+ *
+ * @param pid The PID of the shell.
+ * @param req The request, holding the pattern and the optional maximum
+ *            number of directories to reply with.
+ */
+static void cmd_search(int pid, const struct proto_request *req)
+{
+    struct search s = {.limit = SEARCH_LIMIT_DEFAULT};
+    struct page page = {0};
+    struct state *state;
+    struct dir_entry *dir;
+    struct tag *tag_data;
+    unsigned long limit;
+    uint32_t next = 0;
+    uint32_t iter;
+    char *end;
+    int i;
+
+    state = get_state();
+
+    if (get_shell(pid) == NULL) {
+        return;
+    }
+
+    if (req->n_fields > 2) {
+        LOG_ERR("Too many tokens");
+        server_reply("BAD\n", 4);
+        return;
+    }
+
+    if (req->n_fields > 1) {
+        errno = 0;
+        limit = strtoul(req->fields[1].ptr, &end, 10);
+        if (errno || end == req->fields[1].ptr || *end != '\0' ||
+            limit == 0 || limit > SEARCH_LIMIT_MAX) {
+            LOG_ERR("Invalid limit '%s'", req->fields[1].ptr);
+            server_reply("BAD\n", 4);
+            return;
+        }
+        s.limit = limit;
+    }
+
+    if (fuzzy_compile(&s.pattern, req->fields[0].ptr)) {
+        LOG_ERR("Invalid pattern '%s'", req->fields[0].ptr);
+        server_reply("BAD\n", 4);
+        return;
+    }
+
+    iter = 0;
+    while ((tag_data = (struct tag *)hashmap_next(&state->tags, &iter))) {
+        search_add(&s, tag_data->tag, strlen(tag_data->tag), tag_data->path);
+    }
+
+    iter = 0;
+    while ((dir = (struct dir_entry *)hashmap_next(&state->frecency.dirs,
+                                                   &iter))) {
+        search_add(&s, dir->path, dir->len, dir->path);
+    }
+
+    for (i = req->header.cursor; i < s.n_results; i++) {
+        struct iovec parts[] = {
+            {.iov_base = (void *)s.results[i].path,
+             .iov_len = s.results[i].len},
+            {.iov_base = "\n", .iov_len = 1},
+        };
+        if (!page_add(&page, parts, 2)) {
+            next = i;
+            break;
+        }
+    }
+
+    server_reply_page(page.iov, page.n_iov, next);
+}
+
+/**
+ * @brief Replies to a deferred `flush` once the writer reaches its barrier.
+ */
+static void flush_done(int err, void *ctx)
+{
+    struct server_deferred *reply = ctx;
+
+    if (err || get_state()->journal.lost) {
+        server_resume(reply, reply_bad, NULL);
+    } else {
+        server_resume(reply, reply_ok, NULL);
+    }
+}
+
+/**
+ * @brief Replies once every change made so far is on disk.
+ *
+ * Changes are written by the writer thread, see writer.h, so a reply to
+ * `add` only means the change is queued. A client wanting durability sends
+ * `flush`, which is answered once the writer has caught up. The reply is
+ * deferred meanwhile, so other requests are still served.
+ */
+static void cmd_flush(int pid, const struct proto_request *req)
+{
+    struct server_deferred *reply;
+    struct state *state;
+
+    state = get_state();
+
+    if (get_shell(pid) == NULL) {
+        return;
+    }
+
+    /* Retry a tag file that failed to be written, and save the frecency
+     * database now rather than when it is next aged */
+    if (state->journal.lost) {
+        tag_journal_compact(&state->journal);
+    }
+    if (state->frecency.dirty) {
+        frecency_save(&state->frecency, state->frecency_path);
+    }
+
+    reply = server_defer_reply();
+    if (reply == NULL) {
+        server_reply("BAD\n", 4);
+        return;
+    }
+
+    if (writer_barrier(flush_done, reply)) {
+        server_resume(reply, reply_bad, NULL);
+    }
+}
+
+/**
+ * @brief Structure holding text formatted into a fixed size buffer.
+ */
+struct text {
+    char *buf;
+    size_t size;
+    size_t len; /**<< Length of the text, more than `size` if truncated */
+};
+
+static void text_printf(struct text *t, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void text_printf(struct text *t, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(t->buf + (t->len < t->size ? t->len : t->size),
+                  t->len < t->size ? t->size - t->len : 0, fmt, ap);
+    va_end(ap);
+
+    if (n > 0) {
+        t->len += n;
+    }
+}
+
+/**
+ * @brief Returns the bytes waiting in a socket's receive queue.
+ */
+static uint32_t queued_bytes(int fd)
+{
+    uint32_t mem[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(mem);
+
+    if (fd == -1 ||
+        getsockopt(fd, SOL_SOCKET, SO_MEMINFO, mem, &len) == -1) {
+        return 0;
+    }
+
+    return mem[SK_MEMINFO_RMEM_ALLOC];
+}
+
+/**
+ * @brief Formats the counters of the daemon as a whole.
+ *
+ * In JSON, the object is left open for the opcodes, see `format_op()`.
+ */
+static void format_summary(struct text *t, bool json)
+{
+    struct state *state = get_state();
+    const struct server_metrics *server = metrics_server();
+    const struct op_metrics *op;
+    const struct slab_pool *pool;
+    struct pathstat_stats checks;
+    struct intern_stats paths;
+    struct alloc_stats alloc;
+    struct shell *shell_data;
+    uint64_t requests = 0, bad = 0, dropped = 0, actions = 0;
+    uint32_t queued, iter = 0;
+    int i;
+
+    for (i = 0; i < PROTO_OP_NUM; i++) {
+        op = metrics_op(i);
+        requests += op->requests;
+        bad += op->bad;
+        dropped += op->dropped;
+    }
+    while ((shell_data = hashmap_next(&state->shells, &iter)) != NULL) {
+        actions += shell_data->actions.n_items;
+    }
+    queued = queued_bytes(state->sfd) + queued_bytes(state->abstract_sfd);
+    intern_stats_get(&paths);
+    alloc_stats_get(&alloc);
+    pathstat_stats_get(&checks);
+
+    if (!json) {
+        text_printf(t,
+                    "requests: %llu, %llu bad, %llu dropped, %llu malformed\n"
+                    "socket: %llu wakeups, %llu datagrams, at most %u at once, "
+                    "%u bytes queued\n"
+                    "shells: %d, %llu reaped, %llu actions\n"
+                    "tags: %d\n"
+                    "directories: %d\n"
+                    "paths: %u interned, %llu references, %llu bytes\n"
+                    "memory: %llu bytes of slabs, %llu records live\n",
+                    (unsigned long long)requests, (unsigned long long)bad,
+                    (unsigned long long)dropped,
+                    (unsigned long long)server->malformed,
+                    (unsigned long long)server->wakeups,
+                    (unsigned long long)server->received, server->queued_max,
+                    queued, state->shells.n_items,
+                    (unsigned long long)state->shells_reaped,
+                    (unsigned long long)actions, state->tags.n_items,
+                    state->frecency.dirs.n_items, paths.n_strings,
+                    (unsigned long long)paths.n_refs,
+                    (unsigned long long)paths.bytes,
+                    (unsigned long long)alloc.slab_bytes,
+                    (unsigned long long)alloc.live);
+        for (pool = pool_next(NULL); pool != NULL; pool = pool_next(pool)) {
+            text_printf(t, "  %s: %u live, %zu bytes\n", pool->name,
+                        pool->n_live, pool_live_bytes(pool));
+        }
+        text_printf(t,
+                    "path checks: %llu cached, %llu stats, %llu timeouts, "
+                    "%u results cached, %u workers stuck\n",
+                    (unsigned long long)checks.hits,
+                    (unsigned long long)checks.stats,
+                    (unsigned long long)checks.timeouts, checks.cached,
+                    checks.stuck);
+        return;
+    }
+
+    text_printf(t,
+                "{\"requests\":%llu,\"bad\":%llu,\"dropped\":%llu,"
+                "\"malformed\":%llu,"
+                "\"socket\":{\"wakeups\":%llu,\"datagrams\":%llu,"
+                "\"queued_max\":%u,\"queued_bytes\":%u},"
+                "\"shells\":%d,\"shells_reaped\":%llu,\"actions\":%llu,"
+                "\"tags\":%d,\"directories\":%d,"
+                "\"paths\":{\"interned\":%u,\"refs\":%llu,\"bytes\":%llu},"
+                "\"memory\":{\"slab_bytes\":%llu,\"live\":%llu,\"pools\":{",
+                (unsigned long long)requests, (unsigned long long)bad,
+                (unsigned long long)dropped,
+                (unsigned long long)server->malformed,
+                (unsigned long long)server->wakeups,
+                (unsigned long long)server->received, server->queued_max,
+                queued, state->shells.n_items,
+                (unsigned long long)state->shells_reaped,
+                (unsigned long long)actions, state->tags.n_items,
+                state->frecency.dirs.n_items, paths.n_strings,
+                (unsigned long long)paths.n_refs,
+                (unsigned long long)paths.bytes,
+                (unsigned long long)alloc.slab_bytes,
+                (unsigned long long)alloc.live);
+    for (pool = pool_next(NULL); pool != NULL; pool = pool_next(pool)) {
+        text_printf(t, "%s\"%s\":{\"live\":%u,\"bytes\":%zu}",
+                    pool == pool_next(NULL) ? "" : ",", pool->name,
+                    pool->n_live, pool_live_bytes(pool));
+    }
+    text_printf(t,
+                "}},\"path_checks\":{\"cached\":%llu,\"stats\":%llu,"
+                "\"timeouts\":%llu,\"results_cached\":%u,\"stuck\":%u},"
+                "\"ops\":{",
+                (unsigned long long)checks.hits,
+                (unsigned long long)checks.stats,
+                (unsigned long long)checks.timeouts, checks.cached,
+                checks.stuck);
+}
+
+/**
+ * @brief Formats the counters of an opcode.
+ *
+ * In text, opcodes that were never requested are left out.
+ */
+static void format_op(struct text *t, int opcode, bool json)
+{
+    const struct op_metrics *op = metrics_op(opcode);
+    bool first = true;
+    uint64_t mean;
+    int b;
+
+    mean = op->requests > 0 ? op->total_ns / op->requests : 0;
+
+    if (!json) {
+        if (op->requests == 0) {
+            return;
+        }
+        text_printf(t,
+                    "%s: %llu requests, %llu bad, %llu dropped, mean %.1fus, "
+                    "p50 %.1fus, p99 %.1fus, max %.1fus\n",
+                    proto_opcode_name(opcode),
+                    (unsigned long long)op->requests,
+                    (unsigned long long)op->bad,
+                    (unsigned long long)op->dropped, mean / 1000.0,
+                    metrics_percentile(op, 50) / 1000.0,
+                    metrics_percentile(op, 99) / 1000.0,
+                    op->max_ns / 1000.0);
+        return;
+    }
+
+    text_printf(t,
+                "%s\"%s\":{\"requests\":%llu,\"bad\":%llu,\"dropped\":%llu,"
+                "\"total_ns\":%llu,\"max_ns\":%llu,\"p50_ns\":%llu,"
+                "\"p99_ns\":%llu,\"buckets\":{",
+                opcode == 0 ? "" : ",", proto_opcode_name(opcode),
+                (unsigned long long)op->requests,
+                (unsigned long long)op->bad,
+                (unsigned long long)op->dropped,
+                (unsigned long long)op->total_ns,
+                (unsigned long long)op->max_ns,
+                (unsigned long long)metrics_percentile(op, 50),
+                (unsigned long long)metrics_percentile(op, 99));
+
+    /* Buckets are keyed by their upper bound, empty ones are left out */
+    for (b = 0; b < METRICS_BUCKETS; b++) {
+        if (op->buckets[b] == 0) {
+            continue;
+        }
+        if (b == METRICS_BUCKETS - 1) {
+            text_printf(t, "%s\"+Inf\":%llu", first ? "" : ",",
+                        (unsigned long long)op->buckets[b]);
+        } else {
+            text_printf(t, "%s\"%llu\":%llu", first ? "" : ",",
+                        (unsigned long long)metrics_bucket_bound(b),
+                        (unsigned long long)op->buckets[b]);
+        }
+        first = false;
+    }
+    text_printf(t, "}}");
+}
+
+/**
+ * @brief Replies with the daemon's counters, see metrics.h.
+ *
+ * The counters are formatted as text, or as a JSON object when the first
+ * field is "json". The reply is a listing whose first item describes the
+ * daemon as a whole and each further item an opcode, so a reply too long for
+ * one page is paginated like any other listing. The counters are not per
+ * shell, so the request does not register one.
+ */
+static void cmd_stats(int pid, const struct proto_request *req)
+{
+    static char buf[SERVER_REPLY_MAX];
+    struct text t = {.buf = buf, .size = sizeof(buf)};
+    struct page page = {0};
+    bool json;
+    size_t start;
+    uint32_t item = req->header.cursor;
+    uint32_t n_items;
+
+    json = req->n_fields > 0 && strcmp(req->fields[0].ptr, "json") == 0;
+
+    /* The summary, one item per opcode, and the end of the JSON object */
+    n_items = 1 + PROTO_OP_NUM + json;
+
+    for (; item < n_items; item++) {
+        start = t.len;
+        if (item == 0) {
+            format_summary(&t, json);
+        } else if (item <= PROTO_OP_NUM) {
+            format_op(&t, item - 1, json);
+        } else {
+            text_printf(&t, "}}\n");
+        }
+
+        /* Items that did not fit go on the next page */
+        if (t.len > t.size && page.n_items > 0) {
+            break;
+        }
+        if (t.len == start) {
+            continue;
+        }
+
+        struct iovec part = {
+            .iov_base = buf + start,
+            .iov_len = (t.len < t.size ? t.len : t.size) - start,
+        };
+        if (!page_add(&page, &part, 1)) {
+            break;
+        }
+    }
+
+    server_reply_page(page.iov, page.n_iov, item < n_items ? item : 0);
 }
@@ -3,26 +3,25 @@
  * @brief Command dispatching interface.
  *
  * This header provides the declaration for the command dispatching function,
- * which allows different command strings to be dispatched and handled by
- * appropriate functions.
+ * which allows parsed requests to be dispatched and handled by appropriate
+ * functions.
  */
 
 #ifndef COMMANDS_H_
 #define COMMANDS_H_
 
+#include "protocol.h"
+
 /**
- * @brief Dispatches a command string to the appropriate function.
+ * @brief Dispatches a request to the appropriate function.
  *
- * This function takes a command string and executes the corresponding command
- * from the dispatch table. The command is executed based on the provided
- * process ID (pid) of the sending process (i.e., the shell that sent the
- * message). The `args` parameter contains the remaining arguments after the
- * command string.
+ * This function executes the handler for the request's opcode, found by
+ * indexing the dispatch table. The command is executed for the process ID
+ * (pid) named in the request header, i.e. the shell the request was sent on
+ * behalf of. Requests with too few fields are answered with "BAD".
  *
- * @param cmd_str The command string to be dispatched and executed.
- * @param pid The process ID of the sending process (shell).
- * @param args The remaining arguments for the command.
+ * @param req The parsed request, from either the binary or text protocol.
  */
-void dispatch_command(char *cmd_str, int pid, char *args);
+void dispatch_command(const struct proto_request *req);
 
 #endif /* COMMANDS_H_ */
@@ -0,0 +1,259 @@
+/**
+ * @file event.c
+ * @brief Implementation of the epoll-based event loop.
+ *
+ * Watches are tracked in a table indexed by file descriptor. Watches removed
+ * while events are being dispatched are parked on a free list and released
+ * once the current batch of events has been handled, so that pending events
+ * never reference freed memory.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "event.h"
+#include "log.h"
+
+/* Maximum number of events handled per call to epoll_wait() */
+#define EVENT_BATCH_SIZE 64
+
+/**
+ * @brief Structure representing a watched file descriptor.
+ */
+struct watch {
+    int fd;
+    event_func func; /**<< `NULL` once the watch has been removed */
+    void *ctx;
+
+    bool is_timer;
+    timer_func timer_func;
+
+    struct watch *next; /**<< Link in the free list */
+};
+
+static int epfd = -1;
+
+static bool running = false;
+
+static struct watch **watches = NULL;
+static int watches_len = 0;
+
+static struct watch *dead_watches = NULL;
+
+static int grow_watches(int fd)
+{
+    struct watch **tmp;
+    int len;
+
+    len = (watches_len == 0) ? 64 : watches_len;
+    while (len <= fd) {
+        len *= 2;
+    }
+
+    tmp = realloc(watches, len * sizeof(*watches));
+    if (tmp == NULL) {
+        LOG_ERR("realloc: %s", strerror(errno));
+        return 1;
+    }
+
+    memset(tmp + watches_len, 0, (len - watches_len) * sizeof(*watches));
+    watches = tmp;
+    watches_len = len;
+
+    return 0;
+}
+
+static void free_dead_watches(void)
+{
+    struct watch *w;
+
+    while (dead_watches != NULL) {
+        w = dead_watches;
+        dead_watches = w->next;
+        free(w);
+    }
+}
+
+static void handle_timer(int fd, uint32_t events, void *ctx)
+{
+    struct watch *w = watches[fd];
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    w->timer_func(ctx);
+}
+
+int event_init(void)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        LOG_ERR("epoll_create1: %s", strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
+
+void event_deinit(void)
+{
+    int fd;
+
+    for (fd = 0; fd < watches_len; fd++) {
+        if (watches[fd] == NULL) {
+            continue;
+        }
+
+        if (watches[fd]->is_timer) {
+            close(fd);
+        }
+        free(watches[fd]);
+    }
+
+    free_dead_watches();
+    free(watches);
+    watches = NULL;
+    watches_len = 0;
+
+    if (epfd != -1) {
+        close(epfd);
+        epfd = -1;
+    }
+}
+
+int event_add_fd(int fd, uint32_t events, event_func func, void *ctx)
+{
+    struct epoll_event ev;
+    struct watch *w;
+
+    if (fd < 0) {
+        return 1;
+    }
+
+    if (fd >= watches_len && grow_watches(fd)) {
+        return 1;
+    }
+
+    if (watches[fd] != NULL) {
+        LOG_ERR("fd %d already watched", fd);
+        return 1;
+    }
+
+    w = (struct watch *)malloc(sizeof(struct watch));
+    if (w == NULL) {
+        LOG_ERR("watch malloc failed");
+        return 1;
+    }
+
+    w->fd = fd;
+    w->func = func;
+    w->ctx = ctx;
+    w->is_timer = false;
+    w->timer_func = NULL;
+    w->next = NULL;
+
+    ev.events = events;
+    ev.data.ptr = w;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        LOG_ERR("epoll_ctl: %s", strerror(errno));
+        free(w);
+        return 1;
+    }
+
+    watches[fd] = w;
+    return 0;
+}
+
+int event_del_fd(int fd)
+{
+    struct watch *w;
+
+    if (fd < 0 || fd >= watches_len || watches[fd] == NULL) {
+        return 1;
+    }
+
+    w = watches[fd];
+    watches[fd] = NULL;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    /* Defer the free, the watch may still be referenced by pending events */
+    w->func = NULL;
+    w->next = dead_watches;
+    dead_watches = w;
+
+    return 0;
+}
+
+int event_add_timer(unsigned int interval_ms, timer_func func, void *ctx)
+{
+    struct itimerspec its;
+    int tfd;
+
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) {
+        LOG_ERR("timerfd_create: %s", strerror(errno));
+        return 1;
+    }
+
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(tfd, 0, &its, NULL) == -1) {
+        LOG_ERR("timerfd_settime: %s", strerror(errno));
+        close(tfd);
+        return 1;
+    }
+
+    if (event_add_fd(tfd, EPOLLIN, handle_timer, ctx)) {
+        close(tfd);
+        return 1;
+    }
+
+    watches[tfd]->is_timer = true;
+    watches[tfd]->timer_func = func;
+
+    return 0;
+}
+
+void event_loop(void)
+{
+    struct epoll_event events[EVENT_BATCH_SIZE];
+    struct watch *w;
+    int n, i;
+
+    running = true;
+    while (running) {
+        n = epoll_wait(epfd, events, EVENT_BATCH_SIZE, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERR("epoll_wait: %s", strerror(errno));
+            return;
+        }
+
+        for (i = 0; i < n; i++) {
+            w = (struct watch *)events[i].data.ptr;
+            if (w->func == NULL) {
+                continue;
+            }
+
+            w->func(w->fd, events[i].events, w->ctx);
+        }
+
+        free_dead_watches();
+    }
+}
+
+void event_stop(void)
+{
+    running = false;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file event.h
+ * @brief epoll-based event loop interface.
+ *
+ * This header defines the interface for the daemon's event loop. File
+ * descriptors are registered with a callback which is invoked whenever the
+ * descriptor becomes ready. Periodic work is scheduled through timers, which
+ * are backed by a `timerfd` registered with the same loop.
+ */
+
+#ifndef EVENT_H_
+#define EVENT_H_
+
+#include <stdint.h>
+
+/**
+ * @brief Callback invoked when a watched file descriptor becomes ready.
+ *
+ * @param fd The file descriptor that is ready.
+ * @param events The epoll events reported for `fd`.
+ * @param ctx The context pointer given at registration.
+ */
+typedef void (*event_func)(int fd, uint32_t events, void *ctx);
+
+/**
+ * @brief Callback invoked each time a timer expires.
+ *
+ * @param ctx The context pointer given at registration.
+ */
+typedef void (*timer_func)(void *ctx);
+
+/**
+ * @brief Initialises the event loop.
+ *
+ * This function creates the epoll instance used by the event loop. It must be
+ * called before any other event function.
+ *
+ * @return 0 on success, non-zero on failure.
+ */
+int event_init(void);
+
+/**
+ * @brief Releases all resources held by the event loop.
+ *
+ * Timer file descriptors created by `event_add_timer()` are closed. Other
+ * watched file descriptors remain owned by the caller.
+ */
+void event_deinit(void);
+
+/**
+ * @brief Watches a file descriptor for the given events.
+ *
+ * @param fd The file descriptor to watch.
+ * @param events The epoll events of interest, e.g. `EPOLLIN`.
+ * @param func The callback to invoke when `fd` is ready.
+ * @param ctx Context pointer passed through to `func`.
+ * @return 0 on success, non-zero on failure.
+ */
+int event_add_fd(int fd, uint32_t events, event_func func, void *ctx);
+
+/**
+ * @brief Stops watching a file descriptor.
+ *
+ * It is safe to call this function from within a callback, including for
+ * the descriptor currently being serviced. The descriptor is not closed.
+ *
+ * @param fd The file descriptor to stop watching.
+ * @return 0 on success, non-zero if `fd` was not being watched.
+ */
+int event_del_fd(int fd);
+
+/**
+ * @brief Schedules a periodic timer.
+ *
+ * @param interval_ms The timer period in milliseconds.
+ * @param func The callback to invoke on each expiry.
+ * @param ctx Context pointer passed through to `func`.
+ * @return 0 on success, non-zero on failure.
+ */
+int event_add_timer(unsigned int interval_ms, timer_func func, void *ctx);
+
+/**
+ * @brief Runs the event loop.
+ *
+ * This function waits for events and dispatches them to their callbacks. It
+ * returns once `event_stop()` is called, or if waiting for events fails.
+ */
+void event_loop(void);
+
+/**
+ * @brief Stops the event loop.
+ *
+ * The loop returns after the events of the current batch are dispatched. This
+ * function is meant to be called from a callback.
+ */
+void event_stop(void);
+
+#endif /* EVENT_H_ */
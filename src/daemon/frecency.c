@@ -0,0 +1,519 @@
+/**
+ * @file frecency.c
+ * @brief Implementation of the frecency ranked directory database.
+ *
+ * This file implements recording visits, ranking matches, decaying ranks,
+ * and loading and saving the database file. Directories are allocated from a
+ * slab pool and their paths are interned, so a directory that is also tagged
+ * or on an action stack shares its path with them.
+ *
+ * A visit adds one to a rank, so a visited directory only moves towards the
+ * front of the rank order, past the directories it now outranks. Decaying
+ * scales every rank alike, which keeps the order, and the directories it
+ * forgets are all at the back.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "frecency.h"
+#include "intern.h"
+#include "log.h"
+#include "pool.h"
+#include "writer.h"
+
+/* "nrec" in the first bytes of the file */
+#define FRECENCY_MAGIC 0x6365726e
+
+/* Version of the file format */
+#define FRECENCY_VERSION 1
+
+#define HOUR (60 * 60)
+#define DAY  (24 * HOUR)
+#define WEEK (7 * DAY)
+
+/* Largest factor `score()` weighs a rank by */
+#define SCORE_WEIGHT_MAX 4
+
+/**
+ * @brief Structure representing the header of the database file.
+ */
+struct file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_dirs;
+};
+
+/**
+ * @brief Structure representing the fixed part of a record in the file.
+ *
+ * Records are packed, so this is only used to compute sizes.
+ */
+struct file_record {
+    double rank;
+    int64_t last_seen;
+    uint16_t len;
+} __attribute__((packed));
+
+static struct slab_pool dir_pool = SLAB_POOL_INIT("dir", struct dir_entry);
+
+static int compare_dir_path(void *data, void *key)
+{
+    return strcmp(((struct dir_entry *)data)->path, (char *)key) != 0;
+}
+
+static int cleanup_dir(void *data)
+{
+    struct dir_entry *dir = (struct dir_entry *)data;
+
+    intern_put(dir->path);
+    pool_free(&dir_pool, dir);
+    return 0;
+}
+
+void frecency_init(struct frecency *f)
+{
+    memset(f, 0, sizeof(*f));
+    f->dirs.hash_func = hash_string;
+    f->dirs.compare_func = compare_dir_path;
+    f->dirs.cleanup_func = cleanup_dir;
+}
+
+void frecency_deinit(struct frecency *f)
+{
+    hashmap_delete_all(&f->dirs);
+    free(f->ranked);
+    f->ranked = NULL;
+    f->n_ranked = 0;
+    f->ranked_size = 0;
+    f->total_rank = 0;
+}
+
+/**
+ * @brief Adds a directory at the back of the rank order.
+ *
+ * @return 0 on success, non-zero on failure.
+ */
+static int rank_append(struct frecency *f, struct dir_entry *dir)
+{
+    struct dir_entry **tmp;
+    uint32_t size;
+
+    if (f->n_ranked == f->ranked_size) {
+        size = f->ranked_size == 0 ? 64 : f->ranked_size * 2;
+        tmp = realloc(f->ranked, size * sizeof(*tmp));
+        if (tmp == NULL) {
+            LOG_ERR("rank order realloc failed");
+            return 1;
+        }
+        f->ranked = tmp;
+        f->ranked_size = size;
+    }
+
+    dir->index = f->n_ranked;
+    f->ranked[f->n_ranked++] = dir;
+    return 0;
+}
+
+/**
+ * @brief Moves a directory whose rank grew ahead of those it now outranks.
+ */
+static void rank_raise(struct frecency *f, struct dir_entry *dir)
+{
+    uint32_t lo = 0, hi = dir->index;
+    uint32_t mid, i;
+
+    /* First position ranked below the directory */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (f->ranked[mid]->rank < dir->rank) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    for (i = dir->index; i > lo; i--) {
+        f->ranked[i] = f->ranked[i - 1];
+        f->ranked[i]->index = i;
+    }
+    f->ranked[lo] = dir;
+    dir->index = lo;
+}
+
+static void rank_remove(struct frecency *f, struct dir_entry *dir)
+{
+    uint32_t i;
+
+    for (i = dir->index; i + 1 < f->n_ranked; i++) {
+        f->ranked[i] = f->ranked[i + 1];
+        f->ranked[i]->index = i;
+    }
+    f->n_ranked--;
+}
+
+static int compare_rank(const void *a, const void *b)
+{
+    double ra = (*(struct dir_entry *const *)a)->rank;
+    double rb = (*(struct dir_entry *const *)b)->rank;
+
+    return (ra < rb) - (ra > rb);
+}
+
+static struct dir_entry *dir_create(const char *path, double rank,
+                                    int64_t last_seen)
+{
+    struct dir_entry *dir;
+    const char *slash;
+    size_t len;
+
+    dir = (struct dir_entry *)pool_alloc(&dir_pool);
+    if (dir == NULL) {
+        LOG_ERR("dir entry alloc failed");
+        return NULL;
+    }
+
+    dir->path = intern(path);
+    if (dir->path == NULL) {
+        LOG_ERR("dir path intern failed");
+        pool_free(&dir_pool, dir);
+        return NULL;
+    }
+
+    len = intern_len(dir->path);
+    dir->len = len;
+    dir->rank = rank;
+    dir->last_seen = last_seen;
+
+    /* The last component of "/a/b/" is "b/", so skip one trailing slash */
+    slash = len > 1 ? memrchr(dir->path, '/', len - 1) : NULL;
+    dir->base = slash != NULL ? slash - dir->path + 1 : 0;
+
+    return dir;
+}
+
+int frecency_visit(struct frecency *f, const char *path, time_t now)
+{
+    struct dir_entry *dir;
+    size_t len;
+
+    dir = (struct dir_entry *)hashmap_get(&f->dirs, (void *)path);
+    if (dir == NULL) {
+        len = strlen(path);
+        if (len > UINT16_MAX) {
+            return 1;
+        }
+
+        dir = dir_create(path, 0, now);
+        if (dir == NULL) {
+            return 1;
+        }
+
+        if (rank_append(f, dir)) {
+            cleanup_dir(dir);
+            return 1;
+        }
+
+        if (hashmap_insert(&f->dirs, (void *)dir->path, dir)) {
+            LOG_ERR("dir insert failed");
+            f->n_ranked--;
+            cleanup_dir(dir);
+            return 1;
+        }
+    }
+
+    dir->rank += 1;
+    dir->last_seen = now;
+    f->total_rank += 1;
+    f->dirty = true;
+    rank_raise(f, dir);
+
+    return 0;
+}
+
+/**
+ * @brief Weighs a directory's rank by how long ago it was last visited.
+ */
+static double score(const struct dir_entry *dir, time_t now)
+{
+    int64_t age = now - dir->last_seen;
+
+    if (age < HOUR) {
+        return dir->rank * SCORE_WEIGHT_MAX;
+    } else if (age < DAY) {
+        return dir->rank * 2;
+    } else if (age < WEEK) {
+        return dir->rank / 2;
+    }
+
+    return dir->rank / 4;
+}
+
+static bool matches(const struct dir_entry *dir, const char *term,
+                    bool whole_path)
+{
+    return strstr(whole_path ? dir->path : dir->path + dir->base, term) !=
+           NULL;
+}
+
+int frecency_best(struct frecency *f, const char *term, time_t now,
+                  const char **paths, int n)
+{
+    bool whole_path = strchr(term, '/') != NULL;
+    double scores[FRECENCY_CANDIDATES];
+    struct dir_entry *dir;
+    int n_found = 0;
+    uint32_t i;
+    double s;
+    int j;
+
+    if (*term == '\0' || n <= 0) {
+        return 0;
+    }
+    if (n > FRECENCY_CANDIDATES) {
+        n = FRECENCY_CANDIDATES;
+    }
+
+    /* Keep the best matches, by descending score */
+    for (i = 0; i < f->n_ranked; i++) {
+        dir = f->ranked[i];
+
+        /* Later directories rank no higher, so if even the largest weight
+         * cannot lift this one past the worst kept match, none can */
+        if (n_found == n && dir->rank * SCORE_WEIGHT_MAX <= scores[n - 1]) {
+            break;
+        }
+
+        if (!matches(dir, term, whole_path)) {
+            continue;
+        }
+
+        s = score(dir, now);
+        if (n_found == n && s <= scores[n - 1]) {
+            continue;
+        }
+
+        j = n_found < n ? n_found++ : n - 1;
+        for (; j > 0 && scores[j - 1] < s; j--) {
+            paths[j] = paths[j - 1];
+            scores[j] = scores[j - 1];
+        }
+        paths[j] = dir->path;
+        scores[j] = s;
+    }
+
+    return n_found;
+}
+
+void frecency_forget(struct frecency *f, const char *path)
+{
+    struct dir_entry *dir;
+
+    dir = (struct dir_entry *)hashmap_get(&f->dirs, (void *)path);
+    if (dir == NULL) {
+        return;
+    }
+
+    LOG_INF("Forgetting '%s'", path);
+    f->total_rank -= dir->rank;
+    f->dirty = true;
+    rank_remove(f, dir);
+    hashmap_delete(&f->dirs, (void *)dir->path);
+}
+
+void frecency_age(struct frecency *f)
+{
+    struct dir_entry *dir;
+    uint32_t i;
+
+    if (f->total_rank <= FRECENCY_MAX_TOTAL) {
+        return;
+    }
+
+    f->total_rank = 0;
+    for (i = 0; i < f->n_ranked; i++) {
+        dir = f->ranked[i];
+        dir->rank *= FRECENCY_DECAY;
+        f->total_rank += dir->rank;
+    }
+
+    /* The directories decayed below the minimum are the last ones */
+    while (f->n_ranked > 0 &&
+           f->ranked[f->n_ranked - 1]->rank < FRECENCY_MIN_RANK) {
+        dir = f->ranked[--f->n_ranked];
+        f->total_rank -= dir->rank;
+        hashmap_delete(&f->dirs, (void *)dir->path);
+    }
+    f->dirty = true;
+
+    LOG_INF("Decayed ranks, %d directories left", f->dirs.n_items);
+}
+
+int frecency_load(struct frecency *f, const char *path)
+{
+    struct file_header header;
+    struct file_record record;
+    struct dir_entry *dir;
+    struct stat sb;
+    size_t offset;
+    uint32_t i;
+    char *buf;
+    char saved;
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        LOG_INF("No frecency database at %s", path);
+        return 1;
+    }
+
+    if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(header)) {
+        LOG_ERR("Invalid frecency database at %s", path);
+        close(fd);
+        return 1;
+    }
+
+    /* One spare byte, so the last path can be NUL-terminated in place */
+    buf = malloc(sb.st_size + 1);
+    if (buf == NULL) {
+        LOG_ERR("frecency buffer malloc failed");
+        close(fd);
+        return 1;
+    }
+
+    n = read(fd, buf, sb.st_size);
+    close(fd);
+    if (n != sb.st_size) {
+        LOG_ERR("Short read of frecency database at %s", path);
+        goto fail;
+    }
+
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != FRECENCY_MAGIC || header.version != FRECENCY_VERSION) {
+        LOG_ERR("Unsupported frecency database at %s", path);
+        goto fail;
+    }
+
+    offset = sizeof(header);
+    for (i = 0; i < header.n_dirs; i++) {
+        if ((size_t)n - offset < sizeof(record)) {
+            break;
+        }
+        memcpy(&record, buf + offset, sizeof(record));
+        offset += sizeof(record);
+
+        if ((size_t)n - offset < record.len) {
+            break;
+        }
+
+        /* Paths are not NUL-terminated in the file, so terminate each one
+         * while it is interned, overwriting the next record's first byte */
+        saved = buf[offset + record.len];
+        buf[offset + record.len] = '\0';
+        dir = dir_create(buf + offset, record.rank, record.last_seen);
+        buf[offset + record.len] = saved;
+        offset += record.len;
+        if (dir == NULL) {
+            goto fail;
+        }
+
+        if (hashmap_get(&f->dirs, (void *)dir->path) != NULL ||
+            rank_append(f, dir)) {
+            cleanup_dir(dir);
+            continue;
+        }
+        if (hashmap_insert(&f->dirs, (void *)dir->path, dir)) {
+            f->n_ranked--;
+            cleanup_dir(dir);
+            continue;
+        }
+        f->total_rank += dir->rank;
+    }
+
+    if (i < header.n_dirs) {
+        LOG_ERR("Truncated frecency database at %s", path);
+    }
+
+    /* Records are saved in map order, so sort them once */
+    qsort(f->ranked, f->n_ranked, sizeof(*f->ranked), compare_rank);
+    for (i = 0; i < f->n_ranked; i++) {
+        f->ranked[i]->index = i;
+    }
+
+    free(buf);
+    LOG_INF("Loaded %d directories from %s", f->dirs.n_items, path);
+    return 0;
+
+fail:
+    free(buf);
+    return 1;
+}
+
+/**
+ * @brief Marks the database for saving again if the writer failed to save it.
+ */
+static void frecency_saved(int err, void *ctx)
+{
+    struct frecency *f = ctx;
+
+    if (err) {
+        LOG_ERR("Unable to write frecency database");
+        f->dirty = true;
+    }
+}
+
+int frecency_save(struct frecency *f, const char *path)
+{
+    struct file_header header;
+    struct file_record record;
+    struct dir_entry *dir;
+    uint32_t iter = 0;
+    size_t size, offset;
+    char *buf;
+
+    /* Build the whole file in memory, so it is written in one go */
+    size = sizeof(header);
+    while ((dir = (struct dir_entry *)hashmap_next(&f->dirs, &iter))) {
+        size += sizeof(record) + dir->len;
+    }
+
+    buf = malloc(size);
+    if (buf == NULL) {
+        LOG_ERR("frecency buffer malloc failed");
+        return 1;
+    }
+
+    header.magic = FRECENCY_MAGIC;
+    header.version = FRECENCY_VERSION;
+    header.n_dirs = f->dirs.n_items;
+    memcpy(buf, &header, sizeof(header));
+
+    offset = sizeof(header);
+    iter = 0;
+    while ((dir = (struct dir_entry *)hashmap_next(&f->dirs, &iter))) {
+        record.rank = dir->rank;
+        record.last_seen = dir->last_seen;
+        record.len = dir->len;
+        memcpy(buf + offset, &record, sizeof(record));
+        offset += sizeof(record);
+        memcpy(buf + offset, dir->path, dir->len);
+        offset += dir->len;
+    }
+
+    if (writer_replace(path, buf, size, -1, frecency_saved, f)) {
+        LOG_ERR("Unable to queue frecency database for %s", path);
+        return 1;
+    }
+
+    f->dirty = false;
+    return 0;
+}
@@ -0,0 +1,152 @@
+/**
+ * @file frecency.h
+ * @brief Frecency ranked database of visited directories.
+ *
+ * This header defines the database of directories the user has visited, each
+ * ranked by how often and how recently it was visited ("frecency"). Every
+ * visit adds one to a directory's rank. Ranks decay once their total grows
+ * past `FRECENCY_MAX_TOTAL`, and directories whose rank decays below
+ * `FRECENCY_MIN_RANK` are forgotten, so the database stays small.
+ *
+ * Besides the map keyed by path, directories are kept in an array ordered by
+ * descending rank. A lookup walks it once, from the highest rank, and stops
+ * as soon as no later directory can outscore the matches already found, so
+ * a term matching well ranked directories is answered after a few of them.
+ *
+ * The database is kept in memory and saved to a binary file, see
+ * `frecency_save()`, which is loaded with a single read at startup.
+ */
+
+#ifndef FRECENCY_H_
+#define FRECENCY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "hashmap.h"
+
+/* Total rank past which every rank is decayed */
+#define FRECENCY_MAX_TOTAL 10000.0
+
+/* Factor every rank is multiplied by when decaying */
+#define FRECENCY_DECAY 0.9
+
+/* Rank below which a decayed directory is forgotten */
+#define FRECENCY_MIN_RANK 1.0
+
+/* Period of the timer that ages and saves the database */
+#define FRECENCY_AGE_INTERVAL_MS (60 * 1000)
+
+/* Maximum number of matches a lookup returns, in case the best are gone */
+#define FRECENCY_CANDIDATES 4
+
+/**
+ * @brief Structure representing a visited directory.
+ */
+struct dir_entry {
+    double rank;       /**<< Number of visits, decayed over time */
+    int64_t last_seen; /**<< Time of the last visit, seconds since the epoch */
+    uint16_t base;     /**<< Offset of the last component in `path` */
+    uint16_t len;      /**<< Length of `path` */
+    uint32_t index;    /**<< Position in the rank order */
+    const char *path;  /**<< Interned, see intern.h */
+};
+
+/**
+ * @brief Structure representing the database.
+ */
+struct frecency {
+    struct hashmap dirs;       /**<< Map of `struct dir_entry`, keyed by path */
+    struct dir_entry **ranked; /**<< Directories by descending rank */
+    uint32_t n_ranked;         /**<< Number of directories in `ranked` */
+    uint32_t ranked_size;      /**<< Capacity of `ranked` */
+    double total_rank;         /**<< Sum of the ranks of all directories */
+    bool dirty;                /**<< Whether there are changes not yet saved */
+};
+
+/**
+ * @brief Initialises an empty database.
+ *
+ * @param f Pointer to the database.
+ */
+void frecency_init(struct frecency *f);
+
+/**
+ * @brief Removes all directories from the database and releases its storage.
+ *
+ * @param f Pointer to the database.
+ */
+void frecency_deinit(struct frecency *f);
+
+/**
+ * @brief Records a visit to a directory.
+ *
+ * @param f Pointer to the database.
+ * @param path The directory, which is copied.
+ * @param now The time of the visit.
+ * @return 0 on success, non-zero on failure.
+ */
+int frecency_visit(struct frecency *f, const char *path, time_t now);
+
+/**
+ * @brief Finds the highest ranked directories matching a query term.
+ *
+ * A directory matches if its last component contains `term`, or if `term`
+ * contains a '/' and the whole path contains it. Directories are ranked by
+ * their rank, weighted by how long ago they were last visited. The caller
+ * checks that the matches still exist, and forgets those that do not with
+ * `frecency_forget()`.
+ *
+ * @param f Pointer to the database.
+ * @param term The query term.
+ * @param now The current time.
+ * @param paths Set to the paths of the matches, best first. They are
+ *              interned and valid until the database is next changed.
+ * @param n Size of `paths`, at most `FRECENCY_CANDIDATES`.
+ * @return The number of matches.
+ */
+int frecency_best(struct frecency *f, const char *term, time_t now,
+                  const char **paths, int n);
+
+/**
+ * @brief Forgets a directory that no longer exists.
+ *
+ * @param f Pointer to the database.
+ * @param path The directory. Nothing happens if it is not known.
+ */
+void frecency_forget(struct frecency *f, const char *path);
+
+/**
+ * @brief Decays every rank if their total is past `FRECENCY_MAX_TOTAL`.
+ *
+ * @param f Pointer to the database.
+ */
+void frecency_age(struct frecency *f);
+
+/**
+ * @brief Loads the database from a file, adding to what is in memory.
+ *
+ * @param f Pointer to the database.
+ * @param path Path of the database file.
+ * @return 0 on success, non-zero if the file cannot be read or is malformed.
+ */
+int frecency_load(struct frecency *f, const char *path);
+
+/**
+ * @brief Saves the database to a file.
+ *
+ * The file is a header holding a magic number, a format version and the
+ * number of directories, followed by one record per directory: its rank, its
+ * last visit time, a 16-bit path length and the path. The file is built in
+ * memory and written by the writer thread, see writer.h, to a temporary file
+ * which is then renamed over `path`, so a crash never leaves a partial
+ * database behind. If the write fails, the database is marked dirty again.
+ *
+ * @param f Pointer to the database.
+ * @param path Path of the database file.
+ * @return 0 if the write is queued, non-zero on failure.
+ */
+int frecency_save(struct frecency *f, const char *path);
+
+#endif /* FRECENCY_H_ */
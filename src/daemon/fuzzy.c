@@ -0,0 +1,334 @@
+/**
+ * @file fuzzy.c
+ * @brief Implementation of the fuzzy matcher.
+ *
+ * This file implements compiling patterns, the scalar, SSE2 and AVX2
+ * prefilters, and the scorer. The vector prefilters are compiled for their
+ * instruction set with function attributes and selected at runtime, so the
+ * daemon still runs on CPUs without AVX2.
+ *
+ * The scorer follows fzf's first algorithm: it finds the first window of the
+ * candidate holding the pattern as a subsequence, shrinks it from the back,
+ * and scores the characters in the window.
+ */
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include "fuzzy.h"
+
+#define SCORE_MATCH 16
+#define SCORE_GAP_START -3
+#define SCORE_GAP_EXTENSION -1
+
+/* Bonus for a match at the start of a path component */
+#define BONUS_SLASH 9
+
+/* Bonus for a match after any other delimiter, or of a delimiter */
+#define BONUS_BOUNDARY 8
+
+/* Bonus for a match at a lower to upper case or a letter to digit change */
+#define BONUS_CAMEL 7
+
+/* Minimum bonus for a match following another match */
+#define BONUS_CONSECUTIVE (-(SCORE_GAP_START + SCORE_GAP_EXTENSION))
+
+/* The bonus of the first character of the pattern counts this many times */
+#define BONUS_FIRST_MULTIPLIER 2
+
+enum char_class {
+    CLASS_SLASH,
+    CLASS_DELIM,
+    CLASS_LOWER,
+    CLASS_UPPER,
+    CLASS_DIGIT,
+};
+
+static enum char_class char_class(unsigned char c)
+{
+    if (c == '/') {
+        return CLASS_SLASH;
+    } else if (c >= 'a' && c <= 'z') {
+        return CLASS_LOWER;
+    } else if (c >= 'A' && c <= 'Z') {
+        return CLASS_UPPER;
+    } else if (c >= '0' && c <= '9') {
+        return CLASS_DIGIT;
+    } else if (c >= 0x80) {
+        /* Treat bytes of multibyte characters as letters */
+        return CLASS_LOWER;
+    }
+
+    return CLASS_DELIM;
+}
+
+static int bonus(enum char_class prev, enum char_class cur)
+{
+    if (cur == CLASS_SLASH || cur == CLASS_DELIM) {
+        return BONUS_BOUNDARY;
+    } else if (prev == CLASS_SLASH) {
+        return BONUS_SLASH;
+    } else if (prev == CLASS_DELIM) {
+        return BONUS_BOUNDARY;
+    } else if ((prev == CLASS_LOWER && cur == CLASS_UPPER) ||
+               (prev != CLASS_DIGIT && cur == CLASS_DIGIT)) {
+        return BONUS_CAMEL;
+    }
+
+    return 0;
+}
+
+static inline unsigned char fold(const struct fuzzy_pattern *p,
+                                 unsigned char c)
+{
+    if (p->ignore_case && c >= 'A' && c <= 'Z') {
+        return c | 0x20;
+    }
+
+    return c;
+}
+
+/*
+ * The prefilters fold case by setting bit 5 of every byte, which is cheap to
+ * vectorise. Besides folding letters it also merges a few punctuation pairs,
+ * such as '_' and DEL, which only lets through extra candidates for the
+ * scorer to reject.
+ */
+
+static bool prefilter_scalar(const struct fuzzy_pattern *p, const char *s,
+                             size_t len)
+{
+    uint32_t all = (1u << p->n_set) - 1;
+    uint32_t found = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        found |= p->set_bits[(unsigned char)s[i]];
+        if ((i & 15) == 15 && found == all) {
+            return true;
+        }
+    }
+
+    return found == all;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2"))) static bool
+prefilter_sse2(const struct fuzzy_pattern *p, const char *s, size_t len)
+{
+    __m128i needles[FUZZY_SET_MAX];
+    __m128i fold_bits, chunk, eq;
+    uint32_t all = (1u << p->n_set) - 1;
+    uint32_t found = 0;
+    unsigned char tail[16];
+    size_t offset;
+    int i;
+
+    fold_bits = _mm_set1_epi8(p->ignore_case ? 0x20 : 0);
+    for (i = 0; i < p->n_set; i++) {
+        needles[i] = _mm_set1_epi8((char)p->set[i]);
+    }
+
+    for (offset = 0; offset < len; offset += 16) {
+        if (len - offset >= 16) {
+            chunk = _mm_loadu_si128((const __m128i *)(s + offset));
+        } else {
+            /* Never read past the end of the candidate */
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, s + offset, len - offset);
+            chunk = _mm_loadu_si128((const __m128i *)tail);
+        }
+        chunk = _mm_or_si128(chunk, fold_bits);
+
+        for (i = 0; i < p->n_set; i++) {
+            eq = _mm_cmpeq_epi8(chunk, needles[i]);
+            found |= (uint32_t)(_mm_movemask_epi8(eq) != 0) << i;
+        }
+        if (found == all) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+__attribute__((target("avx2"))) static bool
+prefilter_avx2(const struct fuzzy_pattern *p, const char *s, size_t len)
+{
+    __m256i needles[FUZZY_SET_MAX];
+    __m256i fold_bits, chunk, eq;
+    uint32_t all = (1u << p->n_set) - 1;
+    uint32_t found = 0;
+    unsigned char tail[32];
+    size_t offset;
+    int i;
+
+    fold_bits = _mm256_set1_epi8(p->ignore_case ? 0x20 : 0);
+    for (i = 0; i < p->n_set; i++) {
+        needles[i] = _mm256_set1_epi8((char)p->set[i]);
+    }
+
+    for (offset = 0; offset < len; offset += 32) {
+        if (len - offset >= 32) {
+            chunk = _mm256_loadu_si256((const __m256i *)(s + offset));
+        } else {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, s + offset, len - offset);
+            chunk = _mm256_loadu_si256((const __m256i *)tail);
+        }
+        chunk = _mm256_or_si256(chunk, fold_bits);
+
+        for (i = 0; i < p->n_set; i++) {
+            eq = _mm256_cmpeq_epi8(chunk, needles[i]);
+            found |= (uint32_t)(_mm256_movemask_epi8(eq) != 0) << i;
+        }
+        if (found == all) {
+            return true;
+        }
+    }
+
+    return false;
+}
+#endif
+
+int fuzzy_set_impl(struct fuzzy_pattern *p, enum fuzzy_impl impl)
+{
+    switch (impl) {
+    case FUZZY_IMPL_SCALAR:
+        p->prefilter = prefilter_scalar;
+        return 0;
+#ifdef HAVE_X86_SIMD
+    case FUZZY_IMPL_SSE2:
+        if (__builtin_cpu_supports("sse2")) {
+            p->prefilter = prefilter_sse2;
+            return 0;
+        }
+        break;
+    case FUZZY_IMPL_AVX2:
+        if (__builtin_cpu_supports("avx2")) {
+            p->prefilter = prefilter_avx2;
+            return 0;
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+
+    return 1;
+}
+
+int fuzzy_compile(struct fuzzy_pattern *p, const char *pattern)
+{
+    unsigned char c;
+    size_t len;
+    int b, i;
+
+    len = strlen(pattern);
+    if (len == 0 || len > FUZZY_PATTERN_MAX) {
+        return 1;
+    }
+
+    memset(p, 0, sizeof(*p));
+    p->len = len;
+    p->ignore_case = true;
+    for (i = 0; i < (int)len; i++) {
+        if (pattern[i] >= 'A' && pattern[i] <= 'Z') {
+            p->ignore_case = false;
+        }
+    }
+
+    for (i = 0; i < (int)len; i++) {
+        p->chars[i] = fold(p, pattern[i]);
+
+        c = p->ignore_case ? p->chars[i] | 0x20 : p->chars[i];
+        if (memchr(p->set, c, p->n_set) == NULL && p->n_set < FUZZY_SET_MAX) {
+            p->set[p->n_set++] = c;
+        }
+    }
+
+    for (b = 0; b < 256; b++) {
+        c = p->ignore_case ? b | 0x20 : b;
+        for (i = 0; i < p->n_set; i++) {
+            if (c == p->set[i]) {
+                p->set_bits[b] |= 1u << i;
+            }
+        }
+    }
+
+    if (fuzzy_set_impl(p, FUZZY_IMPL_AVX2) &&
+        fuzzy_set_impl(p, FUZZY_IMPL_SSE2)) {
+        fuzzy_set_impl(p, FUZZY_IMPL_SCALAR);
+    }
+
+    return 0;
+}
+
+bool fuzzy_score(const struct fuzzy_pattern *p, const char *s, size_t len,
+                 int *score)
+{
+    enum char_class prev, cur;
+    size_t start, end, i, j;
+    int first_bonus = 0;
+    int consecutive = 0;
+    bool in_gap = false;
+    int total = 0;
+    int b;
+
+    /* Find where the first occurrence of the pattern ends */
+    for (i = 0, j = 0; i < len; i++) {
+        if (fold(p, s[i]) == (unsigned char)p->chars[j] && ++j == p->len) {
+            break;
+        }
+    }
+    if (j < p->len) {
+        return false;
+    }
+    end = i + 1;
+
+    /* Walk back from there to find the shortest window holding it */
+    for (i = end, j = p->len; j > 0; i--) {
+        if (fold(p, s[i - 1]) == (unsigned char)p->chars[j - 1]) {
+            j--;
+        }
+    }
+    start = i;
+
+    prev = start > 0 ? char_class(s[start - 1]) : CLASS_SLASH;
+    for (i = start, j = 0; i < end; i++) {
+        cur = char_class(s[i]);
+
+        if (j < p->len && fold(p, s[i]) == (unsigned char)p->chars[j]) {
+            total += SCORE_MATCH;
+            b = bonus(prev, cur);
+            if (consecutive == 0) {
+                first_bonus = b;
+            } else {
+                /* A run keeps the bonus of the boundary it started at */
+                if (b >= BONUS_BOUNDARY && b > first_bonus) {
+                    first_bonus = b;
+                }
+                b = b > first_bonus ? b : first_bonus;
+                b = b > BONUS_CONSECUTIVE ? b : BONUS_CONSECUTIVE;
+            }
+            total += j == 0 ? b * BONUS_FIRST_MULTIPLIER : b;
+            in_gap = false;
+            consecutive++;
+            j++;
+        } else {
+            total += in_gap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+            in_gap = true;
+            consecutive = 0;
+            first_bonus = 0;
+        }
+
+        prev = cur;
+    }
+
+    *score = total;
+    return true;
+}
@@ -0,0 +1,110 @@
+/**
+ * @file fuzzy.h
+ * @brief Fuzzy (subsequence) matching of tags and paths.
+ *
+ * This header defines a fuzzy matcher in the style of fzf: a candidate
+ * matches a pattern if the pattern's characters appear in it in order, not
+ * necessarily next to each other. Matches are scored so that characters
+ * matched at the start of a word or path component, and runs of consecutive
+ * characters, rank higher than matches scattered across gaps.
+ *
+ * Matching a candidate takes two steps. A prefilter first rejects candidates
+ * that do not contain every distinct character of the pattern, comparing 16
+ * or 32 bytes at a time with SSE2 or AVX2 where the CPU supports it. Only the
+ * candidates that survive are scored, by a scalar pass over the candidate.
+ *
+ * Patterns without upper case letters match case insensitively.
+ */
+
+#ifndef FUZZY_H_
+#define FUZZY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Maximum length of a pattern */
+#define FUZZY_PATTERN_MAX 64
+
+/* Maximum number of distinct pattern characters checked by the prefilter */
+#define FUZZY_SET_MAX 16
+
+/**
+ * @brief Implementations of the prefilter.
+ */
+enum fuzzy_impl {
+    FUZZY_IMPL_SCALAR,
+    FUZZY_IMPL_SSE2,
+    FUZZY_IMPL_AVX2,
+};
+
+struct fuzzy_pattern;
+
+/**
+ * @brief Function checking whether a candidate may match a pattern.
+ */
+typedef bool (*fuzzy_prefilter_func)(const struct fuzzy_pattern *p,
+                                     const char *s, size_t len);
+
+/**
+ * @brief Structure representing a compiled pattern.
+ */
+struct fuzzy_pattern {
+    char chars[FUZZY_PATTERN_MAX]; /**<< Folded if `ignore_case` */
+    size_t len;
+    bool ignore_case;
+
+    /* Distinct characters of the pattern, folded if `ignore_case` */
+    unsigned char set[FUZZY_SET_MAX];
+    int n_set;
+    uint32_t set_bits[256]; /**<< Bit i set for the bytes matching `set[i]` */
+
+    fuzzy_prefilter_func prefilter;
+};
+
+/**
+ * @brief Compiles a pattern, using the fastest prefilter the CPU supports.
+ *
+ * @param p Pointer to the compiled pattern.
+ * @param pattern The pattern, of 1 to `FUZZY_PATTERN_MAX` bytes.
+ * @return 0 on success, non-zero if the pattern is empty or too long.
+ */
+int fuzzy_compile(struct fuzzy_pattern *p, const char *pattern);
+
+/**
+ * @brief Selects the prefilter implementation used by a compiled pattern.
+ *
+ * @param p Pointer to the compiled pattern.
+ * @param impl The implementation.
+ * @return 0 on success, non-zero if the CPU does not support it.
+ */
+int fuzzy_set_impl(struct fuzzy_pattern *p, enum fuzzy_impl impl);
+
+/**
+ * @brief Scores a candidate without running the prefilter.
+ *
+ * @param p Pointer to the compiled pattern.
+ * @param s The candidate.
+ * @param len Length of `s`.
+ * @param score Set to the score of the match, higher is better.
+ * @return true if the candidate matches, false otherwise.
+ */
+bool fuzzy_score(const struct fuzzy_pattern *p, const char *s, size_t len,
+                 int *score);
+
+/**
+ * @brief Matches and scores a candidate.
+ *
+ * @param p Pointer to the compiled pattern.
+ * @param s The candidate.
+ * @param len Length of `s`.
+ * @param score Set to the score of the match, higher is better.
+ * @return true if the candidate matches, false otherwise.
+ */
+static inline bool fuzzy_match(const struct fuzzy_pattern *p, const char *s,
+                               size_t len, int *score)
+{
+    return p->prefilter(p, s, len) && fuzzy_score(p, s, len, score);
+}
+
+#endif /* FUZZY_H_ */
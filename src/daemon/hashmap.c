@@ -0,0 +1,239 @@
+/**
+ * @file hashmap.c
+ * @brief Hash map ADT implementation
+ *
+ * This file provides the implementation of the insertion-ordered hash map
+ * ADT. Holes in the dense array are only reclaimed when the map is rebuilt,
+ * so the number of occupied and tombstoned index slots never exceeds
+ * `cap_entries`. As `cap_entries` is three quarters of `n_buckets`, probe
+ * sequences always terminate at an empty slot.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+#define INDEX_EMPTY     0
+#define INDEX_TOMBSTONE UINT32_MAX
+
+#define MIN_BUCKETS 16
+
+uint32_t hash_string(void *key)
+{
+    const unsigned char *p = (const unsigned char *)key;
+    uint32_t h = 2166136261u;
+
+    while (*p) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+uint32_t hash_int(void *key)
+{
+    uint32_t h = (uint32_t)*(int *)key;
+
+    /* Finaliser from MurmurHash3 */
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+
+    return h;
+}
+
+/**
+ * @brief Rebuilds the map with `n_buckets` index slots.
+ *
+ * Holes are removed from the dense array and the index is rebuilt from
+ * scratch, which also clears every tombstone.
+ */
+static int rebuild(struct hashmap *m, uint32_t n_buckets)
+{
+    struct hashmap_entry *entries;
+    uint32_t *index;
+    uint32_t cap, i, j, slot, mask;
+
+    cap = n_buckets - n_buckets / 4;
+
+    index = (uint32_t *)calloc(n_buckets, sizeof(uint32_t));
+    if (index == NULL) {
+        return 1;
+    }
+
+    entries = (struct hashmap_entry *)malloc(cap * sizeof(*entries));
+    if (entries == NULL) {
+        free(index);
+        return 1;
+    }
+
+    mask = n_buckets - 1;
+    for (i = 0, j = 0; i < m->n_entries; i++) {
+        if (m->entries[i].data == NULL) {
+            continue;
+        }
+
+        entries[j] = m->entries[i];
+
+        slot = entries[j].hash & mask;
+        while (index[slot] != INDEX_EMPTY) {
+            slot = (slot + 1) & mask;
+        }
+        index[slot] = j + 1;
+        j++;
+    }
+
+    free(m->entries);
+    free(m->index);
+
+    m->entries = entries;
+    m->n_entries = j;
+    m->cap_entries = cap;
+    m->index = index;
+    m->n_buckets = n_buckets;
+
+    return 0;
+}
+
+/**
+ * @brief Finds the index slot holding the data matching `key`.
+ *
+ * @return The slot, or `INDEX_TOMBSTONE` if no matching data is found.
+ */
+static uint32_t find_slot(struct hashmap *m, void *key, uint32_t hash)
+{
+    struct hashmap_entry *entry;
+    uint32_t slot, mask;
+
+    if (m->n_buckets == 0) {
+        return INDEX_TOMBSTONE;
+    }
+
+    mask = m->n_buckets - 1;
+    for (slot = hash & mask; m->index[slot] != INDEX_EMPTY;
+         slot = (slot + 1) & mask) {
+        if (m->index[slot] == INDEX_TOMBSTONE) {
+            continue;
+        }
+
+        entry = &m->entries[m->index[slot] - 1];
+        if (entry->hash == hash && !m->compare_func(entry->data, key)) {
+            return slot;
+        }
+    }
+
+    return INDEX_TOMBSTONE;
+}
+
+void *hashmap_get(struct hashmap *m, void *key)
+{
+    uint32_t slot;
+
+    slot = find_slot(m, key, m->hash_func(key));
+    if (slot == INDEX_TOMBSTONE) {
+        return NULL;
+    }
+
+    return m->entries[m->index[slot] - 1].data;
+}
+
+int hashmap_insert(struct hashmap *m, void *key, void *data)
+{
+    uint32_t hash, slot, mask, n_buckets;
+
+    if (data == NULL) {
+        return 1;
+    }
+
+    /* Out of room: compact if half the entries are holes, otherwise grow */
+    if (m->n_entries == m->cap_entries) {
+        n_buckets = (m->n_buckets == 0) ? MIN_BUCKETS : m->n_buckets;
+        if ((uint32_t)m->n_items >= m->n_entries / 2) {
+            n_buckets *= 2;
+        }
+
+        if (rebuild(m, n_buckets)) {
+            return 1;
+        }
+    }
+
+    hash = m->hash_func(key);
+    mask = m->n_buckets - 1;
+
+    slot = hash & mask;
+    while (m->index[slot] != INDEX_EMPTY &&
+           m->index[slot] != INDEX_TOMBSTONE) {
+        slot = (slot + 1) & mask;
+    }
+
+    m->entries[m->n_entries].hash = hash;
+    m->entries[m->n_entries].data = data;
+    m->n_entries++;
+    m->index[slot] = m->n_entries;
+    m->n_items++;
+
+    return 0;
+}
+
+int hashmap_delete(struct hashmap *m, void *key)
+{
+    struct hashmap_entry *entry;
+    uint32_t slot;
+
+    slot = find_slot(m, key, m->hash_func(key));
+    if (slot == INDEX_TOMBSTONE) {
+        return 1;
+    }
+
+    entry = &m->entries[m->index[slot] - 1];
+    m->cleanup_func(entry->data);
+    entry->data = NULL;
+
+    m->index[slot] = INDEX_TOMBSTONE;
+    m->n_items--;
+
+    return 0;
+}
+
+int hashmap_delete_all(struct hashmap *m)
+{
+    uint32_t i;
+
+    for (i = 0; i < m->n_entries; i++) {
+        if (m->entries[i].data != NULL) {
+            m->cleanup_func(m->entries[i].data);
+        }
+    }
+
+    free(m->entries);
+    free(m->index);
+
+    m->entries = NULL;
+    m->n_entries = 0;
+    m->cap_entries = 0;
+    m->index = NULL;
+    m->n_buckets = 0;
+    m->n_items = 0;
+
+    return 0;
+}
+
+void *hashmap_next(struct hashmap *m, uint32_t *iter)
+{
+    void *data;
+
+    while (*iter < m->n_entries) {
+        data = m->entries[*iter].data;
+        (*iter)++;
+
+        if (data != NULL) {
+            return data;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,123 @@
+/**
+ * @file hashmap.h
+ * @brief Hash map Abstract Data Type (ADT) interface.
+ *
+ * This file defines the interface for an insertion-ordered hash map ADT. Data
+ * is stored in a dense array in insertion order, and located through an
+ * open-addressing (linear probing) index of the array. Iterating the map
+ * therefore visits data in the order it was inserted.
+ *
+ * Like the list ADT, the map stores `void *` data, and relies on user provided
+ * hash, comparison and cleanup functions. The map allocates its storage
+ * lazily, so a zeroed map with its function pointers set is ready for use.
+ */
+
+#ifndef HASHMAP_H_
+#define HASHMAP_H_
+
+#include <stdint.h>
+
+/**
+ * @brief Structure representing an entry in the map's dense array.
+ */
+struct hashmap_entry {
+    uint32_t hash;
+    void *data; /**<< `NULL` if the entry has been deleted */
+};
+
+/**
+ * @brief Structure representing the hash map.
+ *
+ * `entries` holds the data in insertion order, including holes left by
+ * deletions. `index` holds `n_buckets` slots, each of which is empty, a
+ * tombstone, or the position of an entry plus one.
+ */
+struct hashmap {
+    struct hashmap_entry *entries;
+    uint32_t n_entries; /**<< Entries in use, including holes */
+    uint32_t cap_entries;
+
+    uint32_t *index;
+    uint32_t n_buckets; /**<< Always zero or a power of two */
+
+    int n_items;
+
+    uint32_t (*hash_func)(void *key);
+    int (*compare_func)(void *data, void *key);
+    int (*cleanup_func)(void *data);
+};
+
+/**
+ * @brief Hashes a NUL-terminated string.
+ *
+ * Suitable as a `hash_func` for maps keyed by strings.
+ *
+ * @param key Pointer to the string.
+ * @return The 32-bit FNV-1a hash of the string.
+ */
+uint32_t hash_string(void *key);
+
+/**
+ * @brief Hashes an integer.
+ *
+ * Suitable as a `hash_func` for maps keyed by integers, e.g. PIDs.
+ *
+ * @param key Pointer to the integer.
+ * @return A well mixed 32-bit hash of the integer.
+ */
+uint32_t hash_int(void *key);
+
+/**
+ * @brief Retrieves data from the map by key.
+ *
+ * @param m Pointer to the map.
+ * @param key Key to search for (compared against stored data).
+ * @return Pointer to the data, or `NULL` if no matching data is found.
+ */
+void *hashmap_get(struct hashmap *m, void *key);
+
+/**
+ * @brief Inserts data into the map.
+ *
+ * The data is placed after all existing data in iteration order. The caller
+ * must ensure that no data matching `key` is already present.
+ *
+ * @param m Pointer to the map.
+ * @param key Key for the data, used to compute its hash.
+ * @param data Pointer to the data to insert. Must not be `NULL`.
+ * @return 0 on success, non-zero on failure.
+ */
+int hashmap_insert(struct hashmap *m, void *key, void *data);
+
+/**
+ * @brief Deletes data from the map by key.
+ *
+ * The data is cleaned up using the map's `cleanup_func`.
+ *
+ * @param m Pointer to the map.
+ * @param key Key used to search for the data.
+ * @return 0 on success, non-zero if no matching data is found.
+ */
+int hashmap_delete(struct hashmap *m, void *key);
+
+/**
+ * @brief Removes all data from the map and releases its storage.
+ *
+ * @param m Pointer to the map.
+ * @return 0 on success, non-zero on failure.
+ */
+int hashmap_delete_all(struct hashmap *m);
+
+/**
+ * @brief Iterates over the map in insertion order.
+ *
+ * `iter` must be zero before the first call. Deleting the data most recently
+ * returned is permitted during iteration, inserting is not.
+ *
+ * @param m Pointer to the map.
+ * @param iter Pointer to the iteration cursor.
+ * @return Pointer to the next data, or `NULL` once iteration is complete.
+ */
+void *hashmap_next(struct hashmap *m, uint32_t *iter);
+
+#endif /* HASHMAP_H_ */
@@ -0,0 +1,122 @@
+/**
+ * @file intern.c
+ * @brief Implementation of the intern table.
+ *
+ * The table is a hash map keyed by string, holding `struct istr` entries
+ * allocated from the string arena.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "hashmap.h"
+#include "intern.h"
+#include "pool.h"
+
+static int compare_istr(void *data, void *key)
+{
+    return strcmp(((struct istr *)data)->str, (char *)key) != 0;
+}
+
+static int cleanup_istr(void *data)
+{
+    struct istr *is = (struct istr *)data;
+
+    arena_free(is, sizeof(*is) + is->len + 1);
+    return 0;
+}
+
+static struct hashmap table = {
+    .hash_func = hash_string,
+    .compare_func = compare_istr,
+    .cleanup_func = cleanup_istr,
+};
+
+static struct intern_stats stats;
+
+static struct istr *header(const char *s)
+{
+    return (struct istr *)(s - offsetof(struct istr, str));
+}
+
+const char *intern(const char *s)
+{
+    struct istr *is;
+    size_t len;
+
+    is = (struct istr *)hashmap_get(&table, (void *)s);
+    if (is != NULL) {
+        is->refs++;
+        stats.n_refs++;
+        return is->str;
+    }
+
+    len = strlen(s);
+    if (len > UINT32_MAX) {
+        return NULL;
+    }
+
+    is = (struct istr *)arena_alloc(sizeof(*is) + len + 1);
+    if (is == NULL) {
+        return NULL;
+    }
+    is->refs = 1;
+    is->len = len;
+    memcpy(is->str, s, len + 1);
+
+    if (hashmap_insert(&table, is->str, is)) {
+        cleanup_istr(is);
+        return NULL;
+    }
+
+    stats.n_strings++;
+    stats.n_refs++;
+    stats.bytes += len;
+
+    return is->str;
+}
+
+const char *intern_ref(const char *s)
+{
+    header(s)->refs++;
+    stats.n_refs++;
+
+    return s;
+}
+
+void intern_put(const char *s)
+{
+    struct istr *is;
+
+    if (s == NULL) {
+        return;
+    }
+
+    is = header(s);
+    stats.n_refs--;
+    if (--is->refs > 0) {
+        return;
+    }
+
+    stats.n_strings--;
+    stats.bytes -= is->len;
+
+    /* The map's cleanup frees the string, so look it up by itself */
+    hashmap_delete(&table, is->str);
+}
+
+uint32_t intern_len(const char *s)
+{
+    return header(s)->len;
+}
+
+void intern_stats_get(struct intern_stats *out)
+{
+    *out = stats;
+}
+
+void intern_deinit(void)
+{
+    hashmap_delete_all(&table);
+    memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,85 @@
+/**
+ * @file intern.h
+ * @brief Reference counted intern table for the paths held by the daemon.
+ *
+ * This header defines a table holding a single copy of every path the daemon
+ * stores, whether for a tag, an entry on a shell's action stack or a visited
+ * directory. Interning a path that is already known costs one hash probe and
+ * a reference count increment instead of a copy, and two interned paths are
+ * equal exactly when their pointers are.
+ *
+ * Each reference returned by `intern()` or `intern_ref()` must be released
+ * with `intern_put()`. A path is freed once its last reference is released.
+ */
+
+#ifndef INTERN_H_
+#define INTERN_H_
+
+#include <stdint.h>
+
+/**
+ * @brief Structure representing an interned string.
+ *
+ * Users only see `str`, the header is found from it.
+ */
+struct istr {
+    uint32_t refs; /**<< Number of references held */
+    uint32_t len;  /**<< Length of `str` */
+    char str[];
+};
+
+/**
+ * @brief Structure holding the intern table's counters.
+ */
+struct intern_stats {
+    uint32_t n_strings; /**<< Distinct strings in the table */
+    uint64_t n_refs;    /**<< References held across all strings */
+    uint64_t bytes;     /**<< Bytes of string data, excluding the NULs */
+};
+
+/**
+ * @brief Interns a string.
+ *
+ * @param s The string.
+ * @return A reference to the interned copy of `s`, or `NULL` on failure.
+ */
+const char *intern(const char *s);
+
+/**
+ * @brief Takes another reference to an interned string.
+ *
+ * @param s An interned string.
+ * @return `s`.
+ */
+const char *intern_ref(const char *s);
+
+/**
+ * @brief Releases a reference to an interned string.
+ *
+ * @param s An interned string, may be `NULL`.
+ */
+void intern_put(const char *s);
+
+/**
+ * @brief Returns the length of an interned string without scanning it.
+ *
+ * @param s An interned string.
+ * @return The length of `s`.
+ */
+uint32_t intern_len(const char *s);
+
+/**
+ * @brief Retrieves the intern table's counters.
+ *
+ * @param stats Set to the counters.
+ */
+void intern_stats_get(struct intern_stats *stats);
+
+/**
+ * @brief Frees every interned string and the table's storage.
+ *
+ * No reference may be used afterwards.
+ */
+void intern_deinit(void);
+
+#endif /* INTERN_H_ */
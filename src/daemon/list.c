@@ -2,16 +2,20 @@
  * @file list.c
  * @brief List ADT implementation
  *
- * This file provides the implementation of the singly-linked list ADT.
+ * This file provides the implementation of the singly-linked list ADT. Nodes
+ * are allocated from a slab pool.
  */
 
 #include <stdlib.h>
 
 #include "list.h"
+#include "pool.h"
+
+static struct slab_pool node_pool = SLAB_POOL_INIT("list node", struct node);
 
 int list_node_create(struct node **n)
 {
-    *n = malloc(sizeof(struct node));
+    *n = (struct node *)pool_alloc(&node_pool);
     if (*n == NULL) {
         return 1;
     }
@@ -73,7 +77,7 @@ int list_delete_node(struct list *l, void *key)
         curr = l->head;
         l->cleanup_func(curr->data);
         l->head = l->head->next;
-        free(curr);
+        pool_free(&node_pool, curr);
         l->n_items--;
         return 0;
     }
@@ -88,7 +92,7 @@ int list_delete_node(struct list *l, void *key)
             }
 
             l->cleanup_func(curr->data);
-            free(curr);
+            pool_free(&node_pool, curr);
             l->n_items--;
             break;
         }
@@ -112,7 +116,7 @@ int list_delete_all(struct list *l)
     while (curr != NULL) {
         l->head = curr->next;
         l->cleanup_func(curr->data);
-        free(curr);
+        pool_free(&node_pool, curr);
         l->n_items--;
         curr = l->head;
     }
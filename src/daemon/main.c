@@ -9,78 +9,98 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <signal.h>
 
 #include "log.h"
-#include "commands.h"
+#include "pathstat.h"
+#include "event.h"
 #include "list.h"
+#include "intern.h"
+#include "pool.h"
+#include "server.h"
 #include "state.h"
 #include "shell.h"
 #include "tag.h"
 #include "utils.h"
+#include "writer.h"
 
 /* The maximum size of the socket paths. This value is limited by the size of
  * sockaddr_un->sun_path . */
 #define SOCKADDR_PATH_MAX sizeof(((struct sockaddr_un *)0)->sun_path)
 
-#define CONFIG_DIR_ENV_VAR "NAV_CONFIG_DIR"
-#define CACHE_DIR_ENV_VAR  "NAV_CACHE_DIR"
-
-#define DEFAULT_CONFIG_DIR  "/home/%s/.config/nav"
-#define DEFAULT_CACHE_DIR   "/home/%s/.cache/nav"
-#define DEFAULT_SOCKET_FILE "nav.sock"
-#define DEFAULT_TAG_FILE    "tags"
+#define CONFIG_DIR_ENV_VAR   "NAV_CONFIG_DIR"
+#define CACHE_DIR_ENV_VAR    "NAV_CACHE_DIR"
+#define ACTION_DEPTH_ENV_VAR "NAV_ACTION_DEPTH"
+
+#define DEFAULT_CONFIG_DIR    "/home/%s/.config/nav"
+#define DEFAULT_CACHE_DIR     "/home/%s/.cache/nav"
+#define DEFAULT_SOCKET_FILE   "nav.sock"
+#define DEFAULT_STREAM_FILE   "stream.sock"
+#define DEFAULT_TAG_FILE      "tags"
+#define DEFAULT_FRECENCY_FILE "frecency"
+
+/**
+ * @brief Logs how many records the pools handed out for how many heap
+ *        allocations.
+ */
+static void log_alloc_stats(void)
+{
+    struct intern_stats paths;
+    struct alloc_stats stats;
+
+    alloc_stats_get(&stats);
+    LOG_INF("%llu records allocated with %llu heap allocations, %llu live in "
+            "%llu bytes of slabs",
+            (unsigned long long)stats.pool_allocs,
+            (unsigned long long)stats.heap_allocs,
+            (unsigned long long)stats.live,
+            (unsigned long long)stats.slab_bytes);
+
+    intern_stats_get(&paths);
+    LOG_INF("%u paths interned, %llu references, %llu bytes",
+            paths.n_strings, (unsigned long long)paths.n_refs,
+            (unsigned long long)paths.bytes);
+
+    LOG_INF("%llu shells reaped after exiting",
+            (unsigned long long)get_state()->shells_reaped);
+}
 
-void handler(int signo, siginfo_t *info, void *context)
+/**
+ * @brief Finishes the requests waiting on path checks, queues any unsaved
+ * changes, then waits for the writer to finish.
+ */
+static void save_pending(struct state *state)
 {
-    struct state *state = get_state();
+    pathstat_deinit();
 
-    /* Remove the nav socket file on shutdown */
-    if (strlen(state->nav_socket_path) > 0) {
-        unlink(state->nav_socket_path);
+    if (state->journal.lost) {
+        tag_journal_compact(&state->journal);
+    }
+    if (state->frecency.dirty) {
+        frecency_save(&state->frecency, state->frecency_path);
     }
 
-    deinit_state();
-
-    _exit(EXIT_SUCCESS);
+    writer_deinit();
 }
 
-void loop(struct state *state)
+/**
+ * @brief Stops the event loop on SIGINT or SIGTERM.
+ *
+ * This function is an `event_func` callback for the signalfd. The daemon shuts
+ * down once the loop returns, outside of any signal handler.
+ */
+static void handle_signal(int fd, uint32_t events, void *ctx)
 {
-    int nbytes = 0;
-    char buf[100] = {0};
-    char *line, *pid_str, *cmd_str, *args;
-    char *saveptr;
-    int pid;
-
-    while (true) {
-        nbytes = recv(state->sfd, buf, 100, 0);
-        if (nbytes > 0) {
-            line = buf;
-            pid_str = strtok_r(line, " ", &saveptr);
-            if (pid_str == NULL) {
-                LOG_ERR("parser: Invalid pid arg.");
-                continue;
-            }
-
-            errno = 0;
-            pid = strtol(pid_str, NULL, 10);
-            if (errno) {
-                LOG_ERR("strol: %s", strerror(errno));
-                break;
-            }
-
-            cmd_str = strtok_r(NULL, " ", &saveptr);
-            if (cmd_str == NULL) {
-                LOG_ERR("parser: Invalid command.");
-                continue;
-            }
-
-            args = strtok_r(NULL, "", &saveptr);
-
-            dispatch_command(cmd_str, pid, args);
-        }
+    struct signalfd_siginfo info;
+
+    if (read(fd, &info, sizeof(info)) != sizeof(info)) {
+        return;
     }
+
+    LOG_INF("Received signal %u, shutting down", info.ssi_signo);
+    event_stop();
 }
 
 static int setup_directory(char *dest, size_t dest_size, const char *env_var,
@@ -126,12 +146,42 @@ static int setup_directory(char *dest, size_t dest_size, const char *env_var,
     return 0;
 }
 
+/**
+ * @brief Reads the number of actions kept per shell from the environment.
+ *
+ * @return The depth, or `ACTION_DEPTH_DEFAULT` if it is unset or invalid.
+ */
+static uint32_t get_action_depth(void)
+{
+    unsigned long depth;
+    char *temp_env;
+    char *end;
+
+    temp_env = getenv(ACTION_DEPTH_ENV_VAR);
+    if (temp_env == NULL) {
+        return ACTION_DEPTH_DEFAULT;
+    }
+
+    errno = 0;
+    depth = strtoul(temp_env, &end, 10);
+    if (errno || end == temp_env || *end != '\0' || depth == 0 ||
+        depth > ACTION_DEPTH_MAX) {
+        LOG_ERR("Invalid %s '%s', using %d", ACTION_DEPTH_ENV_VAR, temp_env,
+                ACTION_DEPTH_DEFAULT);
+        return ACTION_DEPTH_DEFAULT;
+    }
+
+    return depth;
+}
+
 static inline void setup_initial_state(struct state *state)
 {
     int err;
 
+    state->shells.hash_func = hash_int;
     state->shells.compare_func = compare_shell_pid;
     state->shells.cleanup_func = cleanup_shell;
+    state->tags.hash_func = hash_string;
     state->tags.compare_func = compare_tag_tag;
     state->tags.cleanup_func = cleanup_tag;
 
@@ -142,6 +192,9 @@ static inline void setup_initial_state(struct state *state)
     }
     LOG_INF("User is %s", state->uname);
 
+    state->action_depth = get_action_depth();
+    LOG_INF("Keeping %u actions per shell", state->action_depth);
+
     /* Setup config directory */
     if (setup_directory(state->config_dir, sizeof(state->config_dir),
                         CONFIG_DIR_ENV_VAR, DEFAULT_CONFIG_DIR, state->uname,
@@ -163,41 +216,160 @@ static inline void setup_initial_state(struct state *state)
         exit(EXIT_FAILURE);
     }
 
+    err = snprintf(state->stream_socket_path, sizeof(state->stream_socket_path),
+                   "%s/" DEFAULT_STREAM_FILE, state->cache_dir);
+    if (err >= SOCKADDR_PATH_MAX || err <= 0) {
+        LOG_ERR("Cannot get stream socket path.");
+        exit(EXIT_FAILURE);
+    }
+
     snprintf(state->tagfile_path, sizeof(state->tagfile_path),
              "%s/" DEFAULT_TAG_FILE, state->config_dir);
-    read_tag_file(&state->tags, state->tagfile_path);
+    read_tag_file(&state->tags, &state->tag_tree, state->tagfile_path);
+
+    /* Fold a long journal left by the last run into the tag file */
+    tag_journal_open(&state->journal, &state->tags, state->tagfile_path);
+    if (state->journal.size > TAG_JOURNAL_MAX) {
+        tag_journal_compact(&state->journal);
+    }
+
+    err = snprintf(state->frecency_path, sizeof(state->frecency_path),
+                   "%s/" DEFAULT_FRECENCY_FILE, state->config_dir);
+    if (err >= (int)sizeof(state->frecency_path) || err <= 0) {
+        LOG_ERR("Cannot get frecency database path.");
+        exit(EXIT_FAILURE);
+    }
+    frecency_load(&state->frecency, state->frecency_path);
 }
 
-static void register_signal_handlers(void)
+static void setup_snapshot(struct state *state)
 {
-    struct sigaction sa;
-    sa.sa_sigaction = &handler;
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+    /* Clients read tags from the snapshot, but can do without it */
+    snprintf(state->snapshot_path, sizeof(state->snapshot_path),
+             "%s/" SNAPSHOT_FILE, state->cache_dir);
+    if (snapshot_create(&state->snapshot, state->snapshot_path) == 0) {
+        publish_tag_snapshot(&state->tags, &state->snapshot);
+    }
 }
 
-static void setup_socket(struct state *state)
+/**
+ * @brief Ages the frecency database and saves it if it changed.
+ */
+static void age_frecency(void *ctx)
+{
+    struct state *state = get_state();
+
+    frecency_age(&state->frecency);
+    if (state->frecency.dirty) {
+        frecency_save(&state->frecency, state->frecency_path);
+    }
+}
+
+/**
+ * @brief Blocks the shutdown signals, which are read from a signalfd instead.
+ *
+ * This must be called before any thread is started, as threads inherit the
+ * signal mask and would otherwise be killed by the signals.
+ */
+static void block_signals(sigset_t *mask)
 {
+    sigemptyset(mask);
+    sigaddset(mask, SIGINT);
+    sigaddset(mask, SIGTERM);
+
+    if (sigprocmask(SIG_BLOCK, mask, NULL)) {
+        LOG_ERR("sigprocmask: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Creates a socket of `type` bound to `path`.
+ *
+ * Datagram sockets have `SO_PASSCRED` enabled so every request carries its
+ * sender's credentials, stream sockets are left listening for connections.
+ *
+ * @return The socket file descriptor, or -1 on failure.
+ */
+static int open_socket(int type, const char *path, bool abstract)
+{
+    int fd;
     int err;
-    struct sockaddr_un nav_addr;
+    socklen_t len;
+    struct sockaddr_un addr;
 
-    /* Create datagram socket for receiving messages from shells */
-    state->sfd = socket(AF_UNIX, SOCK_DGRAM, 0);
-    if (state->sfd == -1) {
+    len = set_socket_address(&addr, path, abstract);
+    if (len == 0) {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
         LOG_ERR("socket: %s", strerror(errno));
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    /* Bind socket, setting default dest addr */
-    unlink(state->nav_socket_path);
-    nav_addr.sun_family = AF_UNIX;
-    memcpy(nav_addr.sun_path, state->nav_socket_path, SOCKADDR_PATH_MAX);
-    err = bind(state->sfd, (struct sockaddr *)&nav_addr, sizeof(nav_addr));
+    /* Have the kernel attach sender credentials to every request */
+    if (type == SOCK_DGRAM) {
+        err = setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &(int){1}, sizeof(int));
+        if (err == -1) {
+            LOG_ERR("setsockopt: %s", strerror(errno));
+            goto close;
+        }
+    }
+
+    if (!abstract) {
+        unlink(path);
+    }
+
+    err = bind(fd, (struct sockaddr *)&addr, len);
     if (err == -1) {
-        LOG_ERR("bind: %s", strerror(errno));
+        LOG_ERR("bind: %s '%s%s'", strerror(errno), abstract ? "@" : "",
+                path);
+        goto close;
+    }
+
+    if (type == SOCK_SEQPACKET) {
+        err = listen(fd, SOMAXCONN);
+        if (err == -1) {
+            LOG_ERR("listen: %s", strerror(errno));
+            goto close;
+        }
+    }
+
+    LOG_INF("Socket created: %s%s", abstract ? "@" : "", path);
+    return fd;
+
+close:
+    close(fd);
+    return -1;
+}
+
+static void setup_socket(struct state *state)
+{
+    /* Datagram socket for receiving messages from shells */
+    state->sfd = open_socket(SOCK_DGRAM, state->nav_socket_path, false);
+    if (state->sfd == -1) {
         exit(EXIT_FAILURE);
     }
-    LOG_INF("Socket created: %s", state->nav_socket_path);
+
+    /* Stream socket for long-lived client connections */
+    state->lfd = open_socket(SOCK_SEQPACKET, state->stream_socket_path, false);
+    if (state->lfd == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (!use_abstract_sockets()) {
+        return;
+    }
+
+    /* The same sockets in the abstract namespace, named after their paths.
+     * Clients that can't reach these fall back to the pathname sockets, so
+     * failing to create them is not fatal. */
+    state->abstract_sfd = open_socket(SOCK_DGRAM, state->nav_socket_path,
+                                      true);
+    state->abstract_lfd = open_socket(SOCK_SEQPACKET,
+                                      state->stream_socket_path, true);
 }
 
 void print_usage(const char *program_name)
@@ -226,22 +398,97 @@ static void parse_args(int argc, char **argv)
 int main(int argc, char **argv)
 {
     struct state *state;
+    sigset_t mask;
+    int sigfd;
 
     parse_args(argc, argv);
+    block_signals(&mask);
 
     if (init_state()) {
         exit(EXIT_FAILURE);
     }
     state = get_state();
 
+    /* Started first, as loading the state checks paths and queues writes */
+    if (writer_init() || pathstat_init()) {
+        exit(EXIT_FAILURE);
+    }
+
     setup_initial_state(state);
     setup_socket(state);
-    register_signal_handlers();
+    setup_snapshot(state);
+
+    if (event_init()) {
+        exit(EXIT_FAILURE);
+    }
+
+    sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd == -1) {
+        LOG_ERR("signalfd: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    loop(state);
+    if (event_add_fd(sigfd, EPOLLIN, handle_signal, NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (event_add_timer(FRECENCY_AGE_INTERVAL_MS, age_frecency, NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (event_add_fd(writer_completion_fd(), EPOLLIN,
+                     writer_handle_completions, NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (event_add_fd(pathstat_completion_fd(), EPOLLIN,
+                     pathstat_handle_events, NULL) ||
+        event_add_fd(pathstat_timer_fd(), EPOLLIN, pathstat_handle_events,
+                     NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (event_add_fd(state->sfd, EPOLLIN, server_handle_datagrams, NULL)) {
+        exit(EXIT_FAILURE);
+    }
 
+    if (event_add_fd(state->lfd, EPOLLIN, server_handle_connections, NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (state->abstract_sfd != -1 &&
+        event_add_fd(state->abstract_sfd, EPOLLIN, server_handle_datagrams,
+                     NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (state->abstract_lfd != -1 &&
+        event_add_fd(state->abstract_lfd, EPOLLIN, server_handle_connections,
+                     NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    event_loop();
+
+    /* Remove the nav socket files on shutdown */
     unlink(state->nav_socket_path);
+    unlink(state->stream_socket_path);
+
+    /* Tell clients mapping the snapshot to ask the daemon instead */
+    snapshot_destroy(&state->snapshot, state->snapshot_path);
+    save_pending(state);
+    log_alloc_stats();
+    server_deinit();
     close(state->sfd);
+    close(state->lfd);
+    if (state->abstract_sfd != -1) {
+        close(state->abstract_sfd);
+    }
+    if (state->abstract_lfd != -1) {
+        close(state->abstract_lfd);
+    }
+    close(sigfd);
+    event_deinit();
     deinit_state();
 
     return 0;
@@ -0,0 +1,111 @@
+/**
+ * @file metrics.c
+ * @brief Implementation of the request counters and latency histograms.
+ */
+
+#include <time.h>
+
+#include "metrics.h"
+#include "protocol.h"
+
+static struct op_metrics ops[PROTO_OP_NUM];
+static struct server_metrics server;
+
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Finds the bucket counting a latency.
+ */
+static int bucket(uint64_t ns)
+{
+    int b;
+
+    if (ns < (UINT64_C(1) << METRICS_MIN_SHIFT)) {
+        return 0;
+    }
+
+    b = 63 - __builtin_clzll(ns) - METRICS_MIN_SHIFT + 1;
+    return b < METRICS_BUCKETS ? b : METRICS_BUCKETS - 1;
+}
+
+void metrics_record(int opcode, uint64_t start_ns,
+                    enum metrics_outcome outcome)
+{
+    struct op_metrics *op = &ops[opcode];
+    uint64_t ns = metrics_now() - start_ns;
+
+    op->requests++;
+    op->bad += outcome == METRICS_BAD;
+    op->dropped += outcome == METRICS_DROPPED;
+    op->total_ns += ns;
+    if (ns > op->max_ns) {
+        op->max_ns = ns;
+    }
+    op->buckets[bucket(ns)]++;
+}
+
+void metrics_record_malformed(void)
+{
+    server.malformed++;
+}
+
+void metrics_record_wakeup(uint32_t n)
+{
+    server.wakeups++;
+    server.received += n;
+    if (n > server.queued_max) {
+        server.queued_max = n;
+    }
+}
+
+const struct op_metrics *metrics_op(int opcode)
+{
+    return &ops[opcode];
+}
+
+const struct server_metrics *metrics_server(void)
+{
+    return &server;
+}
+
+uint64_t metrics_bucket_bound(int bucket)
+{
+    if (bucket == METRICS_BUCKETS - 1) {
+        return UINT64_MAX;
+    }
+
+    return UINT64_C(1) << (METRICS_MIN_SHIFT + bucket);
+}
+
+uint64_t metrics_percentile(const struct op_metrics *op, unsigned int percent)
+{
+    uint64_t rank, seen = 0;
+    uint64_t bound;
+    int b;
+
+    if (op->requests == 0) {
+        return 0;
+    }
+
+    /* Rank of the request at the percentile, counting from 1 */
+    rank = (op->requests * percent + 99) / 100;
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (b = 0; b < METRICS_BUCKETS - 1; b++) {
+        seen += op->buckets[b];
+        if (seen >= rank) {
+            break;
+        }
+    }
+
+    bound = metrics_bucket_bound(b);
+    return bound < op->max_ns ? bound : op->max_ns;
+}
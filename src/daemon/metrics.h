@@ -0,0 +1,128 @@
+/**
+ * @file metrics.h
+ * @brief Request counters and latency histograms.
+ *
+ * This header defines the counters the server keeps for every request it
+ * dispatches, reported by the `stats` command. Each opcode has a count of
+ * requests, of requests answered with "BAD" and of requests dropped without a
+ * reply, along with a histogram of their latencies. The histogram buckets
+ * double in width, so recording a latency is a couple of additions and a
+ * count of leading zeros, next to the two `clock_gettime()` calls timing it.
+ *
+ * The latency of a request runs from when it is dispatched until its reply is
+ * queued, including the wait for a deferred reply, see server.h.
+ *
+ * Every function runs on the event loop.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+
+/* Number of latency buckets. Bucket 0 counts latencies below
+ * 2^METRICS_MIN_SHIFT ns, bucket i > 0 those below 2^(METRICS_MIN_SHIFT + i)
+ * ns, and the last bucket every longer latency. */
+#define METRICS_BUCKETS   24
+#define METRICS_MIN_SHIFT 10
+
+/**
+ * @brief Enum representing how a request was answered.
+ */
+enum metrics_outcome {
+    METRICS_OK,
+    METRICS_BAD,     /**<< Answered with "BAD" */
+    METRICS_DROPPED, /**<< Never answered, e.g. sent for another's shell */
+};
+
+/**
+ * @brief Structure holding the counters of one opcode.
+ */
+struct op_metrics {
+    uint64_t requests;
+    uint64_t bad;
+    uint64_t dropped;
+    uint64_t total_ns; /**<< Sum of the latencies */
+    uint64_t max_ns;
+    uint64_t buckets[METRICS_BUCKETS];
+};
+
+/**
+ * @brief Structure holding the counters of the server.
+ */
+struct server_metrics {
+    uint64_t malformed;  /**<< Requests that could not be parsed */
+    uint64_t wakeups;    /**<< Times the nav socket was drained */
+    uint64_t received;   /**<< Datagrams drained from the nav socket */
+    uint32_t queued_max; /**<< Most datagrams drained in one wakeup */
+};
+
+/**
+ * @brief Reads the monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ */
+uint64_t metrics_now(void);
+
+/**
+ * @brief Records a request.
+ *
+ * @param opcode The request's opcode, below `PROTO_OP_NUM`.
+ * @param start_ns When the request was dispatched, see `metrics_now()`.
+ * @param outcome How it was answered.
+ */
+void metrics_record(int opcode, uint64_t start_ns,
+                    enum metrics_outcome outcome);
+
+/**
+ * @brief Records a request that could not be parsed.
+ */
+void metrics_record_malformed(void);
+
+/**
+ * @brief Records the number of datagrams drained in one wakeup.
+ *
+ * This is the depth the socket's receive queue had reached, as far as a
+ * wakeup drains it.
+ *
+ * @param n Number of datagrams.
+ */
+void metrics_record_wakeup(uint32_t n);
+
+/**
+ * @brief Returns the counters of an opcode.
+ *
+ * @param opcode The opcode, below `PROTO_OP_NUM`.
+ * @return The counters.
+ */
+const struct op_metrics *metrics_op(int opcode);
+
+/**
+ * @brief Returns the counters of the server.
+ *
+ * @return The counters.
+ */
+const struct server_metrics *metrics_server(void);
+
+/**
+ * @brief Returns the upper bound of a latency bucket.
+ *
+ * @param bucket The bucket, below `METRICS_BUCKETS`.
+ * @return The latency in nanoseconds, or `UINT64_MAX` for the last bucket.
+ */
+uint64_t metrics_bucket_bound(int bucket);
+
+/**
+ * @brief Estimates a latency percentile of an opcode.
+ *
+ * The estimate is the upper bound of the bucket holding the percentile, so
+ * it is at most twice the real latency. It never exceeds the largest latency
+ * recorded.
+ *
+ * @param op The counters of the opcode.
+ * @param percent The percentile, from 0 to 100.
+ * @return The latency in nanoseconds, or 0 if no request was recorded.
+ */
+uint64_t metrics_percentile(const struct op_metrics *op, unsigned int percent);
+
+#endif /* METRICS_H_ */
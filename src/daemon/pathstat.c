@@ -0,0 +1,671 @@
+/**
+ * @file pathstat.c
+ * @brief Implementation of asynchronous path validation.
+ *
+ * The cache is a hash map of entries keyed by interned path. An entry being
+ * checked holds the callbacks waiting for it and the job handed to the
+ * workers. The workers take jobs from a queue and put them on a done list,
+ * both protected by one mutex, and write an eventfd watched by the event
+ * loop. Deadlines are kept by a one-shot timerfd armed for the earliest one.
+ *
+ * A job whose check timed out stays attached to its entry until its `stat()`
+ * returns, which is how stuck paths and workers are recognised. The workers
+ * copy the path out of the job under the lock, and only touch the job again
+ * under the lock, so the event loop can abandon jobs at shutdown.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "hashmap.h"
+#include "intern.h"
+#include "log.h"
+#include "pathstat.h"
+#include "pool.h"
+
+/**
+ * @brief Structure representing a `stat()` handed to the workers.
+ */
+struct pathstat_job {
+    const char *path;        /**<< Interned, the job holds a reference */
+    enum path_status status; /**<< Set by the worker */
+    struct pathstat_job *next;
+};
+
+/**
+ * @brief Structure representing a callback waiting for a check.
+ */
+struct pathstat_waiter {
+    pathstat_func done;
+    void *ctx;
+    struct pathstat_waiter *next;
+};
+
+/**
+ * @brief Structure representing a cached path.
+ */
+struct pathstat_entry {
+    const char *path; /**<< Interned, the entry holds a reference */
+    enum path_status status;
+    uint64_t expires; /**<< When the result goes stale, in ms */
+
+    bool checking;    /**<< Whether `waiters` wait for `job` */
+    uint64_t deadline;
+    struct pathstat_waiter *waiters;
+    struct pathstat_job *job; /**<< Outstanding `stat()`, or `NULL` */
+};
+
+static struct slab_pool entry_pool =
+    SLAB_POOL_INIT("pathstat", struct pathstat_entry);
+static struct slab_pool job_pool =
+    SLAB_POOL_INIT("pathstat_job", struct pathstat_job);
+static struct slab_pool waiter_pool =
+    SLAB_POOL_INIT("pathstat_waiter", struct pathstat_waiter);
+
+static int compare_entry(void *data, void *key)
+{
+    return strcmp(((struct pathstat_entry *)data)->path, (char *)key) != 0;
+}
+
+static int cleanup_entry(void *data)
+{
+    struct pathstat_entry *entry = (struct pathstat_entry *)data;
+
+    intern_put(entry->path);
+    pool_free(&entry_pool, entry);
+    return 0;
+}
+
+static struct hashmap cache = {
+    .hash_func = hash_string,
+    .compare_func = compare_entry,
+    .cleanup_func = cleanup_entry,
+};
+
+/* Number of cached results at which the next sweep happens */
+static int sweep_at = PATHSTAT_CACHE_MAX;
+
+/* Queue and done list, shared with the workers */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static struct pathstat_job *todo_head;
+static struct pathstat_job *todo_tail;
+static struct pathstat_job *done_list;
+static bool stopping;
+static uint64_t n_stats;
+
+static int done_fd = -1;
+static int timer_fd = -1;
+static uint64_t armed; /**<< Deadline the timer is armed for, or 0 */
+static bool running = false;
+
+static uint32_t n_stuck; /**<< Jobs outstanding past their deadline */
+static struct pathstat_stats stats;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static enum path_status stat_path(const char *path)
+{
+    struct stat sb;
+
+    if (stat(path, &sb) == -1) {
+        LOG_ERR("Bad path '%s': %s", path, strerror(errno));
+        return PATH_MISSING;
+    }
+
+    return PATH_EXISTS;
+}
+
+static void *worker_main(void *arg)
+{
+    char path[PATH_MAX];
+    struct pathstat_job *job;
+    enum path_status status;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (todo_head == NULL && !stopping) {
+            pthread_cond_wait(&queued, &lock);
+        }
+        if (stopping) {
+            break;
+        }
+
+        job = todo_head;
+        todo_head = job->next;
+        if (todo_head == NULL) {
+            todo_tail = NULL;
+        }
+        snprintf(path, sizeof(path), "%s", job->path);
+        pthread_mutex_unlock(&lock);
+
+        status = stat_path(path);
+
+        /* The job is abandoned if the daemon stopped meanwhile */
+        pthread_mutex_lock(&lock);
+        if (stopping) {
+            break;
+        }
+        n_stats++;
+        job->status = status;
+        job->next = done_list;
+        done_list = job;
+        if (write(done_fd, &one, sizeof(one)) == -1) {
+            LOG_ERR("write: %s", strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+int pathstat_init(void)
+{
+    sigset_t all, old;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int err = 0;
+    int i;
+
+    done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (done_fd == -1) {
+        LOG_ERR("eventfd: %s", strerror(errno));
+        return 1;
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        LOG_ERR("timerfd_create: %s", strerror(errno));
+        return 1;
+    }
+
+    /* Workers stuck on a hung mount are never joined */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    /* Signals are handled by the event loop's thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 0; i < PATHSTAT_WORKERS && !err; i++) {
+        err = pthread_create(&thread, &attr, worker_main, NULL);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (err) {
+        LOG_ERR("pthread_create: %s", strerror(err));
+        return 1;
+    }
+
+    running = true;
+    return 0;
+}
+
+int pathstat_completion_fd(void)
+{
+    return done_fd;
+}
+
+int pathstat_timer_fd(void)
+{
+    return timer_fd;
+}
+
+/**
+ * @brief Arms the timer for `deadline`, or disarms it if `deadline` is 0.
+ */
+static void arm(uint64_t deadline)
+{
+    struct itimerspec its = {0};
+
+    if (deadline == armed) {
+        return;
+    }
+
+    its.it_value.tv_sec = deadline / 1000;
+    its.it_value.tv_nsec = (deadline % 1000) * 1000000L;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        LOG_ERR("timerfd_settime: %s", strerror(errno));
+        return;
+    }
+
+    armed = deadline;
+}
+
+static uint64_t ttl(enum path_status status)
+{
+    switch (status) {
+    case PATH_EXISTS:
+        return PATHSTAT_TTL_MS;
+    case PATH_MISSING:
+        return PATHSTAT_MISSING_TTL_MS;
+    default:
+        return PATHSTAT_UNKNOWN_TTL_MS;
+    }
+}
+
+/**
+ * @brief Calls and frees a chain of waiters.
+ */
+static void complete(struct pathstat_waiter *w, enum path_status status)
+{
+    struct pathstat_waiter *next;
+
+    for (; w != NULL; w = next) {
+        next = w->next;
+        if (w->done != NULL) {
+            w->done(status, w->ctx);
+        }
+        pool_free(&waiter_pool, w);
+    }
+}
+
+/**
+ * @brief Records the results of the jobs the workers are done with.
+ */
+static void collect(void)
+{
+    struct pathstat_job *job, *next;
+    struct pathstat_entry *entry;
+    struct pathstat_waiter *waiters;
+    uint64_t now = now_ms();
+
+    pthread_mutex_lock(&lock);
+    job = done_list;
+    done_list = NULL;
+    pthread_mutex_unlock(&lock);
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+
+        /* Entries are not dropped while they have a job outstanding */
+        entry = (struct pathstat_entry *)hashmap_get(&cache, (void *)job->path);
+        if (entry != NULL) {
+            entry->job = NULL;
+            entry->status = job->status;
+            entry->expires = now + ttl(job->status);
+        }
+
+        intern_put(job->path);
+        pool_free(&job_pool, job);
+        if (entry == NULL) {
+            continue;
+        }
+
+        if (!entry->checking) {
+            /* The check timed out, but the mount has come back */
+            n_stuck--;
+            continue;
+        }
+
+        entry->checking = false;
+        waiters = entry->waiters;
+        entry->waiters = NULL;
+        complete(waiters, entry->status);
+    }
+}
+
+/**
+ * @brief Completes the checks past their deadline, and rearms the timer.
+ */
+static void expire(void)
+{
+    struct pathstat_entry *entry;
+    struct pathstat_waiter *expired = NULL;
+    struct pathstat_waiter *w;
+    uint64_t now = now_ms();
+    uint64_t next = 0;
+    uint32_t iter = 0;
+
+    while ((entry = (struct pathstat_entry *)hashmap_next(&cache, &iter))) {
+        if (!entry->checking) {
+            continue;
+        }
+
+        if (entry->deadline > now) {
+            if (next == 0 || entry->deadline < next) {
+                next = entry->deadline;
+            }
+            continue;
+        }
+
+        LOG_ERR("Timed out checking '%s'", entry->path);
+        entry->checking = false;
+        entry->status = PATH_UNKNOWN;
+        entry->expires = now + PATHSTAT_UNKNOWN_TTL_MS;
+        n_stuck++;
+        stats.timeouts++;
+
+        /* Waiters run once the map is no longer being walked */
+        if (entry->waiters != NULL) {
+            for (w = entry->waiters; w->next != NULL; w = w->next) {
+            }
+            w->next = expired;
+            expired = entry->waiters;
+            entry->waiters = NULL;
+        }
+    }
+
+    armed = 0;
+    if (next != 0) {
+        arm(next);
+    }
+
+    complete(expired, PATH_UNKNOWN);
+}
+
+void pathstat_handle_events(int fd, uint32_t events, void *ctx)
+{
+    uint64_t n;
+
+    if (read(fd, &n, sizeof(n)) == -1 && errno != EAGAIN) {
+        LOG_ERR("read: %s", strerror(errno));
+    }
+
+    collect();
+    expire();
+}
+
+/**
+ * @brief Drops expired results once the cache has grown past its limit.
+ */
+static void sweep(void)
+{
+    struct pathstat_entry *entry;
+    uint64_t now = now_ms();
+    uint32_t iter = 0;
+
+    if (cache.n_items < sweep_at) {
+        return;
+    }
+
+    while ((entry = (struct pathstat_entry *)hashmap_next(&cache, &iter))) {
+        if (!entry->checking && entry->job == NULL && entry->expires <= now) {
+            hashmap_delete(&cache, (void *)entry->path);
+        }
+    }
+
+    /* Fresh results are kept, so sweep again once the cache has doubled */
+    sweep_at = cache.n_items * 2;
+    if (sweep_at < PATHSTAT_CACHE_MAX) {
+        sweep_at = PATHSTAT_CACHE_MAX;
+    }
+}
+
+static struct pathstat_entry *create_entry(const char *path)
+{
+    struct pathstat_entry *entry;
+
+    sweep();
+
+    entry = (struct pathstat_entry *)pool_alloc(&entry_pool);
+    if (entry == NULL) {
+        return NULL;
+    }
+    memset(entry, 0, sizeof(*entry));
+
+    entry->path = intern(path);
+    if (entry->path == NULL) {
+        pool_free(&entry_pool, entry);
+        return NULL;
+    }
+
+    if (hashmap_insert(&cache, (void *)entry->path, entry)) {
+        cleanup_entry(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+/**
+ * @brief Hands a `stat()` of an entry's path to the workers.
+ */
+static int start_check(struct pathstat_entry *entry)
+{
+    struct pathstat_job *job;
+
+    job = (struct pathstat_job *)pool_alloc(&job_pool);
+    if (job == NULL) {
+        return 1;
+    }
+    job->path = intern_ref(entry->path);
+    job->next = NULL;
+
+    pthread_mutex_lock(&lock);
+    if (todo_tail != NULL) {
+        todo_tail->next = job;
+    } else {
+        todo_head = job;
+    }
+    todo_tail = job;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&lock);
+
+    entry->job = job;
+    entry->checking = true;
+    entry->deadline = now_ms() + PATHSTAT_TIMEOUT_MS;
+    if (armed == 0 || entry->deadline < armed) {
+        arm(entry->deadline);
+    }
+
+    return 0;
+}
+
+bool pathstat_lookup(const char *path, enum path_status *status)
+{
+    struct pathstat_entry *entry;
+
+    entry = (struct pathstat_entry *)hashmap_get(&cache, (void *)path);
+    if (entry == NULL || entry->checking || entry->expires <= now_ms()) {
+        return false;
+    }
+
+    stats.hits++;
+    *status = entry->status;
+    return true;
+}
+
+/**
+ * @brief Checks a path, see `pathstat_submit()`.
+ *
+ * @param cached Whether a cached result may be used.
+ */
+static int check(const char *path, bool cached, pathstat_func done, void *ctx)
+{
+    struct pathstat_entry *entry;
+    struct pathstat_waiter *w;
+    enum path_status status;
+
+    if (cached && pathstat_lookup(path, &status)) {
+        goto complete;
+    }
+
+    /* Nothing would serve the check before its deadline */
+    status = PATH_UNKNOWN;
+    if (n_stuck >= PATHSTAT_WORKERS) {
+        goto complete;
+    }
+
+    if (strlen(path) >= PATH_MAX) {
+        status = PATH_MISSING;
+        goto complete;
+    }
+
+    entry = (struct pathstat_entry *)hashmap_get(&cache, (void *)path);
+    if (entry == NULL) {
+        entry = create_entry(path);
+        if (entry == NULL) {
+            return 1;
+        }
+    } else if (!entry->checking && entry->job != NULL) {
+        /* The path's last stat() is still stuck */
+        goto complete;
+    }
+
+    w = (struct pathstat_waiter *)pool_alloc(&waiter_pool);
+    if (w == NULL) {
+        return 1;
+    }
+    w->done = done;
+    w->ctx = ctx;
+
+    if (!entry->checking && start_check(entry)) {
+        pool_free(&waiter_pool, w);
+        return 1;
+    }
+
+    w->next = entry->waiters;
+    entry->waiters = w;
+
+    return 0;
+
+complete:
+    if (done != NULL) {
+        done(status, ctx);
+    }
+    return 0;
+}
+
+int pathstat_submit(const char *path, bool cached, pathstat_func done,
+                    void *ctx)
+{
+    if (!running) {
+        if (done != NULL) {
+            done(stat_path(path), ctx);
+        }
+        return 0;
+    }
+
+    return check(path, cached, done, ctx);
+}
+
+/**
+ * @brief Structure holding the result of a check waited for.
+ */
+struct wait_result {
+    bool done;
+    enum path_status status;
+};
+
+static void wait_done(enum path_status status, void *ctx)
+{
+    struct wait_result *r = ctx;
+
+    r->done = true;
+    r->status = status;
+}
+
+enum path_status pathstat_wait(const char *path, bool cached)
+{
+    struct wait_result r = {.done = false};
+    struct pollfd pfds[2] = {
+        {.fd = done_fd, .events = POLLIN},
+        {.fd = timer_fd, .events = POLLIN},
+    };
+    uint64_t n;
+    int i;
+
+    if (!running) {
+        return stat_path(path);
+    }
+
+    if (check(path, cached, wait_done, &r)) {
+        return PATH_UNKNOWN;
+    }
+
+    /* The timer is armed for the check's deadline at the latest */
+    while (!r.done) {
+        if (poll(pfds, 2, PATHSTAT_TIMEOUT_MS) == -1 && errno != EINTR) {
+            LOG_ERR("poll: %s", strerror(errno));
+        }
+        for (i = 0; i < 2; i++) {
+            if (read(pfds[i].fd, &n, sizeof(n)) == -1 && errno != EAGAIN) {
+                LOG_ERR("read: %s", strerror(errno));
+            }
+        }
+
+        collect();
+        expire();
+    }
+
+    return r.status;
+}
+
+void pathstat_stats_get(struct pathstat_stats *out)
+{
+    *out = stats;
+    out->cached = cache.n_items;
+    out->stuck = n_stuck;
+
+    pthread_mutex_lock(&lock);
+    out->stats = n_stats;
+    pthread_mutex_unlock(&lock);
+}
+
+void pathstat_deinit(void)
+{
+    struct pathstat_entry *entry;
+    struct pathstat_job *job, *next;
+    struct pathstat_waiter *waiters;
+    uint32_t iter = 0;
+
+    running = false;
+
+    /* Workers still in stat() abandon their jobs */
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&queued);
+    job = todo_head;
+    todo_head = NULL;
+    todo_tail = NULL;
+    pthread_mutex_unlock(&lock);
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+        intern_put(job->path);
+        pool_free(&job_pool, job);
+    }
+
+    collect();
+
+    /* Nobody waits past shutdown */
+    while ((entry = (struct pathstat_entry *)hashmap_next(&cache, &iter))) {
+        waiters = entry->waiters;
+        entry->waiters = NULL;
+        entry->checking = false;
+        complete(waiters, PATH_UNKNOWN);
+    }
+    hashmap_delete_all(&cache);
+    n_stuck = 0;
+
+    if (done_fd != -1) {
+        close(done_fd);
+        done_fd = -1;
+    }
+    if (timer_fd != -1) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+}
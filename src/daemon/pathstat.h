@@ -0,0 +1,160 @@
+/**
+ * @file pathstat.h
+ * @brief Asynchronous path validation with a stat cache.
+ *
+ * This header defines the service used to check that paths exist without
+ * blocking the event loop. A `stat()` on a hung NFS or sshfs mount can block
+ * for minutes, so paths are checked by a small pool of worker threads, and
+ * every check has a deadline. A check that misses its deadline completes as
+ * `PATH_UNKNOWN`, and the path keeps answering `PATH_UNKNOWN` while its
+ * `stat()` is stuck. Once every worker is stuck, all checks complete as
+ * `PATH_UNKNOWN` straight away rather than queueing behind them.
+ *
+ * Results are cached for a short time, so that repeated pushes of the same
+ * directory cost a hash lookup. Several checks of a path in flight at once
+ * share one `stat()`.
+ *
+ * Every function runs on the event loop. Until `pathstat_init()` is called,
+ * paths are checked synchronously, which suits the benchmarks.
+ */
+
+#ifndef PATHSTAT_H_
+#define PATHSTAT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Number of worker threads */
+#define PATHSTAT_WORKERS 4
+
+/* Time a check may take before it completes as PATH_UNKNOWN, well within
+ * the time clients wait for a reply, see the client's client.h */
+#define PATHSTAT_TIMEOUT_MS 20
+
+/* Time results are cached for: existing paths, missing paths, and paths
+ * whose check timed out */
+#define PATHSTAT_TTL_MS         2000
+#define PATHSTAT_MISSING_TTL_MS 500
+#define PATHSTAT_UNKNOWN_TTL_MS 5000
+
+/* Number of cached results above which expired ones are dropped */
+#define PATHSTAT_CACHE_MAX 1024
+
+/**
+ * @brief Enum representing the result of a check.
+ */
+enum path_status {
+    PATH_EXISTS,
+    PATH_MISSING, /**<< The path does not exist or cannot be accessed */
+    PATH_UNKNOWN, /**<< The check timed out */
+};
+
+/**
+ * @brief Function called on the event loop once a check completes.
+ *
+ * @param status The result.
+ * @param ctx The context given when the check was submitted.
+ */
+typedef void (*pathstat_func)(enum path_status status, void *ctx);
+
+/**
+ * @brief Structure holding the counters of the service.
+ */
+struct pathstat_stats {
+    uint64_t hits;     /**<< Checks answered from the cache */
+    uint64_t stats;    /**<< Calls to `stat()` made by the workers */
+    uint64_t timeouts; /**<< Checks that missed their deadline */
+    uint32_t cached;   /**<< Results currently cached */
+    uint32_t stuck;    /**<< Workers blocked past a deadline */
+};
+
+/**
+ * @brief Starts the worker threads.
+ *
+ * @return 0 on success, non-zero on failure.
+ */
+int pathstat_init(void);
+
+/**
+ * @brief Stops the worker threads and empties the cache.
+ *
+ * Workers stuck on a hung mount are left behind rather than waited for.
+ */
+void pathstat_deinit(void);
+
+/**
+ * @brief Returns the file descriptor readable when checks are done.
+ *
+ * It should be watched by the event loop with `pathstat_handle_events()`.
+ *
+ * @return The file descriptor.
+ */
+int pathstat_completion_fd(void);
+
+/**
+ * @brief Returns the file descriptor readable when a deadline passes.
+ *
+ * It should be watched by the event loop with `pathstat_handle_events()`.
+ *
+ * @return The file descriptor.
+ */
+int pathstat_timer_fd(void);
+
+/**
+ * @brief Completes the checks that are done or past their deadline.
+ *
+ * This function is an `event_func` callback for both file descriptors.
+ *
+ * @param fd The ready file descriptor.
+ * @param events The epoll events reported for `fd`.
+ * @param ctx Unused.
+ */
+void pathstat_handle_events(int fd, uint32_t events, void *ctx);
+
+/**
+ * @brief Looks up the cached result for a path.
+ *
+ * @param path The path.
+ * @param status Set to the result if it is cached.
+ * @return `true` if the result is cached, `false` if the path must be
+ *         checked.
+ */
+bool pathstat_lookup(const char *path, enum path_status *status);
+
+/**
+ * @brief Checks a path in the background.
+ *
+ * If `cached` is set and the result is cached, see `pathstat_lookup()`, or
+ * if the check cannot be served before its deadline, `done` is called before
+ * this function returns.
+ *
+ * @param path The path, copied.
+ * @param cached Whether a cached result may be used, see `pathstat_wait()`.
+ * @param done Function called with the result, may be `NULL`.
+ * @param ctx Passed to `done`.
+ * @return 0 on success, non-zero on failure, in which case `done` is not
+ *         called.
+ */
+int pathstat_submit(const char *path, bool cached, pathstat_func done,
+                    void *ctx);
+
+/**
+ * @brief Checks a path, waiting at most until the check's deadline.
+ *
+ * Completions of other checks may run while waiting.
+ *
+ * @param path The path.
+ * @param cached Whether a cached result may be used. Lookups that send the
+ *               user to a path should not trust a cached `PATH_EXISTS`.
+ * @return The result.
+ */
+enum path_status pathstat_wait(const char *path, bool cached);
+
+/**
+ * @brief Retrieves the counters.
+ *
+ * @param stats Set to the counters.
+ */
+void pathstat_stats_get(struct pathstat_stats *stats);
+
+#endif /* PATHSTAT_H_ */
@@ -0,0 +1,235 @@
+/**
+ * @file pool.c
+ * @brief Implementation of the slab pools and the string arena.
+ *
+ * Objects are carved from the newest slab in order, and freed objects are
+ * pushed onto the pool's free list, which is used first. Pools link
+ * themselves into a list when they allocate their first slab, so that
+ * `pool_destroy_all()` can release every slab without the modules owning
+ * the pools having to.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define ARENA_N_CLASSES 9
+
+/* Every object is aligned for any type */
+#define POOL_ALIGN _Alignof(max_align_t)
+
+static struct slab_pool arena_classes[ARENA_N_CLASSES] = {
+    {.name = "str16", .obj_size = 16},     {.name = "str32", .obj_size = 32},
+    {.name = "str64", .obj_size = 64},     {.name = "str128", .obj_size = 128},
+    {.name = "str256", .obj_size = 256},   {.name = "str512", .obj_size = 512},
+    {.name = "str1024", .obj_size = 1024}, {.name = "str2048", .obj_size = 2048},
+    {.name = "str4096", .obj_size = 4096},
+};
+
+/* Pools that hold slabs */
+static struct slab_pool *pools;
+
+static struct alloc_stats stats;
+
+/**
+ * @brief Returns the distance between objects of a pool.
+ */
+static size_t stride(const struct slab_pool *pool)
+{
+    size_t size = pool->obj_size;
+
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+
+    return (size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+}
+
+static int add_slab(struct slab_pool *pool)
+{
+    struct slab *slab;
+    size_t header, size;
+
+    header = (sizeof(struct slab) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+    size = SLAB_SIZE;
+    if (header + SLAB_MIN_OBJECTS * stride(pool) > size) {
+        size = header + SLAB_MIN_OBJECTS * stride(pool);
+    }
+
+    slab = (struct slab *)malloc(size);
+    if (slab == NULL) {
+        return 1;
+    }
+    stats.heap_allocs++;
+    stats.slab_bytes += size;
+
+    if (pool->n_slabs == 0) {
+        pool->next_pool = pools;
+        pools = pool;
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->n_slabs++;
+    pool->next_free = (char *)slab + header;
+    pool->slab_end = (char *)slab + size;
+
+    return 0;
+}
+
+void *pool_alloc(struct slab_pool *pool)
+{
+    void *obj;
+
+    if (pool->free_list != NULL) {
+        obj = pool->free_list;
+        pool->free_list = *(void **)obj;
+    } else {
+        if (pool->next_free == NULL ||
+            pool->next_free + stride(pool) > pool->slab_end) {
+            if (add_slab(pool)) {
+                return NULL;
+            }
+        }
+        obj = pool->next_free;
+        pool->next_free += stride(pool);
+    }
+
+    pool->n_live++;
+    stats.pool_allocs++;
+    stats.live++;
+
+    return obj;
+}
+
+void pool_free(struct slab_pool *pool, void *obj)
+{
+    if (obj == NULL) {
+        return;
+    }
+
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+
+    pool->n_live--;
+    stats.pool_frees++;
+    stats.live--;
+}
+
+/**
+ * @brief Finds the smallest size class holding `size` bytes.
+ *
+ * @return The class, or -1 if `size` is above `ARENA_CLASS_MAX`.
+ */
+static int size_class(size_t size)
+{
+    int class = 0;
+
+    while (class < ARENA_N_CLASSES && arena_classes[class].obj_size < size) {
+        class++;
+    }
+
+    return class < ARENA_N_CLASSES ? class : -1;
+}
+
+void *arena_alloc(size_t size)
+{
+    int class = size_class(size);
+    void *ptr;
+
+    if (class >= 0) {
+        return pool_alloc(&arena_classes[class]);
+    }
+
+    ptr = malloc(size);
+    if (ptr != NULL) {
+        stats.heap_allocs++;
+        stats.pool_allocs++;
+        stats.live++;
+    }
+
+    return ptr;
+}
+
+void arena_free(void *ptr, size_t size)
+{
+    int class = size_class(size);
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    if (class >= 0) {
+        pool_free(&arena_classes[class], ptr);
+        return;
+    }
+
+    free(ptr);
+    stats.heap_frees++;
+    stats.pool_frees++;
+    stats.live--;
+}
+
+char *arena_strndup(const char *s, size_t len)
+{
+    char *copy;
+
+    /* The copy never holds a NUL, so arena_strfree() finds its size class */
+    len = strnlen(s, len);
+    copy = (char *)arena_alloc(len + 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+
+    return copy;
+}
+
+void arena_strfree(char *s)
+{
+    if (s != NULL) {
+        arena_free(s, strlen(s) + 1);
+    }
+}
+
+void pool_destroy_all(void)
+{
+    struct slab_pool *pool;
+    struct slab *slab;
+
+    for (pool = pools; pool != NULL; pool = pool->next_pool) {
+        while ((slab = pool->slabs) != NULL) {
+            pool->slabs = slab->next;
+            free(slab);
+            stats.heap_frees++;
+        }
+
+        stats.live -= pool->n_live;
+        pool->free_list = NULL;
+        pool->next_free = NULL;
+        pool->slab_end = NULL;
+        pool->n_slabs = 0;
+        pool->n_live = 0;
+    }
+
+    pools = NULL;
+    stats.slab_bytes = 0;
+}
+
+void alloc_stats_get(struct alloc_stats *out)
+{
+    *out = stats;
+}
+
+const struct slab_pool *pool_next(const struct slab_pool *pool)
+{
+    return pool == NULL ? pools : pool->next_pool;
+}
+
+size_t pool_live_bytes(const struct slab_pool *pool)
+{
+    return pool->n_live * stride(pool);
+}
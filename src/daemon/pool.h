@@ -0,0 +1,155 @@
+/**
+ * @file pool.h
+ * @brief Slab pools for fixed size records and an arena for strings.
+ *
+ * This header defines the allocators used for the daemon's long lived
+ * records. A slab pool hands out objects of one size, carved from slabs of
+ * many objects, and keeps freed objects on a free list for reuse. The string
+ * arena rounds each allocation up to a power of two size class, and serves
+ * every class from its own slab pool, so paths of similar length recycle the
+ * same memory.
+ *
+ * Slabs are only returned to the heap by `pool_destroy_all()`, so a daemon
+ * that runs for weeks reuses a stable set of slabs instead of fragmenting
+ * the heap with small allocations. Like the other containers, a pool is
+ * ready for use once its object size is set, see `SLAB_POOL_INIT()`.
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of each slab in bytes, unless it is too small for SLAB_MIN_OBJECTS */
+#define SLAB_SIZE (16 * 1024)
+
+/* Minimum number of objects in a slab */
+#define SLAB_MIN_OBJECTS 8
+
+/* Smallest and largest size classes of the string arena */
+#define ARENA_CLASS_MIN 16
+#define ARENA_CLASS_MAX 4096
+
+/**
+ * @brief Structure representing a slab, followed by its objects.
+ */
+struct slab {
+    struct slab *next;
+};
+
+/**
+ * @brief Structure representing a pool of fixed size objects.
+ */
+struct slab_pool {
+    const char *name;
+    size_t obj_size;   /**<< Size of each object, set before first use */
+    struct slab *slabs;
+    void *free_list;   /**<< Freed objects, linked through their first word */
+    char *next_free;   /**<< Next never used object in the newest slab */
+    char *slab_end;    /**<< End of the newest slab */
+    uint32_t n_slabs;
+    uint32_t n_live;   /**<< Objects currently handed out */
+
+    struct slab_pool *next_pool; /**<< Pools with slabs, for cleanup */
+};
+
+/* Initialiser for a pool of `type` objects */
+#define SLAB_POOL_INIT(pool_name, type)                                        \
+    {                                                                          \
+        .name = (pool_name), .obj_size = sizeof(type)                          \
+    }
+
+/**
+ * @brief Structure holding the allocation counters of every pool.
+ */
+struct alloc_stats {
+    uint64_t heap_allocs; /**<< Calls to `malloc()` made by the allocators */
+    uint64_t heap_frees;
+    uint64_t pool_allocs; /**<< Objects and strings handed out */
+    uint64_t pool_frees;
+    uint64_t live;        /**<< Objects and strings currently handed out */
+    uint64_t slab_bytes;  /**<< Bytes held in slabs */
+};
+
+/**
+ * @brief Allocates an object from a pool.
+ *
+ * @param pool Pointer to the pool.
+ * @return Pointer to the uninitialised object, or `NULL` on failure.
+ */
+void *pool_alloc(struct slab_pool *pool);
+
+/**
+ * @brief Returns an object to its pool.
+ *
+ * @param pool Pointer to the pool the object was allocated from.
+ * @param obj Pointer to the object, may be `NULL`.
+ */
+void pool_free(struct slab_pool *pool, void *obj);
+
+/**
+ * @brief Allocates `size` bytes from the string arena.
+ *
+ * Sizes above `ARENA_CLASS_MAX` fall back to `malloc()`.
+ *
+ * @param size Number of bytes.
+ * @return Pointer to the memory, or `NULL` on failure.
+ */
+void *arena_alloc(size_t size);
+
+/**
+ * @brief Returns memory to the string arena.
+ *
+ * @param ptr Pointer returned by `arena_alloc()`, may be `NULL`.
+ * @param size The size passed to `arena_alloc()`.
+ */
+void arena_free(void *ptr, size_t size);
+
+/**
+ * @brief Copies the first `len` bytes of a string into the arena.
+ *
+ * @param s The string.
+ * @param len Number of bytes to copy, the copy is NUL-terminated.
+ * @return The copy, or `NULL` on failure.
+ */
+char *arena_strndup(const char *s, size_t len);
+
+/**
+ * @brief Returns a string copied by `arena_strndup()` to the arena.
+ *
+ * @param s The string, may be `NULL`.
+ */
+void arena_strfree(char *s);
+
+/**
+ * @brief Releases the slabs of every pool, including the arena's.
+ *
+ * Every object must have been freed, or must no longer be used.
+ */
+void pool_destroy_all(void);
+
+/**
+ * @brief Retrieves the allocation counters.
+ *
+ * @param stats Set to the counters.
+ */
+void alloc_stats_get(struct alloc_stats *stats);
+
+/**
+ * @brief Iterates over the pools holding slabs, including the arena's.
+ *
+ * @param pool The previous pool, or `NULL` for the first one.
+ * @return The next pool, or `NULL` once every pool has been returned.
+ */
+const struct slab_pool *pool_next(const struct slab_pool *pool);
+
+/**
+ * @brief Returns the number of bytes of a pool's objects in use.
+ *
+ * @param pool Pointer to the pool.
+ * @return The bytes, including the padding between objects.
+ */
+size_t pool_live_bytes(const struct slab_pool *pool);
+
+#endif /* POOL_H_ */
@@ -0,0 +1,434 @@
+/**
+ * @file radix.c
+ * @brief Radix tree ADT implementation
+ *
+ * This file provides the implementation of the radix tree ADT. Labels are
+ * stored inline at the end of each node. Splitting an edge only shortens the
+ * existing node's label in place, while merging a node with its only child
+ * allocates a node for the joined label.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "radix.h"
+
+/**
+ * @brief Allocates a node with room for a label of `len` bytes.
+ */
+static struct radix_node *node_alloc(size_t len)
+{
+    struct radix_node *node;
+
+    node = (struct radix_node *)calloc(1, sizeof(*node) + len);
+    if (node == NULL) {
+        return NULL;
+    }
+    node->len = len;
+
+    return node;
+}
+
+static struct radix_node *node_create(const char *label, size_t len)
+{
+    struct radix_node *node;
+
+    node = node_alloc(len);
+    if (node != NULL) {
+        memcpy(node->label, label, len);
+    }
+
+    return node;
+}
+
+static void node_free(struct radix_node *node)
+{
+    int i;
+
+    for (i = 0; i < node->n_children; i++) {
+        node_free(node->children[i]);
+    }
+    free(node->children);
+    free(node);
+}
+
+/**
+ * @brief Finds the child whose label starts with byte `c`.
+ *
+ * @param pos Set to the position of the child, or where it would be inserted.
+ * @return The child, or `NULL` if there is none.
+ */
+static struct radix_node *find_child(struct radix_node *node, unsigned char c,
+                                     int *pos)
+{
+    int lo = 0;
+    int hi = node->n_children;
+    int mid;
+    unsigned char first;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        first = (unsigned char)node->children[mid]->label[0];
+        if (first < c) {
+            lo = mid + 1;
+        } else if (first > c) {
+            hi = mid;
+        } else {
+            *pos = mid;
+            return node->children[mid];
+        }
+    }
+
+    *pos = lo;
+    return NULL;
+}
+
+static int add_child(struct radix_node *node, struct radix_node *child,
+                     int pos)
+{
+    struct radix_node **children;
+    int cap;
+
+    if (node->n_children == node->cap_children) {
+        cap = node->cap_children ? node->cap_children * 2 : 2;
+        children = realloc(node->children, cap * sizeof(*children));
+        if (children == NULL) {
+            return 1;
+        }
+        node->children = children;
+        node->cap_children = cap;
+    }
+
+    memmove(&node->children[pos + 1], &node->children[pos],
+            (node->n_children - pos) * sizeof(*node->children));
+    node->children[pos] = child;
+    node->n_children++;
+
+    return 0;
+}
+
+static void remove_child(struct radix_node *node, int pos)
+{
+    memmove(&node->children[pos], &node->children[pos + 1],
+            (node->n_children - pos - 1) * sizeof(*node->children));
+    node->n_children--;
+}
+
+static size_t common_prefix(const char *label, size_t len, const char *key)
+{
+    size_t i;
+
+    for (i = 0; i < len && key[i] != '\0' && key[i] == label[i]; i++) {
+    }
+
+    return i;
+}
+
+int radix_insert(struct radix_tree *t, const char *key, void *data)
+{
+    struct radix_node *node, *child, *mid;
+    size_t common;
+    int pos;
+
+    if (t->root == NULL) {
+        t->root = node_create("", 0);
+        if (t->root == NULL) {
+            return 1;
+        }
+    }
+
+    node = t->root;
+    while (*key != '\0') {
+        child = find_child(node, (unsigned char)*key, &pos);
+        if (child == NULL) {
+            child = node_create(key, strlen(key));
+            if (child == NULL) {
+                return 1;
+            }
+            if (add_child(node, child, pos)) {
+                free(child);
+                return 1;
+            }
+            node = child;
+            break;
+        }
+
+        common = common_prefix(child->label, child->len, key);
+        if (common < child->len) {
+            /* Split the edge, the child keeps the rest of its label */
+            mid = node_create(child->label, common);
+            if (mid == NULL || add_child(mid, child, 0)) {
+                free(mid);
+                return 1;
+            }
+            memmove(child->label, child->label + common, child->len - common);
+            child->len -= common;
+            node->children[pos] = mid;
+            child = mid;
+        }
+
+        node = child;
+        key += common;
+    }
+
+    if (!node->is_key) {
+        node->is_key = true;
+        t->n_keys++;
+    }
+    node->data = data;
+
+    return 0;
+}
+
+/**
+ * @brief Finds the node where `key` ends.
+ *
+ * @param parent Set to the node's parent, if not `NULL`.
+ * @param grandparent Set to the parent's parent, if not `NULL`.
+ * @param pos Set to the node's position in its parent, if not `NULL`.
+ * @param parent_pos Set to the parent's position in the grandparent, if not
+ *                   `NULL`.
+ * @return The node, or `NULL` if no key ends there.
+ */
+static struct radix_node *find_node(struct radix_tree *t, const char *key,
+                                    struct radix_node **parent,
+                                    struct radix_node **grandparent, int *pos,
+                                    int *parent_pos)
+{
+    struct radix_node *node = t->root;
+    struct radix_node *p = NULL, *gp = NULL;
+    int child_pos = 0, p_pos = 0;
+    int next_pos;
+
+    if (node == NULL) {
+        return NULL;
+    }
+
+    while (*key != '\0') {
+        gp = p;
+        p = node;
+        p_pos = child_pos;
+
+        node = find_child(p, (unsigned char)*key, &next_pos);
+        if (node == NULL ||
+            common_prefix(node->label, node->len, key) != node->len) {
+            return NULL;
+        }
+        child_pos = next_pos;
+        key += node->len;
+    }
+
+    if (!node->is_key) {
+        return NULL;
+    }
+
+    if (parent != NULL) {
+        *parent = p;
+    }
+    if (grandparent != NULL) {
+        *grandparent = gp;
+    }
+    if (pos != NULL) {
+        *pos = child_pos;
+    }
+    if (parent_pos != NULL) {
+        *parent_pos = p_pos;
+    }
+
+    return node;
+}
+
+void *radix_get(struct radix_tree *t, const char *key)
+{
+    struct radix_node *node;
+
+    node = find_node(t, key, NULL, NULL, NULL, NULL);
+    return node != NULL ? node->data : NULL;
+}
+
+/**
+ * @brief Merges a node that is not a key with its only child.
+ *
+ * The merged node replaces `node` at `pos` in `parent`. If the merged node
+ * cannot be allocated, the tree is left as it was, which is still correct.
+ */
+static void merge_child(struct radix_node *parent, int pos,
+                        struct radix_node *node)
+{
+    struct radix_node *child = node->children[0];
+    struct radix_node *merged;
+
+    merged = node_alloc(node->len + child->len);
+    if (merged == NULL) {
+        return;
+    }
+    memcpy(merged->label, node->label, node->len);
+    memcpy(merged->label + node->len, child->label, child->len);
+
+    merged->children = child->children;
+    merged->n_children = child->n_children;
+    merged->cap_children = child->cap_children;
+    merged->is_key = child->is_key;
+    merged->data = child->data;
+
+    parent->children[pos] = merged;
+
+    free(node->children);
+    free(node);
+    free(child);
+}
+
+int radix_delete(struct radix_tree *t, const char *key)
+{
+    struct radix_node *node, *parent, *grandparent;
+    int pos, parent_pos;
+
+    node = find_node(t, key, &parent, &grandparent, &pos, &parent_pos);
+    if (node == NULL) {
+        return 1;
+    }
+
+    node->is_key = false;
+    node->data = NULL;
+    t->n_keys--;
+
+    /* The root is never removed or merged */
+    if (parent == NULL) {
+        return 0;
+    }
+
+    if (node->n_children == 0) {
+        remove_child(parent, pos);
+        free(node->children);
+        free(node);
+
+        if (grandparent != NULL && !parent->is_key &&
+            parent->n_children == 1) {
+            merge_child(grandparent, parent_pos, parent);
+        }
+    } else if (node->n_children == 1) {
+        merge_child(parent, pos, node);
+    }
+
+    return 0;
+}
+
+void radix_delete_all(struct radix_tree *t)
+{
+    if (t->root != NULL) {
+        node_free(t->root);
+    }
+
+    t->root = NULL;
+    t->n_keys = 0;
+}
+
+/**
+ * @brief State of a walk, with the key built up from the labels so far.
+ */
+struct walk {
+    char *key;
+    size_t len;
+    size_t cap;
+    radix_visit_func visit;
+    void *ctx;
+    bool stopped;
+};
+
+static int walk_push(struct walk *w, const char *label, size_t len)
+{
+    char *key;
+    size_t cap;
+
+    if (w->len + len + 1 > w->cap) {
+        cap = w->cap ? w->cap : 64;
+        while (w->len + len + 1 > cap) {
+            cap *= 2;
+        }
+        key = realloc(w->key, cap);
+        if (key == NULL) {
+            return 1;
+        }
+        w->key = key;
+        w->cap = cap;
+    }
+
+    memcpy(w->key + w->len, label, len);
+    w->len += len;
+    w->key[w->len] = '\0';
+
+    return 0;
+}
+
+/**
+ * @brief Visits every key in the subtree of `node`, in order.
+ *
+ * The key built so far must already include `node`'s label.
+ */
+static int walk_subtree(struct walk *w, struct radix_node *node)
+{
+    size_t len = w->len;
+    int i;
+
+    if (node->is_key && w->visit(w->key, node->data, w->ctx)) {
+        w->stopped = true;
+        return 0;
+    }
+
+    for (i = 0; i < node->n_children && !w->stopped; i++) {
+        if (walk_push(w, node->children[i]->label, node->children[i]->len)) {
+            return 1;
+        }
+        if (walk_subtree(w, node->children[i])) {
+            return 1;
+        }
+        w->len = len;
+        w->key[len] = '\0';
+    }
+
+    return 0;
+}
+
+int radix_walk_prefix(struct radix_tree *t, const char *prefix,
+                      radix_visit_func visit, void *ctx)
+{
+    struct walk w = {.visit = visit, .ctx = ctx};
+    struct radix_node *node = t->root;
+    size_t common;
+    int pos;
+    int err;
+
+    if (node == NULL) {
+        return 0;
+    }
+
+    if (walk_push(&w, "", 0)) {
+        return 1;
+    }
+
+    /* Descend to the node whose subtree holds every key with the prefix */
+    while (*prefix != '\0') {
+        node = find_child(node, (unsigned char)*prefix, &pos);
+        if (node == NULL) {
+            free(w.key);
+            return 0;
+        }
+
+        common = common_prefix(node->label, node->len, prefix);
+        if (prefix[common] != '\0' && common < node->len) {
+            free(w.key);
+            return 0;
+        }
+
+        if (walk_push(&w, node->label, node->len)) {
+            free(w.key);
+            return 1;
+        }
+        prefix += common;
+    }
+
+    err = walk_subtree(&w, node);
+    free(w.key);
+
+    return err;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file radix.h
+ * @brief Radix tree Abstract Data Type (ADT) interface.
+ *
+ * This file defines the interface for a radix tree (compressed prefix tree)
+ * keyed by NUL-terminated strings. Each edge holds a run of key bytes, and
+ * the children of a node are kept sorted by their first byte, so walking the
+ * tree visits keys in lexicographic (byte) order. This makes it cheap to find
+ * every key starting with a prefix, e.g. for tab completion.
+ *
+ * The tree stores a `void *` per key but never owns or frees it. The tree
+ * allocates its storage lazily, so a zeroed tree is ready for use.
+ */
+
+#ifndef RADIX_H_
+#define RADIX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief Structure representing a node in the tree.
+ *
+ * The node's label is the run of key bytes on the edge from its parent. The
+ * root's label is empty.
+ */
+struct radix_node {
+    struct radix_node **children; /**<< Sorted by the first byte of label */
+    int n_children;
+    int cap_children;
+
+    bool is_key; /**<< Whether a key ends at this node */
+    void *data;  /**<< Data for the key ending here, if `is_key` */
+
+    size_t len;   /**<< Length of `label` */
+    char label[]; /**<< Not NUL-terminated */
+};
+
+/**
+ * @brief Structure representing the radix tree.
+ */
+struct radix_tree {
+    struct radix_node *root;
+    int n_keys;
+};
+
+/**
+ * @brief Function called for each key visited by `radix_walk_prefix()`.
+ *
+ * @param key The key, only valid for the duration of the call.
+ * @param data The key's data.
+ * @param ctx The context passed to `radix_walk_prefix()`.
+ * @return 0 to continue the walk, non-zero to stop it.
+ */
+typedef int (*radix_visit_func)(const char *key, void *data, void *ctx);
+
+/**
+ * @brief Inserts a key into the tree, or replaces the data of an existing key.
+ *
+ * @param t Pointer to the tree.
+ * @param key The key, which is copied.
+ * @param data Pointer to the data for the key.
+ * @return 0 on success, non-zero on failure.
+ */
+int radix_insert(struct radix_tree *t, const char *key, void *data);
+
+/**
+ * @brief Retrieves the data for a key.
+ *
+ * @param t Pointer to the tree.
+ * @param key The key to search for.
+ * @return Pointer to the data, or `NULL` if the key is not in the tree.
+ */
+void *radix_get(struct radix_tree *t, const char *key);
+
+/**
+ * @brief Deletes a key from the tree.
+ *
+ * Nodes left without a purpose are freed, and a node left with a single child
+ * is merged with it, so the tree stays compressed. The key's data is not
+ * freed.
+ *
+ * @param t Pointer to the tree.
+ * @param key The key to delete.
+ * @return 0 on success, non-zero if the key is not in the tree.
+ */
+int radix_delete(struct radix_tree *t, const char *key);
+
+/**
+ * @brief Removes all keys from the tree and releases its storage.
+ *
+ * @param t Pointer to the tree.
+ */
+void radix_delete_all(struct radix_tree *t);
+
+/**
+ * @brief Visits every key starting with a prefix, in lexicographic order.
+ *
+ * @param t Pointer to the tree.
+ * @param prefix The prefix, which may be empty to visit every key.
+ * @param visit Function called for each key.
+ * @param ctx Context passed to `visit`.
+ * @return 0 if the walk completed or was stopped by `visit`, non-zero on
+ *         allocation failure.
+ */
+int radix_walk_prefix(struct radix_tree *t, const char *prefix,
+                      radix_visit_func visit, void *ctx);
+
+#endif /* RADIX_H_ */
@@ -0,0 +1,731 @@
+/**
+ * @file server.c
+ * @brief Implementation of batched request handling.
+ *
+ * This file drains the nav socket with `recvmmsg()`, parses each request into
+ * its PID, command and arguments, dispatches it, and flushes every reply
+ * queued during the batch with a single `sendmmsg()`. The sender credentials
+ * attached to each request are checked before it is dispatched.
+ *
+ * Connections accepted on the stream socket are serviced the same way, except
+ * that the credentials are read once when the connection is accepted and
+ * replies are sent back over the connection rather than to an address. While
+ * the reply to a request on a connection is deferred, the connection is not
+ * read, and requests already received after it are held until it is answered.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "commands.h"
+#include "event.h"
+#include "log.h"
+#include "metrics.h"
+#include "protocol.h"
+
+/* Maximum number of recvmmsg() calls per wakeup, so timers are not starved */
+#define SERVER_MAX_ROUNDS 4
+
+/* Maximum number of parent processes walked when verifying a sender */
+#define SERVER_MAX_ANCESTRY 16
+
+/**
+ * @brief Structure holding a request received on a connection, held while
+ *        an earlier request's reply is deferred.
+ */
+struct held_request {
+    char *buf; /**<< Copy of the request, `NULL` if it could not be copied */
+    size_t len;
+};
+
+/**
+ * @brief Structure holding the state of a stream connection.
+ */
+struct connection {
+    int fd;
+    int index;         /**<< Position in the connection table */
+    struct ucred cred; /**<< Credentials of the peer when it connected */
+    bool waiting;      /**<< Whether the reply to a request is deferred */
+    bool paused;       /**<< Whether the event loop stopped reading `fd` */
+    int n_held;
+    int next_held; /**<< Next held request to handle */
+    struct held_request held[SERVER_BATCH_SIZE];
+};
+
+/**
+ * @brief Structure holding the receive side of a batch.
+ */
+struct inbox {
+    struct mmsghdr msgs[SERVER_BATCH_SIZE];
+    struct iovec iovs[SERVER_BATCH_SIZE];
+    struct sockaddr_un addrs[SERVER_BATCH_SIZE];
+    char bufs[SERVER_BATCH_SIZE][SERVER_MSG_MAX + 1];
+    union {
+        char buf[CMSG_SPACE(sizeof(struct ucred))];
+        struct cmsghdr align;
+    } ctrls[SERVER_BATCH_SIZE];
+};
+
+/**
+ * @brief Structure holding the replies queued during a batch.
+ */
+struct outbox {
+    struct mmsghdr msgs[SERVER_BATCH_SIZE];
+    struct iovec iovs[SERVER_BATCH_SIZE];
+    struct sockaddr_un addrs[SERVER_BATCH_SIZE];
+    char bufs[SERVER_BATCH_SIZE][sizeof(struct proto_header) + SERVER_REPLY_MAX];
+    int n_msgs;
+};
+
+/**
+ * @brief Structure holding the sender of a request whose reply is deferred.
+ */
+struct server_deferred {
+    int fd;
+    struct connection *conn; /**<< Connection of the request, or `NULL` */
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    bool framed;                /**<< Whether the request was a binary frame */
+    struct proto_header header; /**<< Header of the request if framed */
+    int opcode;
+    uint64_t start_ns; /**<< When the request was dispatched */
+};
+
+static struct inbox inbox;
+static struct outbox outbox;
+
+static struct connection *connections[SERVER_MAX_CONNECTIONS];
+static int n_connections = 0;
+
+/* Socket and sender of the request currently being dispatched. Requests read
+ * from a connection have no address, the reply goes back over `current_fd`. */
+static int current_fd = -1;
+static struct connection *current_conn = NULL;
+static bool current_replied = false;
+static struct sockaddr_un *current_addr = NULL;
+static socklen_t current_addr_len = 0;
+static struct ucred *current_cred = NULL;
+
+/* Header of the current request if it is a binary frame, `NULL` for a text
+ * request. Replies to binary requests are framed with a matching header. */
+static struct proto_header *current_header = NULL;
+
+/* What the metrics record about the current request, see metrics.h */
+static int current_opcode = 0;
+static uint64_t current_start = 0;
+static bool current_bad = false;
+static bool current_deferred = false;
+
+static void flush_replies(int fd)
+{
+    int i = 0;
+    int sent;
+
+    while (i < outbox.n_msgs) {
+        sent = sendmmsg(fd, &outbox.msgs[i], outbox.n_msgs - i,
+                        MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent == -1) {
+            /* Drop the reply that failed, e.g. the client has gone away */
+            LOG_ERR("sendmmsg: %s '%s'", strerror(errno),
+                    outbox.addrs[i].sun_path);
+            i++;
+            continue;
+        }
+        i += sent;
+    }
+
+    outbox.n_msgs = 0;
+}
+
+static void queue_reply(const struct iovec *iov, int iovcnt, uint32_t cursor)
+{
+    struct proto_header header;
+    size_t offset = 0;
+    size_t payload;
+    size_t len;
+    int i, j;
+
+    if (current_conn == NULL &&
+        (current_addr == NULL || current_addr_len <= sizeof(sa_family_t))) {
+        LOG_ERR("No address to reply to");
+        return;
+    }
+
+    if (outbox.n_msgs == SERVER_BATCH_SIZE) {
+        flush_replies(current_fd);
+    }
+
+    i = outbox.n_msgs++;
+
+    if (current_header != NULL) {
+        offset = sizeof(header);
+    }
+    payload = offset;
+
+    /* Gather the reply parts into the outbox */
+    for (j = 0; j < iovcnt; j++) {
+        len = iov[j].iov_len;
+        if (offset + len > sizeof(outbox.bufs[i])) {
+            LOG_ERR("Reply truncated");
+            len = sizeof(outbox.bufs[i]) - offset;
+        }
+        memcpy(outbox.bufs[i] + offset, iov[j].iov_base, len);
+        offset += len;
+    }
+    current_bad = offset - payload == 4 &&
+                  memcmp(outbox.bufs[i] + payload, "BAD\n", 4) == 0;
+
+    if (current_header != NULL) {
+        header = *current_header;
+        header.flags = cursor != 0 ? PROTO_FLAG_MORE : 0;
+        header.length = offset - sizeof(header);
+        header.cursor = cursor;
+        memcpy(outbox.bufs[i], &header, sizeof(header));
+    }
+
+    outbox.iovs[i].iov_base = outbox.bufs[i];
+    outbox.iovs[i].iov_len = offset;
+
+    memset(&outbox.msgs[i].msg_hdr, 0, sizeof(outbox.msgs[i].msg_hdr));
+    if (current_conn == NULL) {
+        memcpy(&outbox.addrs[i], current_addr, current_addr_len);
+        outbox.msgs[i].msg_hdr.msg_name = &outbox.addrs[i];
+        outbox.msgs[i].msg_hdr.msg_namelen = current_addr_len;
+    }
+    outbox.msgs[i].msg_hdr.msg_iov = &outbox.iovs[i];
+    outbox.msgs[i].msg_hdr.msg_iovlen = 1;
+
+    current_replied = true;
+}
+
+void server_replyv(const struct iovec *iov, int iovcnt)
+{
+    queue_reply(iov, iovcnt, 0);
+}
+
+void server_reply_page(const struct iovec *iov, int iovcnt, uint32_t cursor)
+{
+    queue_reply(iov, iovcnt, cursor);
+}
+
+void server_reply(const char *buf, size_t len)
+{
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+
+    queue_reply(&iov, 1, 0);
+}
+
+struct server_deferred *server_defer_reply(void)
+{
+    struct server_deferred *d;
+
+    if (current_conn == NULL &&
+        (current_addr == NULL || current_addr_len <= sizeof(sa_family_t))) {
+        return NULL;
+    }
+
+    d = malloc(sizeof(*d));
+    if (d == NULL) {
+        return NULL;
+    }
+
+    d->fd = current_fd;
+    d->conn = current_conn;
+    d->addr_len = 0;
+    if (current_conn == NULL) {
+        memcpy(&d->addr, current_addr, current_addr_len);
+        d->addr_len = current_addr_len;
+    } else {
+        current_conn->waiting = true;
+    }
+    d->framed = current_header != NULL;
+    if (d->framed) {
+        d->header = *current_header;
+    }
+    d->opcode = current_opcode;
+    d->start_ns = current_start;
+
+    current_replied = true;
+    current_deferred = true;
+
+    return d;
+}
+
+static void resume_connection(struct connection *conn);
+
+void server_resume(struct server_deferred *d, void (*func)(void *ctx),
+                   void *ctx)
+{
+    int fd = current_fd;
+    struct connection *conn = current_conn;
+    struct sockaddr_un *addr = current_addr;
+    socklen_t addr_len = current_addr_len;
+    struct proto_header *header = current_header;
+    struct ucred *cred = current_cred;
+    int opcode = current_opcode;
+    uint64_t start = current_start;
+    bool replied = current_replied;
+    bool bad = current_bad;
+    bool deferred = current_deferred;
+
+    /* The reply may be sent while a batch is being handled, whose queued
+     * replies go out first */
+    if (outbox.n_msgs > 0) {
+        flush_replies(current_fd);
+    }
+
+    current_fd = d->fd;
+    current_conn = d->conn;
+    current_addr = d->conn == NULL ? &d->addr : NULL;
+    current_addr_len = d->addr_len;
+    current_header = d->framed ? &d->header : NULL;
+    current_cred = d->conn != NULL ? &d->conn->cred : NULL;
+    current_opcode = d->opcode;
+    current_start = d->start_ns;
+
+    current_replied = false;
+    current_deferred = false;
+    func(ctx);
+    if (!current_replied) {
+        server_reply("BAD\n", 4);
+    }
+    flush_replies(d->fd);
+
+    /* `func` may have deferred the reply again */
+    if (!current_deferred) {
+        metrics_record(d->opcode, d->start_ns,
+                       current_bad ? METRICS_BAD : METRICS_OK);
+
+        if (d->conn != NULL) {
+            d->conn->waiting = false;
+            if (d->conn->paused) {
+                resume_connection(d->conn);
+            }
+        }
+    }
+
+    current_fd = fd;
+    current_conn = conn;
+    current_addr = addr;
+    current_addr_len = addr_len;
+    current_header = header;
+    current_cred = cred;
+    current_opcode = opcode;
+    current_start = start;
+    current_replied = replied;
+    current_bad = bad;
+    current_deferred = deferred;
+
+    free(d);
+}
+
+/**
+ * @brief Reads the parent PID of `pid` from procfs.
+ *
+ * @return The parent PID, or -1 if it cannot be determined.
+ */
+static pid_t get_parent_pid(pid_t pid)
+{
+    char path[32];
+    char buf[512];
+    char *p;
+    size_t n;
+    FILE *f;
+    int ppid;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    /* The command name may contain spaces and parentheses, so skip past the
+     * last closing parenthesis before reading the state and parent PID */
+    p = strrchr(buf, ')');
+    if (p == NULL || sscanf(p + 1, " %*c %d", &ppid) != 1) {
+        return -1;
+    }
+
+    return ppid;
+}
+
+bool server_sender_owns_pid(int pid)
+{
+    pid_t p;
+    int depth;
+
+    if (current_cred == NULL || pid <= 1) {
+        return false;
+    }
+
+    p = current_cred->pid;
+    for (depth = 0; depth < SERVER_MAX_ANCESTRY && p > 1; depth++) {
+        if (p == pid) {
+            return true;
+        }
+        p = get_parent_pid(p);
+    }
+
+    return false;
+}
+
+/**
+ * @brief Extracts the sender credentials from a received message.
+ *
+ * @return Pointer to the credentials, or `NULL` if none were attached.
+ */
+static struct ucred *get_credentials(struct msghdr *hdr)
+{
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_CREDENTIALS) {
+            return (struct ucred *)CMSG_DATA(cmsg);
+        }
+    }
+
+    return NULL;
+}
+
+static void handle_request(char *buf, size_t len)
+{
+    struct proto_request req;
+    uint64_t start = metrics_now();
+    int err;
+
+    current_replied = false;
+    current_bad = false;
+    current_deferred = false;
+
+    if (len > 0 && buf[0] == PROTO_MAGIC) {
+        err = proto_parse_request(buf, len, &req);
+
+        /* Frame the reply even if only the header could be read */
+        if (len >= sizeof(req.header)) {
+            current_header = &req.header;
+        }
+    } else {
+        err = proto_parse_text_request(buf, &req);
+    }
+
+    if (!err) {
+        current_opcode = req.header.opcode;
+        current_start = start;
+        dispatch_command(&req);
+    }
+
+    /* Every request on a connection gets exactly one reply, so the client can
+     * match replies to requests by order alone */
+    if (current_conn != NULL && !current_replied) {
+        server_reply("BAD\n", 4);
+    }
+
+    /* Deferred requests are recorded once they are answered */
+    if (err || req.header.opcode >= PROTO_OP_NUM) {
+        metrics_record_malformed();
+    } else if (!current_replied) {
+        metrics_record(req.header.opcode, start, METRICS_DROPPED);
+    } else if (!current_deferred) {
+        metrics_record(req.header.opcode, start,
+                       current_bad ? METRICS_BAD : METRICS_OK);
+    }
+
+    current_header = NULL;
+}
+
+static int receive_batch(int fd)
+{
+    int i;
+    int n;
+
+    for (i = 0; i < SERVER_BATCH_SIZE; i++) {
+        inbox.iovs[i].iov_base = inbox.bufs[i];
+        inbox.iovs[i].iov_len = SERVER_MSG_MAX;
+
+        memset(&inbox.msgs[i].msg_hdr, 0, sizeof(inbox.msgs[i].msg_hdr));
+        inbox.msgs[i].msg_hdr.msg_name = &inbox.addrs[i];
+        inbox.msgs[i].msg_hdr.msg_namelen = sizeof(inbox.addrs[i]);
+        inbox.msgs[i].msg_hdr.msg_iov = &inbox.iovs[i];
+        inbox.msgs[i].msg_hdr.msg_iovlen = 1;
+        inbox.msgs[i].msg_hdr.msg_control = inbox.ctrls[i].buf;
+        inbox.msgs[i].msg_hdr.msg_controllen = sizeof(inbox.ctrls[i].buf);
+    }
+
+    n = recvmmsg(fd, inbox.msgs, SERVER_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            LOG_ERR("recvmmsg: %s", strerror(errno));
+        }
+        return 0;
+    }
+
+    return n;
+}
+
+void server_handle_datagrams(int fd, uint32_t events, void *ctx)
+{
+    uid_t uid = getuid();
+    uint32_t received = 0;
+    int round;
+    int n, i;
+
+    for (round = 0; round < SERVER_MAX_ROUNDS; round++) {
+        n = receive_batch(fd);
+        received += n;
+
+        current_fd = fd;
+        for (i = 0; i < n; i++) {
+            if (inbox.msgs[i].msg_len == 0) {
+                continue;
+            }
+            inbox.bufs[i][inbox.msgs[i].msg_len] = '\0';
+
+            current_cred = get_credentials(&inbox.msgs[i].msg_hdr);
+            if (current_cred == NULL || current_cred->uid != uid) {
+                LOG_ERR("Dropping request from another user");
+                continue;
+            }
+
+            current_addr = &inbox.addrs[i];
+            current_addr_len = inbox.msgs[i].msg_hdr.msg_namelen;
+            handle_request(inbox.bufs[i], inbox.msgs[i].msg_len);
+        }
+        current_addr = NULL;
+        current_addr_len = 0;
+        current_cred = NULL;
+
+        flush_replies(fd);
+
+        /* A short batch means the socket has been drained */
+        if (n < SERVER_BATCH_SIZE) {
+            break;
+        }
+    }
+
+    metrics_record_wakeup(received);
+}
+
+static void close_connection(struct connection *conn)
+{
+    struct connection *last;
+    int i;
+
+    event_del_fd(conn->fd);
+    close(conn->fd);
+
+    for (i = conn->next_held; i < conn->n_held; i++) {
+        free(conn->held[i].buf);
+    }
+
+    /* Move the last connection into the freed slot */
+    last = connections[--n_connections];
+    connections[conn->index] = last;
+    last->index = conn->index;
+    connections[n_connections] = NULL;
+
+    free(conn);
+}
+
+/**
+ * @brief Holds the requests of a batch received after a deferred one.
+ *
+ * @param conn The connection.
+ * @param first Index of the first request to hold in the inbox.
+ * @param n Number of requests in the inbox.
+ */
+static void hold_requests(struct connection *conn, int first, int n)
+{
+    struct held_request *held;
+    size_t len;
+    int i;
+
+    conn->n_held = 0;
+    conn->next_held = 0;
+
+    for (i = first; i < n; i++) {
+        len = inbox.msgs[i].msg_len;
+        if (len == 0) {
+            continue;
+        }
+
+        held = &conn->held[conn->n_held++];
+        held->len = len;
+        held->buf = malloc(len + 1);
+        if (held->buf == NULL) {
+            LOG_ERR("malloc: %s", strerror(errno));
+            continue;
+        }
+        memcpy(held->buf, inbox.bufs[i], len);
+        held->buf[len] = '\0';
+    }
+}
+
+/**
+ * @brief Stops reading a connection until its deferred reply is sent.
+ */
+static void pause_connection(struct connection *conn)
+{
+    event_del_fd(conn->fd);
+    conn->paused = true;
+}
+
+static void handle_connection(int fd, uint32_t events, void *ctx);
+
+/**
+ * @brief Handles the requests held by a connection whose deferred reply was
+ *        just sent, then reads it again.
+ *
+ * This function is called with the connection as the current sender.
+ */
+static void resume_connection(struct connection *conn)
+{
+    struct held_request *held;
+
+    conn->paused = false;
+
+    while (conn->next_held < conn->n_held) {
+        held = &conn->held[conn->next_held++];
+        if (held->buf != NULL) {
+            handle_request(held->buf, held->len);
+            free(held->buf);
+        } else {
+            server_reply("BAD\n", 4);
+        }
+
+        if (conn->waiting) {
+            flush_replies(conn->fd);
+            conn->paused = true;
+            return;
+        }
+    }
+    conn->n_held = 0;
+    conn->next_held = 0;
+
+    flush_replies(conn->fd);
+
+    if (event_add_fd(conn->fd, EPOLLIN | EPOLLRDHUP, handle_connection,
+                     conn)) {
+        close_connection(conn);
+    }
+}
+
+static void handle_connection(int fd, uint32_t events, void *ctx)
+{
+    struct connection *conn = ctx;
+    int round;
+    int n, i;
+
+    current_fd = fd;
+    current_conn = conn;
+    current_cred = &conn->cred;
+
+    for (round = 0; round < SERVER_MAX_ROUNDS && !conn->waiting; round++) {
+        n = receive_batch(fd);
+
+        for (i = 0; i < n; i++) {
+            if (inbox.msgs[i].msg_len == 0) {
+                continue;
+            }
+            inbox.bufs[i][inbox.msgs[i].msg_len] = '\0';
+
+            handle_request(inbox.bufs[i], inbox.msgs[i].msg_len);
+
+            /* Later requests wait for the deferred reply, to keep the order
+             * of the connection's replies */
+            if (conn->waiting) {
+                hold_requests(conn, i + 1, n);
+                break;
+            }
+        }
+
+        flush_replies(fd);
+
+        if (n < SERVER_BATCH_SIZE) {
+            break;
+        }
+    }
+
+    current_conn = NULL;
+    current_cred = NULL;
+
+    /* A hang up is noticed once the connection is read again */
+    if (conn->waiting) {
+        pause_connection(conn);
+    } else if (events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+        close_connection(conn);
+    }
+}
+
+void server_handle_connections(int fd, uint32_t events, void *ctx)
+{
+    struct connection *conn;
+    socklen_t len;
+    int cfd;
+    int err;
+
+    while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) !=
+           -1) {
+        if (n_connections == SERVER_MAX_CONNECTIONS) {
+            LOG_ERR("Too many connections");
+            close(cfd);
+            continue;
+        }
+
+        conn = malloc(sizeof(*conn));
+        if (conn == NULL) {
+            LOG_ERR("malloc: %s", strerror(errno));
+            close(cfd);
+            continue;
+        }
+        conn->fd = cfd;
+        conn->waiting = false;
+        conn->paused = false;
+        conn->n_held = 0;
+        conn->next_held = 0;
+
+        len = sizeof(conn->cred);
+        err = getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &conn->cred, &len);
+        if (err == -1 || conn->cred.uid != getuid()) {
+            LOG_ERR("Dropping connection from another user");
+            close(cfd);
+            free(conn);
+            continue;
+        }
+
+        if (event_add_fd(cfd, EPOLLIN | EPOLLRDHUP, handle_connection, conn)) {
+            close(cfd);
+            free(conn);
+            continue;
+        }
+
+        conn->index = n_connections;
+        connections[n_connections++] = conn;
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG_ERR("accept4: %s", strerror(errno));
+    }
+}
+
+void server_deinit(void)
+{
+    while (n_connections > 0) {
+        close_connection(connections[n_connections - 1]);
+    }
+}
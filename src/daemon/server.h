@@ -0,0 +1,159 @@
+/**
+ * @file server.h
+ * @brief Batched request handling for the nav socket.
+ *
+ * This header defines the interface used by the event loop to service the
+ * nav datagram socket, and the interface used by command handlers to reply
+ * to the request currently being dispatched.
+ *
+ * Requests are drained from the socket in batches using `recvmmsg()`. Replies
+ * produced while dispatching a batch are queued and flushed together using
+ * `sendmmsg()` once the whole batch has been handled.
+ *
+ * The nav socket has `SO_PASSCRED` enabled, so every request carries the
+ * kernel verified credentials of its sender. Requests from other users are
+ * dropped.
+ *
+ * Long-lived clients can instead connect to the `SOCK_SEQPACKET` stream socket
+ * and send any number of requests over the connection. Each connection keeps
+ * its own state, holding the peer credentials read when it was accepted, and
+ * every request sent on it receives exactly one reply, in order.
+ */
+
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Maximum number of datagrams received or sent per system call */
+#define SERVER_BATCH_SIZE 32
+
+/* Maximum size of a single request datagram, enough for two paths */
+#define SERVER_MSG_MAX 8192
+
+/* Maximum size of a single reply payload */
+#define SERVER_REPLY_MAX 8192
+
+/* Maximum number of open stream connections */
+#define SERVER_MAX_CONNECTIONS 128
+
+/**
+ * @brief Services a readable nav socket.
+ *
+ * This function is an `event_func` callback. It drains pending requests from
+ * `fd`, dispatches each of them, and flushes the queued replies.
+ *
+ * @param fd The nav socket file descriptor.
+ * @param events The epoll events reported for `fd`.
+ * @param ctx Unused.
+ */
+void server_handle_datagrams(int fd, uint32_t events, void *ctx);
+
+/**
+ * @brief Accepts pending connections on the stream socket.
+ *
+ * This function is an `event_func` callback. Each accepted connection from the
+ * daemon's user is added to the event loop, and is serviced until the peer
+ * closes it.
+ *
+ * @param fd The listening stream socket file descriptor.
+ * @param events The epoll events reported for `fd`.
+ * @param ctx Unused.
+ */
+void server_handle_connections(int fd, uint32_t events, void *ctx);
+
+/**
+ * @brief Closes all open stream connections.
+ */
+void server_deinit(void);
+
+/**
+ * @brief Queues a reply to the sender of the current request.
+ *
+ * This function must only be called by command handlers while a request is
+ * being dispatched. The reply is copied, so `buf` may be reused immediately.
+ * Replies longer than `SERVER_REPLY_MAX` are truncated. Replies to binary
+ * requests are framed with a header echoing the request's opcode.
+ *
+ * @param buf Pointer to the reply payload.
+ * @param len Length of the reply payload in bytes.
+ */
+void server_reply(const char *buf, size_t len);
+
+/**
+ * @brief Queues a reply gathered from several buffers.
+ *
+ * This function behaves like `server_reply()`, but the payload is the
+ * concatenation of the `iovcnt` buffers in `iov`. This lets handlers reply
+ * with stored strings directly rather than formatting them into a temporary
+ * buffer first.
+ *
+ * @param iov Array of buffers making up the reply payload.
+ * @param iovcnt Number of buffers in `iov`.
+ */
+void server_replyv(const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Queues one page of a listing.
+ *
+ * This function behaves like `server_replyv()`. If `cursor` is non-zero, the
+ * reply is marked as continuing, and the client fetches the next page by
+ * repeating its request with `cursor`. Text requests cannot be continued, so
+ * they only ever receive the first page.
+ *
+ * @param iov Array of buffers making up the page.
+ * @param iovcnt Number of buffers in `iov`.
+ * @param cursor Where the next page starts, or 0 if this is the last page.
+ */
+void server_reply_page(const struct iovec *iov, int iovcnt, uint32_t cursor);
+
+/**
+ * @brief Opaque structure holding the sender of a deferred reply.
+ */
+struct server_deferred;
+
+/**
+ * @brief Defers the reply to the current request.
+ *
+ * Command handlers waiting on the writer thread or a path check use this
+ * function to reply once the work is done, without blocking other requests.
+ * A connection is not read while one of its replies is deferred, and the
+ * requests it already sent are held, so its replies keep their order.
+ *
+ * @return The sender, to pass to `server_resume()`, or `NULL` if the
+ *         reply cannot be deferred and must be queued as usual.
+ */
+struct server_deferred *server_defer_reply(void);
+
+/**
+ * @brief Finishes a deferred request.
+ *
+ * This function can be called at any time on the event loop. It runs `func`
+ * as if the request were being dispatched again: `server_reply()` and the
+ * like answer its sender, and the reply is sent as soon as `func` returns.
+ * A request `func` leaves unanswered gets "BAD". `func` may defer the reply
+ * again with `server_defer_reply()`.
+ *
+ * @param d The sender returned by `server_defer_reply()`, which is freed.
+ * @param func Function replying to the request.
+ * @param ctx Passed to `func`.
+ */
+void server_resume(struct server_deferred *d, void (*func)(void *ctx),
+                   void *ctx);
+
+/**
+ * @brief Checks whether the current request was sent on behalf of `pid`.
+ *
+ * A request is sent on behalf of `pid` if the sender's kernel verified PID is
+ * `pid`, or if `pid` is an ancestor of the sender. The latter covers a client
+ * process run from a shell, which names the shell's PID in its requests.
+ *
+ * @param pid The PID named in the request.
+ * @return `true` if the sender is `pid` or one of its descendants.
+ */
+bool server_sender_owns_pid(int pid);
+
+#endif /* SERVER_H_ */
@@ -3,13 +3,22 @@
  * @brief Implementation of shell node state storage and utility functions.
  *
  * This file provides the implementation for managing shell nodes in the shell
- * list.
+ * map, and their action stacks. Shells are allocated from a slab pool.
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "event.h"
+#include "intern.h"
+#include "pool.h"
 #include "shell.h"
-#include "list.h"
+
+static struct slab_pool shell_pool = SLAB_POOL_INIT("shell", struct shell);
+
+/* Slots of action stacks, sized by the first stack created */
+static struct slab_pool stack_pool = {.name = "action stack"};
 
 int compare_shell_pid(void *data, void *key)
 {
@@ -23,38 +32,123 @@ int compare_shell_pid(void *data, void *key)
     return 1;
 }
 
+struct shell *shell_create(int pid, uint32_t depth)
+{
+    struct shell *s;
+
+    s = (struct shell *)pool_alloc(&shell_pool);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->pid = pid;
+    s->pidfd = -1;
+    if (action_stack_init(&s->actions, depth)) {
+        pool_free(&shell_pool, s);
+        return NULL;
+    }
+
+    return s;
+}
+
 int cleanup_shell(void *data)
 {
     struct shell *s = (struct shell *)data;
-    struct action *a;
 
-    while (s->actions.n_items > 0) {
-        a = (struct action *)s->actions.head->data;
-        list_delete_node(&s->actions, a->path);
+    if (s->pidfd != -1) {
+        event_del_fd(s->pidfd);
+        close(s->pidfd);
+    }
+    action_stack_deinit(&s->actions);
+    pool_free(&shell_pool, s);
+    return 0;
+}
+
+int action_stack_init(struct action_stack *stack, uint32_t depth)
+{
+    size_t size = depth * sizeof(struct action);
+
+    memset(stack, 0, sizeof(*stack));
+    stack->depth = depth;
+
+    /* Every stack in the daemon has the same depth, so the slots are one
+     * object of the stack pool. Stacks of other sizes fall back to the heap. */
+    if (stack_pool.obj_size == 0) {
+        stack_pool.obj_size = size;
+    }
+    if (size == stack_pool.obj_size) {
+        stack->slots = (struct action *)pool_alloc(&stack_pool);
+    } else {
+        stack->slots = (struct action *)malloc(size);
+    }
+    if (stack->slots == NULL) {
+        return 1;
     }
 
-    free(data);
     return 0;
 }
 
-int compare_action_path(void *data, void *key)
+void action_stack_deinit(struct action_stack *stack)
 {
-    struct action *a = (struct action *)data;
-    char *path = (char *)key;
+    action_clear(stack);
 
-    if (!strcmp(a->path, path)) {
-        return 0;
+    if (stack->slots != NULL &&
+        stack->depth * sizeof(struct action) == stack_pool.obj_size) {
+        pool_free(&stack_pool, stack->slots);
+    } else {
+        free(stack->slots);
     }
+    memset(stack, 0, sizeof(*stack));
+}
 
-    return 1;
+static struct action *slot(const struct action_stack *stack, uint32_t i)
+{
+    return &stack->slots[(stack->oldest + i) % stack->depth];
 }
 
-int cleanup_action(void *data)
+void action_push(struct action_stack *stack, const char *path)
 {
-    struct action *a = (struct action *)data;
+    if (stack->n_items == stack->depth) {
+        intern_put(slot(stack, 0)->path);
+        stack->oldest = (stack->oldest + 1) % stack->depth;
+        stack->n_items--;
+    }
 
-    free(a->path);
-    free(data);
+    slot(stack, stack->n_items)->path = path;
+    stack->n_items++;
+}
 
-    return 0;
+const char *action_peek(const struct action_stack *stack, uint32_t i,
+                        uint32_t *len)
+{
+    const char *path;
+
+    if (i >= stack->n_items) {
+        return NULL;
+    }
+
+    path = slot(stack, stack->n_items - 1 - i)->path;
+    if (len != NULL) {
+        *len = intern_len(path);
+    }
+
+    return path;
+}
+
+void action_pop(struct action_stack *stack)
+{
+    if (stack->n_items == 0) {
+        return;
+    }
+
+    stack->n_items--;
+    intern_put(slot(stack, stack->n_items)->path);
+}
+
+void action_clear(struct action_stack *stack)
+{
+    while (stack->n_items > 0) {
+        action_pop(stack);
+    }
+    stack->oldest = 0;
 }
@@ -3,42 +3,60 @@
  * @brief Shell node state storage and utility functions.
  *
  * This header defines the `struct shell` used to store state for each shell in
- * the shell list. It also provides function declarations for comparing shell
- * nodes by PID and for cleaning up shell data.
+ * the shell map. It also provides function declarations for comparing shell
+ * nodes by PID, for cleaning up shell data, and for operating on a shell's
+ * bounded action stack.
  */
 
 #ifndef SHELL_H_
 #define SHELL_H_
 
-#include <sys/un.h>
+#include <stdint.h>
 
-#include "list.h"
+/* Number of actions kept per shell when `NAV_ACTION_DEPTH` is not set */
+#define ACTION_DEPTH_DEFAULT 128
+
+/* Largest number of actions kept per shell */
+#define ACTION_DEPTH_MAX 65536
 
 /**
- * @brief Structure representing a shell node.
+ * @brief Structure representing an entry in the action stack.
+ */
+struct action {
+    const char *path; /**<< Interned, see intern.h */
+};
+
+/**
+ * @brief Structure representing a shell's action stack.
  *
- * This structure stores information about a shell registered with navd.
+ * The stack is a ring of `depth` actions, allocated once, so pushing and
+ * popping never allocate. Each action holds a reference to an interned path,
+ * so a path pushed by many shells is stored once. When the ring is full, the
+ * oldest action is evicted to make room.
  */
-struct shell {
-    int pid;
-    struct sockaddr_un sock_addr;
-    struct list actions;
+struct action_stack {
+    struct action *slots;
+    uint32_t depth;   /**<< Number of slots */
+    uint32_t oldest;  /**<< Slot of the oldest action */
+    uint32_t n_items; /**<< Number of actions on the stack */
 };
 
 /**
- * @brief Structure representing a node in the action stack.
+ * @brief Structure representing a shell node.
  *
- * This structure stores information about an action in the action stack.
+ * This structure stores information about a shell registered with navd.
  */
-struct action {
-    char *path;
+struct shell {
+    int pid;
+    int pidfd; /**<< Readable once the shell exits, or -1 if not watched */
+    struct action_stack actions;
 };
 
 /**
  * @brief Compares the PID of a shell node with a given key.
  *
  * This function compares the PID stored in a shell node with a given PID key.
- * It is used as a comparison function for list operations (e.g., searching for
+ * It is used as a comparison function for map operations (e.g., searching for
  * a shell node).
  *
  * @param data Pointer to the `struct shell` to be compared.
@@ -47,11 +65,21 @@ struct action {
  */
 int compare_shell_pid(void *data, void *key);
 
+/**
+ * @brief Creates a shell node with an empty action stack.
+ *
+ * @param pid The PID of the shell.
+ * @param depth Number of actions the shell's stack holds.
+ * @return Pointer to the new shell node, or `NULL` on failure.
+ */
+struct shell *shell_create(int pid, uint32_t depth);
+
 /**
  * @brief Cleans up and deallocates memory for a shell node.
  *
- * This function frees the memory associated with a shell node. It is used as a
- * cleanup function when removing shell nodes from the list.
+ * This function frees the memory associated with a shell node, and stops
+ * watching the shell's pidfd. It is used as a cleanup function when removing
+ * shell nodes from the map.
  *
  * @param data Pointer to the `struct shell` to be cleaned up.
  * @return 0 on success.
@@ -59,17 +87,54 @@ int compare_shell_pid(void *data, void *key);
 int cleanup_shell(void *data);
 
 /**
- * @brief Cleans up and deallocates memory for a shell's action stack node.
+ * @brief Allocates an empty action stack.
  *
- * This function frees the memory associated with each action in the action
- * list `actions`. It is used as a cleanup function when removing actions nodes
- * from the action list.
+ * @param stack Pointer to the stack.
+ * @param depth Number of actions the stack holds before evicting the oldest.
+ * @return 0 on success, non-zero on failure.
+ */
+int action_stack_init(struct action_stack *stack, uint32_t depth);
+
+/**
+ * @brief Releases the storage of an action stack.
  *
- * @param data Pointer to the `struct action` to be cleaned up.
- * @return 0 on success.
+ * @param stack Pointer to the stack.
+ */
+void action_stack_deinit(struct action_stack *stack);
+
+/**
+ * @brief Pushes a path onto an action stack, evicting the oldest action if
+ *        the stack is full.
+ *
+ * @param stack Pointer to the stack.
+ * @param path An interned path. The stack takes over the caller's reference.
  */
-int cleanup_action(void *data);
+void action_push(struct action_stack *stack, const char *path);
 
-int compare_action_path(void *data, void *key);
+/**
+ * @brief Retrieves an action's path, counting from the top of the stack.
+ *
+ * @param stack Pointer to the stack.
+ * @param i Position of the action, 0 for the most recent.
+ * @param len Set to the length of the path, if not `NULL`.
+ * @return The interned path, valid until the stack is next changed, or `NULL`
+ *         if there is no such action.
+ */
+const char *action_peek(const struct action_stack *stack, uint32_t i,
+                        uint32_t *len);
+
+/**
+ * @brief Removes the most recent action from the stack, if any.
+ *
+ * @param stack Pointer to the stack.
+ */
+void action_pop(struct action_stack *stack);
+
+/**
+ * @brief Removes every action from the stack.
+ *
+ * @param stack Pointer to the stack.
+ */
+void action_clear(struct action_stack *stack);
 
 #endif /* SHELL_H_ */
@@ -12,8 +12,10 @@
 #include <errno.h>
 
 #include "state.h"
-#include "list.h"
+#include "hashmap.h"
+#include "intern.h"
 #include "log.h"
+#include "pool.h"
 
 /**
  * @brief Static instance of the global state.
@@ -39,22 +41,38 @@ int init_state(void)
                sizeof(singleton_state->cache_dir));
         memset(singleton_state->nav_socket_path, 0,
                sizeof(singleton_state->nav_socket_path));
+        memset(singleton_state->stream_socket_path, 0,
+               sizeof(singleton_state->stream_socket_path));
         memset(singleton_state->tagfile_path, 0,
                sizeof(singleton_state->tagfile_path));
+        memset(singleton_state->snapshot_path, 0,
+               sizeof(singleton_state->snapshot_path));
+        memset(singleton_state->frecency_path, 0,
+               sizeof(singleton_state->frecency_path));
         singleton_state->uname = NULL;
         singleton_state->sfd = -1;
+        singleton_state->lfd = -1;
+        singleton_state->abstract_sfd = -1;
+        singleton_state->abstract_lfd = -1;
 
-        /* Setup shell list */
-        singleton_state->shells.head = NULL;
-        singleton_state->shells.n_items = 0;
-        singleton_state->shells.compare_func = NULL;
-        singleton_state->shells.cleanup_func = NULL;
+        /* Setup shell map */
+        memset(&singleton_state->shells, 0, sizeof(singleton_state->shells));
+        singleton_state->shells_reaped = 0;
 
-        /* Setup tag list */
-        singleton_state->tags.head = NULL;
-        singleton_state->tags.n_items = 0;
-        singleton_state->tags.compare_func = NULL;
-        singleton_state->tags.cleanup_func = NULL;
+        /* Setup tag map */
+        memset(&singleton_state->tags, 0, sizeof(singleton_state->tags));
+        memset(&singleton_state->tag_tree, 0,
+               sizeof(singleton_state->tag_tree));
+        memset(&singleton_state->journal, 0,
+               sizeof(singleton_state->journal));
+        singleton_state->journal.fd = -1;
+
+        /* No snapshot until one is created */
+        memset(&singleton_state->snapshot, 0,
+               sizeof(singleton_state->snapshot));
+
+        /* Setup frecency database */
+        frecency_init(&singleton_state->frecency);
 
         return 0;
     }
@@ -64,8 +82,16 @@ int init_state(void)
 
 void deinit_state(void)
 {
-    list_delete_all(&singleton_state->shells);
-    list_delete_all(&singleton_state->tags);
+    tag_journal_close(&singleton_state->journal);
+    hashmap_delete_all(&singleton_state->shells);
+    frecency_deinit(&singleton_state->frecency);
+    radix_delete_all(&singleton_state->tag_tree);
+    hashmap_delete_all(&singleton_state->tags);
+
+    /* Every record has been returned to its pool and every path released, so
+     * release the slabs */
+    intern_deinit();
+    pool_destroy_all();
 
     free(singleton_state);
 }
@@ -11,7 +11,12 @@
 #define STATE_H_
 
 #include <limits.h>
-#include "list.h"
+#include <stdint.h>
+#include "frecency.h"
+#include "hashmap.h"
+#include "radix.h"
+#include "snapshot.h"
+#include "tag.h"
 
 /* The socket path is cache_dir/<pid>.sock where pid could be could be some
  * integer up to 2^22 (7 byte string). The upper limit on socket paths is
@@ -33,13 +38,28 @@ struct state {
 
     char nav_socket_path[SOCKET_PATH_MAX_LEN]; /**<< Location of the server
                                                   socket file */
+    char stream_socket_path[SOCKET_PATH_MAX_LEN]; /**<< Location of the stream
+                                                     socket file */
     char tagfile_path[PATH_MAX];               /**<< Location of the tag-file */
+    char snapshot_path[PATH_MAX]; /**<< Location of the tag snapshot file */
+    char frecency_path[PATH_MAX]; /**<< Location of the frecency database */
 
     char *uname; /**<< The user who owns this daemon process */
     int sfd;     /**<< File descriptor for the server socket */
+    int lfd;     /**<< File descriptor for the listening stream socket */
+    int abstract_sfd; /**<< Server socket in the abstract namespace, or -1 */
+    int abstract_lfd; /**<< Stream socket in the abstract namespace, or -1 */
 
-    struct list shells; /**<< List of all registered shells */
-    struct list tags;   /**<< List of all known tags */
+    struct hashmap shells; /**<< Map of all registered shells, keyed by PID */
+    uint32_t action_depth; /**<< Number of actions kept per shell */
+    uint64_t shells_reaped; /**<< Shells freed because their process exited */
+    struct hashmap tags;   /**<< Map of all known tags, keyed by tag */
+    struct radix_tree tag_tree; /**<< The same tags, for prefix queries */
+    struct tag_journal journal; /**<< Changes to `tags` since the tag-file */
+
+    struct snapshot snapshot; /**<< Snapshot of `tags` read by clients */
+
+    struct frecency frecency; /**<< Ranked directories the user visited */
 };
 
 /**
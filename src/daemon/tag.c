@@ -2,18 +2,32 @@
  * @file tag.c
  * @brief Implementation of tag storage for navd.
  *
- * This file provides the implementation of the tag list compare and cleanup
- * functions and reading and writing of tag files.
+ * This file provides the implementation of the tag map compare and cleanup
+ * functions, reading tag files and their journals, queueing changes to the
+ * journal on the writer thread, and publishing tag snapshots.
+ * Tags are allocated from a slab pool and their names from the string arena.
+ * Their paths are interned, so a tag and the actions and visited directories
+ * naming the same path share one copy.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "tag.h"
-#include "list.h"
+#include "hashmap.h"
+#include "intern.h"
 #include "log.h"
+#include "pathstat.h"
+#include "pool.h"
 #include "utils.h"
+#include "writer.h"
+
+static struct slab_pool tag_pool = SLAB_POOL_INIT("tag", struct tag);
 
 int compare_tag_tag(void *data, void *key)
 {
@@ -26,111 +40,437 @@ int compare_tag_tag(void *data, void *key)
     return 1;
 }
 
+struct tag *tag_create(const char *tag, size_t tag_len, const char *path)
+{
+    struct tag *tag_data;
+
+    tag_data = (struct tag *)pool_alloc(&tag_pool);
+    if (tag_data == NULL) {
+        LOG_ERR("tag data alloc failed");
+        return NULL;
+    }
+
+    tag_data->tag = arena_strndup(tag, tag_len);
+    tag_data->path = intern(path);
+    if (tag_data->tag == NULL || tag_data->path == NULL) {
+        LOG_ERR("tag data strndup failed");
+        cleanup_tag(tag_data);
+        return NULL;
+    }
+
+    return tag_data;
+}
+
+int tag_set_path(struct tag *tag_data, const char *path)
+{
+    const char *interned;
+
+    interned = intern(path);
+    if (interned == NULL) {
+        return 1;
+    }
+
+    intern_put(tag_data->path);
+    tag_data->path = interned;
+
+    return 0;
+}
+
 int cleanup_tag(void *data)
 {
     struct tag *tag = (struct tag *)data;
 
-    free(tag->tag);
-    free(tag->path);
+    arena_strfree(tag->tag);
+    intern_put(tag->path);
+    pool_free(&tag_pool, tag);
 
     return 0;
 }
 
-int read_tag_file(struct list *tags, char *path)
+/**
+ * @brief Adds or updates the tag on a "tag=tag_path" line.
+ *
+ * @param line The line, which is trimmed in place.
+ */
+static void load_tag(struct hashmap *tags, struct radix_tree *tree, char *line)
 {
-    char *saveptr, *token, *tag = NULL, *tag_path = NULL;
-    char line[256] = {0};
-    struct node *tag_node;
+    char *saveptr = NULL, *token, *tag, *tag_path;
     struct tag *tag_data;
+    int tag_len, path_len;
 
-    FILE *f = fopen(path, "r");
-    if (f == NULL) {
-        LOG_ERR("Unable to open file at %s", path);
+    token = strtok_r(line, "=", &saveptr);
+    if (token == NULL) {
+        LOG_ERR("No tag in token.");
+        return;
+    }
+    tag = token;
+    tag_len = get_trailing_whitespace(token);
+
+    token = strtok_r(NULL, "", &saveptr);
+    if (token == NULL) {
+        LOG_ERR("No tag path in token.");
+        return;
+    }
+    tag_path = token;
+    path_len = get_trailing_whitespace(token);
+
+    /* Both are trimmed in place, as the line is no longer needed */
+    tag[tag_len] = '\0';
+    tag_path[path_len] = '\0';
+
+    tag_data = (struct tag *)hashmap_get(tags, tag);
+    if (tag_data != NULL) {
+        LOG_INF("Tag '%s' already exists. Updating.", tag);
+        if (tag_set_path(tag_data, tag_path)) {
+            LOG_ERR("tag path intern failed");
+        }
+        return;
+    }
+
+    /* Create the tag and add it to the map */
+    tag_data = tag_create(tag, tag_len, tag_path);
+    if (tag_data == NULL) {
+        return;
+    }
+
+    tag = tag_data->tag;
+    if (hashmap_insert(tags, tag, tag_data)) {
+        LOG_ERR("tag insert failed");
+        cleanup_tag(tag_data);
+        return;
+    }
+
+    if (radix_insert(tree, tag, tag_data)) {
+        LOG_ERR("tag tree insert failed");
+        hashmap_delete(tags, tag);
+        return;
+    }
+
+    LOG_INF("Loaded: %s --> %s", tag, tag_data->path);
+}
+
+/**
+ * @brief Deletes the tag on a "tag" line, if it exists.
+ *
+ * @param line The line, which is trimmed in place.
+ */
+static void unload_tag(struct hashmap *tags, struct radix_tree *tree,
+                       char *line)
+{
+    line[get_trailing_whitespace(line)] = '\0';
+
+    /* The map frees the tag, so it goes from the tree first */
+    radix_delete(tree, line);
+    if (hashmap_delete(tags, line) == 0) {
+        LOG_INF("Unloaded: %s", line);
+    }
+}
+
+static int journal_path(char *dest, size_t dest_size, const char *tagfile_path)
+{
+    int err;
+
+    err = snprintf(dest, dest_size, "%s.journal", tagfile_path);
+    if (err < 0 || err >= (int)dest_size) {
+        LOG_ERR("Path too long for tag journal");
         return 1;
     }
 
+    return 0;
+}
+
+/**
+ * @brief Replays the changes in a journal onto the tag map.
+ *
+ * Every change is a line ending in a newline. A last line without one was
+ * cut short by a crash before it was synced, so it is ignored and truncated
+ * from the journal, where the next change would otherwise be appended to it.
+ */
+static void replay_journal(struct hashmap *tags, struct radix_tree *tree,
+                           const char *path)
+{
+    char line[TAG_LINE_MAX];
+    long valid = 0;
+    int n = 0;
+    size_t len;
+
+    FILE *f = fopen(path, "r+");
+    if (f == NULL) {
+        return;
+    }
+
     while (fgets(line, sizeof(line), f)) {
-        if (strcmp(line, "\n") == 0) {
+        len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') {
             break;
         }
+        valid = ftell(f);
+        n++;
 
-        saveptr = NULL;
-
-        token = strtok_r(line, "=", &saveptr);
-        if (token == NULL) {
-            LOG_ERR("No tag in token.");
-            continue;
+        if (line[0] == '+') {
+            load_tag(tags, tree, line + 1);
+        } else if (line[0] == '-') {
+            unload_tag(tags, tree, line + 1);
+        } else {
+            LOG_ERR("Unknown tag journal record '%c'", line[0]);
         }
-        tag = strndup(token, get_trailing_whitespace(token));
+    }
 
-        token = strtok_r(NULL, "", &saveptr);
-        if (token == NULL) {
-            LOG_ERR("No tag path in token.");
-            free(tag);
-            continue;
+    fseek(f, 0, SEEK_END);
+    if (ftell(f) != valid) {
+        LOG_ERR("Truncating torn record at the end of %s", path);
+        if (ftruncate(fileno(f), valid) == -1) {
+            LOG_ERR("ftruncate: %s", strerror(errno));
         }
-        tag_path = strndup(token, get_trailing_whitespace(token));
+    }
 
-        tag_node = list_get_node(tags, tag);
-        if (tag_node != NULL) {
-            LOG_INF("Tag '%s' already exists. Updating.", tag);
-            ((struct tag *)tag_node->data)->path = tag_path;
-            continue;
-        }
+    fclose(f);
 
-        if (!valid_path(tag_path)) {
-            free(tag);
-            free(tag_path);
-            continue;
-        }
+    LOG_INF("Replayed %d tag changes from %s", n, path);
+}
+
+/**
+ * @brief Drops the loaded tags whose path no longer exists.
+ *
+ * Every path is handed to the stat workers before any result is waited for,
+ * so the checks run in parallel, and a hung mount costs one deadline rather
+ * than one per tag. Tags whose check timed out are kept.
+ */
+static void drop_missing(struct hashmap *tags, struct radix_tree *tree)
+{
+    struct tag *tag_data;
+    uint32_t iter = 0;
 
-        /* Create the tag and add it to the list*/
-        if (list_node_create(&tag_node)) {
-            LOG_ERR("tag node create failed");
-            free(tag);
-            free(tag_path);
-            continue;
+    while ((tag_data = (struct tag *)hashmap_next(tags, &iter))) {
+        pathstat_submit(tag_data->path, true, NULL, NULL);
+    }
+
+    iter = 0;
+    while ((tag_data = (struct tag *)hashmap_next(tags, &iter))) {
+        if (pathstat_wait(tag_data->path, true) == PATH_MISSING) {
+            LOG_INF("Dropping tag '%s'", tag_data->tag);
+            radix_delete(tree, tag_data->tag);
+            hashmap_delete(tags, tag_data->tag);
         }
+    }
+}
+
+int read_tag_file(struct hashmap *tags, struct radix_tree *tree, char *path)
+{
+    char jpath[PATH_MAX];
+    char line[TAG_LINE_MAX] = {0};
+    int err = 0;
+
+    /* A missing tag file still leaves the journal to replay */
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        LOG_ERR("Unable to open file at %s", path);
+        err = 1;
+    } else {
+        while (fgets(line, sizeof(line), f)) {
+            if (strcmp(line, "\n") == 0) {
+                break;
+            }
 
-        tag_data = (struct tag *)malloc(sizeof(struct tag));
-        if (tag_data == NULL) {
-            LOG_ERR("tag data malloc create failed");
-            free(tag);
-            free(tag_path);
-            continue;
+            load_tag(tags, tree, line);
         }
 
-        tag_data->tag = tag;
-        tag_data->path = tag_path;
-        tag_node->data = tag_data;
-        list_append_node(tags, tag_node);
+        fclose(f);
+    }
+
+    /* Changes since the tag file was last written */
+    if (journal_path(jpath, sizeof(jpath), path) == 0) {
+        replay_journal(tags, tree, jpath);
+    }
+
+    drop_missing(tags, tree);
+
+    return err;
+}
+
+int tag_journal_open(struct tag_journal *journal, struct hashmap *tags,
+                     const char *tagfile_path)
+{
+    struct stat sb;
+
+    journal->fd = -1;
+    journal->size = 0;
+    journal->lost = false;
+    journal->tags = tags;
+    journal->tagfile_path = tagfile_path;
+
+    if (journal_path(journal->path, sizeof(journal->path), tagfile_path)) {
+        return 1;
+    }
+
+    journal->fd = open(journal->path,
+                       O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (journal->fd == -1) {
+        LOG_ERR("open: %s '%s'", strerror(errno), journal->path);
+        return 1;
+    }
 
-        LOG_INF("Loaded: %s --> %s", tag, tag_path);
+    if (fstat(journal->fd, &sb) == 0) {
+        journal->size = sb.st_size;
     }
 
     return 0;
 }
 
-int write_tag_file(struct list *tags, char *path)
+void tag_journal_close(struct tag_journal *journal)
+{
+    if (journal->fd != -1) {
+        close(journal->fd);
+        journal->fd = -1;
+    }
+}
+
+/**
+ * @brief Notes a change the writer failed to save, see writer.h.
+ */
+static void journal_done(int err, void *ctx)
+{
+    struct tag_journal *journal = (struct tag_journal *)ctx;
+
+    if (err) {
+        journal->lost = true;
+    }
+}
+
+/**
+ * @brief Formats the tag map as the contents of a tag file.
+ *
+ * @param len Set to the length of the contents.
+ * @return The contents, allocated with `malloc()`, or `NULL` on failure.
+ */
+static char *format_tag_file(struct hashmap *tags, size_t *len)
 {
-    struct node *tag_node;
     struct tag *tag_data;
+    uint32_t iter = 0;
+    size_t size = 1;
+    char *buf, *p;
 
-    FILE *f = fopen(path, "w");
-    if (f == NULL) {
-        LOG_ERR("Unable to open file at %s", path);
+    while ((tag_data = (struct tag *)hashmap_next(tags, &iter)) != NULL) {
+        size += strlen(tag_data->tag) + intern_len(tag_data->path) + 2;
+    }
+
+    buf = malloc(size);
+    if (buf == NULL) {
+        LOG_ERR("tag file malloc failed");
+        return NULL;
+    }
+
+    p = buf;
+    iter = 0;
+    while ((tag_data = (struct tag *)hashmap_next(tags, &iter)) != NULL) {
+        p = stpcpy(p, tag_data->tag);
+        *p++ = '=';
+        p = stpcpy(p, tag_data->path);
+        *p++ = '\n';
+    }
+    *p++ = '\n';
+
+    *len = p - buf;
+    return buf;
+}
+
+int tag_journal_compact(struct tag_journal *journal)
+{
+    size_t len;
+    char *buf;
+
+    buf = format_tag_file(journal->tags, &len);
+    if (buf == NULL ||
+        writer_replace(journal->tagfile_path, buf, len, journal->fd,
+                       journal_done, journal)) {
+        journal->lost = true;
         return 1;
     }
 
-    tag_node = tags->head;
-    while (tag_node != NULL) {
-        tag_data = (struct tag *)tag_node->data;
-        fprintf(f, "%s=%s\n", tag_data->tag, tag_data->path);
-        tag_node = tag_node->next;
+    journal->lost = false;
+    journal->size = 0;
+
+    LOG_INF("Compacting tag journal into %s", journal->tagfile_path);
+    return 0;
+}
+
+/**
+ * @brief Queues appending a change to the journal.
+ *
+ * The tag file is rewritten instead if an earlier change was lost, or if the
+ * journal would grow past `TAG_JOURNAL_MAX`.
+ */
+static int journal_change(struct tag_journal *journal, const struct iovec *iov,
+                          int n_iov)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < n_iov; i++) {
+        len += iov[i].iov_len;
+    }
+
+    if (journal->lost || journal->fd == -1 ||
+        journal->size + len > TAG_JOURNAL_MAX ||
+        writer_appendv(journal->fd, iov, n_iov, journal_done, journal)) {
+        return tag_journal_compact(journal);
     }
-    fprintf(f, "\n");
-    fclose(f);
 
-    LOG_INF("Tag file written to %s", path);
+    journal->size += len;
     return 0;
 }
+
+int tag_journal_set(struct tag_journal *journal, const struct tag *tag_data)
+{
+    const struct iovec iov[] = {
+        {.iov_base = "+", .iov_len = 1},
+        {.iov_base = tag_data->tag, .iov_len = strlen(tag_data->tag)},
+        {.iov_base = "=", .iov_len = 1},
+        {.iov_base = (void *)tag_data->path,
+         .iov_len = intern_len(tag_data->path)},
+        {.iov_base = "\n", .iov_len = 1},
+    };
+
+    return journal_change(journal, iov, 5);
+}
+
+int tag_journal_delete(struct tag_journal *journal, const char *tag)
+{
+    const struct iovec iov[] = {
+        {.iov_base = "-", .iov_len = 1},
+        {.iov_base = (void *)tag, .iov_len = strlen(tag)},
+        {.iov_base = "\n", .iov_len = 1},
+    };
+
+    return journal_change(journal, iov, 3);
+}
+
+int publish_tag_snapshot(struct hashmap *tags, struct snapshot *snapshot)
+{
+    struct snapshot_entry *entries;
+    struct tag *tag_data;
+    uint32_t iter = 0;
+    uint32_t n = 0;
+    int err;
+
+    if (snapshot->map == NULL) {
+        return 1;
+    }
+
+    entries = malloc(tags->n_items * sizeof(*entries) + 1);
+    if (entries == NULL) {
+        LOG_ERR("snapshot entries malloc failed");
+        return 1;
+    }
+
+    while ((tag_data = (struct tag *)hashmap_next(tags, &iter)) != NULL) {
+        entries[n].tag = tag_data->tag;
+        entries[n].path = tag_data->path;
+        n++;
+    }
+
+    err = snapshot_publish(snapshot, entries, n);
+    free(entries);
+
+    return err;
+}
@@ -1,26 +1,67 @@
 /**
  * @file tag.h
- * @brief Tag list node storage and utility functions
+ * @brief Tag map node storage and utility functions
  *
  * This header defines the `struct tag`, which stores the entries for the
- * tag list, and the associated struct list comparison and cleanup functions.
+ * tag map, and the associated struct hashmap comparison and cleanup functions.
+ * Tags are keyed by their tag string.
+ *
+ * Tags are stored in a tag file, holding one "tag=tag_path" line per tag, and
+ * a journal next to it. Each change is appended to the journal as a single
+ * line, "+tag=tag_path" when a tag is added or updated and "-tag" when it is
+ * deleted, and synced to disk. Once the journal would grow past
+ * `TAG_JOURNAL_MAX`, the tag file is rewritten from the tag map and the
+ * journal is emptied. Replaying a change twice has no further effect, so a
+ * crash at any point leaves the tag file and journal describing the latest
+ * tags that reached the disk.
+ *
+ * The writes are queued on the writer thread, see writer.h, so saving a
+ * change never blocks. If a change cannot be queued or fails to reach the
+ * journal, the next change rewrites the tag file instead.
  */
 
 #ifndef TAG_H_
 #define TAG_H_
 
-#include "list.h"
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "hashmap.h"
+#include "radix.h"
+#include "snapshot.h"
 
+/* Size in bytes past which the journal is compacted into the tag file */
+#define TAG_JOURNAL_MAX (64 * 1024)
+
+/* Longest line read from the tag file or journal */
+#define TAG_LINE_MAX (PATH_MAX + 256)
+
+/**
+ * @brief Structure representing a node in the tag map.
+ */
 struct tag {
     char *tag;
-    char *path;
+    const char *path; /**<< Interned, see intern.h */
+};
+
+/**
+ * @brief Structure representing the journal of tag changes.
+ */
+struct tag_journal {
+    int fd;               /**<< Open for appending, or -1 */
+    off_t size;           /**<< Bytes queued since the last compaction */
+    bool lost;            /**<< Whether a change failed to reach the journal */
+    struct hashmap *tags; /**<< Tags written to the tag file when compacting */
+    const char *tagfile_path;
+    char path[PATH_MAX];  /**<< The tag file's path with ".journal" appended */
 };
 
 /**
  * @brief Compares the tag of a tag node with a given key.
  *
- * This function compares the tagstored in a tag node with a given tag key.
- * It is used as a comparison function for list operations (e.g., searching for
+ * This function compares the tag stored in a tag node with a given tag key.
+ * It is used as a comparison function for map operations (e.g., searching for
  * a tag node).
  *
  * @param data Pointer to the `struct tag` to be compared.
@@ -29,12 +70,31 @@ struct tag {
  */
 int compare_tag_tag(void *data, void *key);
 
+/**
+ * @brief Creates a tag node holding a copy of a tag and its interned path.
+ *
+ * @param tag The tag.
+ * @param tag_len Number of bytes of `tag` to copy.
+ * @param path The tag's path.
+ * @return Pointer to the new tag node, or `NULL` on failure.
+ */
+struct tag *tag_create(const char *tag, size_t tag_len, const char *path);
+
+/**
+ * @brief Replaces the path of a tag node with the interned `path`.
+ *
+ * @param tag_data Pointer to the `struct tag`.
+ * @param path The new path.
+ * @return 0 on success, non-zero on failure, leaving the old path in place.
+ */
+int tag_set_path(struct tag *tag_data, const char *path);
+
 /**
  * @brief Cleans up and deallocates memory for a tag node.
  *
- * This function frees the memory associated with a tag node. This amounts to
- * free the tag and path. It is used as a cleanup function when removing tag
- * nodes from the tag list.
+ * This function returns a tag node created by `tag_create()`, and its tag
+ * string, to their pools, and releases its path. It is used as a cleanup
+ * function when removing tag nodes from the tag map.
  *
  * @param data Pointer to the `struct tag` to be cleaned up.
  * @return 0 on success.
@@ -42,33 +102,91 @@ int compare_tag_tag(void *data, void *key);
 int cleanup_tag(void *data);
 
 /**
- * @brief Reads tag data from a file and populates the provided tag list.
+ * @brief Reads tag data from a file and its journal and populates the
+ *        provided tag map.
  *
  * This function opens the specified file at `path` and reads each line,
  * expecting a format of "tag=tag_path". It parses each line into tag and path
- * components, verifies the path, and adds each unique tag-path pair to the
- * given `tags` list. If a tag already exists, the path is updated instead.
+ * components, and adds each unique tag-path pair to the given `tags` map and
+ * `tree`. If a tag already exists, the path is updated instead. The changes in
+ * the journal are then replayed on top, and a last change only partly written
+ * before a crash is truncated from the journal. Finally, tags whose path no
+ * longer exists are dropped, see pathstat.h.
  *
- * @param tags Pointer to the `list` structure where parsed tags will be
+ * @param tags Pointer to the `hashmap` structure where parsed tags will be
  *             stored.
+ * @param tree Pointer to the `radix_tree` structure where the tags will be
+ *             indexed by name.
  * @param path Pointer to the file path to read tags from.
  * @return 0 on success, 1 if the file cannot be opened or if memory allocation
  *         fails.
  */
-int read_tag_file(struct list *tags, char *path);
+int read_tag_file(struct hashmap *tags, struct radix_tree *tree, char *path);
+
+/**
+ * @brief Opens the journal of the tag file at `tagfile_path` for appending.
+ *
+ * If the journal cannot be opened, `fd` is set to -1 and every change
+ * rewrites the tag file instead.
+ *
+ * @param journal Pointer to the journal.
+ * @param tags Pointer to the tag map the journal records changes to.
+ * @param tagfile_path Path of the tag file, which must outlive the journal.
+ * @return 0 on success, non-zero on failure.
+ */
+int tag_journal_open(struct tag_journal *journal, struct hashmap *tags,
+                     const char *tagfile_path);
+
+/**
+ * @brief Closes the journal.
+ *
+ * @param journal Pointer to the journal.
+ */
+void tag_journal_close(struct tag_journal *journal);
+
+/**
+ * @brief Saves the addition or update of a tag.
+ *
+ * @param journal Pointer to the journal.
+ * @param tag_data The tag.
+ * @return 0 once the change is queued, non-zero on failure.
+ */
+int tag_journal_set(struct tag_journal *journal, const struct tag *tag_data);
+
+/**
+ * @brief Saves the deletion of a tag.
+ *
+ * @param journal Pointer to the journal.
+ * @param tag The tag.
+ * @return 0 once the change is queued, non-zero on failure.
+ */
+int tag_journal_delete(struct tag_journal *journal, const char *tag);
+
+/**
+ * @brief Compacts the journal into the tag file.
+ *
+ * This function queues writing every tag-path pair in the tag map to the tag
+ * file, in the format "tag=tag_path", one per line followed by an empty line.
+ * The tags are written to a temporary file, which is synced and renamed over
+ * the tag file, so a crash leaves either the old or the new file in place.
+ * The journal is emptied once the tag file has been replaced.
+ *
+ * @param journal Pointer to the journal.
+ * @return 0 once the write is queued, non-zero on failure.
+ */
+int tag_journal_compact(struct tag_journal *journal);
 
 /**
- * @brief Writes the provided tag list to a file.
+ * @brief Publishes the provided tag map to a snapshot.
  *
- * This function writes each tag-path pair from the `tags` list to the
- * specified file at `path`, in the format "tag=tag_path". Each entry is
- * written on a new line, and an extra newline is added at the end of the file.
- * Existing file contents are overwritten.
+ * This function replaces the contents of `snapshot` with every tag-path pair
+ * in the `tags` map, in map order, so that clients can read them without
+ * asking the daemon. See snapshot.h.
  *
- * @param tags Pointer to the `list` structure containing tags to write.
- * @param path Pointer to the file path to write tags to.
- * @return 0 on success, 1 if the file cannot be opened.
+ * @param tags Pointer to the `hashmap` structure containing tags to publish.
+ * @param snapshot Pointer to the snapshot to publish to.
+ * @return 0 on success, 1 if the snapshot could not be published.
  */
-int write_tag_file(struct list *tags, char *path);
+int publish_tag_snapshot(struct hashmap *tags, struct snapshot *snapshot);
 
 #endif /* TAG_H_ */
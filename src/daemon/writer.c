@@ -0,0 +1,509 @@
+/**
+ * @file writer.c
+ * @brief Implementation of the background writer.
+ *
+ * The ring is indexed by three free running counters. The event loop fills
+ * the slot at `head` and publishes it by advancing `head`, the writer
+ * performs the jobs up to `head` and publishes them as done by advancing
+ * `tail`, and the event loop runs the completions of the jobs up to `tail`
+ * and frees their buffers, advancing `reclaimed`. Each counter is only
+ * written by one thread, so the ring needs no lock. Buffers are allocated and
+ * freed on the event loop, which lets them come from the string arena.
+ *
+ * The writer sleeps on an eventfd written by the event loop when it queues a
+ * job, and writes another eventfd, watched by the event loop, when it has
+ * finished a batch.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "pool.h"
+#include "writer.h"
+
+/* Maximum number of replaced files remembered while coalescing a batch */
+#define WRITER_MAX_REPLACES 16
+
+#define SLOT(i) (&ring[(i) & (WRITER_QUEUE_SIZE - 1)])
+
+/**
+ * @brief Kinds of job.
+ */
+enum writer_op {
+    WRITER_APPEND,  /**<< Append `buf` to `fd` and sync it */
+    WRITER_REPLACE, /**<< Atomically replace `path` with `buf` */
+    WRITER_BARRIER, /**<< Complete once all earlier jobs are done */
+};
+
+/**
+ * @brief Structure representing a queued job.
+ */
+struct writer_job {
+    enum writer_op op;
+    int fd;      /**<< File appended to, or emptied after a replace, or -1 */
+    char *path;  /**<< File replaced */
+    char *buf;
+    size_t len;
+    int err;     /**<< Set by the writer */
+    bool skip;   /**<< Set by the writer if the job was coalesced away */
+
+    writer_done_func done; /**<< May be `NULL` */
+    void *ctx;
+};
+
+static struct writer_job ring[WRITER_QUEUE_SIZE];
+
+static _Atomic uint32_t head;     /**<< Written by the event loop */
+static _Atomic uint32_t tail;     /**<< Written by the writer */
+static uint32_t reclaimed;        /**<< Only used by the event loop */
+static atomic_bool stopping;
+
+/* Jobs that failed since the last barrier, only used by the writer */
+static int failures;
+
+static int wake_fd = -1; /**<< Written when jobs are queued */
+static int done_fd = -1; /**<< Written when jobs are done */
+static pthread_t thread;
+static bool running = false;
+
+static void notify(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) == -1) {
+        LOG_ERR("write: %s", strerror(errno));
+    }
+}
+
+/**
+ * @brief Syncs the directory holding `path`, so a rename into it persists.
+ */
+static void sync_parent_dir(const char *path)
+{
+    char dir[PATH_MAX];
+    char *slash;
+    int fd;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (slash == NULL) {
+        snprintf(dir, sizeof(dir), ".");
+    } else if (slash == dir) {
+        dir[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    fsync(fd);
+    close(fd);
+}
+
+static int replace_file(const struct writer_job *job)
+{
+    char tmp_path[PATH_MAX];
+    size_t offset = 0;
+    ssize_t n;
+    int err;
+    int fd;
+
+    err = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", job->path);
+    if (err < 0 || err >= (int)sizeof(tmp_path)) {
+        LOG_ERR("Path too long for %s", job->path);
+        return 1;
+    }
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        LOG_ERR("open: %s '%s'", strerror(errno), tmp_path);
+        return 1;
+    }
+
+    while (offset < job->len) {
+        n = write(fd, job->buf + offset, job->len - offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        offset += n;
+    }
+
+    /* The data must be on disk before the rename makes it the file */
+    err = offset != job->len || fsync(fd) == -1;
+    err |= close(fd) == -1;
+    if (err || rename(tmp_path, job->path) == -1) {
+        LOG_ERR("Unable to write %s", job->path);
+        unlink(tmp_path);
+        return 1;
+    }
+    sync_parent_dir(job->path);
+
+    if (job->fd != -1 &&
+        (ftruncate(job->fd, 0) == -1 || fdatasync(job->fd) == -1)) {
+        LOG_ERR("Unable to empty the file replaced by %s", job->path);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Appends a run of jobs to the same file with one write and one sync.
+ *
+ * @param i Index of the first job of the run, set past its last job.
+ * @param end Index past the last job of the batch.
+ */
+static void append_run(uint32_t *i, uint32_t end)
+{
+    struct iovec iov[IOV_MAX];
+    struct writer_job *job;
+    int fd = SLOT(*i)->fd;
+    ssize_t total = 0, n;
+    off_t size;
+    uint32_t j;
+    int n_iov = 0;
+    int err;
+
+    for (j = *i; j != end && n_iov < IOV_MAX; j++) {
+        job = SLOT(j);
+        if (job->skip) {
+            continue;
+        }
+        if (job->op != WRITER_APPEND || job->fd != fd) {
+            break;
+        }
+        iov[n_iov].iov_base = job->buf;
+        iov[n_iov].iov_len = job->len;
+        total += job->len;
+        n_iov++;
+    }
+
+    size = lseek(fd, 0, SEEK_END);
+    n = writev(fd, iov, n_iov);
+    err = n != total || fdatasync(fd) == -1;
+    if (err) {
+        LOG_ERR("Unable to append %zd bytes: %s", total, strerror(errno));
+
+        /* Never leave part of a record behind for the next one to follow */
+        if (n > 0 && size != -1 && ftruncate(fd, size) == -1) {
+            LOG_ERR("ftruncate: %s", strerror(errno));
+        }
+    }
+
+    for (; *i != j; (*i)++) {
+        job = SLOT(*i);
+        if (!job->skip) {
+            job->err = err;
+            failures += err;
+        }
+    }
+}
+
+/**
+ * @brief Marks the jobs of a batch made redundant by a later replace.
+ */
+static void coalesce(uint32_t start, uint32_t end)
+{
+    const struct writer_job *replaces[WRITER_MAX_REPLACES];
+    struct writer_job *job;
+    int n_replaces = 0;
+    uint32_t i;
+    int r;
+
+    for (i = end; i != start; i--) {
+        job = SLOT(i - 1);
+        job->skip = false;
+        job->err = 0;
+
+        for (r = 0; r < n_replaces; r++) {
+            if ((job->op == WRITER_REPLACE &&
+                 strcmp(job->path, replaces[r]->path) == 0) ||
+                (job->op == WRITER_APPEND && job->fd == replaces[r]->fd)) {
+                job->skip = true;
+                break;
+            }
+        }
+
+        if (job->op == WRITER_REPLACE && !job->skip &&
+            n_replaces < WRITER_MAX_REPLACES) {
+            replaces[n_replaces++] = job;
+        }
+    }
+}
+
+static void perform_batch(uint32_t start, uint32_t end)
+{
+    struct writer_job *job;
+    uint32_t i = start;
+
+    coalesce(start, end);
+
+    while (i != end) {
+        job = SLOT(i);
+        if (job->skip) {
+            i++;
+            continue;
+        }
+
+        switch (job->op) {
+        case WRITER_APPEND:
+            append_run(&i, end);
+            continue;
+        case WRITER_REPLACE:
+            job->err = replace_file(job);
+            failures += job->err;
+            break;
+        case WRITER_BARRIER:
+            job->err = failures;
+            failures = 0;
+            break;
+        }
+        i++;
+    }
+}
+
+static void *writer_main(void *arg)
+{
+    uint32_t start, end;
+    uint64_t n;
+
+    for (;;) {
+        start = atomic_load_explicit(&tail, memory_order_relaxed);
+        end = atomic_load_explicit(&head, memory_order_acquire);
+
+        if (start == end) {
+            if (atomic_load(&stopping)) {
+                break;
+            }
+            if (read(wake_fd, &n, sizeof(n)) == -1 && errno != EINTR) {
+                LOG_ERR("read: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        perform_batch(start, end);
+
+        atomic_store_explicit(&tail, end, memory_order_release);
+        notify(done_fd);
+    }
+
+    return NULL;
+}
+
+int writer_init(void)
+{
+    sigset_t all, old;
+    int err;
+
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd == -1 || done_fd == -1) {
+        LOG_ERR("eventfd: %s", strerror(errno));
+        return 1;
+    }
+
+    /* Signals are handled by the event loop's thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&thread, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        LOG_ERR("pthread_create: %s", strerror(err));
+        return 1;
+    }
+
+    running = true;
+    return 0;
+}
+
+/**
+ * @brief Runs the completions of the done jobs and frees their buffers.
+ */
+static void reclaim(void)
+{
+    uint32_t done = atomic_load_explicit(&tail, memory_order_acquire);
+    struct writer_job job;
+
+    while (reclaimed != done) {
+        /* The slot is free before the completion runs, so it can queue */
+        job = *SLOT(reclaimed);
+        reclaimed++;
+
+        if (job.op == WRITER_APPEND) {
+            arena_free(job.buf, job.len);
+        } else if (job.op == WRITER_REPLACE) {
+            free(job.buf);
+            arena_strfree(job.path);
+        }
+
+        if (job.done != NULL) {
+            job.done(job.err, job.ctx);
+        }
+    }
+}
+
+void writer_drain(void)
+{
+    struct pollfd pfd = {.fd = done_fd, .events = POLLIN};
+    uint64_t n;
+
+    for (;;) {
+        reclaim();
+        if (reclaimed == atomic_load_explicit(&head, memory_order_relaxed)) {
+            return;
+        }
+
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            LOG_ERR("poll: %s", strerror(errno));
+            return;
+        }
+        if (read(done_fd, &n, sizeof(n)) == -1 && errno != EAGAIN) {
+            LOG_ERR("read: %s", strerror(errno));
+        }
+    }
+}
+
+void writer_deinit(void)
+{
+    if (running) {
+        writer_drain();
+
+        atomic_store(&stopping, true);
+        notify(wake_fd);
+        pthread_join(thread, NULL);
+        running = false;
+    }
+
+    if (wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    if (done_fd != -1) {
+        close(done_fd);
+        done_fd = -1;
+    }
+}
+
+int writer_completion_fd(void)
+{
+    return done_fd;
+}
+
+void writer_handle_completions(int fd, uint32_t events, void *ctx)
+{
+    uint64_t n;
+
+    if (read(fd, &n, sizeof(n)) == -1 && errno != EAGAIN) {
+        LOG_ERR("read: %s", strerror(errno));
+    }
+
+    reclaim();
+}
+
+/**
+ * @brief Queues a job.
+ *
+ * @return 0 on success, non-zero if the ring is full.
+ */
+static int push(const struct writer_job *job)
+{
+    uint32_t h = atomic_load_explicit(&head, memory_order_relaxed);
+
+    if (!running) {
+        return 1;
+    }
+
+    if (h - reclaimed == WRITER_QUEUE_SIZE) {
+        reclaim();
+        if (h - reclaimed == WRITER_QUEUE_SIZE) {
+            LOG_ERR("Writer queue full");
+            return 1;
+        }
+    }
+
+    *SLOT(h) = *job;
+    atomic_store_explicit(&head, h + 1, memory_order_release);
+    notify(wake_fd);
+
+    return 0;
+}
+
+int writer_appendv(int fd, const struct iovec *iov, int iovcnt,
+                   writer_done_func done, void *ctx)
+{
+    struct writer_job job = {
+        .op = WRITER_APPEND, .fd = fd, .done = done, .ctx = ctx};
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        job.len += iov[i].iov_len;
+    }
+
+    job.buf = arena_alloc(job.len);
+    if (job.buf == NULL) {
+        return 1;
+    }
+
+    job.len = 0;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(job.buf + job.len, iov[i].iov_base, iov[i].iov_len);
+        job.len += iov[i].iov_len;
+    }
+
+    if (push(&job)) {
+        arena_free(job.buf, job.len);
+        return 1;
+    }
+
+    return 0;
+}
+
+int writer_replace(const char *path, char *buf, size_t len, int truncate_fd,
+                   writer_done_func done, void *ctx)
+{
+    struct writer_job job = {
+        .op = WRITER_REPLACE,
+        .fd = truncate_fd,
+        .buf = buf,
+        .len = len,
+        .done = done,
+        .ctx = ctx,
+    };
+
+    job.path = arena_strndup(path, PATH_MAX);
+    if (job.path == NULL || push(&job)) {
+        arena_strfree(job.path);
+        free(buf);
+        return 1;
+    }
+
+    return 0;
+}
+
+int writer_barrier(writer_done_func done, void *ctx)
+{
+    struct writer_job job = {
+        .op = WRITER_BARRIER, .fd = -1, .done = done, .ctx = ctx};
+
+    return push(&job);
+}
@@ -0,0 +1,124 @@
+/**
+ * @file writer.h
+ * @brief Background thread performing the daemon's disk writes.
+ *
+ * This header defines the writer, a thread that performs every disk write on
+ * behalf of the event loop, so that a slow disk, e.g. a config directory on
+ * NFS, never stalls requests. The event loop queues jobs on a lock-free
+ * single-producer, single-consumer ring, and the writer drains the ring in
+ * batches:
+ *
+ * - consecutive appends to the same file are gathered into one `writev()`
+ *   and a single `fdatasync()`,
+ * - a file replaced several times in a batch is only written once, and
+ * - appends to a file emptied by a later replace in the batch are skipped,
+ *   as the replacement already holds them.
+ *
+ * Once a batch is done, the writer wakes the event loop, which runs each
+ * job's completion function, see `writer_handle_completions()`. Jobs are
+ * performed in the order they were queued, so a barrier completes once every
+ * job queued before it is on disk. A job skipped in favour of a later replace
+ * completes successfully, even if the replace then fails.
+ *
+ * Every function except the writer's own thread runs on the event loop.
+ */
+
+#ifndef WRITER_H_
+#define WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Number of jobs the ring holds, a power of two */
+#define WRITER_QUEUE_SIZE 1024
+
+/**
+ * @brief Function called on the event loop once a job is done.
+ *
+ * @param err 0 if the job succeeded, non-zero otherwise.
+ * @param ctx The context given when the job was queued.
+ */
+typedef void (*writer_done_func)(int err, void *ctx);
+
+/**
+ * @brief Starts the writer thread.
+ *
+ * @return 0 on success, non-zero on failure.
+ */
+int writer_init(void);
+
+/**
+ * @brief Waits for every queued job, then stops the writer thread.
+ */
+void writer_deinit(void);
+
+/**
+ * @brief Returns the file descriptor that becomes readable when jobs are done.
+ *
+ * It should be watched by the event loop with `writer_handle_completions()`.
+ *
+ * @return The file descriptor.
+ */
+int writer_completion_fd(void);
+
+/**
+ * @brief Runs the completion functions of the jobs the writer has done.
+ *
+ * This function is an `event_func` callback.
+ *
+ * @param fd The completion file descriptor.
+ * @param events The epoll events reported for `fd`.
+ * @param ctx Unused.
+ */
+void writer_handle_completions(int fd, uint32_t events, void *ctx);
+
+/**
+ * @brief Queues appending the concatenation of `iov` to a file.
+ *
+ * The data is copied.
+ *
+ * @param fd The file, opened for appending.
+ * @param iov Array of buffers to append.
+ * @param iovcnt Number of buffers in `iov`.
+ * @param done Function called once the data is on disk, may be `NULL`.
+ * @param ctx Passed to `done`.
+ * @return 0 on success, non-zero if the ring is full or on failure.
+ */
+int writer_appendv(int fd, const struct iovec *iov, int iovcnt,
+                   writer_done_func done, void *ctx);
+
+/**
+ * @brief Queues replacing a file with `buf`.
+ *
+ * The data is written to a temporary file, which is synced and renamed over
+ * `path`. If `truncate_fd` is not -1, that file is then emptied, see tag.h.
+ *
+ * @param path The file.
+ * @param buf The new contents, allocated with `malloc()`. The writer takes
+ *            ownership of it, even on failure.
+ * @param len Length of `buf`.
+ * @param truncate_fd File emptied once `path` is replaced, or -1.
+ * @param done Function called once the file is replaced, may be `NULL`.
+ * @param ctx Passed to `done`.
+ * @return 0 on success, non-zero if the ring is full or on failure.
+ */
+int writer_replace(const char *path, char *buf, size_t len, int truncate_fd,
+                   writer_done_func done, void *ctx);
+
+/**
+ * @brief Queues a barrier.
+ *
+ * @param done Function called once every job queued before is done. Its
+ *             `err` is the number of jobs that failed since the last barrier.
+ * @param ctx Passed to `done`.
+ * @return 0 on success, non-zero if the ring is full.
+ */
+int writer_barrier(writer_done_func done, void *ctx);
+
+/**
+ * @brief Blocks until every queued job is done, and runs their completions.
+ */
+void writer_drain(void);
+
+#endif /* WRITER_H_ */
@@ -46,6 +46,9 @@ void _log(FILE *file, int level, const char *func, const char *file_name,
 
     file = (file == NULL) ? stderr : file;
 
+    /* Keep the line whole when several threads log at once */
+    flockfile(file);
+
 #ifdef PRETTY_LOG
     bold(file);
     fprintf(file, "[%s::%s] [%s]: ", file_name, func, log_level_strings[level]);
@@ -59,4 +62,6 @@ void _log(FILE *file, int level, const char *func, const char *file_name,
     va_end(ap);
 
     fprintf(file, "\n");
+
+    funlockfile(file);
 }
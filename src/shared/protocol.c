@@ -0,0 +1,246 @@
+/**
+ * @file protocol.c
+ * @brief Implementation of the binary wire protocol.
+ *
+ * This file implements encoding and parsing of request frames, and parsing of
+ * the text protocol kept for compatibility.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "protocol.h"
+#include "log.h"
+
+static const char *const op_names[PROTO_OP_NUM] = {
+    [PROTO_OP_REGISTER] = "register", [PROTO_OP_UNREGISTER] = "unregister",
+    [PROTO_OP_ADD] = "add",           [PROTO_OP_DELETE] = "delete",
+    [PROTO_OP_SHOW] = "show",         [PROTO_OP_GET] = "get",
+    [PROTO_OP_PUSH] = "push",         [PROTO_OP_POP] = "pop",
+    [PROTO_OP_ACTIONS] = "actions",   [PROTO_OP_LIST] = "list",
+    [PROTO_OP_RESET] = "reset",       [PROTO_OP_JUMP] = "jump",
+    [PROTO_OP_COMPLETE] = "complete", [PROTO_OP_VISIT] = "visit",
+    [PROTO_OP_SEARCH] = "search",
+    [PROTO_OP_FLUSH] = "flush",       [PROTO_OP_STATS] = "stats",
+};
+
+/* Position, counting from 1, of the field that takes the rest of a text
+ * request, so that paths may contain spaces. 0 if every field is split on
+ * spaces. */
+static const int text_path_field[PROTO_OP_NUM] = {
+    [PROTO_OP_ADD] = 2,
+    [PROTO_OP_PUSH] = 1,
+    [PROTO_OP_JUMP] = 2,
+    [PROTO_OP_VISIT] = 1,
+};
+
+int proto_lookup_opcode(const char *name)
+{
+    int i;
+
+    for (i = 0; i < PROTO_OP_NUM; i++) {
+        if (strcmp(name, op_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+const char *proto_opcode_name(int opcode)
+{
+    return op_names[opcode];
+}
+
+int proto_encode_request(char *buf, size_t size, int opcode, int32_t pid,
+                         int argc, char **argv)
+{
+    struct proto_header header;
+    uint16_t field_len;
+    size_t offset;
+    size_t len;
+    int i;
+
+    if (argc > PROTO_MAX_FIELDS || size < sizeof(header)) {
+        return -1;
+    }
+
+    offset = sizeof(header);
+    for (i = 0; i < argc; i++) {
+        len = strlen(argv[i]);
+        if (len > UINT16_MAX ||
+            offset + sizeof(field_len) + len + 1 > size) {
+            return -1;
+        }
+
+        field_len = len;
+        memcpy(buf + offset, &field_len, sizeof(field_len));
+        offset += sizeof(field_len);
+
+        /* Copy the terminating NUL too, so the daemon can use it in place */
+        memcpy(buf + offset, argv[i], len + 1);
+        offset += len + 1;
+    }
+
+    header.magic = PROTO_MAGIC;
+    header.version = PROTO_VERSION;
+    header.opcode = opcode;
+    header.flags = 0;
+    header.pid = pid;
+    header.length = offset - sizeof(header);
+    header.cursor = 0;
+    memcpy(buf, &header, sizeof(header));
+
+    return offset;
+}
+
+int proto_parse_request(const char *buf, size_t len,
+                        struct proto_request *req)
+{
+    uint16_t field_len;
+    size_t offset;
+
+    if (len < sizeof(req->header)) {
+        LOG_ERR("Frame too short");
+        return 1;
+    }
+
+    memcpy(&req->header, buf, sizeof(req->header));
+    if (req->header.magic != PROTO_MAGIC ||
+        req->header.version != PROTO_VERSION) {
+        LOG_ERR("Unsupported frame version %u", req->header.version);
+        return 1;
+    }
+
+    if (req->header.length != len - sizeof(req->header)) {
+        LOG_ERR("Frame length mismatch");
+        return 1;
+    }
+
+    req->n_fields = 0;
+    offset = sizeof(req->header);
+    while (offset < len) {
+        if (req->n_fields == PROTO_MAX_FIELDS) {
+            LOG_ERR("Too many fields");
+            return 1;
+        }
+
+        if (len - offset < sizeof(field_len)) {
+            LOG_ERR("Truncated field");
+            return 1;
+        }
+        memcpy(&field_len, buf + offset, sizeof(field_len));
+        offset += sizeof(field_len);
+
+        if (len - offset < (size_t)field_len + 1 ||
+            buf[offset + field_len] != '\0') {
+            LOG_ERR("Truncated field");
+            return 1;
+        }
+
+        req->fields[req->n_fields].ptr = buf + offset;
+        req->fields[req->n_fields].len = field_len;
+        req->n_fields++;
+        offset += field_len + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Splits the next field off a text request, in place.
+ *
+ * Leading spaces are skipped. A field ends at the first of `delims`, which is
+ * overwritten with a NUL, or at the end of the request.
+ *
+ * @param line Pointer to the rest of the request, advanced past the field.
+ * @param delims Characters ending the field.
+ * @return The field, or `NULL` if the request has no more fields.
+ */
+static char *next_text_field(char **line, const char *delims)
+{
+    char *start, *end;
+
+    start = *line + strspn(*line, " ");
+    if (*start == '\0' || *start == '\n') {
+        *line = start;
+        return NULL;
+    }
+
+    end = start + strcspn(start, delims);
+    *line = *end != '\0' ? end + 1 : end;
+    *end = '\0';
+
+    return start;
+}
+
+int proto_parse_text_request(char *buf, struct proto_request *req)
+{
+    char *pid_str, *cmd_str, *token;
+    char *line = buf;
+    char *end;
+    long pid;
+    int opcode;
+    int len;
+
+    pid_str = next_text_field(&line, " \n");
+    if (pid_str == NULL) {
+        LOG_ERR("parser: Invalid pid arg.");
+        return 1;
+    }
+
+    errno = 0;
+    pid = strtol(pid_str, &end, 10);
+    if (errno || end == pid_str) {
+        LOG_ERR("parser: Invalid pid '%s'.", pid_str);
+        return 1;
+    }
+
+    cmd_str = next_text_field(&line, " \n");
+    if (cmd_str == NULL) {
+        LOG_ERR("parser: Invalid command.");
+        return 1;
+    }
+
+    opcode = proto_lookup_opcode(cmd_str);
+    if (opcode == -1) {
+        LOG_INF("Unknown command: %s", cmd_str);
+        return 1;
+    }
+
+    memset(&req->header, 0, sizeof(req->header));
+    req->header.opcode = opcode;
+    req->header.pid = pid;
+
+    req->n_fields = 0;
+    for (;;) {
+        /* A path runs to the end of the line, less trailing spaces */
+        if (req->n_fields + 1 == text_path_field[opcode]) {
+            token = next_text_field(&line, "\n");
+            if (token != NULL) {
+                len = strlen(token);
+                while (token[len - 1] == ' ') {
+                    token[--len] = '\0';
+                }
+            }
+        } else {
+            token = next_text_field(&line, " \n");
+        }
+
+        if (token == NULL) {
+            break;
+        }
+
+        if (req->n_fields == PROTO_MAX_FIELDS) {
+            LOG_ERR("parser: Too many fields.");
+            return 1;
+        }
+
+        req->fields[req->n_fields].ptr = token;
+        req->fields[req->n_fields].len = strlen(token);
+        req->n_fields++;
+    }
+
+    return 0;
+}
@@ -0,0 +1,490 @@
+/**
+ * @file snapshot.c
+ * @brief Implementation of the shared memory tag snapshot.
+ *
+ * This file implements publishing the snapshot in the daemon, and the
+ * lock-free reads used by clients.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "log.h"
+
+/**
+ * @brief Structure pairing a tag with the offset of its entry, for sorting.
+ */
+struct index_item {
+    const char *tag;
+    uint32_t offset;
+};
+
+static int compare_index_items(const void *a, const void *b)
+{
+    return strcmp(((const struct index_item *)a)->tag,
+                  ((const struct index_item *)b)->tag);
+}
+
+static void begin_write(struct snapshot_header *header)
+{
+    __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_write(struct snapshot_header *header)
+{
+    __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELEASE);
+}
+
+int snapshot_create(struct snapshot *s, const char *path)
+{
+    struct snapshot_header *header;
+    int fd;
+
+    s->map = NULL;
+    s->size = SNAPSHOT_SIZE;
+
+    /* Readers keep their mapping of an old file, which they will find marked
+     * unusable, rather than seeing this one truncated under them */
+    unlink(path);
+
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        LOG_ERR("open: %s '%s'", strerror(errno), path);
+        return 1;
+    }
+
+    if (ftruncate(fd, s->size) == -1) {
+        LOG_ERR("ftruncate: %s", strerror(errno));
+        goto fail;
+    }
+
+    s->map = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s->map == MAP_FAILED) {
+        LOG_ERR("mmap: %s", strerror(errno));
+        s->map = NULL;
+        goto fail;
+    }
+    close(fd);
+
+    header = s->map;
+    header->magic = SNAPSHOT_MAGIC;
+    header->version = SNAPSHOT_VERSION;
+    header->seq = 0;
+    header->pid = 0;
+    header->n_tags = 0;
+    header->data_len = 0;
+
+    LOG_INF("Snapshot created: %s", path);
+
+    return 0;
+
+fail:
+    close(fd);
+    unlink(path);
+    return 1;
+}
+
+int snapshot_publish(struct snapshot *s, const struct snapshot_entry *entries,
+                     uint32_t n_entries)
+{
+    struct snapshot_header *header = s->map;
+    struct index_item *items;
+    uint32_t *index;
+    uint16_t tag_len, path_len;
+    size_t capacity, len, offset;
+    uint32_t i;
+    char *data;
+
+    if (header == NULL) {
+        return 1;
+    }
+
+    items = malloc(n_entries * sizeof(*items) + 1);
+    if (items == NULL) {
+        LOG_ERR("snapshot index malloc failed");
+        return 1;
+    }
+
+    begin_write(header);
+
+    if (n_entries > (s->size - sizeof(*header)) / sizeof(*index)) {
+        goto full;
+    }
+
+    index = (uint32_t *)(header + 1);
+    data = (char *)(index + n_entries);
+    capacity = s->size - sizeof(*header) - n_entries * sizeof(*index);
+
+    offset = 0;
+    for (i = 0; i < n_entries; i++) {
+        len = strlen(entries[i].tag);
+        if (len > UINT16_MAX) {
+            goto full;
+        }
+        tag_len = len;
+
+        len = strlen(entries[i].path);
+        if (len > UINT16_MAX) {
+            goto full;
+        }
+        path_len = len;
+
+        len = 2 * sizeof(uint16_t) + tag_len + 1 + path_len + 1;
+        if (offset + len > capacity) {
+            goto full;
+        }
+
+        items[i].tag = entries[i].tag;
+        items[i].offset = offset;
+
+        memcpy(data + offset, &tag_len, sizeof(tag_len));
+        offset += sizeof(tag_len);
+        memcpy(data + offset, entries[i].tag, tag_len + 1);
+        offset += tag_len + 1;
+        memcpy(data + offset, &path_len, sizeof(path_len));
+        offset += sizeof(path_len);
+        memcpy(data + offset, entries[i].path, path_len + 1);
+        offset += path_len + 1;
+    }
+
+    qsort(items, n_entries, sizeof(*items), compare_index_items);
+    for (i = 0; i < n_entries; i++) {
+        index[i] = items[i].offset;
+    }
+
+    header->n_tags = n_entries;
+    header->data_len = offset;
+    header->pid = getpid();
+
+    end_write(header);
+    free(items);
+    return 0;
+
+full:
+    LOG_ERR("Too many tags for the snapshot, clients will ask the daemon");
+    header->n_tags = 0;
+    header->data_len = 0;
+    header->pid = 0;
+
+    end_write(header);
+    free(items);
+    return 1;
+}
+
+void snapshot_destroy(struct snapshot *s, const char *path)
+{
+    struct snapshot_header *header = s->map;
+
+    if (header == NULL) {
+        return;
+    }
+
+    begin_write(header);
+    header->pid = 0;
+    end_write(header);
+
+    munmap(s->map, s->size);
+    s->map = NULL;
+    unlink(path);
+}
+
+int snapshot_open(struct snapshot *s, const char *path)
+{
+    struct stat sb;
+    int fd;
+
+    s->map = NULL;
+    s->size = 0;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 1;
+    }
+
+    if (fstat(fd, &sb) == -1 ||
+        sb.st_size < (off_t)sizeof(struct snapshot_header)) {
+        close(fd);
+        return 1;
+    }
+
+    s->map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED) {
+        s->map = NULL;
+        return 1;
+    }
+    s->size = sb.st_size;
+
+    return 0;
+}
+
+/**
+ * @brief Starts a read of the snapshot.
+ *
+ * @param s Pointer to the snapshot.
+ * @param seq Set to the sequence number to pass to `end_read()`.
+ * @param n_tags Set to the number of entries.
+ * @param data Set to the first entry.
+ * @param data_len Set to the length of the entries, which are within the
+ *                 mapping.
+ * @return `true` if the snapshot can be read, `false` if it is being written
+ *         or is unusable.
+ */
+static bool begin_read(const struct snapshot *s, uint32_t *seq,
+                       uint32_t *n_tags, const char **data, uint32_t *data_len)
+{
+    const struct snapshot_header *header = s->map;
+    size_t index_len;
+    pid_t pid;
+
+    if (header == NULL) {
+        return false;
+    }
+
+    *seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+    if (*seq & 1) {
+        return false;
+    }
+
+    pid = header->pid;
+    if (header->magic != SNAPSHOT_MAGIC ||
+        header->version != SNAPSHOT_VERSION || pid <= 0) {
+        return false;
+    }
+
+    *n_tags = header->n_tags;
+    *data_len = header->data_len;
+
+    index_len = (size_t)*n_tags * sizeof(uint32_t);
+    if (index_len > s->size - sizeof(*header) ||
+        *data_len > s->size - sizeof(*header) - index_len) {
+        return false;
+    }
+    *data = (const char *)(header + 1) + index_len;
+
+    return true;
+}
+
+/**
+ * @brief Finishes a read of the snapshot.
+ *
+ * @return `true` if the snapshot did not change since `begin_read()`.
+ */
+static bool end_read(const struct snapshot *s, uint32_t seq)
+{
+    const struct snapshot_header *header = s->map;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&header->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/**
+ * @brief Checks that the daemon that wrote the snapshot is still running.
+ */
+static bool daemon_alive(const struct snapshot *s)
+{
+    const struct snapshot_header *header = s->map;
+    pid_t pid = header->pid;
+
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+/**
+ * @brief Reads a string field at `*offset` and advances past it.
+ *
+ * @return The field, or `NULL` if it runs past `data_len`.
+ */
+static const char *read_field(const char *data, uint32_t data_len,
+                              size_t *offset, uint16_t *len)
+{
+    const char *field;
+
+    if (*offset + sizeof(*len) > data_len) {
+        return NULL;
+    }
+    memcpy(len, data + *offset, sizeof(*len));
+
+    if (*offset + sizeof(*len) + *len + 1 > data_len) {
+        return NULL;
+    }
+    field = data + *offset + sizeof(*len);
+    *offset += sizeof(*len) + *len + 1;
+
+    return field;
+}
+
+/**
+ * @brief Looks up a tag once, without retrying.
+ *
+ * @return As `snapshot_get()`, or -2 if the snapshot changed during the read.
+ */
+static int try_get(const struct snapshot *s, const char *tag, size_t tag_len,
+                   char *dest, size_t dest_size)
+{
+    const uint32_t *index = (const uint32_t *)((const char *)s->map +
+                                               sizeof(struct snapshot_header));
+    const char *data, *entry_tag, *entry_path;
+    uint32_t seq, n_tags, data_len;
+    uint32_t lo, hi, mid;
+    uint16_t entry_tag_len, entry_path_len;
+    size_t offset;
+    int cmp;
+
+    if (!begin_read(s, &seq, &n_tags, &data, &data_len)) {
+        return -2;
+    }
+
+    lo = 0;
+    hi = n_tags;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        offset = index[mid];
+        entry_tag = read_field(data, data_len, &offset, &entry_tag_len);
+        if (entry_tag == NULL) {
+            break;
+        }
+
+        cmp = memcmp(tag, entry_tag,
+                     tag_len < entry_tag_len ? tag_len : entry_tag_len);
+        if (cmp == 0) {
+            cmp = (tag_len > entry_tag_len) - (tag_len < entry_tag_len);
+        }
+
+        if (cmp < 0) {
+            hi = mid;
+        } else if (cmp > 0) {
+            lo = mid + 1;
+        } else {
+            entry_path = read_field(data, data_len, &offset, &entry_path_len);
+            if (entry_path == NULL || entry_path_len >= dest_size) {
+                break;
+            }
+            memcpy(dest, entry_path, entry_path_len);
+            dest[entry_path_len] = '\0';
+
+            return end_read(s, seq) ? 0 : -2;
+        }
+    }
+
+    if (!end_read(s, seq)) {
+        return -2;
+    }
+
+    /* A consistent snapshot with a malformed entry is unusable */
+    return lo < hi ? -1 : 1;
+}
+
+int snapshot_get(const struct snapshot *s, const char *tag, char *dest,
+                 size_t dest_size)
+{
+    size_t tag_len = strlen(tag);
+    int retries;
+    int err;
+
+    if (s->map == NULL || !daemon_alive(s)) {
+        return -1;
+    }
+
+    for (retries = 0; retries < SNAPSHOT_READ_RETRIES; retries++) {
+        err = try_get(s, tag, tag_len, dest, dest_size);
+        if (err != -2) {
+            return err;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Lists the tags once, without retrying.
+ *
+ * @return As `snapshot_list()`, or -2 if the snapshot changed during the read.
+ */
+static int try_list(const struct snapshot *s, char **dest)
+{
+    const char *data, *entry_tag, *entry_path;
+    uint32_t seq, n_tags, data_len;
+    uint16_t entry_tag_len, entry_path_len;
+    size_t offset, len;
+    uint32_t i;
+    char *list;
+
+    if (!begin_read(s, &seq, &n_tags, &data, &data_len)) {
+        return -2;
+    }
+
+    /* Every tag takes at most its entry's length in the list */
+    list = malloc((size_t)data_len + 1);
+    if (list == NULL) {
+        return -1;
+    }
+
+    offset = 0;
+    len = 0;
+    for (i = 0; i < n_tags; i++) {
+        entry_tag = read_field(data, data_len, &offset, &entry_tag_len);
+        entry_path = entry_tag == NULL ? NULL
+                                       : read_field(data, data_len, &offset,
+                                                    &entry_path_len);
+        if (entry_path == NULL) {
+            break;
+        }
+
+        if (i > 0) {
+            list[len++] = ' ';
+        }
+        memcpy(list + len, entry_tag, entry_tag_len);
+        len += entry_tag_len;
+    }
+    list[len] = '\0';
+
+    if (!end_read(s, seq)) {
+        free(list);
+        return -2;
+    }
+
+    if (i < n_tags) {
+        free(list);
+        return -1;
+    }
+
+    *dest = list;
+    return len;
+}
+
+int snapshot_list(const struct snapshot *s, char **dest)
+{
+    int retries;
+    int len;
+
+    if (s->map == NULL || !daemon_alive(s)) {
+        return -1;
+    }
+
+    for (retries = 0; retries < SNAPSHOT_READ_RETRIES; retries++) {
+        len = try_list(s, dest);
+        if (len != -2) {
+            return len;
+        }
+    }
+
+    return -1;
+}
+
+void snapshot_close(struct snapshot *s)
+{
+    if (s->map != NULL) {
+        munmap(s->map, s->size);
+        s->map = NULL;
+    }
+}
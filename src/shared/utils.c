@@ -8,11 +8,12 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
-#include <sys/stat.h>
-#include <errno.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <string.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "utils.h"
 #include "log.h"
@@ -37,7 +38,7 @@ int get_trailing_whitespace(char *s)
     int i = 0;
     char *p = s;
 
-    while (p != NULL) {
+    while (*p != '\0') {
         if (*p == '\n' || *p == ' ') {
             break;
         }
@@ -48,19 +49,32 @@ int get_trailing_whitespace(char *s)
     return i;
 }
 
-bool valid_path(char *path)
+bool use_abstract_sockets(void)
 {
-    struct stat sb;
-    int err;
+    char *temp_env = getenv(ABSTRACT_SOCKET_ENV_VAR);
 
-    err = fstatat(0, path, &sb, 0);
-    if (err && errno == ENOENT) {
-        LOG_ERR("Path '%s' does not exist.", path);
-        return false;
-    } else if (err) {
-        LOG_ERR("Bad path %s", path);
-        return false;
+    return temp_env != NULL && temp_env[0] != '\0' && strcmp(temp_env, "0");
+}
+
+socklen_t set_socket_address(struct sockaddr_un *addr, const char *path,
+                             bool abstract)
+{
+    size_t len = strlen(path);
+    size_t offset = abstract ? 1 : 0;
+
+    /* Pathnames need room for a NUL terminator, abstract names are counted */
+    if (offset + len >= sizeof(addr->sun_path)) {
+        LOG_ERR("Socket path too long: '%s'", path);
+        return 0;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path + offset, path, len);
+
+    if (abstract) {
+        return offsetof(struct sockaddr_un, sun_path) + offset + len;
     }
 
-    return true;
+    return sizeof(*addr);
 }
@@ -1,9 +1,13 @@
+import json
 import os
 import random
 import shutil
 import signal
+import socket
 import string
+import struct
 import subprocess
+import tempfile
 import time
 
 import pytest
@@ -17,6 +21,7 @@ CLIENT_PATH = "./build/client"
 NAV_ROOT = "/tmp/nav-" + "".join(random.choices(string.ascii_letters, k=6))
 
 ENV = {"NAV_CACHE_DIR": NAV_ROOT, "NAV_CONFIG_DIR": NAV_ROOT}
+ABSTRACT_ENV = dict(ENV, NAV_ABSTRACT_SOCKET="1")
 
 
 def make_clean():
@@ -35,6 +40,14 @@ def build_all():
     return
 
 
+def wait_for_daemon(process):
+    # The snapshot is only created once the sockets are listening
+    for _ in range(500):
+        if os.path.exists(f"{NAV_ROOT}/tags.snap") or process.poll() is not None:
+            return
+        time.sleep(0.002)
+
+
 @pytest.fixture()
 def daemon():
     # Start the daemon process in the background
@@ -42,7 +55,7 @@ def daemon():
         [DAEMON_PATH], stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=ENV
     )
 
-    time.sleep(0.001)
+    wait_for_daemon(process)
     if process.poll() is not None:
         raise RuntimeError("Daemon launch failed:\n" + process.stderr.read().decode())
 
@@ -72,7 +85,101 @@ def daemon_preloaded_tag():
         [DAEMON_PATH], stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=ENV
     )
 
-    time.sleep(0.001)
+    wait_for_daemon(process)
+    if process.poll() is not None:
+        raise RuntimeError("Daemon launch failed:\n" + process.stderr.read().decode())
+
+    # Yield control back to the test
+    yield process
+
+    # Cleanup the process when finished testing
+    process.send_signal(signal.SIGINT)
+    try:
+        process.wait(timeout=5)
+    except subprocess.TimeoutExpired:
+        process.kill()
+
+    shutil.rmtree(NAV_ROOT)
+
+
+@pytest.fixture()
+def daemon_journaled_tags():
+    # Setup a tagfile, and a journal long enough to be compacted at startup
+    # whose last change was cut short
+    os.mkdir(NAV_ROOT)
+    with open(f"{NAV_ROOT}/tags", "w") as tagfile:
+        tagfile.write("kept=/tmp/\n")
+        tagfile.write("deleted=/tmp/\n")
+        tagfile.write("\n")
+    with open(f"{NAV_ROOT}/tags.journal", "w") as journal:
+        for i in range(5000):
+            journal.write(f"+filler{i}=/tmp/\n")
+        journal.write("-deleted\n")
+        journal.write("+kept=/\n")
+        journal.write("+torn=/tm")
+
+    # Start the daemon process in the background. It logs every tag it loads,
+    # more than a pipe holds, so its output goes to a file.
+    log = tempfile.TemporaryFile()
+    process = subprocess.Popen([DAEMON_PATH], stdout=log, stderr=log, env=ENV)
+
+    wait_for_daemon(process)
+    if process.poll() is not None:
+        log.seek(0)
+        raise RuntimeError("Daemon launch failed:\n" + log.read().decode())
+
+    # Yield control back to the test
+    yield process
+
+    # Cleanup the process when finished testing
+    process.send_signal(signal.SIGINT)
+    try:
+        process.wait(timeout=5)
+    except subprocess.TimeoutExpired:
+        process.kill()
+
+    shutil.rmtree(NAV_ROOT)
+    log.close()
+
+
+@pytest.fixture()
+def daemon_abstract():
+    # Start the daemon process in the background, with abstract sockets
+    process = subprocess.Popen(
+        [DAEMON_PATH],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        env=ABSTRACT_ENV,
+    )
+
+    wait_for_daemon(process)
+    if process.poll() is not None:
+        raise RuntimeError("Daemon launch failed:\n" + process.stderr.read().decode())
+
+    # Yield control back to the test
+    yield process
+
+    # Cleanup the process when finished testing
+    process.send_signal(signal.SIGINT)
+    try:
+        process.wait(timeout=5)
+    except subprocess.TimeoutExpired:
+        process.kill()
+
+    shutil.rmtree(NAV_ROOT)
+
+
+@pytest.fixture()
+def daemon_shallow_actions():
+    # Start the daemon process in the background, keeping 3 actions per shell
+    process = subprocess.Popen(
+        [DAEMON_PATH],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        env=dict(ENV, NAV_ACTION_DEPTH="3"),
+    )
+
+    wait_for_daemon(process)
     if process.poll() is not None:
         raise RuntimeError("Daemon launch failed:\n" + process.stderr.read().decode())
 
@@ -127,7 +234,7 @@ def test_register_unregister(daemon):
 
 def test_tags_add_get_show_delete(daemon):
     """
-    Test tagging: add, get, delete and tagfile.
+    Test tagging: add, get, delete and the tag journal.
     """
 
     pid = "123456"
@@ -173,13 +280,17 @@ def test_tags_add_get_show_delete(daemon):
     assert client.returncode == 0
     assert client.stdout.strip() == "test --> /tmp/"
 
-    # Check tagfile
-    with open(f"{NAV_ROOT}/tags", "r") as tagfile:
-        line = tagfile.readline()
-        assert line == "test=/tmp/\n"
+    # Changes are written in the background, wait for them
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "flush"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
 
-        line = tagfile.readline()
-        assert line == "\n", "Missing newline at end of file"
+    # Check the journal
+    with open(f"{NAV_ROOT}/tags.journal", "r") as journal:
+        assert journal.read() == "+test=/tmp/\n"
 
     # Delete test --> /tmp/
     client = subprocess.run(
@@ -197,10 +308,17 @@ def test_tags_add_get_show_delete(daemon):
     assert client.returncode == 0
     assert client.stdout.strip() == "BAD"
 
-    # Check tagfile
-    with open(f"{NAV_ROOT}/tags") as tagfile:
-        line = tagfile.readline()
-        assert line == "\n", "Missing newline at end of file"
+    # Changes are written in the background, wait for them
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "flush"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    # Check the journal
+    with open(f"{NAV_ROOT}/tags.journal") as journal:
+        assert journal.read() == "+test=/tmp/\n-test\n"
 
     # Unregister with daemon
     client = subprocess.run(
@@ -250,6 +368,74 @@ def test_preloaded_tagfile(daemon_preloaded_tag):
     assert client.stdout.strip() == "OK"
 
 
+def test_tag_journal(daemon_journaled_tags):
+    """
+    Test replaying and compacting the tag journal at startup.
+    """
+    pid = "123456"
+
+    # Register with daemon
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "register"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    # Changes in the journal win over the tagfile, and the torn one is dropped
+    for tag, expected in [
+        ("kept", "/"),
+        ("deleted", "BAD"),
+        ("filler4999", "/tmp/"),
+        ("torn", "BAD"),
+    ]:
+        client = subprocess.run(
+            [CLIENT_PATH, pid, "get", tag], capture_output=True, text=True, env=ENV
+        )
+
+        assert client.returncode == 0
+        assert client.stdout.strip() == expected
+
+    # Changes are written in the background, wait for them
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "flush"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    # The journal was compacted into the tagfile
+    with open(f"{NAV_ROOT}/tags") as tagfile:
+        lines = tagfile.read().split("\n")
+
+    assert lines[0] == "kept=/"
+    assert "deleted=/tmp/" not in lines
+    assert "filler0=/tmp/" in lines
+    assert len(lines) == 5001 + 2, "Missing newline at end of file"
+    assert os.path.getsize(f"{NAV_ROOT}/tags.journal") == 0
+
+    # New changes go to the emptied journal
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "add", "new", "/tmp/"],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "flush"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    with open(f"{NAV_ROOT}/tags.journal") as journal:
+        assert journal.read() == "+new=/tmp/\n"
+
+
 def test_action_stack(daemon):
     """
     Test the action stack: push, pop, and empty pop.
@@ -376,6 +562,38 @@ def test_action_reset(daemon):
     assert client.stdout.strip() == "OK"
 
 
+def test_action_stack_depth(daemon_shallow_actions):
+    """
+    Test that a full action stack evicts its oldest actions.
+    """
+    pid = str(os.getpid())
+    paths = ["/tmp/", "/usr/", "/etc/", "/var/", "/tmp/"]
+
+    requests = [f"push {path}" for path in paths]
+    requests += ["actions", "pop", "pop", "push /usr/", "actions"]
+    requests += ["pop", "pop", "pop", "pop"]
+    client = subprocess.run(
+        [CLIENT_PATH, "--serve", pid],
+        input="\n".join(requests) + "\n",
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.split("\0")[:-1] == ["OK\n"] * len(paths) + [
+        "    1. /tmp/\n    2. /var/\n    3. /etc/\n",
+        "/tmp/\n",
+        "/var/\n",
+        "OK\n",
+        "    1. /usr/\n    2. /etc/\n",
+        "/usr/\n",
+        "/etc/\n",
+        "BAD\n",
+        "BAD\n",
+    ]
+
+
 def test_tags_list(daemon):
     """
     Test listing tags.
@@ -438,3 +656,835 @@ def test_tags_list(daemon):
 
     assert client.returncode == 0
     assert client.stdout.strip() == "OK"
+
+
+def test_implicit_register(daemon):
+    """
+    Test that a shell is registered on its first request. The test process is
+    the parent of each client, so its PID can be used as the shell PID.
+    """
+    pid = str(os.getpid())
+
+    # Push /tmp/ without registering first
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "push", "/tmp/"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    # Pop
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "pop"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "/tmp/"
+
+    # Unregister with daemon
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "unregister"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+
+def test_implicit_register_foreign_pid(daemon):
+    """
+    Test that a request naming a PID which is neither the sender nor one of its
+    ancestors does not register that PID. No reply is sent, so the client
+    times out with a non-zero return value.
+    """
+    pid = "123456"
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "push", "/tmp/"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 1
+
+
+def test_exited_shell_reaped(daemon):
+    """
+    Test that a shell is unregistered once its process exits, even though it
+    never unregistered itself.
+    """
+    shell = subprocess.Popen(["sleep", "60"])
+    pid = str(shell.pid)
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "register"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    # Kill the shell and give the daemon time to notice
+    shell.kill()
+    shell.wait()
+    time.sleep(0.2)
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "unregister"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 1
+
+
+def test_stats(daemon):
+    """
+    Test that requests are counted per command, and that the counters can be
+    read as JSON.
+    """
+    pid = str(os.getpid())
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "push", "/tmp/"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.stdout.strip() == "OK"
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "push", os.path.join(NAV_ROOT, "missing")],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.stdout.strip() == "BAD"
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "stats", "json"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    stats = json.loads(client.stdout)
+    push = stats["ops"]["push"]
+    assert push["requests"] == 2
+    assert push["bad"] == 1
+    assert sum(push["buckets"].values()) == 2
+    assert push["max_ns"] > 0
+    assert stats["shells"] == 1
+    assert stats["actions"] == 1
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "stats"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert "push: 2 requests, 1 bad, 0 dropped" in client.stdout
+
+
+def test_jump(daemon):
+    """
+    Test jump: resolve a tag and push the current directory in one request.
+    """
+    pid = "123456"
+
+    # Register with daemon
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "register"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    # Add test --> /tmp/
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "add", "test", "/tmp/"],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    # Jump to a missing tag, nothing is pushed
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "jump", "missing", "/home/"],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "BAD"
+
+    # Jump to test from /home/
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "jump", "test", "/home/"],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "/tmp/"
+
+    # Pop returns the directory pushed by the jump
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "pop"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "/home/"
+
+    # Only one action was pushed
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "pop"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "BAD"
+
+    # Unregister with daemon
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "unregister"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+
+def test_client_serve(daemon):
+    """
+    Test serve mode: many requests stream over one connection, and each reply
+    is terminated by a NUL byte. Every request gets exactly one reply, even
+    when the daemon has nothing to say. No client socket file is created.
+    """
+    pid = str(os.getpid())
+    requests = [
+        "add test /tmp/",
+        "flush",
+        "get test",
+        "jump test /home/",
+        "pop",
+        "unregister",
+        "unregister",
+    ]
+
+    client = subprocess.run(
+        [CLIENT_PATH, "--serve", pid],
+        input="\n".join(requests) + "\n",
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+
+    replies = [reply.strip() for reply in client.stdout.split("\0")]
+    assert replies == ["OK", "OK", "/tmp/", "/tmp/", "/home/", "OK", "BAD", ""]
+
+    assert sorted(os.listdir(NAV_ROOT)) == [
+        "nav.sock",
+        "stream.sock",
+        "tags.journal",
+        "tags.snap",
+    ]
+
+
+def test_abstract_sockets(daemon_abstract):
+    """
+    Test abstract socket addresses. Clients autobind, so no client socket file
+    is created, and requests still reach the daemon once its socket files are
+    removed. A client without abstract sockets enabled uses the socket files.
+    """
+    pid = str(os.getpid())
+
+    # Add test --> /tmp/ using a pathname client
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "add", "test", "/tmp/"],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    # Remove the snapshot too, so that gets go to the daemon
+    os.unlink(f"{NAV_ROOT}/nav.sock")
+    os.unlink(f"{NAV_ROOT}/stream.sock")
+    os.unlink(f"{NAV_ROOT}/tags.snap")
+
+    # Get test over the abstract datagram socket
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "get", "test"],
+        capture_output=True,
+        text=True,
+        env=ABSTRACT_ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "/tmp/"
+
+    # Get test over the abstract stream socket
+    client = subprocess.run(
+        [CLIENT_PATH, "--serve", pid],
+        input="get test\n",
+        capture_output=True,
+        text=True,
+        env=ABSTRACT_ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip("\0").strip() == "/tmp/"
+
+    assert os.listdir(NAV_ROOT) == ["tags.journal"]
+
+
+def test_abstract_sockets_fallback(daemon):
+    """
+    Test that a client with abstract sockets enabled falls back to the socket
+    files when the daemon has no abstract sockets.
+    """
+    pid = str(os.getpid())
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "add", "test", "/tmp/"],
+        capture_output=True,
+        text=True,
+        env=ABSTRACT_ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+
+def test_paths_with_spaces(daemon):
+    """
+    Test that arguments containing spaces survive the binary protocol.
+    """
+    pid = str(os.getpid())
+    path = f"{NAV_ROOT}/dir with spaces"
+    os.mkdir(path)
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "add", "spaces", path],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "jump", "spaces", path],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == path
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "pop"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == path
+
+
+def test_path_checks(daemon):
+    """
+    Test that paths are checked before they are stored. Datagram requests are
+    answered once the check completes, and requests on a connection in order.
+    """
+    pid = str(os.getpid())
+    missing = f"{NAV_ROOT}/missing"
+    path = f"{NAV_ROOT}/present"
+    os.mkdir(path)
+
+    for request in [
+        ["add", "missing", missing],
+        ["push", missing],
+        ["visit", missing],
+        ["add", "present", path],
+        ["jump", "present", missing],
+        ["push", path],
+        ["visit", path],
+    ]:
+        client = subprocess.run(
+            [CLIENT_PATH, pid] + request, capture_output=True, text=True, env=ENV
+        )
+
+        assert client.returncode == 0
+        expected = "BAD" if missing in request else "OK"
+        assert client.stdout.strip() == expected
+
+    # Once cached, results are the same over a connection
+    requests = [f"push {missing}", f"jump present {path}", "pop", f"push {path}"]
+    client = subprocess.run(
+        [CLIENT_PATH, "--serve", pid],
+        input="\n".join(requests) + "\n",
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    replies = [reply.strip() for reply in client.stdout.split("\0")]
+    assert replies == ["BAD", path, path, "OK", ""]
+
+
+def test_deferred_replies_keep_order(daemon):
+    """
+    Test that requests sent back to back on a connection are answered in
+    order while some of them wait for path checks.
+    """
+    pid = os.getpid()
+    paths = [f"{NAV_ROOT}/order{i}" for i in range(40)]
+    for path in paths:
+        os.mkdir(path)
+
+    # Pushes of unchecked paths are deferred, pops and flushes are not
+    requests = []
+    expected = []
+    for path in paths:
+        requests += [f"{pid} push {path}", f"{pid} pop", f"{pid} flush"]
+        expected += [b"OK\n", f"{path}\n".encode(), b"OK\n"]
+    requests.append(f"{pid} pop")
+    expected.append(b"BAD\n")
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET) as sock:
+        sock.settimeout(1)
+        sock.connect(f"{NAV_ROOT}/stream.sock")
+
+        for request in requests:
+            sock.send(request.encode())
+
+        replies = [sock.recv(1024).rstrip(b"\0") for _ in requests]
+
+    assert replies == expected
+
+
+def test_text_and_binary_frames(daemon):
+    """
+    Test raw requests on a stream connection. Text requests are still accepted
+    and answered without framing. Binary replies echo the request header, and
+    a malformed frame is answered with a framed "BAD".
+    """
+    pid = os.getpid()
+    header = struct.Struct("=BBBBiII")
+
+    def frame(opcode, fields):
+        payload = b"".join(
+            struct.pack("=H", len(f)) + f.encode() + b"\0" for f in fields
+        )
+        return header.pack(0, 2, opcode, 0, pid, len(payload), 0) + payload
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET) as sock:
+        sock.settimeout(1)
+
+        # The daemon may still be starting up
+        for _ in range(100):
+            if os.path.exists(f"{NAV_ROOT}/stream.sock"):
+                break
+            time.sleep(0.01)
+        sock.connect(f"{NAV_ROOT}/stream.sock")
+
+        # Text protocol: add test --> /tmp/, then get it
+        sock.send(f"{pid} add test /tmp/".encode())
+        assert sock.recv(1024) == b"OK\n"
+
+        sock.send(f"{pid} get test".encode())
+        assert sock.recv(1024) == b"/tmp/\n"
+
+        # Binary protocol: get test (opcode 5)
+        sock.send(frame(5, ["test"]))
+        reply = sock.recv(1024)
+        magic, version, opcode, flags, reply_pid, length, cursor = (
+            header.unpack_from(reply)
+        )
+        assert (magic, version, opcode, reply_pid) == (0, 2, 5, pid)
+        assert (flags, cursor) == (0, 0)
+        assert reply[header.size :] == b"/tmp/\n"
+        assert length == len(reply) - header.size
+
+        # Binary protocol: a field running past the end of the frame
+        bad = frame(5, ["test"])
+        sock.send(bad[:-1])
+        reply = sock.recv(1024)
+        assert reply[header.size :] == b"BAD\n"
+
+
+def test_text_paths_with_spaces(daemon):
+    """
+    Test that a text request's path runs to the end of the line, so paths
+    with spaces are kept whole.
+    """
+    pid = os.getpid()
+    path = f"{NAV_ROOT}/with some spaces"
+    os.mkdir(path)
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET) as sock:
+        sock.settimeout(1)
+        sock.connect(f"{NAV_ROOT}/stream.sock")
+
+        sock.send(f"{pid} add spaced {path}\n".encode())
+        assert sock.recv(1024) == b"OK\n"
+
+        sock.send(f"{pid} get spaced".encode())
+        assert sock.recv(1024) == f"{path}\n".encode()
+
+        # Trailing spaces are not part of the path
+        sock.send(f"{pid} push {path} ".encode())
+        assert sock.recv(1024).startswith(b"OK\n")
+
+        sock.send(f"{pid} push {NAV_ROOT}".encode())
+        assert sock.recv(1024).startswith(b"OK\n")
+
+        # The tag is split off before the path
+        sock.send(f"{pid} jump spaced {path}".encode())
+        assert sock.recv(1024) == f"{path}\n".encode()
+
+        for expected in [path, NAV_ROOT, path]:
+            sock.send(f"{pid} pop".encode())
+            assert sock.recv(1024) == f"{expected}\n".encode()
+
+
+def test_paginated_listings(daemon):
+    """
+    Test listings too long for one reply. The client fetches every page and
+    reassembles them, so nothing is lost or repeated.
+    """
+    pid = str(os.getpid())
+    root = NAV_ROOT + "-pages"
+    tags = [f"tag{i:03}" for i in range(80)]
+    path = f"{root}/" + "x" * 100
+    actions = [f"{root}/action{i:03}" for i in range(70)]
+
+    # Tags and actions must be existing paths
+    for directory in [path] + actions:
+        os.makedirs(directory, exist_ok=True)
+
+    requests = [f"add {tag} {path}" for tag in tags]
+    requests += [f"push {action}" for action in actions]
+    client = subprocess.run(
+        [CLIENT_PATH, "--serve", pid],
+        input="\n".join(requests) + "\n",
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+
+    # show: more bytes than fit in one reply
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "show"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    lines = client.stdout.splitlines()
+    assert sorted(lines) == [f"{tag} --> {path}" for tag in tags]
+
+    # list: more tags than fit in one page
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "list"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert sorted(client.stdout.split(" ")) == tags
+
+    # complete: more matches than fit in one page, in sorted order
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "complete", "tag"],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.splitlines() == sorted(tags)
+
+    # actions: numbered from the most recent across pages
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "actions"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    expected = [
+        f"    {i + 1}. {action}" for i, action in enumerate(reversed(actions))
+    ]
+    assert client.stdout.splitlines() == expected
+
+    shutil.rmtree(root)
+
+
+def test_tag_snapshot(daemon):
+    """
+    Test that get and list are answered from the tag snapshot without the
+    daemon, and that a snapshot left behind by a dead daemon is not used.
+    """
+    pid = str(os.getpid())
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "add", "test", "/tmp/"],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    # A stopped daemon cannot answer, but its snapshot can
+    daemon.send_signal(signal.SIGSTOP)
+    try:
+        client = subprocess.run(
+            [CLIENT_PATH, pid, "get", "test"],
+            capture_output=True,
+            text=True,
+            env=ENV,
+        )
+
+        assert client.returncode == 0
+        assert client.stdout == "/tmp/\n"
+
+        client = subprocess.run(
+            [CLIENT_PATH, pid, "list"], capture_output=True, text=True, env=ENV
+        )
+
+        assert client.returncode == 0
+        assert client.stdout == "test"
+
+        # Tags missing from the snapshot still go to the daemon
+        client = subprocess.run(
+            [CLIENT_PATH, pid, "get", "missing"],
+            capture_output=True,
+            text=True,
+            env=ENV,
+        )
+
+        assert client.returncode != 0
+    finally:
+        daemon.send_signal(signal.SIGCONT)
+
+    # Let the daemon answer the request queued while it was stopped, so the
+    # stale reply cannot reach the next client bound to the same address
+    time.sleep(0.1)
+
+    # Deleted tags are gone from the snapshot
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "delete", "test"],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "OK"
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "get", "test"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "BAD"
+
+    # The snapshot of a daemon that was killed is stale
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "add", "test", "/tmp/"],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+
+    daemon.kill()
+    daemon.wait()
+    assert os.path.exists(f"{NAV_ROOT}/tags.snap")
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "get", "test"], capture_output=True, text=True, env=ENV
+    )
+
+    assert client.returncode != 0
+
+
+def test_complete(daemon):
+    """
+    Test completing tags by prefix. Matches are sorted, can be capped, and
+    stay correct as tags are added and deleted.
+    """
+    pid = str(os.getpid())
+    tags = ["alpha", "alps", "al", "beta", "alphabet"]
+
+    requests = [f"add {tag} /tmp/" for tag in tags] + ["delete alps"]
+    client = subprocess.run(
+        [CLIENT_PATH, "--serve", pid],
+        input="\n".join(requests) + "\n",
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+
+    def complete(*args):
+        client = subprocess.run(
+            [CLIENT_PATH, pid, "complete", *args],
+            capture_output=True,
+            text=True,
+            env=ENV,
+        )
+        assert client.returncode == 0
+        return client.stdout.splitlines()
+
+    assert complete("al") == ["al", "alpha", "alphabet"]
+    assert complete("alph") == ["alpha", "alphabet"]
+    assert complete("alps") == []
+    assert complete("x") == []
+    assert complete() == ["al", "alpha", "alphabet", "beta"]
+    assert complete("al", "2") == ["al", "alpha"]
+    assert complete("", "1") == ["al"]
+
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "complete", "al", "many"],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == "BAD"
+
+
+def test_frecency(daemon):
+    """
+    Test that get and jump fall back to the highest ranked visited directory
+    when no tag matches, and that the ranks survive a daemon restart.
+    """
+    pid = str(os.getpid())
+    root = NAV_ROOT + "-frecency"
+    alpha = f"{root}/project-alpha"
+    beta = f"{root}/project-beta"
+    gone = f"{root}/project-gone"
+    for directory in [alpha, beta, gone]:
+        os.makedirs(directory, exist_ok=True)
+
+    # beta is visited more often than alpha, and gone most of all
+    requests = [f"visit {alpha}"] + [f"visit {beta}"] * 3 + [f"push {gone}"] * 5
+    requests += ["add beta /tmp/"]
+    client = subprocess.run(
+        [CLIENT_PATH, "--serve", pid],
+        input="\n".join(requests) + "\n",
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.split("\0")[:-1] == ["OK\n"] * len(requests)
+
+    def get(term):
+        client = subprocess.run(
+            [CLIENT_PATH, pid, "get", term], capture_output=True, text=True, env=ENV
+        )
+        assert client.returncode == 0
+        return client.stdout.strip()
+
+    # Directories that no longer exist are skipped
+    shutil.rmtree(gone)
+    assert get("project") == beta
+    assert get("alpha") == alpha
+    assert get(f"{root}/") == beta
+    assert get("missing") == "BAD"
+
+    # Tags take precedence
+    assert get("beta") == "/tmp/"
+
+    # jump falls back the same way, and pushes the cwd
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "jump", "alpha", "/tmp/"],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.strip() == alpha
+
+    # The database is saved on shutdown and loaded on startup
+    daemon.send_signal(signal.SIGINT)
+    daemon.wait(timeout=5)
+    assert os.path.exists(f"{NAV_ROOT}/frecency")
+
+    process = subprocess.Popen(
+        [DAEMON_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, env=ENV
+    )
+    try:
+        for _ in range(100):
+            if os.path.exists(f"{NAV_ROOT}/nav.sock"):
+                break
+            time.sleep(0.01)
+
+        assert get("project") == beta
+    finally:
+        process.send_signal(signal.SIGINT)
+        process.wait(timeout=5)
+        shutil.rmtree(root)
+
+
+def test_search(daemon):
+    """
+    Test that search fuzzy matches tags by name and visited directories by
+    path, best match first, without repeating a directory.
+    """
+    pid = str(os.getpid())
+    # Keep the root free of the letters the patterns below look for
+    root = f"/tmp/srch-{os.getpid()}"
+    daemon_dir = f"{root}/src/nav-daemon"
+    notes = f"{root}/docs/NavNotes"
+    other = f"{root}/other"
+    for directory in [daemon_dir, notes, other]:
+        os.makedirs(directory, exist_ok=True)
+
+    requests = [f"visit {daemon_dir}", f"visit {notes}", f"visit {other}"]
+    requests += [f"add proj {other}", f"add notes {notes}"]
+    client = subprocess.run(
+        [CLIENT_PATH, "--serve", pid],
+        input="\n".join(requests) + "\n",
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+
+    assert client.returncode == 0
+    assert client.stdout.split("\0")[:-1] == ["OK\n"] * len(requests)
+
+    def search(*args):
+        client = subprocess.run(
+            [CLIENT_PATH, pid, "search", *args],
+            capture_output=True,
+            text=True,
+            env=ENV,
+        )
+        assert client.returncode == 0
+        return client.stdout.splitlines()
+
+    # Matches at the start of a component rank first, ties go to shorter paths
+    assert search("nvdmn") == [daemon_dir]
+    assert search("nav") == [notes, daemon_dir]
+    assert search("nav", "1") == [notes]
+
+    # Tags match by name, and a directory is listed once
+    assert search("prj") == [other]
+    assert search("notes") == [notes]
+
+    # Upper case patterns are case sensitive
+    assert search("NN") == [notes]
+    assert search("nn") == [notes, daemon_dir]
+    assert search("zzz") == []
+
+    assert search("nav", "0") == ["BAD"]
+    assert search("nav", str(65)) == ["BAD"]
+    assert search("n" * 65) == ["BAD"]
+
+    shutil.rmtree(root)
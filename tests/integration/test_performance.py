@@ -0,0 +1,269 @@
+"""
+Latency regression gates.
+
+A fixed workload is run against a daemon started like the `daemon` fixture in
+test_client_daemon.py, and the median latency of each command, which shrugs
+off the odd slow request on a busy machine, is checked against a budget, as is
+its 90th percentile against a looser one. The budgets are generous, so they
+only catch gross regressions; set NAV_PERF_BUDGET_SCALE to scale them on slow
+machines.
+
+Results are written as JSON to NAV_PERF_RESULTS, build/perf-results.json by
+default, so trends can be tracked across commits. Pointing NAV_PERF_BASELINE
+at an earlier results file also fails any command whose median grew by more
+than NAV_PERF_TOLERANCE, 1.5 by default, over the baseline.
+"""
+
+import json
+import os
+import random
+import shutil
+import signal
+import statistics
+import string
+import subprocess
+import time
+
+import pytest
+
+DAEMON_PATH = "./build/daemon"
+CLIENT_PATH = "./build/client"
+
+NAV_ROOT = "/tmp/nav-perf-" + "".join(random.choices(string.ascii_letters, k=6))
+
+ENV = {"NAV_CACHE_DIR": NAV_ROOT, "NAV_CONFIG_DIR": NAV_ROOT}
+
+RESULTS_PATH = os.environ.get("NAV_PERF_RESULTS", "build/perf-results.json")
+BASELINE_PATH = os.environ.get("NAV_PERF_BASELINE")
+BUDGET_SCALE = float(os.environ.get("NAV_PERF_BUDGET_SCALE", "1"))
+TOLERANCE = float(os.environ.get("NAV_PERF_TOLERANCE", "1.5"))
+
+# Rounds of the workload, and rounds run first to warm up, not measured
+ROUNDS = 1000
+WARMUP_ROUNDS = 30
+
+# Number of tags and directories the workload uses
+N_TAGS = 20
+
+# Times a one-shot client is run
+PROCESS_RUNS = 30
+
+# Budgets in milliseconds for the median and 90th percentile of each command
+BUDGETS_MS = {
+    "push": (0.5, 2.0),
+    "pop": (0.5, 2.0),
+    "get": (0.5, 2.0),
+    "jump": (0.5, 2.0),
+    "visit": (0.5, 2.0),
+    "complete": (0.5, 2.0),
+    "search": (0.5, 2.0),
+    "show": (0.5, 2.0),
+    "process": (20.0, 50.0),
+}
+
+# Latency moves below this, in milliseconds, are noise for the baseline check
+BASELINE_SLACK_MS = 0.01
+
+
+@pytest.fixture(scope="module", autouse=True)
+def build_all():
+    result = subprocess.run(["make", "all"], capture_output=True, text=True)
+    if result.returncode != 0:
+        raise RuntimeError("Build failed:\n" + result.stderr)
+
+
+@pytest.fixture(scope="module")
+def results():
+    results = {"timestamp": time.time(), "commit": git_commit(), "commands": {}}
+
+    yield results
+
+    os.makedirs(os.path.dirname(RESULTS_PATH) or ".", exist_ok=True)
+    with open(RESULTS_PATH, "w") as f:
+        json.dump(results, f, indent=2)
+
+
+@pytest.fixture()
+def daemon():
+    os.makedirs(NAV_ROOT, exist_ok=True)
+
+    # The daemon logs every request, which a pipe would not keep up with
+    process = subprocess.Popen(
+        [DAEMON_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, env=ENV
+    )
+
+    for _ in range(500):
+        if os.path.exists(f"{NAV_ROOT}/tags.snap") or process.poll() is not None:
+            break
+        time.sleep(0.002)
+    if process.poll() is not None:
+        raise RuntimeError("Daemon launch failed")
+
+    yield process
+
+    process.send_signal(signal.SIGINT)
+    try:
+        process.wait(timeout=5)
+    except subprocess.TimeoutExpired:
+        process.kill()
+
+    shutil.rmtree(NAV_ROOT)
+
+
+def git_commit():
+    result = subprocess.run(
+        ["git", "rev-parse", "HEAD"], capture_output=True, text=True
+    )
+    return result.stdout.strip() if result.returncode == 0 else None
+
+
+def summarize(samples):
+    """
+    Summarizes latencies in seconds as milliseconds.
+    """
+    ms = sorted(s * 1000 for s in samples)
+    quantiles = statistics.quantiles(ms, n=100, method="inclusive")
+    return {
+        "n": len(ms),
+        "median_ms": statistics.median(ms),
+        "p90_ms": quantiles[89],
+        "p99_ms": quantiles[98],
+        "max_ms": ms[-1],
+    }
+
+
+class Server:
+    """
+    A `client --serve` process, which sends each request over one connection.
+    """
+
+    def __init__(self, pid):
+        self.process = subprocess.Popen(
+            [CLIENT_PATH, "--serve", pid],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.DEVNULL,
+            env=ENV,
+        )
+
+    def request(self, *fields):
+        """
+        Sends a request and returns its reply and latency in seconds.
+        """
+        start = time.perf_counter()
+        self.process.stdin.write(("\t".join(fields) + "\n").encode())
+        self.process.stdin.flush()
+
+        reply = b""
+        while not reply.endswith(b"\0"):
+            chunk = os.read(self.process.stdout.fileno(), 65536)
+            if not chunk:
+                raise RuntimeError("client exited")
+            reply += chunk
+
+        return reply[:-1].decode(), time.perf_counter() - start
+
+    def close(self):
+        self.process.stdin.close()
+        self.process.wait(timeout=5)
+
+
+def check(results, command, summary):
+    """
+    Records a command's latencies and checks them against its budgets.
+    """
+    results["commands"][command] = summary
+
+    median_budget, p90_budget = BUDGETS_MS[command]
+    assert summary["median_ms"] <= median_budget * BUDGET_SCALE, command
+    assert summary["p90_ms"] <= p90_budget * BUDGET_SCALE, command
+
+    if BASELINE_PATH is None:
+        return
+    with open(BASELINE_PATH) as f:
+        baseline = json.load(f)["commands"].get(command)
+    if baseline is not None:
+        limit = baseline["median_ms"] * TOLERANCE + BASELINE_SLACK_MS
+        assert summary["median_ms"] <= limit, command
+
+
+def test_request_latency(daemon, results):
+    """
+    Test the latency of a fixed workload of navigation commands sent over one
+    connection, as the bash integration does.
+    """
+    pid = str(os.getpid())
+    dirs = []
+    for i in range(N_TAGS):
+        path = os.path.join(NAV_ROOT, f"dir-{i}")
+        os.mkdir(path)
+        dirs.append(path)
+
+    server = Server(pid)
+    for i, path in enumerate(dirs):
+        reply, _ = server.request("add", f"tag-{i}", path)
+        assert reply == "OK\n"
+
+    workload = [
+        ("push", lambda i: ("push", dirs[i % N_TAGS])),
+        ("get", lambda i: ("get", f"tag-{i % N_TAGS}")),
+        ("jump", lambda i: ("jump", f"tag-{i % N_TAGS}", dirs[(i + 1) % N_TAGS])),
+        ("pop", lambda i: ("pop",)),
+        ("pop", lambda i: ("pop",)),
+        ("visit", lambda i: ("visit", dirs[(i * 7) % N_TAGS])),
+        ("complete", lambda i: ("complete", "tag-1")),
+        ("search", lambda i: ("search", "dr1")),
+        ("show", lambda i: ("show",)),
+    ]
+
+    samples = {}
+    for i in range(WARMUP_ROUNDS + ROUNDS):
+        for command, fields in workload:
+            reply, latency = server.request(*fields(i))
+            assert reply != "BAD\n", command
+            if i >= WARMUP_ROUNDS:
+                samples.setdefault(command, []).append(latency)
+
+    # The daemon's own view of the same requests, see `stats json`. Requests
+    # answered from the client's snapshot of the tags never reach it.
+    reply, _ = server.request("stats", "json")
+    stats = json.loads(reply)
+    results["daemon"] = {
+        command: {
+            "requests": op["requests"],
+            "p50_ms": op["p50_ns"] / 1e6,
+            "p99_ms": op["p99_ns"] / 1e6,
+        }
+        for command, op in stats["ops"].items()
+        if command in samples and op["requests"] > 0
+    }
+    server.close()
+
+    for command, latencies in samples.items():
+        check(results, command, summarize(latencies))
+
+
+def test_process_latency(daemon, results):
+    """
+    Test the latency of running the client once per request, as scripts
+    without the builtin or a serving client do.
+    """
+    pid = str(os.getpid())
+    client = subprocess.run(
+        [CLIENT_PATH, pid, "add", "home", NAV_ROOT],
+        capture_output=True,
+        text=True,
+        env=ENV,
+    )
+    assert client.stdout.strip() == "OK"
+
+    latencies = []
+    for _ in range(PROCESS_RUNS):
+        start = time.perf_counter()
+        client = subprocess.run(
+            [CLIENT_PATH, pid, "get", "home"], capture_output=True, text=True, env=ENV
+        )
+        latencies.append(time.perf_counter() - start)
+        assert client.stdout.strip() == NAV_ROOT
+
+    check(results, "process", summarize(latencies))